@@ -0,0 +1,319 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "BadPixelMap.h"
+#include "CFAReader.h"
+#include "Calibration.h"
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_BAD_PIXELS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static const char bad_pixels_header[] = "sjcam_raw2dng bad pixels 1";
+
+// Hot: mean above 1.5 times its neighbours plus this many 12-bit levels (dark frames are near zero)
+#define HOT_PIXEL_MARGIN 64
+// Dead: mean below half of its darkest neighbour, where that is at least this bright (flat frames).
+// A hot neighbour would lift their mean and make good pixels look dead.
+#define DEAD_PIXEL_MIN_LEVEL 256
+
+static bool point_less(const dng_point &a, const dng_point &b)
+{
+  return a.v < b.v || (a.v == b.v && a.h < b.h);
+}
+
+BadPixelMap::BadPixelMap() : m_ulWidth(0), m_ulHeight(0)
+{
+}
+
+int BadPixelMap::Load(const std::string &szPath)
+{
+  FILE *fp = fopen(szPath.c_str(), "r");
+  if (!fp) {
+    perror(szPath.c_str());
+    return -1;
+  }
+
+  char line[256];
+  std::vector<std::string> fields;
+  int ret = 0;
+
+  m_oPoints[0].clear();
+
+  if (!fgets(line, sizeof(line), fp) || strncmp(line, bad_pixels_header, sizeof(bad_pixels_header) - 1)) {
+    fprintf(stderr, "%s: Not a bad pixel map\n", szPath.c_str());
+    ret = -1;
+  } else if (!fgets(line, sizeof(line), fp) || split_string(line, '\t', fields) != 3) {
+    fprintf(stderr, "%s: Missing camera of the bad pixel map\n", szPath.c_str());
+    ret = -1;
+  } else {
+    m_szCameraModel = fields[0];
+    m_ulWidth = (uint32)strtoul(fields[1].c_str(), NULL, 10);
+    m_ulHeight = (uint32)strtoul(fields[2].c_str(), NULL, 10);
+
+    while (fgets(line, sizeof(line), fp)) {
+      int v, h;
+      if (sscanf(line, "%d\t%d", &v, &h) != 2 || v < 0 || h < 0 || (uint32)v >= m_ulHeight ||
+          (uint32)h >= m_ulWidth) {
+        fprintf(stderr, "%s: Skipping malformed bad pixel line\n", szPath.c_str());
+        continue;
+      }
+      m_oPoints[0].push_back(dng_point(v, h));
+    }
+  }
+
+  fclose(fp);
+
+  if (ret)
+    return ret;
+
+  Finish();
+
+  return 0;
+}
+
+int BadPixelMap::Save(const std::string &szPath) const
+{
+  const std::string tmp_path = szPath + ".tmp";
+
+  FILE *fp = fopen(tmp_path.c_str(), "w");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  fprintf(fp, "%s\n", bad_pixels_header);
+  fprintf(fp, "%s\t%u\t%u\n", m_szCameraModel.c_str(), (unsigned int)m_ulWidth, (unsigned int)m_ulHeight);
+
+  std::vector<dng_point>::const_iterator it;
+  for (it = m_oPoints[0].begin(); it != m_oPoints[0].end(); ++it)
+    fprintf(fp, "%d\t%d\n", (int)it->v, (int)it->h);
+
+  if (fclose(fp)) {
+    perror("fclose");
+    remove(tmp_path.c_str());
+    return -1;
+  }
+
+  if (replace_file(tmp_path, szPath)) {
+    perror("rename");
+    remove(tmp_path.c_str());
+    return -1;
+  }
+
+  return 0;
+}
+
+bool BadPixelMap::Matches(const CameraProfile &oCamProfile) const
+{
+  return oCamProfile.m_szCameraModel == m_szCameraModel && oCamProfile.m_ulWidth == m_ulWidth &&
+         oCamProfile.m_ulHeight == m_ulHeight;
+}
+
+void BadPixelMap::Finish()
+{
+  // Hand edited maps may be out of order or list a pixel twice
+  std::sort(m_oPoints[0].begin(), m_oPoints[0].end(), point_less);
+  m_oPoints[0].erase(std::unique(m_oPoints[0].begin(), m_oPoints[0].end()), m_oPoints[0].end());
+
+  m_oPoints[1].resize(m_oPoints[0].size());
+
+  std::vector<dng_point>::const_reverse_iterator it;
+  std::vector<dng_point>::iterator flipped = m_oPoints[1].begin();
+  for (it = m_oPoints[0].rbegin(); it != m_oPoints[0].rend(); ++it, ++flipped)
+    *flipped = dng_point((int32)m_ulHeight - 1 - it->v, (int32)m_ulWidth - 1 - it->h);
+}
+
+bool BadPixelMap::IsBad(uint32 ulOrientation, int32 v, int32 h) const
+{
+  return std::binary_search(m_oPoints[ulOrientation].begin(), m_oPoints[ulOrientation].end(), dng_point(v, h),
+                            point_less);
+}
+
+// Sample (v, h) of the readout
+static uint16 read_sample(const CFAReader &reader, const CameraProfile &oCamProfile, int32 v, int32 h)
+{
+  uint16 pair[2];
+
+  reader.read_area((uint8_t *)pair, oCamProfile.m_ulWidth, oCamProfile.m_ulStride, v, h & ~1, 1, 2);
+
+  return pair[h & 1];
+}
+
+void BadPixelMap::FixArea(const CFAReader &reader,
+                          const CameraProfile &oCamProfile,
+                          bool bFlipped,
+                          const dng_rect &area,
+                          uint16 *buf,
+                          const FrameCalibration *poCalibration) const
+{
+  // Same color neighbours: the ones two pixels away, and the diagonal ones of a green pixel
+  static const int32 offsets[][2] = {{-2, 0}, {2, 0}, {0, -2}, {0, 2}, {-2, -2}, {-2, 2}, {2, -2}, {2, 2},
+                                     {-1, -1}, {-1, 1}, {1, -1}, {1, 1}};
+
+  const uint32 orientation = bFlipped ? 1 : 0;
+  const std::vector<dng_point> &points = m_oPoints[orientation];
+
+  const int32 h = (int32)m_ulHeight;
+  const int32 w = (int32)m_ulWidth;
+
+  std::vector<dng_point>::const_iterator it =
+    std::lower_bound(points.begin(), points.end(), dng_point(area.t, area.l), point_less);
+
+  for (; it != points.end() && it->v < area.b; ++it) {
+    if (it->h < area.l || it->h >= area.r)
+      continue;
+
+    // Both Bayer layouts have their green pixels where row + column is odd
+    const uint32 count = ((it->v + it->h) & 1) ? 12 : 8;
+
+    uint16 values[12];
+    uint32 good = 0;
+
+    for (uint32 i = 0; i < count; ++i) {
+      const int32 v = it->v + offsets[i][0];
+      const int32 col = it->h + offsets[i][1];
+
+      if (v < 0 || v >= h || col < 0 || col >= w || IsBad(orientation, v, col))
+        continue;
+
+      values[good] = read_sample(reader, oCamProfile, v, col);
+      if (poCalibration)
+        values[good] = poCalibration->ApplySample(oCamProfile, v, col, values[good]);
+      ++good;
+    }
+
+    // Left as it is inside a cluster too large to interpolate
+    if (!good)
+      continue;
+
+    std::sort(values, values + good);
+
+    uint16 &sample = buf[(it->v - area.t) * area.W() + (it->h - area.l)];
+    sample = (good & 1) ? values[good / 2] : (uint16)((values[good / 2 - 1] + values[good / 2] + 1) / 2);
+  }
+}
+
+int BadPixelDetector::AddFrame(const std::string &szRawFile)
+{
+  return m_oFrames.AddFrame(szRawFile);
+}
+
+// Outlier tests of a sum against the sum n4 and the smallest nmin of its four neighbours (all over the same
+// number of frames). hot: s > 1.5 n4 / 4 + margin, i.e. 8 s > 3 n4 + 8 margin; dead: 2 s < nmin >= min.
+static inline bool is_hot(uint32 s, uint32 n4, uint32 margin8)
+{
+  return 8 * s > 3 * n4 + margin8;
+}
+
+static inline bool is_dead(uint32 s, uint32 nmin, uint32 min)
+{
+  return nmin >= min && 2 * s < nmin;
+}
+
+#ifdef HAVE_BAD_PIXELS_SSE2
+// _mm_min_epi32 needs SSE4.1
+static inline __m128i min_epi32(__m128i a, __m128i b)
+{
+  const __m128i greater = _mm_cmpgt_epi32(a, b);
+
+  return _mm_or_si128(_mm_and_si128(greater, b), _mm_andnot_si128(greater, a));
+}
+
+// First x (from x >= 2 on) of a group of four that may hold an outlier, or where fewer than four pixels
+// with both right neighbours are left. Sums of up to 65535 frames fit the signed compares.
+static int32 skip_good_pixels(const uint32 *row,
+                              const uint32 *up,
+                              const uint32 *down,
+                              int32 x,
+                              int32 w,
+                              uint32 margin8,
+                              uint32 min)
+{
+  const __m128i vmargin8 = _mm_set1_epi32((int)margin8);
+  const __m128i vmin = _mm_set1_epi32((int)min - 1);
+
+  for (; x + 4 + 2 <= w; x += 4) {
+    const __m128i s = _mm_loadu_si128((const __m128i *)(row + x));
+    const __m128i left = _mm_loadu_si128((const __m128i *)(row + x - 2));
+    const __m128i right = _mm_loadu_si128((const __m128i *)(row + x + 2));
+    const __m128i above = _mm_loadu_si128((const __m128i *)(up + x));
+    const __m128i below = _mm_loadu_si128((const __m128i *)(down + x));
+
+    const __m128i n4 = _mm_add_epi32(_mm_add_epi32(left, right), _mm_add_epi32(above, below));
+    const __m128i nmin = min_epi32(min_epi32(left, right), min_epi32(above, below));
+
+    const __m128i hot =
+      _mm_cmpgt_epi32(_mm_slli_epi32(s, 3), _mm_add_epi32(_mm_add_epi32(n4, _mm_add_epi32(n4, n4)), vmargin8));
+    const __m128i dead = _mm_and_si128(_mm_cmpgt_epi32(nmin, vmin), _mm_cmplt_epi32(_mm_add_epi32(s, s), nmin));
+
+    if (_mm_movemask_epi8(_mm_or_si128(hot, dead)))
+      break;
+  }
+
+  return x;
+}
+#endif
+
+void BadPixelDetector::Detect(BadPixelMap &oMap, bool bFlipped, size_t &ulHot, size_t &ulDead) const
+{
+  ulHot = 0;
+  ulDead = 0;
+
+  oMap.m_oPoints[0].clear();
+
+  const CameraProfile *poProfile = m_oFrames.GetProfile();
+  const size_t frames = m_oFrames.GetFrameCount();
+
+  if (!poProfile || !frames)
+    return;
+
+  const int32 w = (int32)poProfile->m_ulWidth;
+  const int32 h = (int32)poProfile->m_ulHeight;
+  const std::vector<uint32> &sums = m_oFrames.GetSums();
+
+  oMap.m_szCameraModel = poProfile->m_szCameraModel;
+  oMap.m_ulWidth = (uint32)w;
+  oMap.m_ulHeight = (uint32)h;
+
+  const uint32 margin8 = 8 * HOT_PIXEL_MARGIN * (uint32)frames;
+  const uint32 min = DEAD_PIXEL_MIN_LEVEL * (uint32)frames;
+
+  for (int32 y = 0; y < h; ++y) {
+    const uint32 *row = &sums[(size_t)y * w];
+    // Same color neighbours, mirrored at the borders
+    const uint32 *up = &sums[(size_t)(y >= 2 ? y - 2 : y + 2) * w];
+    const uint32 *down = &sums[(size_t)(y + 2 < h ? y + 2 : y - 2) * w];
+
+    for (int32 x = 0; x < w; ++x) {
+#ifdef HAVE_BAD_PIXELS_SSE2
+      if (x >= 2)
+        x = skip_good_pixels(row, up, down, x, w, margin8, min);
+#endif
+
+      const uint32 left = row[x >= 2 ? x - 2 : x + 2];
+      const uint32 right = row[x + 2 < w ? x + 2 : x - 2];
+
+      if (is_hot(row[x], left + right + up[x] + down[x], margin8))
+        ++ulHot;
+      else if (is_dead(row[x], std::min(std::min(left, right), std::min(up[x], down[x])), min))
+        ++ulDead;
+      else
+        continue;
+
+      if (bFlipped)
+        oMap.m_oPoints[0].push_back(dng_point(h - 1 - y, w - 1 - x));
+      else
+        oMap.m_oPoints[0].push_back(dng_point(y, x));
+    }
+  }
+
+  oMap.Finish();
+}
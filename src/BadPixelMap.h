@@ -0,0 +1,84 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __BAD_PIXEL_MAP_H__
+#define __BAD_PIXEL_MAP_H__
+
+#include <string>
+#include <vector>
+
+#include <dng_point.h>
+#include <dng_rect.h>
+
+#include "CFAReader.h"
+#include "CameraProfile.h"
+#include "FrameAccumulator.h"
+
+class FrameCalibration;
+
+// Hot and dead pixels of one sensor, sorted by row and column. The cameras do not record a serial number,
+// so a map is tied to the camera model and resolution it was built from and it is up to the user to keep
+// one map per camera body.
+//
+// The map is applied while the readout is unpacked rather than as a FixBadPixelsList opcode: the stage 1
+// image carries the CFA in the first of three planes, which that opcode (in the SDK as in other DNG
+// readers) refuses to process.
+class BadPixelMap
+{
+  public:
+  BadPixelMap();
+
+  int Load(const std::string &szPath);
+  int Save(const std::string &szPath) const;
+
+  // True if the map was built from frames of oCamProfile
+  bool Matches(const CameraProfile &oCamProfile) const;
+
+  // Replace the mapped pixels in area (readout coordinates) of the unpacked samples in buf, tightly packed
+  // rows of area.W(), by the median of their good neighbours of the same color. bFlipped for frames taken
+  // in rotated orientation. Neighbours outside buf are read from reader and calibrated by poCalibration
+  // (if not NULL), as buf is. Safe to call concurrently for different areas.
+  void FixArea(const CFAReader &reader,
+               const CameraProfile &oCamProfile,
+               bool bFlipped,
+               const dng_rect &area,
+               uint16 *buf,
+               const FrameCalibration *poCalibration = NULL) const;
+
+  protected:
+  friend class BadPixelDetector;
+
+  // Sort the points and derive the ones of a rotated readout
+  void Finish();
+
+  bool IsBad(uint32 ulOrientation, int32 v, int32 h) const;
+
+  std::string m_szCameraModel;
+  uint32 m_ulWidth;
+  uint32 m_ulHeight;
+
+  // As found on the sensor and as read out in rotated orientation, which starts at its last pixel
+  std::vector<dng_point> m_oPoints[2];
+};
+
+// Builds a BadPixelMap from dark frames (finds hot pixels) and/or flat frames (finds dead pixels).
+// Frames are summed up so single frame noise averages out, then every pixel is compared to its four
+// nearest neighbours of the same color.
+class BadPixelDetector
+{
+  public:
+  // Add the RAW file to the sums, -1 if it cannot be read or its size differs from the frames before
+  int AddFrame(const std::string &szRawFile);
+
+  size_t GetFrameCount() const
+  {
+    return m_oFrames.GetFrameCount();
+  }
+
+  // Fill oMap with the outliers of the frames added so far, bFlipped if they were taken in rotated orientation
+  void Detect(BadPixelMap &oMap, bool bFlipped, size_t &ulHot, size_t &ulDead) const;
+
+  protected:
+  FrameAccumulator m_oFrames;
+};
+
+#endif // __BAD_PIXEL_MAP_H__
@@ -16,25 +16,25 @@ typedef unsigned short uint16_t;
 
 CFAReader::CFAReader()
 #if defined(_WIN32) || defined(_WIN64)
-        : m_buf(NULL), m_fd(INVALID_HANDLE_VALUE),
+        : m_buf(NULL), m_fd(INVALID_HANDLE_VALUE), m_map_handle(NULL),
 #else
         : m_buf((uint8_t *)MAP_FAILED), m_fd(-1),
 #endif
-          m_filesz(0)
+          m_filesz(0), m_bMapped(false)
 {
 }
 
 CFAReader::~CFAReader()
 {
 #if defined(_WIN32) || defined(_WIN64)
-  if (m_buf != NULL)
+  if (m_bMapped)
     UnmapViewOfFile(m_buf);
   if (m_map_handle != NULL)
     CloseHandle(m_map_handle);
   if (m_fd != INVALID_HANDLE_VALUE)
     CloseHandle(m_fd);
 #else
-  if (m_buf != MAP_FAILED) {
+  if (m_bMapped) {
     ::munmap(m_buf, m_filesz);
     m_buf = NULL;
   }
@@ -46,7 +46,7 @@ CFAReader::~CFAReader()
 #endif
 }
 
-int CFAReader::open(const char *fname, size_t expected_size)
+int CFAReader::open(const char *fname, size_t expected_size, bool populate)
 {
 #if defined(_WIN32) || defined(_WIN64)
   m_fd =
@@ -64,6 +64,7 @@ int CFAReader::open(const char *fname, size_t expected_size)
   m_buf = (uint8_t *)MapViewOfFile(m_map_handle, FILE_MAP_READ, 0, 0, 0);
   if (NULL == m_buf)
     return GetLastError();
+  m_bMapped = true;
 #else
 #ifdef O_NOATIME
   m_fd = ::open(fname, O_NOATIME | O_RDONLY);
@@ -76,12 +77,14 @@ int CFAReader::open(const char *fname, size_t expected_size)
   m_filesz = expected_size;
 
 #ifdef MAP_POPULATE
-  m_buf = (uint8_t *)::mmap(NULL, m_filesz, PROT_READ, MAP_PRIVATE | MAP_POPULATE, m_fd, 0);
+  m_buf = (uint8_t *)::mmap(NULL, m_filesz, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), m_fd, 0);
 #else
+  (void)populate;
   m_buf = (uint8_t *)::mmap(NULL, m_filesz, PROT_READ, MAP_PRIVATE, m_fd, 0);
 #endif
   if (MAP_FAILED == m_buf)
     return errno;
+  m_bMapped = true;
 
   posix_madvise(m_buf, m_filesz, POSIX_MADV_SEQUENTIAL);
 #endif
@@ -89,6 +92,18 @@ int CFAReader::open(const char *fname, size_t expected_size)
   return 0;
 }
 
+int CFAReader::open(const uint8_t *buf, size_t size, size_t expected_size)
+{
+  if (size != expected_size)
+    return EINVAL;
+
+  // The caller keeps ownership, nothing to unmap later
+  m_buf = (uint8_t *)buf;
+  m_filesz = size;
+
+  return 0;
+}
+
 void CFAReader::read(uint8_t *out_buf, size_t x, size_t y, size_t stride)
 {
   uint8_t *bCurrByte = m_buf;
@@ -121,6 +136,24 @@ void CFAReader::read(uint8_t *out_buf, size_t x, size_t y, size_t stride)
   }
 }
 
+void CFAReader::read_area(uint8_t *out_buf, size_t x, size_t stride, size_t top, size_t left, size_t rows, size_t cols)
+  const
+{
+  const size_t row_bytes = (x * 12) / 8 + stride;
+
+  for (size_t i = 0; i < rows; ++i) {
+    const uint8_t *bCurrByte = m_buf + (top + i) * row_bytes + (left * 12) / 8;
+
+    for (size_t j = 0; j < cols; j += 2, bCurrByte += 3, out_buf += 4) {
+      // layout: 22223333 XXXX1111 (first pixel), 3333XXXX 11112222 (second pixel)
+      out_buf[0] = bCurrByte[0];
+      out_buf[1] = bCurrByte[1] & 0x0F;
+      out_buf[2] = (uint8_t)((bCurrByte[2] << 4) | (bCurrByte[1] >> 4));
+      out_buf[3] = (uint8_t)(bCurrByte[2] >> 4);
+    }
+  }
+}
+
 void CFAReader::read(uint8_t *out_buf, size_t total)
 {
   uint8_t *bCurrByte = m_buf;
@@ -13,12 +13,32 @@ class CFAReader
   public:
   CFAReader();
 
-  int open(const char *fname, size_t expected_size);
+  // populate reads the whole file in right away, which pays off unless many files are open at once
+  int open(const char *fname, size_t expected_size, bool populate = true);
+
+  // Read from a readout already in memory, buf must stay valid while the reader is used
+  int open(const uint8_t *buf, size_t size, size_t expected_size);
 
   void read(uint8_t *out_buf, size_t total);
 
   void read(uint8_t *out_buf, size_t x, size_t y, size_t stride);
 
+  // Unpack a rectangle of a (possibly strided) frame of width x into a tightly packed buffer.
+  // left and cols must be even so the area starts and ends on a whole 3 byte pixel pair.
+  // Safe to call concurrently for different areas.
+  void read_area(uint8_t *out_buf, size_t x, size_t stride, size_t top, size_t left, size_t rows, size_t cols) const;
+
+  // The packed readout as opened, size() bytes
+  const uint8_t *data(void) const
+  {
+    return m_buf;
+  }
+
+  size_t size(void) const
+  {
+    return m_filesz;
+  }
+
   ~CFAReader();
 
   protected:
@@ -30,6 +50,7 @@ class CFAReader
   int m_fd;
 #endif
   size_t m_filesz;
+  bool m_bMapped;
 };
 
 #endif // __CFA_READER_H__
@@ -0,0 +1,193 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <dng_tag_types.h>
+#include <dng_utils.h>
+
+#include "CFAStackTask.h"
+#include "FrameAccumulator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_STACK_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Rows of a tile, a thread's buffers do not depend on it
+#define STACK_TILE_ROWS 16
+// Up to this many frames the median is taken by a sorting network across 8 pixels at once,
+// which takes frames^2 / 2 compares, beyond by partial sorting one pixel at a time
+#define STACK_NETWORK_FRAMES 16
+
+CFAStackTask::CFAStackTask(const std::vector<const CFAReader *> &readers,
+                           const CameraProfile &profile,
+                           Mode mode,
+                           uint8 *out)
+        : m_oReaders(readers), m_oProfile(profile), m_eMode(mode), m_pOut(out)
+{
+  fMinTaskArea = 1;
+
+  // Whole rows, so the packed output of a tile does not share bytes with another one
+  fUnitCell = dng_point(1, (int32)m_oProfile.m_ulWidth);
+  fMaxTileSize = dng_point(STACK_TILE_ROWS, (int32)m_oProfile.m_ulWidth);
+}
+
+void CFAStackTask::Start(uint32 threadCount,
+                         const dng_point & /* tileSize */,
+                         dng_memory_allocator *allocator,
+                         dng_abort_sniffer * /* sniffer */)
+{
+  const uint32 w = m_oProfile.m_ulWidth;
+
+  const uint32 frames = (uint32)m_oReaders.size();
+
+  // A row to unpack into, then the sums of a row (mean) or the row of every frame and the samples of
+  // a pixel (median)
+  uint32 bufferSize = w * (uint32)TagTypeSize(ttShort);
+  if (m_eMode == modeMean)
+    bufferSize += w * (uint32)TagTypeSize(ttLong);
+  else
+    bufferSize += (w + 1) * frames * (uint32)TagTypeSize(ttShort);
+
+  for (uint32 index = 0; index < threadCount; index++)
+    m_oBufferData[index].Reset(allocator->Allocate(bufferSize));
+}
+
+// row[i] = round(sums[i] / frames), the same float arithmetic with or without SSE2
+static void mean_row(const uint32 *sums, uint16 *row, uint32 count, uint32 frames)
+{
+  const float scale = 1.0f / (float)frames;
+  uint32 i = 0;
+
+#ifdef HAVE_STACK_SSE2
+  const __m128 vscale = _mm_set1_ps(scale);
+  const __m128 half = _mm_set1_ps(0.5f);
+
+  for (; i + 8 <= count; i += 8) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *)(sums + i));
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(sums + i + 4));
+
+    // Sums of up to 65535 12-bit frames fit the signed conversion, the means the signed pack
+    const __m128i mlo = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), vscale), half));
+    const __m128i mhi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), vscale), half));
+
+    _mm_storeu_si128((__m128i *)(row + i), _mm_packs_epi32(mlo, mhi));
+  }
+#endif
+
+  for (; i < count; ++i)
+    row[i] = (uint16)((float)(int32)sums[i] * scale + 0.5f);
+}
+
+// Median of the count samples at values (reordered), the mean of the middle two for an even count
+static uint16 median(uint16 *values, uint32 count)
+{
+  if (count == 1)
+    return values[0];
+
+  uint16 *mid = values + count / 2;
+
+  std::nth_element(values, mid, values + count);
+
+  if (count & 1)
+    return *mid;
+
+  const uint16 below = *std::max_element(values, mid);
+
+  return (uint16)((below + *mid + 1) / 2);
+}
+
+// row[x] = median of rows[f * count + x] over the frames, pixels is scratch of frames samples
+static void median_row(const uint16 *rows, uint32 frames, uint16 *row, uint32 count, uint16 *pixel)
+{
+  uint32 x = 0;
+
+#ifdef HAVE_STACK_SSE2
+  if (frames <= STACK_NETWORK_FRAMES) {
+    __m128i v[STACK_NETWORK_FRAMES];
+
+    for (; x + 8 <= count; x += 8) {
+      for (uint32 f = 0; f < frames; ++f)
+        v[f] = _mm_loadu_si128((const __m128i *)(rows + (size_t)f * count + x));
+
+      // Odd-even transposition sort, 12-bit samples fit the signed compares
+      for (uint32 round = 0; round < frames; ++round) {
+        for (uint32 f = round & 1; f + 1 < frames; f += 2) {
+          const __m128i lo = _mm_min_epi16(v[f], v[f + 1]);
+          v[f + 1] = _mm_max_epi16(v[f], v[f + 1]);
+          v[f] = lo;
+        }
+      }
+
+      // Rounds up like median()
+      const __m128i m = (frames & 1) ? v[frames / 2] : _mm_avg_epu16(v[frames / 2 - 1], v[frames / 2]);
+      _mm_storeu_si128((__m128i *)(row + x), m);
+    }
+  }
+#endif
+
+  for (; x < count; ++x) {
+    for (uint32 f = 0; f < frames; ++f)
+      pixel[f] = rows[(size_t)f * count + x];
+
+    row[x] = median(pixel, frames);
+  }
+}
+
+// Pack row into the 12-bit readout layout CFAReader unpacks, count is even
+static void pack_row(const uint16 *row, uint8 *out, uint32 count)
+{
+  for (uint32 i = 0; i < count; i += 2, out += 3) {
+    const uint16 a = row[i];
+    const uint16 b = row[i + 1];
+
+    out[0] = (uint8)(a & 0xFF);
+    out[1] = (uint8)(((a >> 8) & 0x0F) | ((b & 0x0F) << 4));
+    out[2] = (uint8)(b >> 4);
+  }
+}
+
+void CFAStackTask::Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer * /* sniffer */)
+{
+  const uint32 w = m_oProfile.m_ulWidth;
+  const uint32 frames = (uint32)m_oReaders.size();
+  const size_t rowBytes = (w * 12) / 8 + m_oProfile.m_ulStride;
+
+  uint16 *row = (uint16 *)m_oBufferData[threadIndex]->Buffer();
+  uint32 *sums = (uint32 *)(row + w);
+  uint16 *rows = row + w;
+
+  for (int32 v = tile.t; v < tile.b; ++v) {
+    if (m_eMode == modeMean) {
+      memset(sums, 0, w * sizeof(uint32));
+
+      for (uint32 f = 0; f < frames; ++f) {
+        m_oReaders[f]->read_area((uint8_t *)row, w, m_oProfile.m_ulStride, v, 0, 1, w);
+        FrameAccumulator::AddRow(sums, row, w);
+      }
+
+      mean_row(sums, row, w, frames);
+    } else {
+      for (uint32 f = 0; f < frames; ++f)
+        m_oReaders[f]->read_area((uint8_t *)(rows + (size_t)f * w), w, m_oProfile.m_ulStride, v, 0, 1, w);
+
+      median_row(rows, frames, row, w, rows + (size_t)frames * w);
+    }
+
+    pack_row(row, m_pOut + (size_t)v * rowBytes, w);
+  }
+}
+
+real64 CFAStackTask::NoiseScale(Mode mode, size_t ulFrames)
+{
+  if (ulFrames < 2)
+    return 1.0;
+
+  // The median of normally distributed samples is sqrt(pi / 2) times as noisy as their mean
+  const real64 scale = (mode == modeMedian && ulFrames > 2 ? sqrt(3.14159265358979323846 / 2) : 1.0) / sqrt((real64)ulFrames);
+
+  return scale < 1.0 ? scale : 1.0;
+}
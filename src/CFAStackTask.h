@@ -0,0 +1,46 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __CFA_STACK_TASK_H__
+#define __CFA_STACK_TASK_H__
+
+#include <vector>
+
+#include <dng_area_task.h>
+#include <dng_auto_ptr.h>
+#include <dng_memory.h>
+#include <dng_sdk_limits.h>
+
+#include "CFAReader.h"
+#include "CameraProfile.h"
+
+// Stacks a run of readouts of one camera into a single readout in the same packed layout, which then
+// converts like any other. Every row is unpacked from all frames and combined before the next one, so
+// a thread only holds one row per frame whatever the number of frames; tiles of rows run in parallel.
+class CFAStackTask : public dng_area_task
+{
+  public:
+  enum Mode { modeMean, modeMedian };
+
+  // out holds m_ulFileSize bytes of profile and must be zeroed
+  CFAStackTask(const std::vector<const CFAReader *> &readers, const CameraProfile &profile, Mode mode, uint8 *out);
+
+  virtual void Start(uint32 threadCount,
+                     const dng_point &tileSize,
+                     dng_memory_allocator *allocator,
+                     dng_abort_sniffer *sniffer);
+
+  virtual void Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer *sniffer);
+
+  // Factor of the noise of a single frame left in the stack of ulFrames
+  static real64 NoiseScale(Mode mode, size_t ulFrames);
+
+  protected:
+  const std::vector<const CFAReader *> &m_oReaders;
+  const CameraProfile &m_oProfile;
+  Mode m_eMode;
+  uint8 *m_pOut;
+
+  AutoPtr<dng_memory_block> m_oBufferData[kMaxMPThreads];
+};
+
+#endif // __CFA_STACK_TASK_H__
@@ -0,0 +1,231 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <string.h>
+
+#include <dng_pixel_buffer.h>
+#include <dng_tag_types.h>
+#include <dng_utils.h>
+
+#include "CFAUnpackTask.h"
+#include "FastMD5.h"
+
+// White balance statistics sample every n-th 2x2 cell across and down (1/64 of the pixels with 4)
+#define WB_SAMPLE_STEP 4
+// Cells with a sample at or above this are left out, their color is clipped
+#define WB_CLIP_LEVEL 3900
+// Fraction of the sampled cells that must be usable for an estimate
+#define WB_MIN_CELLS_FRACTION 0.01
+
+// Add the sampled 2x2 cells of area (readout coordinates, even top and left) in buf to sums
+static void sum_wb_cells(const uint16 *buf, const dng_rect &area, uint64 sums[4], uint64 &cells, uint64 &sampled)
+{
+  const int32 step = 2 * WB_SAMPLE_STEP;
+  const uint32 w = area.W();
+
+  // On a grid anchored at the readout origin, whatever the tile
+  const int32 top = (area.t + step - 1) / step * step;
+  const int32 left = (area.l + step - 1) / step * step;
+
+  for (int32 v = top; v + 1 < area.b; v += step) {
+    const uint16 *row0 = buf + (v - area.t) * w;
+    const uint16 *row1 = row0 + w;
+
+    for (int32 h = left; h + 1 < area.r; h += step) {
+      const uint32 x = (uint32)(h - area.l);
+      const uint16 a = row0[x], b = row0[x + 1], c = row1[x], d = row1[x + 1];
+
+      ++sampled;
+
+      if (a >= WB_CLIP_LEVEL || b >= WB_CLIP_LEVEL || c >= WB_CLIP_LEVEL || d >= WB_CLIP_LEVEL)
+        continue;
+
+      sums[0] += a;
+      sums[1] += b;
+      sums[2] += c;
+      sums[3] += d;
+      ++cells;
+    }
+  }
+}
+
+CFAUnpackTask::CFAUnpackTask(const CFAReader &reader,
+                             const CameraProfile &profile,
+                             dng_image &image,
+                             const BadPixelMap *badPixels,
+                             bool flipped,
+                             const FrameCalibration *calibration,
+                             bool wbStats)
+        : m_oReader(reader), m_oProfile(profile), m_oImage(image), m_poBadPixels(badPixels), m_bFlipped(flipped),
+          m_poCalibration(calibration), m_bWBStats(wbStats), m_ulTilesAcross(0), m_ulTilesDown(0), m_ulTileBytes(0)
+{
+  fMinTaskArea = 1;
+
+  fUnitCell = dng_point(Min_int32(kDigestTileSize, m_oImage.Bounds().H()),
+                        Min_int32(kDigestTileSize, m_oImage.Bounds().W()));
+
+  // Several digest tiles side by side, so a thread can hash them in one go
+  fMaxTileSize = dng_point(fUnitCell.v, Min_int32(fUnitCell.h * MD5_LANES, m_oImage.Bounds().W()));
+}
+
+void CFAUnpackTask::Start(uint32 threadCount,
+                          const dng_point &tileSize,
+                          dng_memory_allocator *allocator,
+                          dng_abort_sniffer * /* sniffer */)
+{
+  if (m_oImage.PixelType() != ttShort || tileSize.v != fUnitCell.v || tileSize.h % fUnitCell.h)
+    ThrowProgramError();
+
+  m_ulTilesAcross = (m_oImage.Bounds().W() + fUnitCell.h - 1) / fUnitCell.h;
+  m_ulTilesDown = (m_oImage.Bounds().H() + fUnitCell.v - 1) / fUnitCell.v;
+
+  m_oTileHash.Reset(new dng_fingerprint[m_ulTilesAcross * m_ulTilesDown]);
+
+  m_ulTileBytes = m_oImage.Planes() * TagTypeSize(ttShort) * fUnitCell.h * fUnitCell.v;
+
+  uint32 bufferSize = m_ulTileBytes * (tileSize.h / fUnitCell.h);
+
+  for (uint32 index = 0; index < threadCount; index++) {
+    m_oBufferData[index].Reset(allocator->Allocate(bufferSize));
+    memset(m_oBufferData[index]->Buffer(), 0, bufferSize);
+  }
+
+  memset(m_ulWBSums, 0, sizeof(m_ulWBSums));
+  memset(m_ulWBCells, 0, sizeof(m_ulWBCells));
+  memset(m_ulWBSampled, 0, sizeof(m_ulWBSampled));
+}
+
+void CFAUnpackTask::Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer * /* sniffer */)
+{
+  const dng_rect &bounds = m_oImage.Bounds();
+  const uint32 planes = m_oImage.Planes();
+  const uint32 fullTilePixels = fUnitCell.h * fUnitCell.v;
+
+  const uint8 *data[MD5_LANES];
+  uint32 bytes[MD5_LANES];
+  uint32 tileIndex[MD5_LANES];
+  uint32 count = 0;
+
+  for (int32 left = tile.l; left < tile.r; left += fUnitCell.h) {
+    dng_rect area(tile.t, left, tile.b, Min_int32(left + fUnitCell.h, tile.r));
+
+    uint32 pixels = area.W() * area.H();
+    uint8 *buf = m_oBufferData[threadIndex]->Buffer_uint8() + count * m_ulTileBytes;
+
+    m_oReader.read_area(buf,
+                        m_oProfile.m_ulWidth,
+                        m_oProfile.m_ulStride,
+                        area.t - bounds.t,
+                        area.l - bounds.l,
+                        area.H(),
+                        area.W());
+
+    const dng_rect readoutArea(area.t - bounds.t, area.l - bounds.l, area.b - bounds.t, area.r - bounds.l);
+
+    if (m_poCalibration)
+      m_poCalibration->ApplyArea(m_oProfile, readoutArea, (uint16 *)buf);
+
+    if (m_poBadPixels)
+      m_poBadPixels->FixArea(m_oReader, m_oProfile, m_bFlipped, readoutArea, (uint16 *)buf, m_poCalibration);
+
+    if (m_bWBStats)
+      sum_wb_cells((const uint16 *)buf,
+                   readoutArea,
+                   m_ulWBSums[threadIndex],
+                   m_ulWBCells[threadIndex],
+                   m_ulWBSampled[threadIndex]);
+
+    // The buffer starts zeroed and full tiles only ever write the CFA plane,
+    // but a smaller edge tile packs its zero planes where a full CFA plane used to be
+    if (pixels != fullTilePixels)
+      memset(buf + pixels * TagTypeSize(ttShort), 0, (planes - 1) * pixels * TagTypeSize(ttShort));
+
+    dng_pixel_buffer buffer;
+
+    buffer.fArea = area;
+    buffer.fPlane = 0;
+    buffer.fPlanes = planes;
+    buffer.fRowStep = area.W();
+    buffer.fColStep = 1;
+    buffer.fPlaneStep = pixels;
+    buffer.fPixelType = ttShort;
+    buffer.fPixelSize = TagTypeSize(ttShort);
+    buffer.fData = buf;
+
+    m_oImage.Put(buffer);
+
+    data[count] = buf;
+    bytes[count] = planes * pixels * TagTypeSize(ttShort);
+    tileIndex[count] = ((area.t - bounds.t) / fUnitCell.v) * m_ulTilesAcross + (area.l - bounds.l) / fUnitCell.h;
+    ++count;
+  }
+
+  bool sameSize = (count == MD5_LANES);
+  for (uint32 i = 1; sameSize && i < count; ++i)
+    sameSize = (bytes[i] == bytes[0]);
+
+  if (sameSize) {
+    dng_fingerprint result[MD5_LANES];
+
+    md5_x4(data, bytes[0], result);
+
+    for (uint32 i = 0; i < count; ++i)
+      m_oTileHash[tileIndex[i]] = result[i];
+  } else {
+    for (uint32 i = 0; i < count; ++i) {
+      dng_md5_printer printer;
+
+      printer.Process(data[i], bytes[i]);
+
+      m_oTileHash[tileIndex[i]] = printer.Result();
+    }
+  }
+}
+
+dng_fingerprint CFAUnpackTask::Result()
+{
+  dng_md5_printer printer;
+
+  for (uint32 tileIndex = 0; tileIndex < m_ulTilesAcross * m_ulTilesDown; tileIndex++)
+    printer.Process(m_oTileHash[tileIndex].data, 16);
+
+  return printer.Result();
+}
+
+bool CFAUnpackTask::GrayWorldNeutral(dng_vector &neutral) const
+{
+  if (!m_bWBStats)
+    return false;
+
+  uint64 sums[4] = {0, 0, 0, 0};
+  uint64 cells = 0;
+  uint64 sampled = 0;
+
+  for (uint32 index = 0; index < kMaxMPThreads; index++) {
+    for (uint32 i = 0; i < 4; ++i)
+      sums[i] += m_ulWBSums[index][i];
+    cells += m_ulWBCells[index];
+    sampled += m_ulWBSampled[index];
+  }
+
+  if (!cells || (real64)cells < WB_MIN_CELLS_FRACTION * (real64)sampled)
+    return false;
+
+  const real64 black = (real64)m_oProfile.m_ulBlackLevel;
+
+  // RGGB, or BGGR for a rotated readout
+  real64 red = (real64)sums[m_bFlipped ? 3 : 0] / (real64)cells - black;
+  real64 green = (real64)(sums[1] + sums[2]) / (real64)(2 * cells) - black;
+  real64 blue = (real64)sums[m_bFlipped ? 0 : 3] / (real64)cells - black;
+
+  if (red <= 0 || green <= 0 || blue <= 0)
+    return false;
+
+  const real64 maxValue = Max_real64(Max_real64(red, green), blue);
+
+  neutral = dng_vector(3);
+  neutral[0] = red / maxValue;
+  neutral[1] = green / maxValue;
+  neutral[2] = blue / maxValue;
+
+  return true;
+}
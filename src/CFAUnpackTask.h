@@ -0,0 +1,78 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __CFA_UNPACK_TASK_H__
+#define __CFA_UNPACK_TASK_H__
+
+#include <dng_area_task.h>
+#include <dng_auto_ptr.h>
+#include <dng_fingerprint.h>
+#include <dng_image.h>
+#include <dng_matrix.h>
+#include <dng_memory.h>
+#include <dng_sdk_limits.h>
+
+#include "BadPixelMap.h"
+#include "CFAReader.h"
+#include "Calibration.h"
+#include "CameraProfile.h"
+
+// Unpacks the sensor readout straight into the stage 1 image tile by tile and computes the
+// NewRawImageDigest of every tile while it is still in cache, so WriteDNG does not need to
+// read the whole raw image again.
+//
+// Tiles follow dng_find_new_raw_image_digest_task: 256x256, planar, little endian 16-bit samples.
+// Planes other than the CFA plane are written as zeros so the digest matches what gets stored.
+// Dark and flat calibration and the pixels of a bad pixel map are applied before a tile is hashed,
+// so they are stored corrected. With white balance statistics, a sparse grid of the tile's 2x2 CFA cells
+// is summed up as well while the tile is still in cache.
+class CFAUnpackTask : public dng_area_task
+{
+  public:
+  CFAUnpackTask(const CFAReader &reader,
+                const CameraProfile &profile,
+                dng_image &image,
+                const BadPixelMap *badPixels = NULL,
+                bool flipped = false,
+                const FrameCalibration *calibration = NULL,
+                bool wbStats = false);
+
+  virtual void Start(uint32 threadCount,
+                     const dng_point &tileSize,
+                     dng_memory_allocator *allocator,
+                     dng_abort_sniffer *sniffer);
+
+  virtual void Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer *sniffer);
+
+  // Digest equal to dng_negative::FindNewRawImageDigest() of the unpacked image
+  dng_fingerprint Result();
+
+  // Camera neutral (red, green, blue) of the gray world: the mean color of the unclipped CFA cells
+  // sampled, normalized to the largest. False without statistics or if too few cells were usable.
+  bool GrayWorldNeutral(dng_vector &neutral) const;
+
+  protected:
+  enum { kDigestTileSize = 256 };
+
+  const CFAReader &m_oReader;
+  const CameraProfile &m_oProfile;
+  dng_image &m_oImage;
+  const BadPixelMap *m_poBadPixels;
+  bool m_bFlipped;
+  const FrameCalibration *m_poCalibration;
+  bool m_bWBStats;
+
+  uint32 m_ulTilesAcross;
+  uint32 m_ulTilesDown;
+  uint32 m_ulTileBytes;
+
+  AutoArray<dng_fingerprint> m_oTileHash;
+
+  AutoPtr<dng_memory_block> m_oBufferData[kMaxMPThreads];
+
+  // Per thread sums of the four positions of the 2x2 cells sampled, in readout order, and their number
+  uint64 m_ulWBSums[kMaxMPThreads][4];
+  uint64 m_ulWBCells[kMaxMPThreads];
+  uint64 m_ulWBSampled[kMaxMPThreads];
+};
+
+#endif // __CFA_UNPACK_TASK_H__
@@ -0,0 +1,297 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "Calibration.h"
+#include "DNGConverter.h"
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_CALIBRATION_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static const char master_header[] = "sjcam_raw2dng calibration master 1";
+
+// Samples of the 12-bit readouts
+#define CALIBRATION_WHITE_LEVEL 4095
+// Gain of 1.0 in the 3.13 fixed point gains, which top out just below 8
+#define CALIBRATION_GAIN_ONE 8192
+
+CalibrationMaster::CalibrationMaster() : m_ulWidth(0), m_ulHeight(0), m_ulFrames(0)
+{
+}
+
+int CalibrationMaster::Load(const std::string &szPath)
+{
+  FILE *fp = fopen(szPath.c_str(), "rb");
+  if (!fp) {
+    perror(szPath.c_str());
+    return -1;
+  }
+
+  char line[256];
+  std::vector<std::string> fields;
+  int ret = 0;
+
+  if (!fgets(line, sizeof(line), fp) || strncmp(line, master_header, sizeof(master_header) - 1)) {
+    fprintf(stderr, "%s: Not a calibration master\n", szPath.c_str());
+    ret = -1;
+  } else if (!fgets(line, sizeof(line), fp) || split_string(line, '\t', fields) != 4) {
+    fprintf(stderr, "%s: Missing camera of the calibration master\n", szPath.c_str());
+    ret = -1;
+  } else {
+    m_szCameraModel = fields[0];
+    m_ulWidth = (uint32)strtoul(fields[1].c_str(), NULL, 10);
+    m_ulHeight = (uint32)strtoul(fields[2].c_str(), NULL, 10);
+    m_ulFrames = strtoul(fields[3].c_str(), NULL, 10);
+
+    // Little endian samples, row by row
+    std::vector<uint8> data((size_t)m_ulWidth * m_ulHeight * 2);
+
+    if (data.empty() || fread(&data[0], 1, data.size(), fp) != data.size()) {
+      fprintf(stderr, "%s: Truncated calibration master\n", szPath.c_str());
+      ret = -1;
+    } else {
+      m_oSamples.resize(data.size() / 2);
+      for (size_t i = 0; i < m_oSamples.size(); ++i)
+        m_oSamples[i] = (uint16)(data[2 * i] | (data[2 * i + 1] << 8));
+    }
+  }
+
+  fclose(fp);
+
+  return ret;
+}
+
+int CalibrationMaster::Save(const std::string &szPath) const
+{
+  const std::string tmp_path = szPath + ".tmp";
+
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  fprintf(fp, "%s\n", master_header);
+  fprintf(fp, "%s\t%u\t%u\t%zu\n", m_szCameraModel.c_str(), (unsigned int)m_ulWidth, (unsigned int)m_ulHeight,
+          m_ulFrames);
+
+  std::vector<uint8> data(m_oSamples.size() * 2);
+  for (size_t i = 0; i < m_oSamples.size(); ++i) {
+    data[2 * i] = (uint8)(m_oSamples[i] & 0xFF);
+    data[2 * i + 1] = (uint8)(m_oSamples[i] >> 8);
+  }
+
+  bool failed = !data.empty() && fwrite(&data[0], 1, data.size(), fp) != data.size();
+
+  if (fclose(fp) || failed) {
+    perror("fclose");
+    remove(tmp_path.c_str());
+    return -1;
+  }
+
+  if (replace_file(tmp_path, szPath)) {
+    perror("rename");
+    remove(tmp_path.c_str());
+    return -1;
+  }
+
+  return 0;
+}
+
+void CalibrationMaster::Average(const FrameAccumulator &oFrames, bool bFlipped)
+{
+  const CameraProfile *poProfile = oFrames.GetProfile();
+  const uint64 frames = oFrames.GetFrameCount();
+
+  m_oSamples.clear();
+  m_ulFrames = 0;
+
+  if (!poProfile || !frames)
+    return;
+
+  m_szCameraModel = poProfile->m_szCameraModel;
+  m_ulWidth = poProfile->m_ulWidth;
+  m_ulHeight = poProfile->m_ulHeight;
+  m_ulFrames = (size_t)frames;
+
+  const std::vector<uint32> &sums = oFrames.GetSums();
+  m_oSamples.resize(sums.size());
+
+  for (size_t i = 0; i < sums.size(); ++i)
+    m_oSamples[i] = (uint16)(((uint64)sums[i] * 16 + frames / 2) / frames);
+
+  // A rotated readout starts at the last pixel of the sensor
+  if (bFlipped)
+    std::reverse(m_oSamples.begin(), m_oSamples.end());
+}
+
+bool CalibrationMaster::Matches(const CameraProfile &oCamProfile) const
+{
+  return oCamProfile.m_szCameraModel == m_szCameraModel && oCamProfile.m_ulWidth == m_ulWidth &&
+         oCamProfile.m_ulHeight == m_ulHeight;
+}
+
+FrameCalibration::FrameCalibration() : m_ulWidth(0), m_ulHeight(0)
+{
+}
+
+int FrameCalibration::Init(const CalibrationMaster *poDark, const CalibrationMaster *poFlat, bool bFlipped)
+{
+  const CalibrationMaster *poFirst = poDark ? poDark : poFlat;
+  if (!poFirst)
+    return -1;
+
+  if (poDark && poFlat &&
+      (poDark->m_szCameraModel != poFlat->m_szCameraModel || poDark->m_ulWidth != poFlat->m_ulWidth ||
+       poDark->m_ulHeight != poFlat->m_ulHeight)) {
+    fprintf(stderr, "Dark and flat masters are of different cameras or resolutions\n");
+    return -1;
+  }
+
+  m_szCameraModel = poFirst->m_szCameraModel;
+  m_ulWidth = poFirst->m_ulWidth;
+  m_ulHeight = poFirst->m_ulHeight;
+
+  m_oDark.clear();
+  m_oGain.clear();
+
+  if (poDark)
+    m_oDark = poDark->m_oSamples;
+
+  if (poFlat) {
+    const std::vector<uint16> &flat = poFlat->m_oSamples;
+
+    // The masters do not record the black level, the camera profile they match does
+    uint32 black16 = 0;
+    for (size_t i = 0; i < DNGConverter::GetCameraProfileCount(); ++i) {
+      if (Matches(DNGConverter::GetCameraProfile(i))) {
+        black16 = DNGConverter::GetCameraProfile(i).m_ulBlackLevel * 16;
+        break;
+      }
+    }
+
+    // Mean of each CFA color
+    uint64 sums[4] = {0, 0, 0, 0};
+    uint64 counts[4] = {0, 0, 0, 0};
+
+    for (uint32 y = 0; y < m_ulHeight; ++y) {
+      for (uint32 x = 0; x < m_ulWidth; ++x) {
+        const uint32 f = flat[(size_t)y * m_ulWidth + x];
+        const uint32 color = (y & 1) * 2 + (x & 1);
+
+        sums[color] += f > black16 ? f - black16 : 0;
+        ++counts[color];
+      }
+    }
+
+    real64 means[4];
+    for (uint32 color = 0; color < 4; ++color)
+      means[color] = counts[color] ? (real64)sums[color] / (real64)counts[color] : 0.0;
+
+    m_oGain.resize(flat.size());
+
+    for (uint32 y = 0; y < m_ulHeight; ++y) {
+      for (uint32 x = 0; x < m_ulWidth; ++x) {
+        const size_t i = (size_t)y * m_ulWidth + x;
+        const real64 f = flat[i] > black16 ? (real64)(flat[i] - black16) : 0.0;
+
+        // Pixels too dark to correct are left to a bad pixel map
+        const real64 gain = f > 0 ? means[(y & 1) * 2 + (x & 1)] / f * CALIBRATION_GAIN_ONE : 0.0;
+        m_oGain[i] = (uint16)(gain > 0 && gain < 65535.0 ? gain + 0.5 : CALIBRATION_GAIN_ONE);
+      }
+    }
+  }
+
+  // The masters are in sensor orientation, which a rotated readout runs through backwards
+  if (bFlipped) {
+    std::reverse(m_oDark.begin(), m_oDark.end());
+    std::reverse(m_oGain.begin(), m_oGain.end());
+  }
+
+  return 0;
+}
+
+bool FrameCalibration::Matches(const CameraProfile &oCamProfile) const
+{
+  return oCamProfile.m_szCameraModel == m_szCameraModel && oCamProfile.m_ulWidth == m_ulWidth &&
+         oCamProfile.m_ulHeight == m_ulHeight;
+}
+
+// Samples in 1/16 levels minus dark, times gain (3.13) gives half levels: round, add black, clip
+static inline uint16 calibrate(uint16 sample, uint32 dark, uint32 gain, uint32 black)
+{
+  const uint32 v = (uint32)sample * 16 > dark ? (uint32)sample * 16 - dark : 0;
+  const uint32 out = ((((v * gain) >> 16) + 1) >> 1) + black;
+
+  return (uint16)(out < CALIBRATION_WHITE_LEVEL ? out : CALIBRATION_WHITE_LEVEL);
+}
+
+// Calibrate count samples of row, with a dark and/or gain row or the constant ones instead
+static void calibrate_row(uint16 *row,
+                          uint32 count,
+                          const uint16 *dark,
+                          uint16 darkConst,
+                          const uint16 *gain,
+                          uint16 gainConst,
+                          uint16 black)
+{
+  uint32 i = 0;
+
+#ifdef HAVE_CALIBRATION_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i vdark = _mm_set1_epi16((short)darkConst);
+  const __m128i vgain = _mm_set1_epi16((short)gainConst);
+  const __m128i vblack = _mm_set1_epi16((short)black);
+  const __m128i vwhite = _mm_set1_epi16(CALIBRATION_WHITE_LEVEL);
+
+  for (; i + 8 <= count; i += 8) {
+    const __m128i s = _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(row + i)), 4);
+    const __m128i d = dark ? _mm_loadu_si128((const __m128i *)(dark + i)) : vdark;
+    const __m128i g = gain ? _mm_loadu_si128((const __m128i *)(gain + i)) : vgain;
+
+    __m128i out = _mm_avg_epu16(_mm_mulhi_epu16(_mm_subs_epu16(s, d), g), zero);
+    out = _mm_adds_epu16(out, vblack);
+    // _mm_min_epu16 needs SSE4.1
+    out = _mm_sub_epi16(out, _mm_subs_epu16(out, vwhite));
+
+    _mm_storeu_si128((__m128i *)(row + i), out);
+  }
+#endif
+
+  for (; i < count; ++i)
+    row[i] = calibrate(row[i], dark ? dark[i] : darkConst, gain ? gain[i] : gainConst, black);
+}
+
+void FrameCalibration::ApplyArea(const CameraProfile &oCamProfile, const dng_rect &area, uint16 *buf) const
+{
+  const uint16 black = (uint16)oCamProfile.m_ulBlackLevel;
+
+  for (int32 v = area.t; v < area.b; ++v) {
+    const size_t offset = (size_t)v * m_ulWidth + area.l;
+
+    calibrate_row(buf + (size_t)(v - area.t) * area.W(),
+                  area.W(),
+                  m_oDark.empty() ? NULL : &m_oDark[offset],
+                  (uint16)(black * 16),
+                  m_oGain.empty() ? NULL : &m_oGain[offset],
+                  CALIBRATION_GAIN_ONE,
+                  black);
+  }
+}
+
+uint16 FrameCalibration::ApplySample(const CameraProfile &oCamProfile, int32 v, int32 h, uint16 sample) const
+{
+  const size_t i = (size_t)v * m_ulWidth + h;
+
+  return calibrate(sample,
+                   m_oDark.empty() ? oCamProfile.m_ulBlackLevel * 16 : m_oDark[i],
+                   m_oGain.empty() ? CALIBRATION_GAIN_ONE : m_oGain[i],
+                   oCamProfile.m_ulBlackLevel);
+}
@@ -0,0 +1,79 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __CALIBRATION_H__
+#define __CALIBRATION_H__
+
+#include <string>
+#include <vector>
+
+#include <dng_rect.h>
+
+#include "CameraProfile.h"
+#include "FrameAccumulator.h"
+
+// Mean of a series of dark frames (lens capped, same exposure and ISO as the lights) or flat frames
+// (evenly lit), in sensor orientation and 1/16 levels. Like a BadPixelMap it is tied to a camera model
+// and resolution only.
+class CalibrationMaster
+{
+  public:
+  CalibrationMaster();
+
+  int Load(const std::string &szPath);
+  int Save(const std::string &szPath) const;
+
+  // Average the frames of oFrames, bFlipped if they were taken in rotated orientation
+  void Average(const FrameAccumulator &oFrames, bool bFlipped);
+
+  // True if the master was built from frames of oCamProfile
+  bool Matches(const CameraProfile &oCamProfile) const;
+
+  size_t GetFrameCount() const
+  {
+    return m_ulFrames;
+  }
+
+  protected:
+  friend class FrameCalibration;
+
+  std::string m_szCameraModel;
+  uint32 m_ulWidth;
+  uint32 m_ulHeight;
+  size_t m_ulFrames;
+
+  std::vector<uint16> m_oSamples;
+};
+
+// Dark subtraction and flat field correction of unpacked readouts, fused into one pass:
+//   out = black + (in - dark) * mean(flat) / flat
+// with the flat mean taken per CFA color, so white balance is left alone. The masters are turned into
+// per pixel offsets and gains in readout orientation once, applying them takes a subtraction and a
+// multiplication per sample.
+class FrameCalibration
+{
+  public:
+  FrameCalibration();
+
+  // Either master may be NULL. -1 if both are and if they differ in camera or size.
+  int Init(const CalibrationMaster *poDark, const CalibrationMaster *poFlat, bool bFlipped);
+
+  // True if the masters were built from frames of oCamProfile
+  bool Matches(const CameraProfile &oCamProfile) const;
+
+  // Correct area (readout coordinates) of the unpacked samples in buf, tightly packed rows of area.W().
+  // Safe to call concurrently for different areas.
+  void ApplyArea(const CameraProfile &oCamProfile, const dng_rect &area, uint16 *buf) const;
+
+  // Correct sample (v, h) of the readout
+  uint16 ApplySample(const CameraProfile &oCamProfile, int32 v, int32 h, uint16 sample) const;
+
+  protected:
+  std::string m_szCameraModel;
+  uint32 m_ulWidth;
+  uint32 m_ulHeight;
+
+  std::vector<uint16> m_oDark; // Dark master in 1/16 levels, empty without one
+  std::vector<uint16> m_oGain; // Flat field gains as 3.13 fixed point, empty without a flat master
+};
+
+#endif // __CALIBRATION_H__
@@ -0,0 +1,360 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#define getpid _getpid
+#define mkdir(path, mode) _mkdir(path)
+#define utime _utime
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+#endif
+
+#include <vector>
+
+#include <dng_fingerprint.h>
+
+#include "ConversionCache.h"
+#include "FastMD5.h"
+#include "helpers.h"
+#include "utils.h"
+
+// Names of the outputs in an entry
+static const std::string cached_dng("output" + dng_suffix);
+static const std::string cached_tiff("output" + tiff_suffix);
+
+// Names of the subdirectories of dir
+static void list_subdirs(const std::string &dir, std::vector<std::string> &names)
+#if defined(_WIN32) || defined(_WIN64)
+{
+  WIN32_FIND_DATA ffd;
+
+  HANDLE hFind = FindFirstFile((dir + "\\*").c_str(), &ffd);
+  if (INVALID_HANDLE_VALUE == hFind)
+    return;
+
+  do {
+    if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && ffd.cFileName[0] != '.')
+      names.push_back(ffd.cFileName);
+  } while (FindNextFile(hFind, &ffd) != 0);
+
+  FindClose(hFind);
+}
+#else
+{
+  DIR *dp = opendir(dir.c_str());
+  if (!dp)
+    return;
+
+  struct dirent *dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    if (dirp->d_name[0] == '.')
+      continue;
+
+    struct stat sb;
+    if (dirp->d_type == DT_DIR ||
+        (dirp->d_type == DT_UNKNOWN && !stat((dir + DELIM + dirp->d_name).c_str(), &sb) && S_ISDIR(sb.st_mode)))
+      names.push_back(dirp->d_name);
+  }
+
+  closedir(dp);
+}
+#endif
+
+// Make szTo hold the contents of szFrom, sharing the data where the file system allows:
+// a clone (reflink, copy on write) if it can, else a hard link, else a copy
+static int clone_file(const std::string &szFrom, const std::string &szTo)
+{
+  remove(szTo.c_str());
+
+#if defined(_WIN32) || defined(_WIN64)
+  if (CreateHardLink(szTo.c_str(), szFrom.c_str(), NULL) || CopyFile(szFrom.c_str(), szTo.c_str(), TRUE))
+    return 0;
+#else
+#ifdef FICLONE
+  int in = open(szFrom.c_str(), O_RDONLY);
+  if (in >= 0) {
+    int out = open(szTo.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+
+    if (out >= 0)
+      close(out);
+    close(in);
+
+    if (cloned)
+      return 0;
+
+    remove(szTo.c_str());
+  }
+#endif
+
+  if (link(szFrom.c_str(), szTo.c_str()) == 0)
+    return 0;
+
+  // Another file system
+  FILE *src = fopen(szFrom.c_str(), "rb");
+  if (!src)
+    return -1;
+
+  FILE *dst = fopen(szTo.c_str(), "wb");
+  if (!dst) {
+    fclose(src);
+    return -1;
+  }
+
+  std::vector<char> buf(1 << 20);
+  size_t len;
+  bool failed = false;
+
+  while (!failed && (len = fread(&buf[0], 1, buf.size(), src)) > 0)
+    failed = fwrite(&buf[0], 1, len, dst) != len;
+
+  failed = ferror(src) || failed;
+  fclose(src);
+
+  if (fclose(dst) || failed) {
+    remove(szTo.c_str());
+    return -1;
+  }
+
+  return 0;
+#endif
+
+  return -1;
+}
+
+static uint64_t file_size(const std::string &szPath)
+{
+  struct stat sb;
+  return stat(szPath.c_str(), &sb) ? 0 : (uint64_t)sb.st_size;
+}
+
+ConversionCache::ConversionCache(const std::string &szDir, uint64_t ulMaxSize, const std::string &szConfig)
+        : m_szDir(szDir), m_ulMaxSize(ulMaxSize), m_szConfig(szConfig), m_oMutex("ConversionCache"), m_ulSize(0),
+          m_ulTemp(0), m_ulHits(0), m_ulMisses(0), m_ulEvicted(0), m_ulFetched(0)
+{
+}
+
+int ConversionCache::Open(void)
+{
+  if (mkdir(m_szDir.c_str(), 0755) && errno != EEXIST) {
+    perror(m_szDir.c_str());
+    return -1;
+  }
+
+  std::vector<std::string> buckets;
+  list_subdirs(m_szDir, buckets);
+
+  dng_lock_mutex lock(&m_oMutex);
+
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    std::vector<std::string> keys;
+    list_subdirs(m_szDir + DELIM + buckets[i], keys);
+
+    for (size_t k = 0; k < keys.size(); ++k) {
+      const std::string szEntry = EntryDir(keys[k]);
+
+      struct stat sb;
+      if (stat(szEntry.c_str(), &sb))
+        continue;
+
+      Entry &oEntry = m_oEntries[keys[k]];
+      oEntry.m_lUsed = (long long)sb.st_mtime;
+      oEntry.m_ulSize = file_size(szEntry + DELIM + cached_dng) + file_size(szEntry + DELIM + cached_tiff);
+
+      m_ulSize += oEntry.m_ulSize;
+    }
+  }
+
+  // A smaller size than the last run's
+  Evict("");
+
+  return 0;
+}
+
+std::string ConversionCache::Key(const uint8_t *pRaw, size_t ulSize, const std::string &szMetadataFile) const
+{
+  dng_md5_printer printer;
+
+  // The readout in MD5_LANES parts hashed side by side, then their digests and the rest
+  const uint32 part = (uint32)(ulSize / MD5_LANES);
+  if (part) {
+    const uint8 *data[MD5_LANES];
+    dng_fingerprint lanes[MD5_LANES];
+
+    for (uint32 i = 0; i < MD5_LANES; ++i)
+      data[i] = pRaw + (size_t)i * part;
+
+    md5_x4(data, part, lanes);
+
+    for (uint32 i = 0; i < MD5_LANES; ++i)
+      printer.Process(lanes[i].data, dng_fingerprint::kDNGFingerprintSize);
+  }
+
+  printer.Process(pRaw + (size_t)part * MD5_LANES, (uint32)(ulSize - (size_t)part * MD5_LANES));
+
+  std::string szMetadataHash;
+  if (!szMetadataFile.empty() && !md5_file(szMetadataFile, szMetadataHash))
+    return "";
+
+  const std::string szRest = "," + szMetadataHash + "," + m_szConfig;
+  printer.Process(szRest.data(), (uint32)szRest.size());
+
+  char str[2 * dng_fingerprint::kDNGFingerprintSize + 1];
+  printer.Result().ToUtf8HexString(str);
+
+  return str;
+}
+
+std::string ConversionCache::EntryDir(const std::string &szKey) const
+{
+  return m_szDir + DELIM + szKey.substr(0, 2) + DELIM + szKey;
+}
+
+std::string ConversionCache::TempName(const std::string &szPath)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), ".tmp.%ld.%zu", (long)getpid(), m_ulTemp++);
+
+  return szPath + suffix;
+}
+
+bool ConversionCache::Fetch(const std::string &szKey, const std::string &szDngFile, const std::string &szTiffFile)
+{
+  const std::string szEntry = EntryDir(szKey);
+  const std::string szFrom[2] = {szEntry + DELIM + cached_dng, szEntry + DELIM + cached_tiff};
+  const std::string szTo[2] = {szDngFile, szTiffFile};
+
+  bool hit = true;
+  for (int i = 0; i < 2 && hit; ++i)
+    hit = szTo[i].empty() || file_size(szFrom[i]) > 0;
+
+  // Outputs are put in place under a temporary name like converted ones
+  uint64_t ulFetched = 0;
+  for (int i = 0; i < 2 && hit; ++i) {
+    if (szTo[i].empty())
+      continue;
+
+    const std::string szPartial = szTo[i] + partial_suffix;
+
+    hit = clone_file(szFrom[i], szPartial) == 0 && replace_file(szPartial, szTo[i]) == 0;
+
+    // Renaming a hard link over another link of the same file (fetched before) leaves both in place
+    remove(szPartial.c_str());
+
+    ulFetched += file_size(szTo[i]);
+  }
+
+  dng_lock_mutex lock(&m_oMutex);
+
+  if (!hit) {
+    ++m_ulMisses;
+    return false;
+  }
+
+  ++m_ulHits;
+  m_ulFetched += ulFetched;
+
+  // Recently used, the directory's mtime is not the outputs' even when they are hard links
+  utime(szEntry.c_str(), NULL);
+
+  // Stored by another process since Open()
+  Entry &oEntry = m_oEntries[szKey];
+  if (!oEntry.m_ulSize) {
+    oEntry.m_ulSize = file_size(szFrom[0]) + file_size(szFrom[1]);
+    m_ulSize += oEntry.m_ulSize;
+  }
+  oEntry.m_lUsed = (long long)time(NULL);
+
+  return true;
+}
+
+void ConversionCache::Store(const std::string &szKey, const std::string &szDngFile, const std::string &szTiffFile)
+{
+  const std::string szBucket = m_szDir + DELIM + szKey.substr(0, 2);
+  const std::string szEntry = EntryDir(szKey);
+
+  if ((mkdir(szBucket.c_str(), 0755) && errno != EEXIST) || (mkdir(szEntry.c_str(), 0755) && errno != EEXIST)) {
+    perror(szEntry.c_str());
+    return;
+  }
+
+  const std::string szFrom[2] = {szDngFile, szTiffFile};
+  const std::string szTo[2] = {szEntry + DELIM + cached_dng, szEntry + DELIM + cached_tiff};
+
+  for (int i = 0; i < 2; ++i) {
+    if (szFrom[i].empty() || file_size(szTo[i]) > 0)
+      continue;
+
+    // Complete or not there at all for any process looking into the entry
+    const std::string szTemp = TempName(szTo[i]);
+    if (clone_file(szFrom[i], szTemp) || replace_file(szTemp, szTo[i])) {
+      perror(szTo[i].c_str());
+      remove(szTemp.c_str());
+    }
+  }
+
+  utime(szEntry.c_str(), NULL);
+
+  dng_lock_mutex lock(&m_oMutex);
+
+  Entry &oEntry = m_oEntries[szKey];
+  m_ulSize -= oEntry.m_ulSize;
+
+  oEntry.m_ulSize = file_size(szTo[0]) + file_size(szTo[1]);
+  oEntry.m_lUsed = (long long)time(NULL);
+  m_ulSize += oEntry.m_ulSize;
+
+  Evict(szKey);
+}
+
+void ConversionCache::Evict(const std::string &szKeep)
+{
+  while (m_ulSize > m_ulMaxSize) {
+    std::map<std::string, Entry>::iterator oldest = m_oEntries.end();
+    std::map<std::string, Entry>::iterator it;
+
+    for (it = m_oEntries.begin(); it != m_oEntries.end(); ++it) {
+      if (it->first != szKeep && (oldest == m_oEntries.end() || it->second.m_lUsed < oldest->second.m_lUsed))
+        oldest = it;
+    }
+
+    if (oldest == m_oEntries.end())
+      break;
+
+    // Outputs linked from the entry keep their data
+    const std::string szEntry = EntryDir(oldest->first);
+    remove((szEntry + DELIM + cached_dng).c_str());
+    remove((szEntry + DELIM + cached_tiff).c_str());
+    rmdir(szEntry.c_str());
+
+    m_ulSize -= oldest->second.m_ulSize;
+    m_oEntries.erase(oldest);
+    ++m_ulEvicted;
+  }
+}
+
+void ConversionCache::GetUsage(size_t &ulEntries, uint64_t &ulBytes)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  ulEntries = m_oEntries.size();
+  ulBytes = m_ulSize;
+}
@@ -0,0 +1,104 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __CONVERSION_CACHE_H__
+#define __CONVERSION_CACHE_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <dng_mutex.h>
+
+// Cache size of --cache without --cache-size
+#define DEFAULT_CACHE_SIZE (16ULL << 30)
+
+// Outputs of earlier conversions, found by a hash of their input: the RAW readout, its JPG, and the
+// converter version and options the outputs depend on. A hit clones (reflink) or hard links the cached
+// outputs into place instead of converting, so a RAW copied to several folders is converted once.
+//
+// Entries are directories "<dir>/<2 hex digits>/<key>/" holding the DNG and/or TIFF; the mtime of the
+// directory is when the entry was last used, the oldest entries go once the cache grows beyond its size.
+// Several processes may share a cache, every file enters it by an atomic rename.
+class ConversionCache
+{
+  public:
+  // szConfig identifies everything besides the input the outputs depend on
+  ConversionCache(const std::string &szDir, uint64_t ulMaxSize, const std::string &szConfig);
+
+  // Create the cache directory if needed and take stock of the entries
+  int Open(void);
+
+  // Key of a RAW readout of ulSize bytes and its metadata file (may be empty)
+  std::string Key(const uint8_t *pRaw, size_t ulSize, const std::string &szMetadataFile) const;
+
+  // Put the cached outputs of szKey in place of szDngFile and/or szTiffFile (empty to skip),
+  // false if the entry does not hold all of them
+  bool Fetch(const std::string &szKey, const std::string &szDngFile, const std::string &szTiffFile);
+
+  // Add outputs just written to the entry of szKey, then evict the least recently used entries
+  // beyond the size
+  void Store(const std::string &szKey, const std::string &szDngFile, const std::string &szTiffFile);
+
+  size_t GetHits(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulHits;
+  }
+
+  size_t GetMisses(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulMisses;
+  }
+
+  size_t GetEvicted(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulEvicted;
+  }
+
+  // Bytes of outputs put in place from the cache
+  uint64_t GetBytesFetched(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulFetched;
+  }
+
+  // Entries and their bytes, as far as this process knows
+  void GetUsage(size_t &ulEntries, uint64_t &ulBytes);
+
+  protected:
+  struct Entry {
+    Entry() : m_ulSize(0), m_lUsed(0)
+    {
+    }
+
+    uint64_t m_ulSize;
+    long long m_lUsed;
+  };
+
+  std::string EntryDir(const std::string &szKey) const;
+
+  // Unique name next to szPath to build a file under before renaming it into place
+  std::string TempName(const std::string &szPath);
+
+  // Remove least recently used entries, other than szKeep, until the cache fits. Holds m_oMutex.
+  void Evict(const std::string &szKeep);
+
+  const std::string m_szDir;
+  const uint64_t m_ulMaxSize;
+  const std::string m_szConfig;
+
+  dng_mutex m_oMutex;
+  std::map<std::string, Entry> m_oEntries;
+  uint64_t m_ulSize;
+  size_t m_ulTemp;
+
+  size_t m_ulHits;
+  size_t m_ulMisses;
+  size_t m_ulEvicted;
+  uint64_t m_ulFetched;
+};
+
+#endif // __CONVERSION_CACHE_H__
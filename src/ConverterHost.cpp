@@ -0,0 +1,200 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <vector>
+#include <typeinfo>
+
+#include <dng_area_task.h>
+#include <dng_exceptions.h>
+#include <dng_mutex.h>
+#include <dng_pthread.h>
+#include <dng_sdk_limits.h>
+#include <dng_simple_image.h>
+#include <dng_tag_types.h>
+#include <dng_tile_iterator.h>
+#include <dng_utils.h>
+
+#include "ConverterHost.h"
+#include "Stats.h"
+
+struct AreaTaskQueue {
+  AreaTaskQueue(dng_area_task &task, const dng_point &tileSize, dng_abort_sniffer *sniffer, Trace *trace)
+          : m_oTask(task), m_oTileSize(tileSize), m_pSniffer(sniffer), m_poTrace(trace), m_unLane(0), m_ulNext(0),
+            m_oMutex("AreaTaskQueue"), m_eError(dng_error_none)
+  {
+  }
+
+  dng_area_task &m_oTask;
+  const dng_point m_oTileSize;
+  dng_abort_sniffer *m_pSniffer;
+
+  Trace *m_poTrace;
+  uint32 m_unLane; // Of the thread running the task
+
+  std::vector<dng_rect> m_oTiles;
+  size_t m_ulNext;
+  dng_mutex m_oMutex;
+
+  dng_error_code m_eError;
+};
+
+struct AreaTaskWork {
+  AreaTaskQueue *m_pQueue;
+  uint32 m_unThreadIndex;
+};
+
+static bool next_tile(AreaTaskQueue *queue, dng_rect &tile)
+{
+  dng_lock_mutex lock(&queue->m_oMutex);
+
+  // Stop handing out work once any thread failed
+  if (queue->m_eError != dng_error_none || queue->m_ulNext == queue->m_oTiles.size())
+    return false;
+
+  tile = queue->m_oTiles[queue->m_ulNext++];
+
+  return true;
+}
+
+static void *area_task_worker(void *arg)
+{
+  AreaTaskWork *work = (AreaTaskWork *)arg;
+  AreaTaskQueue *queue = work->m_pQueue;
+
+  dng_error_code error = dng_error_none;
+
+  Trace *trace = queue->m_poTrace;
+  if (trace && work->m_unThreadIndex)
+    trace->join_lane(queue->m_unLane, work->m_unThreadIndex);
+
+  try {
+    dng_rect tile;
+    while (next_tile(queue, tile)) {
+      if (!trace) {
+        queue->m_oTask.ProcessOnThread(work->m_unThreadIndex, tile, queue->m_oTileSize, queue->m_pSniffer);
+        continue;
+      }
+
+      const uint64 start = monotonic_nsec();
+      queue->m_oTask.ProcessOnThread(work->m_unThreadIndex, tile, queue->m_oTileSize, queue->m_pSniffer);
+      trace->tile(typeid(queue->m_oTask).name(), start, monotonic_nsec(), tile);
+    }
+  } catch (const dng_exception &except) {
+    error = except.ErrorCode();
+  } catch (...) {
+    error = dng_error_unknown;
+  }
+
+  if (error != dng_error_none) {
+    dng_lock_mutex lock(&queue->m_oMutex);
+    if (queue->m_eError == dng_error_none)
+      queue->m_eError = error;
+  }
+
+  return NULL;
+}
+
+ConverterHost::ConverterHost(uint32 threads, Stats *stats, Trace *trace, dng_memory_allocator *allocator)
+        : dng_host(allocator), m_unThreads(Pin_uint32(1, threads, kMaxMPThreads)), m_poStats(stats), m_poTrace(trace),
+          m_poScratch(NULL)
+{
+}
+
+void ConverterHost::SetScratchAllocator(dng_memory_allocator *scratch)
+{
+  m_poScratch = scratch;
+}
+
+dng_image *ConverterHost::Make_dng_image(const dng_rect &bounds, uint32 planes, uint32 pixelType)
+{
+  const uint64 bytes = (uint64)bounds.W() * bounds.H() * planes * TagTypeSize(pixelType);
+
+  // Previews and thumbnails are not worth a file of their own
+  if (!m_poScratch || bytes < SCRATCH_MIN_BYTES)
+    return dng_host::Make_dng_image(bounds, planes, pixelType);
+
+  // Same layout as any other image, only the pixels live in a scratch file
+  return new dng_simple_image(bounds, planes, pixelType, *m_poScratch);
+}
+
+uint32 ConverterHost::PerformAreaTaskThreads()
+{
+  return m_unThreads;
+}
+
+void ConverterHost::PerformAreaTask(dng_area_task &task, const dng_rect &area)
+{
+  if (!m_poStats && !m_poTrace) {
+    RunAreaTask(task, area);
+    return;
+  }
+
+  StopWatch oWatch;
+  oWatch.run();
+
+  RunAreaTask(task, area);
+
+  oWatch.stop();
+
+  if (m_poStats)
+    m_poStats->add_task(typeid(task).name(), oWatch.elapsed_nsec(), (uint64)area.W() * (uint64)area.H());
+
+  if (m_poTrace)
+    m_poTrace->task(typeid(task).name(), oWatch.started_nsec(), oWatch.started_nsec() + oWatch.elapsed_nsec());
+}
+
+void ConverterHost::RunAreaTask(dng_area_task &task, const dng_rect &area)
+{
+  dng_point tileSize(task.FindTileSize(area));
+
+  AreaTaskQueue queue(task, tileSize, Sniffer(), m_poTrace);
+
+  // Tiles are anchored at the area origin exactly like the single threaded partitioner does,
+  // so tasks that index per-tile results by position keep working
+  dng_tile_iterator iter(tileSize, area);
+  dng_rect tile;
+  while (iter.GetOneTile(tile))
+    queue.m_oTiles.push_back(tile);
+
+  uint32 threads = Min_uint32(m_unThreads, task.MaxThreads());
+  threads = Min_uint32(threads, (uint32)queue.m_oTiles.size());
+  threads = Min_uint32(threads, Max_uint32(1, (uint32)(area.W() * area.H() / Max_uint32(1, task.MinTaskArea()))));
+
+  // A traced task goes through the queue even on one thread, so its tiles show up
+  if (threads == 0 || (threads == 1 && !m_poTrace)) {
+    dng_host::PerformAreaTask(task, area);
+    return;
+  }
+
+  if (m_poTrace)
+    queue.m_unLane = m_poTrace->lane();
+
+  task.Start(threads, tileSize, &Allocator(), Sniffer());
+
+  std::vector<AreaTaskWork> works(threads);
+  std::vector<pthread_t> pthreads(threads);
+
+  uint32 i;
+  uint32 started = 1;
+
+  for (i = 0; i < threads; ++i) {
+    works[i].m_pQueue = &queue;
+    works[i].m_unThreadIndex = i;
+  }
+
+  // The calling thread acts as worker 0
+  for (i = 1; i < threads; ++i) {
+    if (pthread_create(&pthreads[i], NULL, area_task_worker, &works[i]))
+      break;
+    ++started;
+  }
+
+  area_task_worker(&works[0]);
+
+  for (i = 1; i < started; ++i)
+    pthread_join(pthreads[i], NULL);
+
+  if (queue.m_eError != dng_error_none)
+    Throw_dng_error(queue.m_eError);
+
+  task.Finish(threads);
+}
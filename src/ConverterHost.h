@@ -0,0 +1,41 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __CONVERTER_HOST_H__
+#define __CONVERTER_HOST_H__
+
+#include <dng_host.h>
+
+// Smallest image put in a scratch file by a low memory host
+#define SCRATCH_MIN_BYTES (4 * 1024 * 1024)
+
+class Stats;
+class Trace;
+
+// DNG host that spreads area tasks (digest, linearization, demosaic, render, tile encoding)
+// over several threads of a single image
+class ConverterHost : public dng_host
+{
+  public:
+  // Area tasks are timed into stats and their tiles into trace, unless NULL.
+  // Memory comes from allocator, the SDK default if NULL.
+  ConverterHost(uint32 threads, Stats *stats = NULL, Trace *trace = NULL, dng_memory_allocator *allocator = NULL);
+
+  // Images of full size frames get their pixels from scratch, unless NULL
+  void SetScratchAllocator(dng_memory_allocator *scratch);
+
+  virtual dng_image *Make_dng_image(const dng_rect &bounds, uint32 planes, uint32 pixelType);
+
+  virtual void PerformAreaTask(dng_area_task &task, const dng_rect &area);
+
+  virtual uint32 PerformAreaTaskThreads();
+
+  protected:
+  void RunAreaTask(dng_area_task &task, const dng_rect &area);
+
+  uint32 m_unThreads;
+  Stats *m_poStats;
+  Trace *m_poTrace;
+  dng_memory_allocator *m_poScratch;
+};
+
+#endif // __CONVERTER_HOST_H__
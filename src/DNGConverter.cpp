@@ -39,26 +39,46 @@
 #include <dng_image_writer.h>
 #include <dng_host.h>
 #include <dng_file_stream.h>
+#include <dng_info.h>
+#include <dng_read_image.h>
 #include <dng_render.h>
 #include <dng_preview.h>
 #include <dng_xmp_sdk.h>
 #include <dng_xmp.h>
 #include <dng_globals.h>
+#include <dng_mutex.h>
 
 #include <assert.h>
+#include <string.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/stat.h>
 
 #include "DNGConverter.h"
+#include "BadPixelMap.h"
+#include "Calibration.h"
 #include "CameraProfile.h"
 #include "helpers.h"
 #include "CFAReader.h"
-#include "StopWatch.h"
+#include "CFAStackTask.h"
+#include "CFAUnpackTask.h"
+#include "ConversionCache.h"
+#include "ConverterHost.h"
+#include "FastMD5.h"
+#include "FrameXMP.h"
+#include "ImageDigestTask.h"
+#include "MemoryBudget.h"
+#include "LensCorrection.h"
+#include "LensProfile.h"
+#include "ScratchAllocator.h"
+#include "Stats.h"
 #include "utils.h"
+#include "version.h"
 
-// Enable this for some profiling
-// #define TIME_PROFILE
+// SDK memory of a conversion on top of its full size images: previews, bookkeeping,
+// and the tile buffers of every thread working on its area tasks
+#define MEMORY_OVERHEAD (1024 * 1024)
+#define MEMORY_OVERHEAD_PER_THREAD (1024 * 1024)
 
 const dng_urational DNGConverter::m_oZeroURational(0, 100);
 const dng_urational DNGConverter::m_oOneURational(1, 1);
@@ -79,22 +99,177 @@ const std::string DNGConverter::m_szMake = "SJCAM";
 // Calculate bit limit
 const uint32_t DNGConverter::m_unBitLimit = 0x01 << 12;
 
-DNGConverter::DNGConverter(Config &config) : m_oNeutralWB(3)
+const static CameraProfile gCamProfiles[] = {SJ5000xProfile(4000, 3000),
+                                             SJ5000xProfile(3484, 2612),
+                                             SJ5000xProfile(3032, 2272),
+                                             SJ5000xProfile(2640, 1980),
+                                             M20Profile(4608, 3456),
+                                             M20Profile(4012, 3008),
+                                             M20Profile(3492, 2620),
+                                             SJ6Profile(4624, 3488),
+                                             SJ6Profile(4024, 3036),
+                                             SJ6Profile(3760, 2832)};
+
+static const size_t g_ulNumCamProfiles = sizeof(gCamProfiles) / sizeof(gCamProfiles[0]);
+
+static const CameraProfile *get_CameraProfile(size_t sz)
+{
+  const CameraProfile *oResult = NULL;
+
+  for (unsigned int i = 0; i < g_ulNumCamProfiles; ++i) {
+    if (gCamProfiles[i].m_ulFileSize == sz) {
+      oResult = &gCamProfiles[i];
+      break;
+    }
+  }
+
+  return oResult;
+}
+
+size_t DNGConverter::GetCameraProfileCount(void)
+{
+  return g_ulNumCamProfiles;
+}
+
+const CameraProfile &DNGConverter::GetCameraProfile(size_t i)
+{
+  return gCamProfiles[i];
+}
+
+static uint64 image_pixels(const CameraProfile &oCamProfile)
+{
+  return (uint64)oCamProfile.m_ulWidth * oCamProfile.m_ulHeight;
+}
+
+static uint64 image_bytes(const dng_image &oImage)
+{
+  return (uint64)oImage.Bounds().W() * oImage.Bounds().H() * oImage.Planes() * oImage.PixelSize();
+}
+
+// Appended to the name of the first frame of a stack for the name of its outputs
+static const std::string stack_suffix("_stack");
+
+static dng_mutex g_oSDKMutex("DNGConverter SDK");
+static unsigned int g_unSDKUsers = 0;
+
+// What the outputs depend on besides the input: the converter and the options and files that change them
+static bool cache_signature(const Config &conf, std::string &signature)
+{
+  signature = VERSION_STR;
+
+  if (conf.m_bNoCalibration)
+    signature += ",no-color";
+  if (conf.m_bAutoWB)
+    signature += ",auto-wb";
+  if (conf.m_bGenPreview)
+    signature += ",thumb";
+  if (conf.m_bFlipped)
+    signature += ",rotated";
+  // Verified runs only reuse outputs that were verified
+  if (conf.m_bVerify)
+    signature += ",verified";
+
+  const std::string szFiles[] = {conf.m_bLensCorrections ? conf.m_szLensProfile : std::string(),
+                                 conf.m_szBadPixelMap,
+                                 conf.m_szDarkMaster,
+                                 conf.m_szFlatMaster};
+  const char *szNames[] = {",lens=", ",bad-pixels=", ",dark=", ",flat="};
+
+  // By content, the files may change under the same name
+  for (size_t i = 0; i < sizeof(szNames) / sizeof(szNames[0]); ++i) {
+    std::string hash;
+    if (!szFiles[i].empty() && !md5_file(szFiles[i], hash))
+      return false;
+    if (!szFiles[i].empty())
+      signature += szNames[i] + hash;
+  }
+
+  return true;
+}
+
+DNGConverter::DNGConverter(Config &config)
+        : m_poScratch(NULL), m_poLens(NULL), m_poBadPixels(NULL), m_poCalibration(NULL), m_poCache(NULL),
+          m_oVerifyMutex("DNGConverter verify"), m_ulVerified(0), m_ulVerifyFailed(0), m_oNeutralWB(3)
 {
   m_oConfig = config;
 
-  dng_xmp_sdk::InitializeSDK();
+  if (m_oConfig.m_bLowMemory)
+    m_poScratch = new ScratchAllocator(m_oConfig.m_szPathPrefixOutput);
+
+  {
+    dng_lock_mutex lock(&g_oSDKMutex);
+
+    // Several converters may live in one process (library use), the SDK goes away with the last one
+    if (g_unSDKUsers++ == 0)
+      dng_xmp_sdk::InitializeSDK();
+  }
+
+  // Parsed with the XMP SDK, once for all files
+  if (m_oConfig.m_bLensCorrections && !m_oConfig.m_szLensProfile.empty()) {
+    m_poLens = new LensProfile();
+    if (m_poLens->Load(m_oConfig.m_szLensProfile)) {
+      delete m_poLens;
+      m_poLens = NULL;
+    }
+  }
+
+  if (!m_oConfig.m_szBadPixelMap.empty()) {
+    m_poBadPixels = new BadPixelMap();
+    if (m_poBadPixels->Load(m_oConfig.m_szBadPixelMap)) {
+      delete m_poBadPixels;
+      m_poBadPixels = NULL;
+    }
+  }
+
+  // Only the per pixel offsets and gains derived from the masters are kept
+  if (!m_oConfig.m_szDarkMaster.empty() || !m_oConfig.m_szFlatMaster.empty()) {
+    CalibrationMaster dark, flat;
+    const bool bDark = !m_oConfig.m_szDarkMaster.empty();
+    const bool bFlat = !m_oConfig.m_szFlatMaster.empty();
+
+    if ((!bDark || !dark.Load(m_oConfig.m_szDarkMaster)) && (!bFlat || !flat.Load(m_oConfig.m_szFlatMaster))) {
+      m_poCalibration = new FrameCalibration();
+      if (m_poCalibration->Init(bDark ? &dark : NULL, bFlat ? &flat : NULL, m_oConfig.m_bFlipped)) {
+        delete m_poCalibration;
+        m_poCalibration = NULL;
+      }
+    }
+  }
+
+  std::string szSignature;
+  if (!m_oConfig.m_szCacheDir.empty() && cache_signature(m_oConfig, szSignature)) {
+    m_poCache = new ConversionCache(m_oConfig.m_szCacheDir, m_oConfig.m_ulCacheSize, szSignature);
+    if (m_poCache->Open()) {
+      delete m_poCache;
+      m_poCache = NULL;
+    }
+  }
 
   // SETTINGS: Whitebalance D65, Orientation "normal"
   m_oOrientation = dng_orientation::Normal();
 
   if (m_oConfig.m_bNoCalibration)
     m_oNeutralWB.SetIdentity(3);
+
+  m_oMetadataTemplates.Reset(new MetadataTemplate[g_ulNumCamProfiles]);
+  for (size_t i = 0; i < g_ulNumCamProfiles; ++i)
+    BuildMetadataTemplate(gCamProfiles[i], m_oMetadataTemplates[i]);
 }
 
 DNGConverter::~DNGConverter()
 {
-  dng_xmp_sdk::TerminateSDK();
+  // The templates' XMP goes before the SDK
+  m_oMetadataTemplates.Reset();
+  delete m_poScratch;
+  delete m_poLens;
+  delete m_poBadPixels;
+  delete m_poCalibration;
+  delete m_poCache;
+
+  dng_lock_mutex lock(&g_oSDKMutex);
+
+  if (--g_unSDKUsers == 0)
+    dng_xmp_sdk::TerminateSDK();
 }
 
 template <typename T> void str2rational(const std::string &val, T &result)
@@ -122,18 +297,9 @@ static void XMPdate2DNGdate(const XMP_DateTime &xmp_date, dng_date_time_info &oD
   oDNGDate.SetSubseconds(sub_seconds);
 }
 
-int DNGConverter::ParseMetadata(const std::string &metadata, Exif &oExif)
+static int parse_xmp(const SXMPMeta &meta, Exif &oExif)
 {
-  bool ok, exists;
-  SXMPFiles myFile;
-  ok = myFile.OpenFile(metadata, kXMP_JPEGFile, kXMPFiles_OpenForRead);
-  if (!ok) {
-    return -1;
-  }
-
-  // Create the xmp object and get the xmp data
-  SXMPMeta meta;
-  myFile.GetXMP(&meta);
+  bool exists;
 
   exists = meta.GetProperty(kXMP_NS_XMP, "CreatorTool", &oExif.m_szCreatorTool, NULL);
   if (!exists)
@@ -180,44 +346,436 @@ int DNGConverter::ParseMetadata(const std::string &metadata, Exif &oExif)
 
   oExif.m_uLightSource = ls;
 
+  return 0;
+}
+
+int DNGConverter::ParseMetadata(const std::string &metadata, Exif &oExif)
+{
+  bool ok;
+  SXMPFiles myFile;
+  ok = myFile.OpenFile(metadata, kXMP_JPEGFile, kXMPFiles_OpenForRead);
+  if (!ok) {
+    return -1;
+  }
+
+  // Create the xmp object and get the xmp data
+  SXMPMeta meta;
+  myFile.GetXMP(&meta);
+
   // Close the SXMPFile.  The resource file is already closed if it was
   // opened as read only but this call must still be made.
   myFile.CloseFile();
 
-  return 0;
+  return parse_xmp(meta, oExif);
 }
 
-const static CameraProfile gCamProfiles[] = {SJ5000xProfile(4000, 3000),
-                                             SJ5000xProfile(3484, 2612),
-                                             SJ5000xProfile(3032, 2272),
-                                             SJ5000xProfile(2640, 1980),
-                                             M20Profile(4608, 3456),
-                                             M20Profile(4012, 3008),
-                                             M20Profile(3492, 2620),
-                                             SJ6Profile(4624, 3488),
-                                             SJ6Profile(4024, 3036),
-                                             SJ6Profile(3760, 2832)};
-
-static const CameraProfile *get_CameraProfile(size_t sz)
+// Locate the XMP packet in the APP1 segments of a JPEG
+static bool find_jpeg_xmp(const uint8 *buf, size_t size, const char **packet, size_t *packet_len)
 {
-  const CameraProfile *oResult = NULL;
+  static const char xmp_sig[] = "http://ns.adobe.com/xap/1.0/";
+  const size_t sig_len = sizeof(xmp_sig); // Including the terminating NUL
 
-  for (unsigned int i = 0; i < sizeof(gCamProfiles) / sizeof(gCamProfiles[0]); ++i) {
-    if (gCamProfiles[i].m_ulFileSize == sz) {
-      oResult = &gCamProfiles[i];
+  if (size < 4 || buf[0] != 0xFF || buf[1] != 0xD8)
+    return false;
+
+  size_t pos = 2;
+  while (pos + 4 <= size && buf[pos] == 0xFF) {
+    const uint8 marker = buf[pos + 1];
+
+    // Metadata is over once the image data starts
+    if (marker == 0xDA || marker == 0xD9)
+      break;
+
+    const size_t seg_len = ((size_t)buf[pos + 2] << 8) | buf[pos + 3];
+    if (seg_len < 2 || pos + 2 + seg_len > size)
       break;
+
+    const uint8 *seg = buf + pos + 4;
+    const size_t data_len = seg_len - 2;
+
+    if (marker == 0xE1 && data_len > sig_len && memcmp(seg, xmp_sig, sig_len) == 0) {
+      *packet = (const char *)seg + sig_len;
+      *packet_len = data_len - sig_len;
+      return true;
     }
+
+    pos += 2 + seg_len;
   }
 
-  return oResult;
+  return false;
+}
+
+int DNGConverter::ParseMetadata(const void *metadata, size_t size, Exif &oExif)
+{
+  const char *packet;
+  size_t packet_len;
+
+  if (!find_jpeg_xmp((const uint8 *)metadata, size, &packet, &packet_len))
+    return -1;
+
+  try {
+    SXMPMeta meta(packet, (XMP_StringLen)packet_len);
+    return parse_xmp(meta, oExif);
+  } catch (const XMP_Error &) {
+    return -1;
+  }
+}
+
+// The EXIF fields that change from frame to frame, all of them set so placeholders do not stay behind
+static void set_frame_exif(dng_exif &oExif, const Exif &exif)
+{
+  // Set creator tool
+  // Remarks: Tag [CreatorTool]
+  if (!exif.m_szCreatorTool.empty())
+    oExif.fSoftware.Set_ASCII(exif.m_szCreatorTool.c_str());
+  else
+    oExif.fSoftware.Clear();
+
+  // Set ISO speed
+  // Remarks: Tag [ISOSpeed] / [EXIF]
+  oExif.fISOSpeedRatings[0] = exif.m_unISO;
+  oExif.fISOSpeedRatings[1] = 0;
+  oExif.fISOSpeedRatings[2] = 0;
+
+  // Set metering mode
+  // Remarks: Tag [ExposureBiasValue] / [EXIF]
+  oExif.fExposureBiasValue = exif.m_oExposureBias;
+
+  // Set exposure time (the shutter speed value is derived from it when synced)
+  // Remarks: Tag [ExposureTime] / [EXIF]
+  oExif.fExposureTime = exif.m_oExposureTime;
+  oExif.fShutterSpeedValue = dng_srational();
+
+  // Set focal length
+  // Remarks: Tag [FocalLength] / [EXIF]
+  oExif.fFocalLength.Set_real64(exif.m_dFocalLength, 1000);
+
+  // Set 35mm equivalent focal length
+  // Remarks: Tag [FocalLengthIn35mmFilm] / [EXIF]
+  oExif.fFocalLengthIn35mmFilm = (uint32)round(exif.m_dFocalLength * 5.64);
+
+  // Set lens info
+  // Remarks: Tag [LensInfo] / [EXIF]
+  oExif.fLensInfo[0].Set_real64(exif.m_dFocalLength, 10);
+  oExif.fLensInfo[1].Set_real64(exif.m_dFocalLength, 10);
+
+  // Update date from original file
+  if (exif.m_oOrigDate.IsValid()) {
+    oExif.fDateTimeOriginal = exif.m_oOrigDate;
+    oExif.fDateTimeDigitized = exif.m_oOrigDate;
+  } else {
+    oExif.fDateTimeOriginal = dng_date_time_info();
+    oExif.fDateTimeDigitized = dng_date_time_info();
+  }
+}
+
+void DNGConverter::BuildMetadataTemplate(const CameraProfile &oCamProfile, MetadataTemplate &oTemplate)
+{
+  // -------------------------------------------------------------
+  // DNG EXIF Settings
+  // -------------------------------------------------------------
+
+  oTemplate.m_oExif.Reset(new dng_exif);
+
+  dng_exif *poExif = oTemplate.m_oExif.Get();
+
+  // Set Camera Make
+  // Remarks: Tag [Make] / [EXIF]
+  poExif->fMake.Set_ASCII(m_szMake.c_str());
+
+  // Set Camera Model
+  // Remarks: Tag [Model] / [EXIF]
+  poExif->fModel.Set_ASCII(oCamProfile.m_szCameraModel.c_str());
+
+  // Set Lens Model
+  // Remarks: Tag [LensName] / [EXIF]
+  poExif->fLensName.Set_ASCII("GP43520");
+
+  // Set Lens Make
+  // Remarks: Tag [LensMake] / [EXIF]
+  poExif->fLensMake.Set_ASCII(m_szMake.c_str());
+
+  // Set WB mode
+  // Remarks: Tag [WhiteBalance] / [EXIF]
+  poExif->fWhiteBalance = 0;
+
+  // Set light source
+  // Remarks: Tag [LightSource] / [EXIF]
+  poExif->fLightSource = lsDaylight;
+
+  // Set exposure program
+  // Remarks: Tag [ExposureProgram] / [EXIF]
+  poExif->fExposureProgram = epProgramNormal;
+
+  // Set sensor type
+  // Remarks: Tag [SensingMethod] / [EXIF]
+  poExif->fSensingMethod = 2;
+
+  // Set digital zoom
+  // Remarks: Tag [DigitalZoomRatio] / [EXIF]
+  poExif->fDigitalZoomRatio = m_oZeroURational;
+
+  // Set flash modes
+  // Remarks: Tag [Flash] / [EXIF]
+  poExif->fFlash = 0;
+  poExif->fFlashMask = 0x1;
+
+  // Set metering mode
+  // Remarks: Tag [MeteringMode] / [EXIF]
+  poExif->fMeteringMode = mmCenterWeightedAverage;
+
+  // Set aperture value
+  // Remarks: Tag [ApertureValue] / [EXIF]
+  poExif->SetFNumber(oCamProfile.m_fAperture);
+
+  // Set lens info (focal length range is per file)
+  // Remarks: Tag [LensInfo] / [EXIF]
+  poExif->fLensInfo[2].Set_real64(oCamProfile.m_fAperture, 10);
+  poExif->fLensInfo[3].Set_real64(oCamProfile.m_fAperture, 10);
+
+  // Set file source
+  // Remarks: Tag [FileSource] / [EXIF]
+  poExif->fFileSource = 3;
+
+  // Set scene type
+  // Remarks: Tag [SceneType] / [EXIF]
+  poExif->fSceneType = 1;
+
+  // Set custom rendered
+  // Remarks: Tag [CustomRendered] / [EXIF]
+  poExif->fCustomRendered = 0;
+
+  // -------------------------------------------------------------
+  // DNG Profile Settings: Simple color calibration
+  // -------------------------------------------------------------
+
+  // Camera space RGB to XYZ matrix with D65 illumination
+  dng_matrix_3by3 oCameraRGB_to_XYZ_D65;
+  if (m_oConfig.m_bNoCalibration)
+    oCameraRGB_to_XYZ_D65 = m_oIdentityMatrix;
+  else
+    oCameraRGB_to_XYZ_D65 = m_olsD65Matrix;
+  uint32 ulCalibrationIlluminant1 = lsD65;
+
+  // Camera space RGB to XYZ matrix with StdA illumination
+  dng_matrix_3by3 oCameraRGB_to_XYZ_A;
+  if (m_oConfig.m_bNoCalibration)
+    oCameraRGB_to_XYZ_A = m_oIdentityMatrix;
+  else
+    oCameraRGB_to_XYZ_A = m_olsAMatrix;
+
+  uint32 ulCalibrationIlluminant2 = lsStandardLightA;
+
+  oTemplate.m_oProfile.Reset(new dng_camera_profile);
+
+  dng_camera_profile *oProfile = oTemplate.m_oProfile.Get();
+
+  // Set first illuminant color calibration if available
+  if (ulCalibrationIlluminant1 != 0) {
+    // Set calibration illuminant 1
+    // Remarks: Tag [CalibrationIlluminant1] / [50778]
+    oProfile->SetCalibrationIlluminant1(ulCalibrationIlluminant1);
+
+    // Set color matrix 1
+    // Remarks: Tag [ColorMatrix1] / [50721]
+    oProfile->SetColorMatrix1(oCameraRGB_to_XYZ_D65);
+  }
+
+  // Set second illuminant color calibration if available
+  if (ulCalibrationIlluminant2 != 0) {
+    // Set calibration illuminant 2
+    // Remarks: Tag [CalibrationIlluminant2] / [50779]
+    oProfile->SetCalibrationIlluminant2(ulCalibrationIlluminant2);
+
+    // Set color matrix 1
+    // Remarks: Tag [ColorMatrix2] / [50722]
+    oProfile->SetColorMatrix2(oCameraRGB_to_XYZ_A);
+  }
+
+  // Set name of profile
+  // Remarks: Tag [ProfileName] / [50936]
+  oProfile->SetName(oCamProfile.m_szCameraModel.c_str());
+
+  // Set copyright of profile
+  // Remarks: Tag [ProfileCopyright] / [50942]
+  oProfile->SetCopyright(m_szMake.c_str());
+
+  // Force flag read from DNG to make sure this profile will be embedded
+  oProfile->SetWasReadFromDNG(true);
+
+  // Set policy for profile
+  // Remarks: Tag [ProfileEmbedPolicy] / [50941]
+  oProfile->SetEmbedPolicy(pepAllowCopying);
+
+  // Compute the profile fingerprint once, copies carry it along
+  oProfile->Fingerprint();
+
+  // -------------------------------------------------------------
+  // XMP, synced from the EXIF once
+  // -------------------------------------------------------------
+
+  // Placeholders put the per frame properties where a full sync of a frame would, FrameXMP overwrites them
+  Exif oPlaceholder;
+  oPlaceholder.m_oExposureBias = dng_srational(0, 1);
+  oPlaceholder.m_szCreatorTool = m_szMake;
+  oPlaceholder.m_oOrigDate.SetDateTime(dng_date_time(2000, 1, 1, 0, 0, 0));
+  set_frame_exif(*poExif, oPlaceholder);
+
+  oTemplate.m_oXMP.Reset(new dng_xmp(gDefaultDNGMemoryAllocator));
+
+  // Set before the sync by MakeNegative
+  if (m_oConfig.m_bLensCorrections)
+    oTemplate.m_oXMP->SetBoolean(kXMP_NS_CameraRaw, "AutoLateralCA", true);
+
+  oTemplate.m_oXMP->SyncExif(*poExif);
+}
+
+void DNGConverter::GetOutputFiles(const std::string &szInputFile, std::string &szDngFile, std::string &szTiffFile) const
+{
+  std::string szBaseFilename;
+  size_t unIndex = szInputFile.find_last_of(".");
+  if (unIndex == std::string::npos) {
+    szBaseFilename = szInputFile;
+  } else {
+    szBaseFilename = szInputFile.substr(0, unIndex);
+  }
+
+  if (!m_oConfig.m_szPathPrefixOutput.empty()) {
+    unIndex = szBaseFilename.find_last_of(DIR_DELIM);
+    if (unIndex != std::string::npos)
+      szBaseFilename = szBaseFilename.substr(unIndex + 1, szBaseFilename.length());
+  }
+
+  szDngFile.reserve(m_oConfig.m_szPathPrefixOutput.size() + szBaseFilename.size() + dng_suffix.size());
+  szDngFile = m_oConfig.m_szPathPrefixOutput;
+  szDngFile += szBaseFilename;
+  szDngFile += dng_suffix;
+
+  szTiffFile.reserve(m_oConfig.m_szPathPrefixOutput.size() + szBaseFilename.size() + tiff_suffix.size());
+  szTiffFile = m_oConfig.m_szPathPrefixOutput;
+  szTiffFile += szBaseFilename;
+  szTiffFile += tiff_suffix;
+}
+
+bool DNGConverter::OutputsExist(const std::string &szInputFile) const
+{
+  std::string szDngFile;
+  std::string szTiffFile;
+  struct stat sb;
+
+  GetOutputFiles(szInputFile, szDngFile, szTiffFile);
+
+  if (m_oConfig.m_bDng && (stat(szDngFile.c_str(), &sb) || sb.st_size == 0))
+    return false;
+
+  if (m_oConfig.m_bTiff && (stat(szTiffFile.c_str(), &sb) || sb.st_size == 0))
+    return false;
+
+  return true;
+}
+
+dng_error_code DNGConverter::ReadMetadataFile(const std::string &szInputFile,
+                                              const std::string &szMetadataFile,
+                                              const CameraProfile *oCamProfile,
+                                              Exif &exif)
+{
+  if (szMetadataFile.empty())
+    return dng_error_none;
+
+  StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "metadata");
+  int ret = ParseMetadata(szMetadataFile, exif);
+  if (m_oConfig.m_poProgress || m_oConfig.m_poStats || m_oConfig.m_poTrace) {
+    struct stat mb;
+    oStage.done(stat(szMetadataFile.c_str(), &mb) ? 0 : (uint64)mb.st_size);
+  }
+  if (ret)
+    return dng_error_unknown;
+
+  if (exif.m_szCameraModel != oCamProfile->m_szCameraModel) {
+    fprintf(stderr, "%s: Unsupported camera\n", szInputFile.c_str());
+    return dng_error_bad_format;
+  }
+
+  return dng_error_none;
+}
+
+dng_error_code DNGConverter::WriteOutputs(const CFAReader &reader,
+                                          const CameraProfile *oCamProfile,
+                                          const Exif &exif,
+                                          const std::string &szInputFile,
+                                          real64 fNoiseScale)
+{
+  // Form output filenames
+  std::string m_szOutputFile;
+  std::string m_szRenderFile;
+  GetOutputFiles(szInputFile, m_szOutputFile, m_szRenderFile);
+
+  // Outputs are written under a temporary name and renamed once complete,
+  // so an interrupted conversion never leaves a file that looks converted
+  const std::string m_szPartialOutputFile(m_szOutputFile + partial_suffix);
+  const std::string m_szPartialRenderFile(m_szRenderFile + partial_suffix);
+
+  AutoPtr<MemoryAccount> oAccount(AdmitFile(*oCamProfile));
+
+  // Create DNG
+  try {
+    AutoPtr<dng_file_stream> oDNGStream;
+    AutoPtr<dng_file_stream> oTIFFStream;
+
+    // Create stream writers for output files
+    if (m_oConfig.m_bDng)
+      oDNGStream.Reset(new dng_file_stream(m_szPartialOutputFile.c_str(), true));
+
+    if (m_oConfig.m_bTiff)
+      oTIFFStream.Reset(new dng_file_stream(m_szPartialRenderFile.c_str(), true));
+
+    dng_fingerprint oRawDigest;
+    Convert(reader, oCamProfile, exif, oDNGStream.Get(), oTIFFStream.Get(), oAccount.Get(), fNoiseScale, &oRawDigest);
+
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "write");
+    uint64 ulWritten = 0;
+
+    if (oDNGStream.Get())
+      ulWritten += oDNGStream->Length();
+    if (oTIFFStream.Get())
+      ulWritten += oTIFFStream->Length();
+
+    // Close the files before moving them into place
+    oDNGStream.Reset();
+    oTIFFStream.Reset();
+
+    oStage.done(ulWritten);
+
+    // Read back from the disk before replacing anything, a DNG that does not decode to the image converted
+    // is not kept
+    if (m_oConfig.m_bDng && m_oConfig.m_bVerify &&
+        !VerifyDNG(m_szPartialOutputFile, m_szOutputFile, oRawDigest, oAccount.Get()))
+      ThrowWriteFile();
+
+    if (m_oConfig.m_bDng && replace_file(m_szPartialOutputFile, m_szOutputFile))
+      ThrowWriteFile();
+
+    if (m_oConfig.m_bTiff && replace_file(m_szPartialRenderFile, m_szRenderFile))
+      ThrowWriteFile();
+  } catch (const dng_exception &except) {
+    remove(m_szPartialOutputFile.c_str());
+    remove(m_szPartialRenderFile.c_str());
+    return except.ErrorCode();
+  } catch (...) {
+    remove(m_szPartialOutputFile.c_str());
+    remove(m_szPartialRenderFile.c_str());
+    return dng_error_unknown;
+  }
+
+  return dng_error_none;
 }
 
 dng_error_code DNGConverter::ConvertToDNG(const std::string &m_szInputFile, const std::string &m_szMetadataFile)
 {
-#ifdef TIME_PROFILE
-  StopWatch oProfilerTotal;
-  oProfilerTotal.run();
-#endif
+  if (m_oConfig.m_poTrace)
+    m_oConfig.m_poTrace->begin_item(m_szInputFile);
+
+  StageSpan oFileStage(NULL, m_oConfig.m_poStats, m_oConfig.m_poTrace, "file");
 
   struct stat sb;
   int ret = stat(m_szInputFile.c_str(), &sb);
@@ -234,566 +792,621 @@ dng_error_code DNGConverter::ConvertToDNG(const std::string &m_szInputFile, cons
 
   Exif exif;
 
-#ifdef TIME_PROFILE
-  StopWatch oProfiler;
-#endif
+  dng_error_code rc = ReadMetadataFile(m_szInputFile, m_szMetadataFile, oCamProfile, exif);
+  if (rc != dng_error_none)
+    return rc;
 
-  if (!m_szMetadataFile.empty()) {
-#ifdef TIME_PROFILE
-    oProfiler.reset();
-    oProfiler.run();
-#endif
-    ret = ParseMetadata(m_szMetadataFile, exif);
-#ifdef TIME_PROFILE
-    oProfiler.stop();
-    printf("DNGConverter::ParseMetadata() time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
-    if (ret)
-      return dng_error_unknown;
+  // SETTINGS: Names
+  const std::string &szProfileName = oCamProfile->m_szCameraModel;
 
-    if (exif.m_szCameraModel != oCamProfile->m_szCameraModel) {
-      fprintf(stderr, "%s: Unsupported camera\n", m_szInputFile.c_str());
-      return dng_error_bad_format;
+  // -------------------------------------------------------------
+  // Print settings
+  // -------------------------------------------------------------
+
+  printf("RAW: %s [%s] (%s)\n", m_szInputFile.c_str(), m_szMetadataFile.c_str(), szProfileName.c_str());
+
+  CFAReader reader;
+  ret = reader.open(m_szInputFile.c_str(), oCamProfile->m_ulFileSize);
+  if (ret)
+    return dng_error_unknown;
+
+  // The same RAW converted before, maybe under another name
+  std::string szCacheKey, szDngFile, szTiffFile;
+  if (m_poCache) {
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "cache");
+
+    GetOutputFiles(m_szInputFile, szDngFile, szTiffFile);
+    if (!m_oConfig.m_bDng)
+      szDngFile.clear();
+    if (!m_oConfig.m_bTiff)
+      szTiffFile.clear();
+
+    szCacheKey = m_poCache->Key(reader.data(), reader.size(), m_szMetadataFile);
+    bool hit = !szCacheKey.empty() && m_poCache->Fetch(szCacheKey, szDngFile, szTiffFile);
+    oStage.done(reader.size());
+
+    if (hit) {
+      printf("%s: Outputs taken from the cache\n", m_szInputFile.c_str());
+      oFileStage.done(oCamProfile->m_ulFileSize, image_pixels(*oCamProfile));
+      return dng_error_none;
     }
   }
 
-  // SETTINGS: Names
-  const std::string &szProfileName = oCamProfile->m_szCameraModel;
-  const std::string &szProfileCopyright = m_szMake;
+  rc = WriteOutputs(reader, oCamProfile, exif, m_szInputFile);
+  if (rc != dng_error_none)
+    return rc;
 
-  // Form output filenames
-  std::string szBaseFilename;
-  size_t unIndex = m_szInputFile.find_last_of(".");
-  if (unIndex == std::string::npos) {
-    szBaseFilename = m_szInputFile;
-  } else {
-    szBaseFilename = m_szInputFile.substr(0, unIndex);
+  if (!szCacheKey.empty())
+    m_poCache->Store(szCacheKey, szDngFile, szTiffFile);
+
+  oFileStage.done(oCamProfile->m_ulFileSize, image_pixels(*oCamProfile));
+
+  return dng_error_none;
+}
+
+dng_error_code DNGConverter::StackToDNG(const std::vector<std::string> &oFrames,
+                                        const std::string &szMetadataFile,
+                                        bool bMedian)
+{
+  if (oFrames.empty() || oFrames.size() > MAX_STACK_FRAMES)
+    return dng_error_unknown;
+
+  const std::string &szFirst = oFrames[0];
+
+  if (m_oConfig.m_poTrace)
+    m_oConfig.m_poTrace->begin_item(szFirst);
+
+  StageSpan oFileStage(NULL, m_oConfig.m_poStats, m_oConfig.m_poTrace, "file");
+
+  struct stat sb;
+  if (stat(szFirst.c_str(), &sb)) {
+    perror("stat");
+    return dng_error_unknown;
   }
 
-  if (!m_oConfig.m_szPathPrefixOutput.empty()) {
-    unIndex = szBaseFilename.find_last_of(DIR_DELIM);
-    if (unIndex != std::string::npos)
-      szBaseFilename = szBaseFilename.substr(unIndex + 1, szBaseFilename.length());
+  const CameraProfile *oCamProfile = get_CameraProfile(sb.st_size);
+  if (NULL == oCamProfile) {
+    fprintf(stderr, "%s: Unsupported format\n", szFirst.c_str());
+    return dng_error_bad_format;
   }
 
-  std::string m_szOutputFile;
-  m_szOutputFile.reserve(m_oConfig.m_szPathPrefixOutput.size() + szBaseFilename.size() + dng_suffix.size());
-  m_szOutputFile = m_oConfig.m_szPathPrefixOutput;
-  m_szOutputFile += szBaseFilename;
-  m_szOutputFile += dng_suffix;
+  Exif exif;
+
+  dng_error_code rc = ReadMetadataFile(szFirst, szMetadataFile, oCamProfile, exif);
+  if (rc != dng_error_none)
+    return rc;
+
+  printf("RAW: %s +%zu [%s] (%s)\n",
+         szFirst.c_str(),
+         oFrames.size() - 1,
+         szMetadataFile.c_str(),
+         oCamProfile->m_szCameraModel.c_str());
+
+  // Only a row of each frame is needed at a time, so they are mapped without reading them in
+  AutoArray<CFAReader> oReaders(new CFAReader[oFrames.size()]);
+  std::vector<const CFAReader *> oFrameReaders(oFrames.size());
+
+  for (size_t i = 0; i < oFrames.size(); ++i) {
+    if (stat(oFrames[i].c_str(), &sb) || (size_t)sb.st_size != oCamProfile->m_ulFileSize ||
+        oReaders[i].open(oFrames[i].c_str(), oCamProfile->m_ulFileSize, false)) {
+      fprintf(stderr, "%s: Unable to read or of a different format than %s\n", oFrames[i].c_str(), szFirst.c_str());
+      return dng_error_bad_format;
+    }
+    oFrameReaders[i] = &oReaders[i];
+  }
+
+  const CFAStackTask::Mode eMode = bMedian ? CFAStackTask::modeMedian : CFAStackTask::modeMean;
+  std::vector<uint8> oStacked(oCamProfile->m_ulFileSize, 0);
 
-  // Create DNG
   try {
-    dng_host oDNGHost;
+    ConverterHost oHost((uint32)m_oConfig.m_iTaskThreads, m_oConfig.m_poStats, m_oConfig.m_poTrace);
 
-    // -------------------------------------------------------------
-    // Print settings
-    // -------------------------------------------------------------
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "stack");
+    CFAStackTask oStackTask(oFrameReaders, *oCamProfile, eMode, &oStacked[0]);
+    oHost.PerformAreaTask(oStackTask, dng_rect(oCamProfile->m_ulHeight, oCamProfile->m_ulWidth));
+    oStage.done((uint64)oCamProfile->m_ulFileSize * oFrames.size(), image_pixels(*oCamProfile));
+  } catch (const dng_exception &except) {
+    return except.ErrorCode();
+  } catch (...) {
+    return dng_error_unknown;
+  }
 
-    printf("RAW: %s [%s] (%s)\n", m_szInputFile.c_str(), m_szMetadataFile.c_str(), szProfileName.c_str());
+  CFAReader reader;
+  if (reader.open(&oStacked[0], oStacked.size(), oCamProfile->m_ulFileSize))
+    return dng_error_unknown;
 
-    // -------------------------------------------------------------
-    // BAYER input file settings
-    // -------------------------------------------------------------
+  // Named after the first frame, without taking the place of its own conversion
+  const size_t unDot = szFirst.find_last_of(".");
+  std::string szStackName = szFirst.substr(0, unDot) + stack_suffix;
+  if (unDot != std::string::npos)
+    szStackName += szFirst.substr(unDot);
 
-    unsigned int ulNumPixels = oCamProfile->m_ulWidth * oCamProfile->m_ulHeight;
-    AutoPtr<dng_memory_block> oBayerData(oDNGHost.Allocate(ulNumPixels * TagTypeSize(ttShort)));
+  rc = WriteOutputs(reader, oCamProfile, exif, szStackName, CFAStackTask::NoiseScale(eMode, oFrames.size()));
+  if (rc != dng_error_none)
+    return rc;
 
-    {
-      CFAReader reader;
-      ret = reader.open(m_szInputFile.c_str(), oCamProfile->m_ulFileSize);
-      if (ret)
-        return dng_error_unknown;
+  oFileStage.done((uint64)oCamProfile->m_ulFileSize * oFrames.size(), image_pixels(*oCamProfile));
 
-#ifdef TIME_PROFILE
-      oProfiler.reset();
-      oProfiler.run();
-#endif
-      if (oCamProfile->m_ulStride)
-        reader.read((uint8_t *)oBayerData->Buffer(), oCamProfile->m_ulWidth, oCamProfile->m_ulHeight, oCamProfile->m_ulStride);
-      else
-        reader.read((uint8_t *)oBayerData->Buffer(), ulNumPixels);
-
-#ifdef TIME_PROFILE
-      oProfiler.stop();
-      printf("CFAReader::read() time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
-    }
+  return dng_error_none;
+}
 
-    // -------------------------------------------------------------
-    // DNG Host Settings
-    // -------------------------------------------------------------
+dng_error_code DNGConverter::ConvertBuffer(const void *pRawData,
+                                           size_t ulRawSize,
+                                           const void *pMetadata,
+                                           size_t ulMetadataSize,
+                                           dng_stream *poDNGStream,
+                                           dng_stream *poTIFFStream)
+{
+  if (m_oConfig.m_poTrace)
+    m_oConfig.m_poTrace->begin_item("buffer");
 
-    // Set DNG version
-    // Remarks: Tag [DNGVersion] / [50706]
-    oDNGHost.SetSaveDNGVersion(dngVersion_SaveDefault);
+  StageSpan oFileStage(NULL, m_oConfig.m_poStats, m_oConfig.m_poTrace, "file");
 
-    // Set DNG type to RAW DNG
-    // Remarks: Store Bayer CFA data and not already processed data
-    oDNGHost.SetSaveLinearDNG(false);
+  const CameraProfile *oCamProfile = get_CameraProfile(ulRawSize);
+  if (NULL == oCamProfile)
+    return dng_error_bad_format;
 
-    // -------------------------------------------------------------
-    // DNG Image Settings
-    // -------------------------------------------------------------
+  Exif exif;
 
-    dng_rect vImageBounds(oCamProfile->m_ulHeight, oCamProfile->m_ulWidth);
+  if (pMetadata && ulMetadataSize) {
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "metadata");
+    if (ParseMetadata(pMetadata, ulMetadataSize, exif))
+      return dng_error_bad_format;
+    oStage.done(ulMetadataSize);
 
-    AutoPtr<dng_image> oImage(oDNGHost.Make_dng_image(vImageBounds, m_unColorPlanes, ttShort));
+    if (exif.m_szCameraModel != oCamProfile->m_szCameraModel)
+      return dng_error_bad_format;
+  }
 
-    dng_pixel_buffer oBuffer;
+  CFAReader reader;
+  if (reader.open((const uint8_t *)pRawData, ulRawSize, oCamProfile->m_ulFileSize))
+    return dng_error_bad_format;
 
-    oBuffer.fArea = vImageBounds;
-    oBuffer.fPlane = 0;
-    oBuffer.fPlanes = 1;
-    oBuffer.fRowStep = oBuffer.fPlanes * oCamProfile->m_ulWidth;
-    oBuffer.fColStep = oBuffer.fPlanes;
-    oBuffer.fPlaneStep = 1;
-    oBuffer.fPixelType = ttShort;
-    oBuffer.fPixelSize = TagTypeSize(ttShort);
-    oBuffer.fData = oBayerData->Buffer();
+  AutoPtr<MemoryAccount> oAccount(AdmitFile(*oCamProfile));
 
-    oImage->Put(oBuffer);
+  try {
+    Convert(reader, oCamProfile, exif, poDNGStream, poTIFFStream, oAccount.Get());
+  } catch (const dng_exception &except) {
+    return except.ErrorCode();
+  } catch (...) {
+    return dng_error_unknown;
+  }
 
-    uint16 m_unBayerType;
+  oFileStage.done(ulRawSize, image_pixels(*oCamProfile));
 
-    if (m_oConfig.m_bFlipped)
-      m_unBayerType = 2; // BGGR
-    else
-      m_unBayerType = 1; // RGGB
+  return dng_error_none;
+}
 
-    // -------------------------------------------------------------
-    // DNG Negative Settings
-    // -------------------------------------------------------------
+uint64 DNGConverter::EstimateMemory(const CameraProfile &oCamProfile) const
+{
+  const uint64 ulPixels = image_pixels(oCamProfile);
+  const uint64 ulImage = ulPixels * m_unColorPlanes * TagTypeSize(ttShort);
+
+  // Demosaicing holds the raw image, stage 2 and stage 3 at once
+  uint64 ulBytes = 3 * ulImage;
+
+  // Stage 2 is gone by the time the TIFF is rendered, 8 bits per sample
+  if (m_oConfig.m_bTiff)
+    ulBytes = Max_uint64(ulBytes, 2 * ulImage + ulPixels * m_unColorPlanes * TagTypeSize(ttByte));
+
+  // Those all live in scratch files, only previews too small for one stay in RAM
+  if (m_poScratch)
+    ulBytes = SCRATCH_MIN_BYTES;
+
+  return ulBytes + MEMORY_OVERHEAD + (uint64)m_oConfig.m_iTaskThreads * MEMORY_OVERHEAD_PER_THREAD;
+}
+
+MemoryAccount *DNGConverter::AdmitFile(const CameraProfile &oCamProfile)
+{
+  if (!m_oConfig.m_poMemory)
+    return NULL;
+
+  StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "memory");
+  const uint64 ulProjected = EstimateMemory(oCamProfile);
+  MemoryAccount *poAccount = new MemoryAccount(*m_oConfig.m_poMemory, ulProjected);
+  oStage.done(ulProjected);
+
+  return poAccount;
+}
+
+dng_negative *DNGConverter::MakeNegative(dng_host &oHost, const CameraProfile *oCamProfile, const Exif &exif)
+{
+  uint16 m_unBayerType;
+
+  if (m_oConfig.m_bFlipped)
+    m_unBayerType = 2; // BGGR
+  else
+    m_unBayerType = 1; // RGGB
 
-    AutoPtr<dng_negative> oNegative(oDNGHost.Make_dng_negative());
+  // -------------------------------------------------------------
+  // DNG Negative Settings
+  // -------------------------------------------------------------
 
-    // Set camera model
-    // Remarks: Tag [UniqueCameraModel] / [50708]
-    oNegative->SetModelName(oCamProfile->m_szCameraModel.c_str());
+  AutoPtr<dng_negative> oNegative(oHost.Make_dng_negative());
 
-    // Set localized camera model
-    // Remarks: Tag [UniqueCameraModel] / [50709]
-    oNegative->SetLocalName(oCamProfile->m_szCameraModel.c_str());
+  // Set camera model
+  // Remarks: Tag [UniqueCameraModel] / [50708]
+  oNegative->SetModelName(oCamProfile->m_szCameraModel.c_str());
 
-    // Set bayer pattern information
-    // Remarks: Tag [CFAPlaneColor] / [50710] and [CFALayout] / [50711]
-    oNegative->SetColorKeys(colorKeyRed, colorKeyGreen, colorKeyBlue);
+  // Set localized camera model
+  // Remarks: Tag [UniqueCameraModel] / [50709]
+  oNegative->SetLocalName(oCamProfile->m_szCameraModel.c_str());
 
-    // Set bayer pattern information
-    // Remarks: Tag [CFAPlaneColor] / [50710] and [CFALayout] / [50711]
-    oNegative->SetBayerMosaic(m_unBayerType);
+  // Set bayer pattern information
+  // Remarks: Tag [CFAPlaneColor] / [50710] and [CFALayout] / [50711]
+  oNegative->SetColorKeys(colorKeyRed, colorKeyGreen, colorKeyBlue);
 
-    // Set bayer pattern information
-    // Remarks: Tag [CFAPlaneColor] / [50710] and [CFALayout] / [50711]
-    oNegative->SetColorChannels(m_unColorPlanes);
+  // Set bayer pattern information
+  // Remarks: Tag [CFAPlaneColor] / [50710] and [CFALayout] / [50711]
+  oNegative->SetBayerMosaic(m_unBayerType);
+
+  // Set bayer pattern information
+  // Remarks: Tag [CFAPlaneColor] / [50710] and [CFALayout] / [50711]
+  oNegative->SetColorChannels(m_unColorPlanes);
 
 #if 0
-    // Set linearization table
-    // Remarks: Tag [LinearizationTable] / [50712]
-    AutoPtr<dng_memory_block> oCurve(oDNGHost.Allocate(sizeof(uint16) * m_unBitLimit));
-    for (int64 i = 0; i < m_unBitLimit; i++) {
-      uint16 *pulItem = oCurve->Buffer_uint16() + i;
-      *pulItem = (uint16)(i);
-    }
-    oNegative->SetLinearization(oCurve);
+  // Set linearization table
+  // Remarks: Tag [LinearizationTable] / [50712]
+  AutoPtr<dng_memory_block> oCurve(oHost.Allocate(sizeof(uint16) * m_unBitLimit));
+  for (int64 i = 0; i < m_unBitLimit; i++) {
+    uint16 *pulItem = oCurve->Buffer_uint16() + i;
+    *pulItem = (uint16)(i);
+  }
+  oNegative->SetLinearization(oCurve);
 #endif
 
-    // Set black level to auto black level of sensor
-    // Remarks: Tag [BlackLevel] / [50714]
-    oNegative->SetBlackLevel(oCamProfile->m_ulBlackLevel);
+  // Set black level to auto black level of sensor
+  // Remarks: Tag [BlackLevel] / [50714]
+  oNegative->SetBlackLevel(oCamProfile->m_ulBlackLevel);
 
-    // Set white level
-    // Remarks: Tag [WhiteLevel] / [50717]
-    oNegative->SetWhiteLevel(m_unBitLimit - 1);
+  // Set white level
+  // Remarks: Tag [WhiteLevel] / [50717]
+  oNegative->SetWhiteLevel(m_unBitLimit - 1);
 
-    // Set scale to square pixel
-    // Remarks: Tag [DefaultScale] / [50718]
-    oNegative->SetDefaultScale(m_oOneURational, m_oOneURational);
+  // Set scale to square pixel
+  // Remarks: Tag [DefaultScale] / [50718]
+  oNegative->SetDefaultScale(m_oOneURational, m_oOneURational);
 
-    // Set scale to square pixel
-    // Remarks: Tag [BestQualityScale] / [50780]
-    oNegative->SetBestQualityScale(m_oOneURational);
+  // Set scale to square pixel
+  // Remarks: Tag [BestQualityScale] / [50780]
+  oNegative->SetBestQualityScale(m_oOneURational);
 
-    // Set pixel area
-    // Remarks: Tag [DefaultCropOrigin] / [50719]
-    oNegative->SetDefaultCropOrigin(0, 0);
+  // Set pixel area
+  // Remarks: Tag [DefaultCropOrigin] / [50719]
+  oNegative->SetDefaultCropOrigin(0, 0);
 
-    // Set pixel area
-    // Remarks: Tag [DefaultCropSize] / [50720]
-    oNegative->SetDefaultCropSize(oCamProfile->m_ulWidth, oCamProfile->m_ulHeight);
+  // Set pixel area
+  // Remarks: Tag [DefaultCropSize] / [50720]
+  oNegative->SetDefaultCropSize(oCamProfile->m_ulWidth, oCamProfile->m_ulHeight);
 
-    // Set base orientation
-    // Remarks: See Restriction / Extension tags chapter
-    oNegative->SetBaseOrientation(m_oOrientation);
+  // Set base orientation
+  // Remarks: See Restriction / Extension tags chapter
+  oNegative->SetBaseOrientation(m_oOrientation);
 
-    const dng_vector *pNeutral;
-    if (m_oConfig.m_bNoCalibration) {
-      pNeutral = &m_oNeutralWB;
-    } else {
-      pNeutral = &oCamProfile->m_oNeutralWB;
-    }
-    // Set camera neutral coordinates
-    // Remarks: Tag [AsShotNeutral] / [50728]
-    oNegative->SetCameraNeutral(*pNeutral);
+  const dng_vector *pNeutral;
+  if (m_oConfig.m_bNoCalibration) {
+    pNeutral = &m_oNeutralWB;
+  } else {
+    pNeutral = &oCamProfile->m_oNeutralWB;
+  }
+  // Set camera neutral coordinates
+  // Remarks: Tag [AsShotNeutral] / [50728]
+  oNegative->SetCameraNeutral(*pNeutral);
 
-    // Set baseline exposure
-    // Remarks: Tag [BaselineExposure] / [50730]
-    oNegative->SetBaselineExposure(0);
+  // Set baseline exposure
+  // Remarks: Tag [BaselineExposure] / [50730]
+  oNegative->SetBaselineExposure(0);
 
-    // Set if noise reduction is already applied on RAW data
-    // Remarks: Tag [NoiseReductionApplied] / [50935]
-    oNegative->SetNoiseReductionApplied(m_oZeroURational);
+  // Set if noise reduction is already applied on RAW data
+  // Remarks: Tag [NoiseReductionApplied] / [50935]
+  oNegative->SetNoiseReductionApplied(m_oZeroURational);
 
-    // Set baseline noise
-    // Remarks: Tag [BaselineNoise] / [50731]
-    oNegative->SetBaselineNoise(oCamProfile->m_fBaselineNoise);
+  // Set baseline noise
+  // Remarks: Tag [BaselineNoise] / [50731]
+  oNegative->SetBaselineNoise(oCamProfile->m_fBaselineNoise);
 
-    // Set baseline sharpness
-    // Remarks: Tag [BaselineSharpness] / [50732]
-    oNegative->SetBaselineSharpness(1);
+  // Set baseline sharpness
+  // Remarks: Tag [BaselineSharpness] / [50732]
+  oNegative->SetBaselineSharpness(1);
 
-    // Set anti-alias filter strength
-    // Remarks: Tag [AntiAliasStrength] / [50738]
-    oNegative->SetAntiAliasStrength(m_oZeroURational);
+  // Set anti-alias filter strength
+  // Remarks: Tag [AntiAliasStrength] / [50738]
+  oNegative->SetAntiAliasStrength(m_oZeroURational);
 
-    // -------------------------------------------------------------
-    // DNG EXIF Settings
-    // -------------------------------------------------------------
+  // -------------------------------------------------------------
+  // DNG EXIF Settings
+  // -------------------------------------------------------------
 
-    dng_exif *poExif = oNegative->GetExif();
-
-    // Set Camera Make
-    // Remarks: Tag [Make] / [EXIF]
-    poExif->fMake.Set_ASCII(m_szMake.c_str());
-
-    // Set creator tool
-    // Remarks: Tag [CreatorTool]
-    if (!exif.m_szCreatorTool.empty())
-      poExif->fSoftware.Set_ASCII(exif.m_szCreatorTool.c_str());
-
-    // Set Camera Model
-    // Remarks: Tag [Model] / [EXIF]
-    poExif->fModel.Set_ASCII(oCamProfile->m_szCameraModel.c_str());
-
-    // Set Lens Model
-    // Remarks: Tag [LensName] / [EXIF]
-    poExif->fLensName.Set_ASCII("GP43520");
-
-    // Set Lens Make
-    // Remarks: Tag [LensMake] / [EXIF]
-    poExif->fLensMake.Set_ASCII(m_szMake.c_str());
-
-    // Set ISO speed
-    // Remarks: Tag [ISOSpeed] / [EXIF]
-    poExif->fISOSpeedRatings[0] = exif.m_unISO;
-    poExif->fISOSpeedRatings[1] = 0;
-    poExif->fISOSpeedRatings[2] = 0;
-
-    // Set WB mode
-    // Remarks: Tag [WhiteBalance] / [EXIF]
-    poExif->fWhiteBalance = 0;
-
-    // Set light source
-    // Remarks: Tag [LightSource] / [EXIF]
-    poExif->fLightSource = lsDaylight;
-
-    // Set exposure program
-    // Remarks: Tag [ExposureProgram] / [EXIF]
-    poExif->fExposureProgram = epProgramNormal;
-
-    // Set sensor type
-    // Remarks: Tag [SensingMethod] / [EXIF]
-    poExif->fSensingMethod = 2;
-
-    // Set digital zoom
-    // Remarks: Tag [DigitalZoomRatio] / [EXIF]
-    poExif->fDigitalZoomRatio = m_oZeroURational;
-
-    // Set flash modes
-    // Remarks: Tag [Flash] / [EXIF]
-    poExif->fFlash = 0;
-    poExif->fFlashMask = 0x1;
-
-    // Set metering mode
-    // Remarks: Tag [MeteringMode] / [EXIF]
-    poExif->fMeteringMode = mmCenterWeightedAverage;
-
-    // Set metering mode
-    // Remarks: Tag [ExposureBiasValue] / [EXIF]
-    poExif->fExposureBiasValue = exif.m_oExposureBias;
-
-    // Set aperture value
-    // Remarks: Tag [ApertureValue] / [EXIF]
-    poExif->SetFNumber(oCamProfile->m_fAperture);
-
-    // Set exposure time
-    // Remarks: Tag [ExposureTime] / [EXIF]
-    poExif->fExposureTime = exif.m_oExposureTime;
-
-    // Set focal length
-    // Remarks: Tag [FocalLength] / [EXIF]
-    poExif->fFocalLength.Set_real64(exif.m_dFocalLength, 1000);
-
-    // Set 35mm equivalent focal length
-    // Remarks: Tag [FocalLengthIn35mmFilm] / [EXIF]
-    poExif->fFocalLengthIn35mmFilm = (uint32)round(exif.m_dFocalLength * 5.64);
-
-    // Set lens info
-    // Remarks: Tag [LensInfo] / [EXIF]
-    poExif->fLensInfo[0].Set_real64(exif.m_dFocalLength, 10);
-    poExif->fLensInfo[1].Set_real64(exif.m_dFocalLength, 10);
-    poExif->fLensInfo[2].Set_real64(oCamProfile->m_fAperture, 10);
-    poExif->fLensInfo[3].Set_real64(oCamProfile->m_fAperture, 10);
-
-    // Set file source
-    // Remarks: Tag [FileSource] / [EXIF]
-    poExif->fFileSource = 3;
-
-    // Set scene type
-    // Remarks: Tag [SceneType] / [EXIF]
-    poExif->fSceneType = 1;
-
-    // Set custom rendered
-    // Remarks: Tag [CustomRendered] / [EXIF]
-    poExif->fCustomRendered = 0;
-
-    // Update date from original file
-    if (exif.m_oOrigDate.IsValid()) {
-      poExif->fDateTimeOriginal = exif.m_oOrigDate;
-      poExif->fDateTimeDigitized = exif.m_oOrigDate;
-    }
+  const MetadataTemplate &oTemplate = m_oMetadataTemplates[oCamProfile - gCamProfiles];
 
-    // -------------------------------------------------------------
-    // DNG Profile Settings: Simple color calibration
-    // -------------------------------------------------------------
+  // Start from the EXIF fields shared by every frame of this camera profile
+  oNegative->ResetExif(oTemplate.m_oExif->Clone());
 
-    // Camera space RGB to XYZ matrix with D65 illumination
-    dng_matrix_3by3 oCameraRGB_to_XYZ_D65;
-    if (m_oConfig.m_bNoCalibration)
-      oCameraRGB_to_XYZ_D65 = m_oIdentityMatrix;
-    else
-      oCameraRGB_to_XYZ_D65 = m_olsD65Matrix;
-    uint32 ulCalibrationIlluminant1 = lsD65;
-
-    // Camera space RGB to XYZ matrix with StdA illumination
-    dng_matrix_3by3 oCameraRGB_to_XYZ_A;
-    if (m_oConfig.m_bNoCalibration)
-      oCameraRGB_to_XYZ_A = m_oIdentityMatrix;
-    else
-      oCameraRGB_to_XYZ_A = m_olsAMatrix;
-
-    uint32 ulCalibrationIlluminant2 = lsStandardLightA;
-
-    AutoPtr<dng_camera_profile> oProfile(new dng_camera_profile);
-
-    // Set first illuminant color calibration if available
-    if (ulCalibrationIlluminant1 != 0) {
-      // Set calibration illuminant 1
-      // Remarks: Tag [CalibrationIlluminant1] / [50778]
-      oProfile->SetCalibrationIlluminant1(ulCalibrationIlluminant1);
-
-      // Set color matrix 1
-      // Remarks: Tag [ColorMatrix1] / [50721]
-      oProfile->SetColorMatrix1(oCameraRGB_to_XYZ_D65);
-    }
+  // Replace the placeholders with the fields of this frame
+  set_frame_exif(*oNegative->GetExif(), exif);
+
+  // Of which FrameXMP syncs only the fields set above
+  oNegative->ResetXMP(new FrameXMP(*oTemplate.m_oXMP));
+
+  // -------------------------------------------------------------
+  // DNG Profile Settings: Simple color calibration
+  // -------------------------------------------------------------
+
+  // Copy of the prebuilt profile (fingerprint included)
+  AutoPtr<dng_camera_profile> oProfile(new dng_camera_profile(*oTemplate.m_oProfile));
+
+  // Add camera profile to negative
+  oNegative->AddProfile(oProfile);
+
+  // -------------------------------------------------------------
+  // Lens corrections
+  // -------------------------------------------------------------
 
-    // Set second illuminant color calibration if available
-    if (ulCalibrationIlluminant2 != 0) {
-      // Set calibration illuminant 2
-      // Remarks: Tag [CalibrationIlluminant2] / [50779]
-      oProfile->SetCalibrationIlluminant2(ulCalibrationIlluminant2);
+  if (m_oConfig.m_bLensCorrections) {
+    dng_xmp *oXMP = oNegative->Metadata().GetXMP();
+    oXMP->SetBoolean(kXMP_NS_CameraRaw, "AutoLateralCA", true);
 
-      // Set color matrix 1
-      // Remarks: Tag [ColorMatrix2] / [50722]
-      oProfile->SetColorMatrix2(oCameraRGB_to_XYZ_A);
+    // Vignette first, the warp moves pixels away from the radius its gain is computed for
+    AutoPtr<dng_opcode> oFixVignetteOpcode;
+    if (m_poLens && m_poLens->HasVignette())
+      oFixVignetteOpcode.Reset(m_poLens->MakeVignetteOpcode(oCamProfile->m_ulWidth, oCamProfile->m_ulHeight));
+    else if (oCamProfile->m_oCalib)
+      oFixVignetteOpcode.Reset(
+        new FastFixVignetteRadial(oCamProfile->m_oCalib->m_oVignetteParams, dng_opcode::kFlag_None));
+
+    if (oFixVignetteOpcode.Get())
+      oNegative->OpcodeList3().Append(oFixVignetteOpcode);
+
+    if (m_poLens) {
+      AutoPtr<dng_opcode> oWarpOpcode(m_poLens->MakeWarpOpcode(oCamProfile->m_ulWidth, oCamProfile->m_ulHeight));
+      if (oWarpOpcode.Get())
+        oNegative->OpcodeList3().Append(oWarpOpcode);
     }
+  }
 
-    // Set name of profile
-    // Remarks: Tag [ProfileName] / [50936]
-    oProfile->SetName(szProfileName.c_str());
+  return oNegative.Release();
+}
 
-    // Set copyright of profile
-    // Remarks: Tag [ProfileCopyright] / [50942]
-    oProfile->SetCopyright(szProfileCopyright.c_str());
+dng_image *DNGConverter::MakeRawImage(dng_host &oHost, const CameraProfile &oCamProfile)
+{
+  // The CFA goes in the first plane, the others stay zero
+  return oHost.Make_dng_image(dng_rect(oCamProfile.m_ulHeight, oCamProfile.m_ulWidth), m_unColorPlanes, ttShort);
+}
 
-    // Force flag read from DNG to make sure this profile will be embedded
-    oProfile->SetWasReadFromDNG(true);
+void DNGConverter::Convert(const CFAReader &reader,
+                           const CameraProfile *oCamProfile,
+                           const Exif &exif,
+                           dng_stream *poDNGStream,
+                           dng_stream *poTIFFStream,
+                           dng_memory_allocator *poAllocator,
+                           real64 fNoiseScale,
+                           dng_fingerprint *poRawDigest)
+{
+  ConverterHost oDNGHost((uint32)m_oConfig.m_iTaskThreads, m_oConfig.m_poStats, m_oConfig.m_poTrace, poAllocator);
+  oDNGHost.SetScratchAllocator(m_poScratch);
+
+  const uint64 ulPixels = image_pixels(*oCamProfile);
+
+  // -------------------------------------------------------------
+  // DNG Host Settings
+  // -------------------------------------------------------------
+
+  // Set DNG version
+  // Remarks: Tag [DNGVersion] / [50706]
+  oDNGHost.SetSaveDNGVersion(dngVersion_SaveDefault);
+
+  // Set DNG type to RAW DNG
+  // Remarks: Store Bayer CFA data and not already processed data
+  oDNGHost.SetSaveLinearDNG(false);
+
+  // -------------------------------------------------------------
+  // DNG Image Settings
+  // -------------------------------------------------------------
+
+  dng_rect vImageBounds(oCamProfile->m_ulHeight, oCamProfile->m_ulWidth);
+
+  AutoPtr<dng_image> oImage(MakeRawImage(oDNGHost, *oCamProfile));
+
+  // -------------------------------------------------------------
+  // BAYER input file settings
+  // -------------------------------------------------------------
+
+  // Digest of the raw image, computed while unpacking
+  dng_fingerprint oRawDigest;
+
+  // Camera neutral of the frame with m_bAutoWB, also estimated while unpacking
+  const bool bAutoWB = m_oConfig.m_bAutoWB && !m_oConfig.m_bNoCalibration;
+  dng_vector oAutoNeutral;
+
+  {
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "read");
+    const BadPixelMap *poBadPixels = m_poBadPixels && m_poBadPixels->Matches(*oCamProfile) ? m_poBadPixels : NULL;
+    const FrameCalibration *poCalibration =
+      m_poCalibration && m_poCalibration->Matches(*oCamProfile) ? m_poCalibration : NULL;
+    CFAUnpackTask oUnpackTask(
+      reader, *oCamProfile, *oImage.Get(), poBadPixels, m_oConfig.m_bFlipped, poCalibration, bAutoWB);
+    oDNGHost.PerformAreaTask(oUnpackTask, vImageBounds);
+    oRawDigest = oUnpackTask.Result();
+    if (bAutoWB)
+      oUnpackTask.GrayWorldNeutral(oAutoNeutral);
+    oStage.done(oCamProfile->m_ulFileSize, ulPixels);
+  }
 
-    // Set policy for profile
-    // Remarks: Tag [ProfileEmbedPolicy] / [50941]
-    oProfile->SetEmbedPolicy(pepAllowCopying);
+  AutoPtr<dng_negative> oNegative(MakeNegative(oDNGHost, oCamProfile, exif));
 
-    // Add camera profile to negative
-    oNegative->AddProfile(oProfile);
+  // Less noise than a single frame, for a stack
+  if (fNoiseScale != 1.0)
+    oNegative->SetBaselineNoise(oCamProfile->m_fBaselineNoise * fNoiseScale);
 
-    // -------------------------------------------------------------
-    // Lens corrections
-    // -------------------------------------------------------------
+  // Frames without a usable estimate (mostly clipped or black) keep the profile's neutral
+  if (oAutoNeutral.Count() == 3)
+    oNegative->SetCameraNeutral(oAutoNeutral);
 
-#if 0
-    AutoPtr<dng_opcode> oFixVignetteOpcode;
-    if (m_oConfig.m_bLensCorrections) {
-      dng_xmp *oXMP = oNegative->Metadata().GetXMP();
-      oXMP->SetBoolean(kXMP_NS_CameraRaw, "AutoLateralCA", true);
+  // -------------------------------------------------------------
+  // Write DNG file
+  // -------------------------------------------------------------
 
-#if 0
-      if (oCamProfile->m_oCalib) {
-        oFixVignetteOpcode.Reset(
-          new dng_opcode_FixVignetteRadial(oCamProfile->m_oCalib->m_oVignetteParams, dng_opcode::kFlag_None));
-        oNegative->OpcodeList3().Append(oFixVignetteOpcode);
-      }
-#endif
-    }
-#endif
+  // Assign Raw image data.
+  oNegative->SetStage1Image(oImage);
 
-    // -------------------------------------------------------------
-    // Write DNG file
-    // -------------------------------------------------------------
+  // Compute linearized and range mapped image
+  StageSpan oStage2(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "stage2");
+  oNegative->BuildStage2Image(oDNGHost);
+  oStage2.done(image_bytes(*oNegative->Stage2Image()), ulPixels);
 
-    // Assign Raw image data.
-    oNegative->SetStage1Image(oImage);
+  // Stage 1 is kept as the raw image (no opcodes or linearization table), so the digest
+  // computed while unpacking is valid and WriteDNG does not need to hash the image again
+  if (oNegative->RawImageStage() == dng_negative::rawImageStagePreOpcode1)
+    oNegative->SetNewRawImageDigest(oRawDigest);
 
-#ifdef TIME_PROFILE
-    oProfiler.reset();
-    oProfiler.run();
-#endif
-    // Compute linearized and range mapped image
-    oNegative->BuildStage2Image(oDNGHost);
-#ifdef TIME_PROFILE
-    oProfiler.stop();
-    printf("dng_negative::BuildStage2Image() time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
+  // Compute demosaiced image (used by preview and thumbnail)
+  StageSpan oStage3(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "stage3");
+  oNegative->BuildStage3Image(oDNGHost);
+  oStage3.done(image_bytes(*oNegative->Stage3Image()), ulPixels);
 
-#ifdef TIME_PROFILE
-    oProfiler.reset();
-    oProfiler.run();
-#endif
-    // Compute demosaiced image (used by preview and thumbnail)
-    oNegative->BuildStage3Image(oDNGHost);
-#ifdef TIME_PROFILE
-    oProfiler.stop();
-    printf("dng_negative::BuildStage3Image() time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
+  // Update XMP / EXIF
+  // (IPTC is rebuilt or cleared by dng_image_writer to suit each output format)
+  oNegative->SynchronizeMetadata();
 
-    // Update XMP / EXIF
-    oNegative->SynchronizeMetadata();
+  dng_preview_list *oPreviewList = NULL;
+  dng_jpeg_preview *oJpegPreview = NULL;
 
-    // Update IPTC
-    oNegative->RebuildIPTC(true);
+  if (m_oConfig.m_bGenPreview) {
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "preview");
 
-    dng_preview_list *oPreviewList = NULL;
-    dng_jpeg_preview *oJpegPreview = NULL;
+    dng_render oNegRender(oDNGHost, *oNegative.Get());
 
-    if (m_oConfig.m_bGenPreview) {
-#ifdef TIME_PROFILE
-      oProfiler.reset();
-      oProfiler.run();
-#endif
+    oJpegPreview = new dng_jpeg_preview();
+    oJpegPreview->fInfo.fColorSpace = previewColorSpace_sRGB;
 
-      dng_render oNegRender(oDNGHost, *oNegative.Get());
+    oNegRender.SetMaximumSize(1024);
+    StageSpan oRenderStage(NULL, NULL, m_oConfig.m_poTrace, "render");
+    AutoPtr<dng_image> negImage(oNegRender.Render());
+    oRenderStage.done(0);
+    dng_image_writer oJpegWriter;
+    oJpegWriter.EncodeJPEGPreview(oDNGHost, *negImage.Get(), *oJpegPreview, 4);
+    AutoPtr<dng_preview> oPreview(dynamic_cast<dng_preview *>(oJpegPreview));
 
-      oJpegPreview = new dng_jpeg_preview();
-      oJpegPreview->fInfo.fColorSpace = previewColorSpace_sRGB;
+    dng_image_preview *oThumbnailPreview = new dng_image_preview();
+    oThumbnailPreview->fInfo.fColorSpace = previewColorSpace_sRGB;
 
-      oNegRender.SetMaximumSize(1024);
-      AutoPtr<dng_image> negImage(oNegRender.Render());
-      dng_image_writer oJpegWriter;
-      oJpegWriter.EncodeJPEGPreview(oDNGHost, *negImage.Get(), *oJpegPreview, 4);
-      AutoPtr<dng_preview> oPreview(dynamic_cast<dng_preview *>(oJpegPreview));
+    oNegRender.SetMaximumSize(256);
+    oThumbnailPreview->fImage.Reset(oNegRender.Render());
+    AutoPtr<dng_preview> oThumbnail(dynamic_cast<dng_preview *>(oThumbnailPreview));
 
-      dng_image_preview *oThumbnailPreview = new dng_image_preview();
-      oThumbnailPreview->fInfo.fColorSpace = previewColorSpace_sRGB;
+    oPreviewList = new dng_preview_list();
+    oPreviewList->Append(oPreview);
+    oPreviewList->Append(oThumbnail);
 
-      oNegRender.SetMaximumSize(256);
-      oThumbnailPreview->fImage.Reset(oNegRender.Render());
-      AutoPtr<dng_preview> oThumbnail(dynamic_cast<dng_preview *>(oThumbnailPreview));
+    oStage.done(oJpegPreview->fCompressedData->LogicalSize(), ulPixels);
 
-      oPreviewList = new dng_preview_list();
-      oPreviewList->Append(oPreview);
-      oPreviewList->Append(oThumbnail);
+  }
 
-#ifdef TIME_PROFILE
-      oProfiler.stop();
-      printf("Generate thumbnails and preview time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
-    }
+  AutoPtr<dng_preview_list> oPreviews(oPreviewList);
 
-    AutoPtr<dng_preview_list> oPreviews(oPreviewList);
+  AutoPtr<dng_image_writer> oWriter(new dng_image_writer());
 
-    AutoPtr<dng_image_writer> oWriter(new dng_image_writer());
+  if (poDNGStream) {
+    // Write DNG file to disk
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "encode");
+    oWriter->WriteDNG(oDNGHost, *poDNGStream, *oNegative.Get(), oPreviews.Get());
+    oStage.done(poDNGStream->Length(), ulPixels, "dng");
 
-    if (m_oConfig.m_bDng) {
-      // Create stream writer for output file
-      dng_file_stream oDNGStream(m_szOutputFile.c_str(), true);
+    // Set above or found by WriteDNG, either way of the image in memory
+    if (poRawDigest)
+      *poRawDigest = oNegative->NewRawImageDigest();
+  }
 
-#ifdef TIME_PROFILE
-      oProfiler.reset();
-      oProfiler.run();
-#endif
-      // Write DNG file to disk
-      oWriter->WriteDNG(oDNGHost, oDNGStream, *oNegative.Get(), oPreviews.Get());
-#ifdef TIME_PROFILE
-      oProfiler.stop();
-      printf("dng_image_writer::WriteDNG() time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
-    }
+  if (poTIFFStream) {
+    // -------------------------------------------------------------
+    // Write TIFF file
+    // -------------------------------------------------------------
+
+    // Rendering is part of encoding a TIFF
+    StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "encode");
+
+    // Create render object
+    dng_render oRender(oDNGHost, *oNegative);
+
+    // Set exposure compensation
+    oRender.SetExposure(0.0);
+
+    // Create final image
+    AutoPtr<dng_image> oFinalImage;
+
+    // Render image
+    StageSpan oRenderStage(NULL, NULL, m_oConfig.m_poTrace, "render");
+    oFinalImage.Reset(oRender.Render());
+    oFinalImage->Rotate(oNegative->Orientation());
+    oRenderStage.done(0);
+
+    // Write TIFF file to disk
+    oWriter->WriteTIFF(oDNGHost,
+                       *poTIFFStream,
+                       *oFinalImage.Get(),
+                       piRGB,
+                       ccUncompressed,
+                       oNegative.Get(),
+                       &oRender.FinalSpace(),
+                       NULL,
+                       oJpegPreview);
+    oStage.done(poTIFFStream->Length(), ulPixels, "tiff");
+  }
+}
+
+bool DNGConverter::VerifyDNG(const std::string &szDNGFile,
+                             const std::string &szName,
+                             const dng_fingerprint &oRawDigest,
+                             dng_memory_allocator *poAllocator)
+{
+  StageSpan oStage(m_oConfig.m_poProgress, m_oConfig.m_poStats, m_oConfig.m_poTrace, "verify");
 
-    if (m_oConfig.m_bTiff) {
-      // -------------------------------------------------------------
-      // Write TIFF file
-      // -------------------------------------------------------------
+  ConverterHost oHost((uint32)m_oConfig.m_iTaskThreads, m_oConfig.m_poStats, m_oConfig.m_poTrace, poAllocator);
+  oHost.SetScratchAllocator(m_poScratch);
 
-      std::string m_szRenderFile;
-      m_szRenderFile.reserve(m_oConfig.m_szPathPrefixOutput.size() + szBaseFilename.size() + tiff_suffix.size());
-      m_szRenderFile = m_oConfig.m_szPathPrefixOutput;
-      m_szRenderFile += szBaseFilename;
-      m_szRenderFile += tiff_suffix;
+  const char *szError = NULL;
+  uint64 ulBytes = 0;
+  uint64 ulPixels = 0;
 
-      // Create stream writer for output file
-      dng_file_stream oTIFFStream(m_szRenderFile.c_str(), true);
+  try {
+    dng_file_stream oStream(szDNGFile.c_str());
+    ulBytes = oStream.Length();
 
-      // Create render object
-      dng_render oRender(oDNGHost, *oNegative);
+    dng_info oInfo;
+    oInfo.Parse(oHost, oStream);
+    oInfo.PostParse(oHost);
 
-      // Set exposure compensation
-      oRender.SetExposure(0.0);
+    if (!oInfo.IsValidDNG()) {
+      szError = "not a valid DNG";
+    } else {
+      const dng_ifd &oIFD = *oInfo.fIFD[oInfo.fMainIndex].Get();
+      ulPixels = (uint64)oIFD.fImageWidth * oIFD.fImageLength;
 
-      // Create final image
-      AutoPtr<dng_image> oFinalImage;
+      // Compressed tiles are decoded by all threads of the host
+      AutoPtr<dng_image> oImage(oHost.Make_dng_image(oIFD.Bounds(), oIFD.fSamplesPerPixel, oIFD.PixelType()));
+      dng_read_image oReader;
+      oReader.Read(oHost, oIFD, oStream, *oImage.Get(), NULL, NULL);
 
-      // Render image
-      oFinalImage.Reset(oRender.Render());
-      oFinalImage->Rotate(oNegative->Orientation());
+      // Hashed by tiles in parallel too, MD5_LANES at a time like the image converted
+      ImageDigestTask oDigestTask(*oImage.Get());
+      oHost.PerformAreaTask(oDigestTask, oImage->Bounds());
 
-#ifdef TIME_PROFILE
-      oProfiler.reset();
-      oProfiler.run();
-#endif
-      // Write TIFF file to disk
-      oWriter->WriteTIFF(oDNGHost,
-                         oTIFFStream,
-                         *oFinalImage.Get(),
-                         piRGB,
-                         ccUncompressed,
-                         oNegative.Get(),
-                         &oRender.FinalSpace(),
-                         NULL,
-                         oJpegPreview);
-#ifdef TIME_PROFILE
-      oProfiler.stop();
-      printf("dng_image_writer::WriteTIFF() time: %lu usec\n", oProfiler.elapsed_usec());
-#endif
+      if (oDigestTask.Result() != oRawDigest)
+        szError = "raw image differs from the one converted";
     }
   } catch (const dng_exception &except) {
-    return except.ErrorCode();
-  } catch (...) {
-    return dng_error_unknown;
+    szError = except.ErrorCode() == dng_error_memory ? "out of memory" : "raw image does not decode";
   }
 
-#ifdef TIME_PROFILE
-  oProfilerTotal.stop();
-  printf("DNGConverter::ConvertToDNG() time: %lu usec\n", oProfilerTotal.elapsed_usec());
-#endif
+  oStage.done(ulBytes, ulPixels);
 
-  return dng_error_none;
+  dng_lock_mutex lock(&m_oVerifyMutex);
+
+  ++m_ulVerified;
+  if (szError) {
+    ++m_ulVerifyFailed;
+    fprintf(stderr, "%s: Verification failed, %s\n", szName.c_str(), szError);
+  }
+
+  return !szError;
 }
@@ -4,6 +4,7 @@
 #define __CONVERTER_H__
 
 #include <string>
+#include <vector>
 #include <dng_exceptions.h>
 #include <dng_rational.h>
 #include <dng_matrix.h>
@@ -11,22 +12,66 @@
 #include <dng_date_time.h>
 #include <dng_xy_coord.h>
 #include <dng_orientation.h>
+#include <dng_auto_ptr.h>
+#include <dng_camera_profile.h>
+#include <dng_exif.h>
+#include <dng_mutex.h>
+#include <dng_uncopyable.h>
+#include <dng_xmp.h>
+
+#include "CameraProfile.h"
+
+// Frames a stack may have, so their sums fit 32 bits
+#define MAX_STACK_FRAMES 65535
+
+class CFAReader;
+class ConversionCache;
+class dng_fingerprint;
+class dng_host;
+class dng_image;
+class dng_memory_allocator;
+class dng_negative;
+class dng_stream;
+class BadPixelMap;
+class FrameCalibration;
+class LensProfile;
+class MemoryAccount;
+class MemoryBudget;
+class Progress;
+class ScratchAllocator;
+class Stats;
+class Trace;
 
 struct Config {
   Config()
-          : m_bTiff(false), m_bDng(false), m_bLensCorrections(false), m_bNoCalibration(false), m_iThreads(2),
-            m_bGenPreview(false), m_bFlipped(false)
+          : m_bTiff(false), m_bDng(false), m_bLensCorrections(false), m_bNoCalibration(false), m_bAutoWB(false),
+            m_iThreads(2), m_iTaskThreads(1), m_bGenPreview(false), m_bFlipped(false), m_bLowMemory(false),
+            m_bVerify(false), m_ulCacheSize(0), m_poProgress(NULL), m_poStats(NULL), m_poTrace(NULL), m_poMemory(NULL)
   {
   }
 
   bool m_bTiff;
   bool m_bDng;
   bool m_bLensCorrections;
+  std::string m_szLensProfile; // LCP the lens corrections come from (with m_bLensCorrections)
+  std::string m_szBadPixelMap; // Hot and dead pixels fixed in the files of its camera, empty for none
+  std::string m_szDarkMaster; // Calibration master subtracted from the files of its camera, empty for none
+  std::string m_szFlatMaster; // Calibration master the files of its camera are flat fielded with, empty for none
   bool m_bNoCalibration;
+  bool m_bAutoWB; // AsShotNeutral estimated per file instead of the profile's, unless m_bNoCalibration
   int m_iThreads;
+  int m_iTaskThreads;
   bool m_bGenPreview;
   bool m_bFlipped;
+  bool m_bLowMemory; // Full size images in scratch files next to the outputs instead of RAM
+  bool m_bVerify; // Written DNGs are read back and their raw image checked against the converted one
   std::string m_szPathPrefixOutput;
+  std::string m_szCacheDir; // Outputs of earlier conversions reused by content, empty for none
+  uint64 m_ulCacheSize; // Bytes m_szCacheDir is kept within
+  Progress *m_poProgress; // Per stage events of the items converted, NULL for none
+  Stats *m_poStats; // Stage and SDK task timings, NULL for none
+  Trace *m_poTrace; // Per thread timeline of stages and SDK task tiles, NULL for none
+  MemoryBudget *m_poMemory; // SDK memory accounting and admission of files, NULL for none
 };
 
 struct Exif {
@@ -47,7 +92,15 @@ struct Exif {
   std::string m_szCameraModel;
 };
 
-class DNGConverter
+// Per camera profile metadata that does not depend on the frame,
+// built once per converter and copied into each negative
+struct MetadataTemplate {
+  AutoPtr<dng_exif> m_oExif; // With placeholders for the per frame fields
+  AutoPtr<dng_camera_profile> m_oProfile;
+  AutoPtr<dng_xmp> m_oXMP; // m_oExif synced into XMP, see FrameXMP
+};
+
+class DNGConverter : private dng_uncopyable
 {
   public:
   DNGConverter(Config &config);
@@ -55,11 +108,128 @@ class DNGConverter
 
   dng_error_code ConvertToDNG(const std::string &m_szInputFile, const std::string &m_szMetadataFile);
 
+  // Stack same size frames of one camera (mean, or median with bMedian) into one DNG and/or TIFF named after
+  // the first frame plus "_stack", with the metadata of szMetadataFile (the first frame's JPG).
+  // Frames are read a row at a time, memory does not grow with their number.
+  dng_error_code StackToDNG(const std::vector<std::string> &oFrames, const std::string &szMetadataFile, bool bMedian);
+
+  // Convert a RAW readout held in memory, with the optional JPG carrying its metadata.
+  // The DNG and/or rendered TIFF go to the given streams (NULL to skip); nothing touches the file system.
+  // May be called from several threads at once.
+  dng_error_code ConvertBuffer(const void *pRawData,
+                               size_t ulRawSize,
+                               const void *pMetadata,
+                               size_t ulMetadataSize,
+                               dng_stream *poDNGStream,
+                               dng_stream *poTIFFStream);
+
   int ParseMetadata(const std::string &metadata, Exif &oExif);
+  int ParseMetadata(const void *metadata, size_t size, Exif &oExif);
+
+  // Names of the DNG / TIFF files written for szInputFile
+  void GetOutputFiles(const std::string &szInputFile, std::string &szDngFile, std::string &szTiffFile) const;
+
+  // True if every enabled output of szInputFile is present and not empty
+  bool OutputsExist(const std::string &szInputFile) const;
+
+  // Negative carrying the metadata of oCamProfile and exif, without image data
+  dng_negative *MakeNegative(dng_host &oHost, const CameraProfile *oCamProfile, const Exif &exif);
+
+  // Empty raw image of oCamProfile, as a RAW is unpacked into for a negative
+  static dng_image *MakeRawImage(dng_host &oHost, const CameraProfile &oCamProfile);
+
+  // SDK memory a conversion of oCamProfile takes at its peak with the enabled outputs
+  uint64 EstimateMemory(const CameraProfile &oCamProfile) const;
+
+  // RAW layouts the converter recognizes (by file size)
+  static size_t GetCameraProfileCount(void);
+  static const CameraProfile &GetCameraProfile(size_t i);
+
+  // Lens profile the corrections come from, NULL without corrections or if it failed to load
+  const LensProfile *GetLensProfile() const
+  {
+    return m_poLens;
+  }
+
+  // Bad pixel map of m_szBadPixelMap, NULL without one or if it failed to load
+  const BadPixelMap *GetBadPixelMap() const
+  {
+    return m_poBadPixels;
+  }
+
+  // Dark and flat calibration of m_szDarkMaster / m_szFlatMaster, NULL without them or if they failed to load
+  const FrameCalibration *GetCalibration() const
+  {
+    return m_poCalibration;
+  }
+
+  // DNGs read back with m_bVerify, and those of them that did not match
+  void GetVerified(size_t &ulVerified, size_t &ulFailed)
+  {
+    dng_lock_mutex lock(&m_oVerifyMutex);
+    ulVerified = m_ulVerified;
+    ulFailed = m_ulVerifyFailed;
+  }
+
+  // Cache of m_szCacheDir, NULL without one or if it failed to open
+  ConversionCache *GetCache() const
+  {
+    return m_poCache;
+  }
 
   protected:
+  void Convert(const CFAReader &reader,
+               const CameraProfile *oCamProfile,
+               const Exif &exif,
+               dng_stream *poDNGStream,
+               dng_stream *poTIFFStream,
+               dng_memory_allocator *poAllocator,
+               real64 fNoiseScale = 1.0,
+               dng_fingerprint *poRawDigest = NULL);
+
+  // Decode the raw image of the DNG written to szDNGFile (by the host's threads, a tile each) and check it
+  // against oRawDigest of the converted one. Failures are reported with szName.
+  bool VerifyDNG(const std::string &szDNGFile,
+                 const std::string &szName,
+                 const dng_fingerprint &oRawDigest,
+                 dng_memory_allocator *poAllocator);
+
+  // Parse szMetadataFile (if not empty) of szInputFile into exif, checking it is of oCamProfile
+  dng_error_code ReadMetadataFile(const std::string &szInputFile,
+                                  const std::string &szMetadataFile,
+                                  const CameraProfile *oCamProfile,
+                                  Exif &exif);
+
+  // Convert reader into the output files of szInputFile, with BaselineNoise scaled by fNoiseScale
+  dng_error_code WriteOutputs(const CFAReader &reader,
+                              const CameraProfile *oCamProfile,
+                              const Exif &exif,
+                              const std::string &szInputFile,
+                              real64 fNoiseScale = 1.0);
+
+  // Waits until the memory budget (if any) has room for a file of oCamProfile, NULL without budget
+  MemoryAccount *AdmitFile(const CameraProfile &oCamProfile);
+
+  void BuildMetadataTemplate(const CameraProfile &oCamProfile, MetadataTemplate &oTemplate);
+
   Config m_oConfig;
 
+  AutoArray<MetadataTemplate> m_oMetadataTemplates; // One per camera profile
+
+  ScratchAllocator *m_poScratch; // With m_bLowMemory
+
+  LensProfile *m_poLens; // With m_bLensCorrections
+
+  BadPixelMap *m_poBadPixels; // With m_szBadPixelMap
+
+  FrameCalibration *m_poCalibration; // With m_szDarkMaster and/or m_szFlatMaster
+
+  ConversionCache *m_poCache; // With m_szCacheDir
+
+  dng_mutex m_oVerifyMutex;
+  size_t m_ulVerified;
+  size_t m_ulVerifyFailed;
+
   dng_orientation m_oOrientation;
   dng_vector m_oNeutralWB;
 
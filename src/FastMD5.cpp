@@ -0,0 +1,235 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "FastMD5.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_MD5_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_MD5_SSE2
+
+#define MD5X4_F(x, y, z) _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z)))
+#define MD5X4_G(x, y, z) _mm_xor_si128(y, _mm_and_si128(z, _mm_xor_si128(x, y)))
+#define MD5X4_H(x, y, z) _mm_xor_si128(_mm_xor_si128(x, y), z)
+#define MD5X4_I(x, y, z) _mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, ones)))
+
+#define MD5X4_STEP(f, a, b, c, d, k, s, ac)                                                                            \
+  a = _mm_add_epi32(_mm_add_epi32(a, f(b, c, d)), _mm_add_epi32(x[k], _mm_set1_epi32((int)ac)));                       \
+  a = _mm_or_si128(_mm_slli_epi32(a, s), _mm_srli_epi32(a, 32 - s));                                                   \
+  a = _mm_add_epi32(a, b);
+
+// Load word-transposed message block: x[k] holds word k of every lane
+static inline void md5_x4_load(const uint8 *const block[MD5_LANES], __m128i x[16])
+{
+  for (int q = 0; q < 4; ++q) {
+    __m128i l0 = _mm_loadu_si128((const __m128i *)(block[0] + q * 16));
+    __m128i l1 = _mm_loadu_si128((const __m128i *)(block[1] + q * 16));
+    __m128i l2 = _mm_loadu_si128((const __m128i *)(block[2] + q * 16));
+    __m128i l3 = _mm_loadu_si128((const __m128i *)(block[3] + q * 16));
+
+    __m128i t0 = _mm_unpacklo_epi32(l0, l1);
+    __m128i t1 = _mm_unpacklo_epi32(l2, l3);
+    __m128i t2 = _mm_unpackhi_epi32(l0, l1);
+    __m128i t3 = _mm_unpackhi_epi32(l2, l3);
+
+    x[q * 4 + 0] = _mm_unpacklo_epi64(t0, t1);
+    x[q * 4 + 1] = _mm_unpackhi_epi64(t0, t1);
+    x[q * 4 + 2] = _mm_unpacklo_epi64(t2, t3);
+    x[q * 4 + 3] = _mm_unpackhi_epi64(t2, t3);
+  }
+}
+
+static void md5_x4_transform(__m128i state[4], const uint8 *const block[MD5_LANES])
+{
+  const __m128i ones = _mm_set1_epi32(-1);
+  __m128i x[16];
+
+  md5_x4_load(block, x);
+
+  __m128i a = state[0];
+  __m128i b = state[1];
+  __m128i c = state[2];
+  __m128i d = state[3];
+
+  // Round 1
+  MD5X4_STEP(MD5X4_F, a, b, c, d, 0, 7, 0xd76aa478)
+  MD5X4_STEP(MD5X4_F, d, a, b, c, 1, 12, 0xe8c7b756)
+  MD5X4_STEP(MD5X4_F, c, d, a, b, 2, 17, 0x242070db)
+  MD5X4_STEP(MD5X4_F, b, c, d, a, 3, 22, 0xc1bdceee)
+  MD5X4_STEP(MD5X4_F, a, b, c, d, 4, 7, 0xf57c0faf)
+  MD5X4_STEP(MD5X4_F, d, a, b, c, 5, 12, 0x4787c62a)
+  MD5X4_STEP(MD5X4_F, c, d, a, b, 6, 17, 0xa8304613)
+  MD5X4_STEP(MD5X4_F, b, c, d, a, 7, 22, 0xfd469501)
+  MD5X4_STEP(MD5X4_F, a, b, c, d, 8, 7, 0x698098d8)
+  MD5X4_STEP(MD5X4_F, d, a, b, c, 9, 12, 0x8b44f7af)
+  MD5X4_STEP(MD5X4_F, c, d, a, b, 10, 17, 0xffff5bb1)
+  MD5X4_STEP(MD5X4_F, b, c, d, a, 11, 22, 0x895cd7be)
+  MD5X4_STEP(MD5X4_F, a, b, c, d, 12, 7, 0x6b901122)
+  MD5X4_STEP(MD5X4_F, d, a, b, c, 13, 12, 0xfd987193)
+  MD5X4_STEP(MD5X4_F, c, d, a, b, 14, 17, 0xa679438e)
+  MD5X4_STEP(MD5X4_F, b, c, d, a, 15, 22, 0x49b40821)
+
+  // Round 2
+  MD5X4_STEP(MD5X4_G, a, b, c, d, 1, 5, 0xf61e2562)
+  MD5X4_STEP(MD5X4_G, d, a, b, c, 6, 9, 0xc040b340)
+  MD5X4_STEP(MD5X4_G, c, d, a, b, 11, 14, 0x265e5a51)
+  MD5X4_STEP(MD5X4_G, b, c, d, a, 0, 20, 0xe9b6c7aa)
+  MD5X4_STEP(MD5X4_G, a, b, c, d, 5, 5, 0xd62f105d)
+  MD5X4_STEP(MD5X4_G, d, a, b, c, 10, 9, 0x02441453)
+  MD5X4_STEP(MD5X4_G, c, d, a, b, 15, 14, 0xd8a1e681)
+  MD5X4_STEP(MD5X4_G, b, c, d, a, 4, 20, 0xe7d3fbc8)
+  MD5X4_STEP(MD5X4_G, a, b, c, d, 9, 5, 0x21e1cde6)
+  MD5X4_STEP(MD5X4_G, d, a, b, c, 14, 9, 0xc33707d6)
+  MD5X4_STEP(MD5X4_G, c, d, a, b, 3, 14, 0xf4d50d87)
+  MD5X4_STEP(MD5X4_G, b, c, d, a, 8, 20, 0x455a14ed)
+  MD5X4_STEP(MD5X4_G, a, b, c, d, 13, 5, 0xa9e3e905)
+  MD5X4_STEP(MD5X4_G, d, a, b, c, 2, 9, 0xfcefa3f8)
+  MD5X4_STEP(MD5X4_G, c, d, a, b, 7, 14, 0x676f02d9)
+  MD5X4_STEP(MD5X4_G, b, c, d, a, 12, 20, 0x8d2a4c8a)
+
+  // Round 3
+  MD5X4_STEP(MD5X4_H, a, b, c, d, 5, 4, 0xfffa3942)
+  MD5X4_STEP(MD5X4_H, d, a, b, c, 8, 11, 0x8771f681)
+  MD5X4_STEP(MD5X4_H, c, d, a, b, 11, 16, 0x6d9d6122)
+  MD5X4_STEP(MD5X4_H, b, c, d, a, 14, 23, 0xfde5380c)
+  MD5X4_STEP(MD5X4_H, a, b, c, d, 1, 4, 0xa4beea44)
+  MD5X4_STEP(MD5X4_H, d, a, b, c, 4, 11, 0x4bdecfa9)
+  MD5X4_STEP(MD5X4_H, c, d, a, b, 7, 16, 0xf6bb4b60)
+  MD5X4_STEP(MD5X4_H, b, c, d, a, 10, 23, 0xbebfbc70)
+  MD5X4_STEP(MD5X4_H, a, b, c, d, 13, 4, 0x289b7ec6)
+  MD5X4_STEP(MD5X4_H, d, a, b, c, 0, 11, 0xeaa127fa)
+  MD5X4_STEP(MD5X4_H, c, d, a, b, 3, 16, 0xd4ef3085)
+  MD5X4_STEP(MD5X4_H, b, c, d, a, 6, 23, 0x04881d05)
+  MD5X4_STEP(MD5X4_H, a, b, c, d, 9, 4, 0xd9d4d039)
+  MD5X4_STEP(MD5X4_H, d, a, b, c, 12, 11, 0xe6db99e5)
+  MD5X4_STEP(MD5X4_H, c, d, a, b, 15, 16, 0x1fa27cf8)
+  MD5X4_STEP(MD5X4_H, b, c, d, a, 2, 23, 0xc4ac5665)
+
+  // Round 4
+  MD5X4_STEP(MD5X4_I, a, b, c, d, 0, 6, 0xf4292244)
+  MD5X4_STEP(MD5X4_I, d, a, b, c, 7, 10, 0x432aff97)
+  MD5X4_STEP(MD5X4_I, c, d, a, b, 14, 15, 0xab9423a7)
+  MD5X4_STEP(MD5X4_I, b, c, d, a, 5, 21, 0xfc93a039)
+  MD5X4_STEP(MD5X4_I, a, b, c, d, 12, 6, 0x655b59c3)
+  MD5X4_STEP(MD5X4_I, d, a, b, c, 3, 10, 0x8f0ccc92)
+  MD5X4_STEP(MD5X4_I, c, d, a, b, 10, 15, 0xffeff47d)
+  MD5X4_STEP(MD5X4_I, b, c, d, a, 1, 21, 0x85845dd1)
+  MD5X4_STEP(MD5X4_I, a, b, c, d, 8, 6, 0x6fa87e4f)
+  MD5X4_STEP(MD5X4_I, d, a, b, c, 15, 10, 0xfe2ce6e0)
+  MD5X4_STEP(MD5X4_I, c, d, a, b, 6, 15, 0xa3014314)
+  MD5X4_STEP(MD5X4_I, b, c, d, a, 13, 21, 0x4e0811a1)
+  MD5X4_STEP(MD5X4_I, a, b, c, d, 4, 6, 0xf7537e82)
+  MD5X4_STEP(MD5X4_I, d, a, b, c, 11, 10, 0xbd3af235)
+  MD5X4_STEP(MD5X4_I, c, d, a, b, 2, 15, 0x2ad7d2bb)
+  MD5X4_STEP(MD5X4_I, b, c, d, a, 9, 21, 0xeb86d391)
+
+  state[0] = _mm_add_epi32(state[0], a);
+  state[1] = _mm_add_epi32(state[1], b);
+  state[2] = _mm_add_epi32(state[2], c);
+  state[3] = _mm_add_epi32(state[3], d);
+}
+
+void md5_x4(const uint8 *const data[MD5_LANES], uint32 len, dng_fingerprint result[MD5_LANES])
+{
+  __m128i state[4];
+  state[0] = _mm_set1_epi32(0x67452301);
+  state[1] = _mm_set1_epi32((int)0xefcdab89);
+  state[2] = _mm_set1_epi32((int)0x98badcfe);
+  state[3] = _mm_set1_epi32(0x10325476);
+
+  const uint8 *block[MD5_LANES];
+  uint32 lane;
+
+  const uint32 full = len / 64;
+  for (uint32 i = 0; i < full; ++i) {
+    for (lane = 0; lane < MD5_LANES; ++lane)
+      block[lane] = data[lane] + i * 64;
+
+    md5_x4_transform(state, block);
+  }
+
+  // All lanes have the same length, so padding is identical in shape for every lane
+  const uint32 rem = len - full * 64;
+  const uint32 tail_blocks = rem < 56 ? 1 : 2;
+  const uint64 bits = (uint64)len << 3;
+
+  uint8 tail[MD5_LANES][128];
+  for (lane = 0; lane < MD5_LANES; ++lane) {
+    memset(tail[lane], 0, sizeof(tail[lane]));
+    memcpy(tail[lane], data[lane] + full * 64, rem);
+    tail[lane][rem] = 0x80;
+
+    uint8 *length = tail[lane] + tail_blocks * 64 - 8;
+    for (int i = 0; i < 8; ++i)
+      length[i] = (uint8)(bits >> (8 * i));
+  }
+
+  for (uint32 i = 0; i < tail_blocks; ++i) {
+    for (lane = 0; lane < MD5_LANES; ++lane)
+      block[lane] = tail[lane] + i * 64;
+
+    md5_x4_transform(state, block);
+  }
+
+  uint32 words[4][MD5_LANES];
+  for (int i = 0; i < 4; ++i)
+    _mm_storeu_si128((__m128i *)words[i], state[i]);
+
+  for (lane = 0; lane < MD5_LANES; ++lane) {
+    for (int i = 0; i < 4; ++i) {
+      result[lane].data[i * 4 + 0] = (uint8)(words[i][lane]);
+      result[lane].data[i * 4 + 1] = (uint8)(words[i][lane] >> 8);
+      result[lane].data[i * 4 + 2] = (uint8)(words[i][lane] >> 16);
+      result[lane].data[i * 4 + 3] = (uint8)(words[i][lane] >> 24);
+    }
+  }
+}
+
+#else // HAVE_MD5_SSE2
+
+void md5_x4(const uint8 *const data[MD5_LANES], uint32 len, dng_fingerprint result[MD5_LANES])
+{
+  for (uint32 lane = 0; lane < MD5_LANES; ++lane) {
+    dng_md5_printer printer;
+
+    printer.Process(data[lane], len);
+
+    result[lane] = printer.Result();
+  }
+}
+
+#endif // HAVE_MD5_SSE2
+
+bool md5_file(const std::string &fname, std::string &hash)
+{
+  FILE *fp = fopen(fname.c_str(), "rb");
+  if (!fp) {
+    perror("fopen");
+    return false;
+  }
+
+  std::vector<unsigned char> buf(1 << 20);
+  dng_md5_printer printer;
+  size_t len;
+
+  while ((len = fread(&buf[0], 1, buf.size(), fp)) > 0)
+    printer.Process(&buf[0], (uint32)len);
+
+  bool ok = !ferror(fp);
+  fclose(fp);
+
+  if (!ok)
+    return false;
+
+  char str[2 * dng_fingerprint::kDNGFingerprintSize + 1];
+  printer.Result().ToUtf8HexString(str);
+  hash = str;
+
+  return true;
+}
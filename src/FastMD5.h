@@ -0,0 +1,21 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __FAST_MD5_H__
+#define __FAST_MD5_H__
+
+#include <string>
+
+#include <dng_fingerprint.h>
+
+// Number of independent messages hashed side by side by md5_x4()
+#define MD5_LANES 4
+
+// Hash MD5_LANES equally sized messages at once.
+// Uses one SSE2 lane per message where available and falls back to dng_md5_printer otherwise.
+// Results are bit-identical to dng_md5_printer.
+void md5_x4(const uint8 *const data[MD5_LANES], uint32 len, dng_fingerprint result[MD5_LANES]);
+
+// MD5 of the contents of fname as hex digits, false if it cannot be read
+bool md5_file(const std::string &fname, std::string &hash);
+
+#endif // __FAST_MD5_H__
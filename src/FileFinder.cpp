@@ -4,9 +4,32 @@
 #include "utils.h"
 #include "helpers.h"
 
-#include <list>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <dng_pthread.h>
+
+// Directory entries fetched per system call
+#define DIR_BUFFER_SIZE (64 * 1024)
 
 static const std::string empty_string;
 
@@ -23,148 +46,422 @@ void FileFinder::cleanup_work_items(void)
 void FileFinder::add_work_item(const std::string &szRawFile, const std::string &szMetadataFile)
 {
   RawWorkItem *wi = new RawWorkItem(szRawFile, szMetadataFile);
-  m_WorkItems.push_back(wi);
+
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    ++m_ulFound;
+
+    if (!m_poSink) {
+      m_WorkItems.push_back(wi);
+      return;
+    }
+  }
+
+  m_poSink->push(wi);
 }
 
-int FileFinder::find_files(std::string &dir)
+bool FileFinder::get_metadata_suffix(const std::string &szRawFile, std::string &szSuffix)
 {
-  std::list<std::string> files;
-  int ret = list_dir(dir, files, m_Filter);
-  if (ret)
-    return ret;
+  size_t suffix_idx = szRawFile.find_last_of('_');
+  if (suffix_idx == std::string::npos)
+    return false;
+
+  std::string suffix = szRawFile.substr(suffix_idx + 1, szRawFile.length());
+  int pic_num = atoi(suffix.c_str());
+  if (pic_num < 1)
+    return false;
 
-  std::list<std::string>::iterator it, found_it = files.begin();
-  bool found = false;
+  // The camera stores the JPG of a RAW shot under the next picture number
   char buffer[16];
-  std::string jpg_suffix;
-  std::string res;
+  snprintf(buffer, sizeof(buffer), "_%03u.JPG", pic_num + 1);
+  szSuffix = buffer;
+
+  return true;
+}
 
-  dir += DELIM;
+typedef FileFinder::JpgsBySuffix JpgsBySuffix;
 
-  for (it = files.begin(); it != files.end(); ++it) {
-    if (found) {
-      if (has_suffix(*it, jpg_suffix)) {
-        res = dir + *it;
-      }
+static void map_jpgs(const std::vector<std::string> &jpgs, JpgsBySuffix &by_suffix)
+{
+  std::vector<std::string>::const_iterator it;
+  for (it = jpgs.begin(); it != jpgs.end(); ++it) {
+    size_t idx = it->find_last_of('_');
+    if (idx != std::string::npos)
+      by_suffix[it->substr(idx)].push_back(*it);
+  }
+
+  JpgsBySuffix::iterator suffix;
+  for (suffix = by_suffix.begin(); suffix != by_suffix.end(); ++suffix)
+    std::sort(suffix->second.begin(), suffix->second.end());
+}
+
+// Name of the JPG holding the metadata of the RAW named name, empty if it has none, taken out of
+// by_suffix so no other RAW gets it. Of several JPGs with its number (the counter wrapped), the one
+// sharing the RAW's leading part, else the first sorting after the RAW, as the camera writes it later.
+static std::string metadata_name(const std::string &name, JpgsBySuffix &by_suffix)
+{
+  std::string suffix;
+  if (!FileFinder::get_metadata_suffix(name, suffix))
+    return empty_string;
 
-      std::string fname;
-      fname.reserve(dir.size() + found_it->size());
-      fname = dir;
-      fname += *found_it;
+  JpgsBySuffix::iterator found = by_suffix.find(suffix);
+  if (found == by_suffix.end())
+    return empty_string;
 
-      add_work_item(fname, res);
-      found = false;
-      res.clear();
+  std::vector<std::string> &names = found->second;
+
+  const std::string same = name.substr(0, name.find_last_of('_')) + suffix;
+  std::vector<std::string>::iterator jpg = std::lower_bound(names.begin(), names.end(), same);
+
+  if (jpg == names.end() || *jpg != same)
+    jpg = std::upper_bound(names.begin(), names.end(), name);
+
+  if (jpg == names.end())
+    return empty_string;
+
+  const std::string res = *jpg;
+  names.erase(jpg);
+
+  return res;
+}
+
+void FileFinder::pair_files(const std::string &dir,
+                            const std::vector<std::string> &raws,
+                            const std::vector<std::string> &jpgs)
+{
+  // Looked up by number rather than relying on a RAW's JPG sorting right after it
+  JpgsBySuffix by_suffix;
+  map_jpgs(jpgs, by_suffix);
+
+  std::vector<std::string>::const_iterator it;
+  for (it = raws.begin(); it != raws.end(); ++it) {
+    const std::string jpg = metadata_name(*it, by_suffix);
+
+    if (!jpg.empty())
+      add_work_item(dir + *it, dir + jpg);
+    else
+      add_work_item(dir + *it, empty_string);
+  }
+}
+
+// Sort the RAWs and JPGs of dir into raws / jpgs and its subdirectories into dirs
+#if defined(_WIN32) || defined(_WIN64)
+static int read_dir(const std::string &dir,
+                    std::vector<std::string> &raws,
+                    std::vector<std::string> &jpgs,
+                    std::vector<std::string> *dirs)
+{
+  WIN32_FIND_DATA ffd;
+
+  const std::string files_to_list = dir + "\\*";
+
+  HANDLE hFind = FindFirstFile(files_to_list.c_str(), &ffd);
+  if (INVALID_HANDLE_VALUE == hFind)
+    return GetLastError();
+
+  do {
+    const std::string name(ffd.cFileName);
+
+    if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      if (dirs && name != "." && name != ".." && !(ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        dirs->push_back(name);
+    } else if (has_suffix(name, raw_suffix)) {
+      raws.push_back(name);
+    } else if (has_suffix(name, jpeg_suffix)) {
+      jpgs.push_back(name);
     }
+  } while (FindNextFile(hFind, &ffd) != 0);
 
-    if (has_suffix(*it, raw_suffix)) {
-      size_t suffix_idx = it->find_last_of('_');
-      if (suffix_idx == std::string::npos) {
-        std::string fname;
-        fname.reserve(dir.size() + it->size());
-        fname = dir;
-        fname += *it;
-
-        add_work_item(fname, res);
-        found = false;
-        res.clear();
-        continue;
-      }
+  DWORD dwError = GetLastError();
+  if (dwError == ERROR_NO_MORE_FILES)
+    dwError = 0;
 
-      std::string suffix = it->substr(suffix_idx + 1, it->length());
-      int pic_num = atoi(suffix.c_str());
-      if (pic_num < 1) {
-        std::string fname;
-        fname.reserve(dir.size() + it->size());
-        fname = dir;
-        fname += *it;
-
-        add_work_item(fname, res);
-        found = false;
-        res.clear();
-        continue;
-      }
+  FindClose(hFind);
+
+  return dwError;
+}
+#else
+enum EntryType { entryOther, entryFile, entryDir };
+
+static void add_entry(const char *name,
+                      EntryType type,
+                      std::vector<std::string> &raws,
+                      std::vector<std::string> &jpgs,
+                      std::vector<std::string> *dirs)
+{
+  if (type == entryDir) {
+    if (dirs && strcmp(name, ".") && strcmp(name, ".."))
+      dirs->push_back(name);
+    return;
+  }
 
-      snprintf(buffer, sizeof(buffer), "_%03u.JPG", pic_num + 1);
-      jpg_suffix = buffer;
+  if (type != entryFile)
+    return;
 
-      found_it = it;
-      found = true;
+  const std::string fname(name);
+
+  if (has_suffix(fname, raw_suffix))
+    raws.push_back(fname);
+  else if (has_suffix(fname, jpeg_suffix))
+    jpgs.push_back(fname);
+}
+
+// Type of an entry of the directory open as fd, looked up if the file system did not tell.
+// Symbolic links are neither files nor directories, like readdir() based listing always had it.
+static EntryType entry_type(int fd, const char *name, unsigned char d_type)
+{
+  switch (d_type) {
+  case DT_REG:
+    return entryFile;
+  case DT_DIR:
+    return entryDir;
+  case DT_UNKNOWN:
+    break;
+  default:
+    return entryOther;
+  }
+
+  struct stat sb;
+  if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW))
+    return entryOther;
+
+  if (S_ISREG(sb.st_mode))
+    return entryFile;
+
+  return S_ISDIR(sb.st_mode) ? entryDir : entryOther;
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+// Straight getdents64, a large buffer saves system calls on directories of thousands of files
+static int read_dir(const std::string &dir,
+                    std::vector<std::string> &raws,
+                    std::vector<std::string> &jpgs,
+                    std::vector<std::string> *dirs)
+{
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    int ret = errno;
+    perror(dir.c_str());
+    return ret;
+  }
+
+  std::vector<char> buffer(DIR_BUFFER_SIZE);
+  int ret = 0;
+
+  for (;;) {
+    long n = syscall(SYS_getdents64, fd, &buffer[0], buffer.size());
+    if (n < 0) {
+      ret = errno;
+      perror(dir.c_str());
+      break;
+    }
+
+    if (n == 0)
+      break;
+
+    for (long pos = 0; pos < n;) {
+      const linux_dirent64 *entry = (const linux_dirent64 *)&buffer[pos];
+      add_entry(entry->d_name, entry_type(fd, entry->d_name, entry->d_type), raws, jpgs, dirs);
+      pos += entry->d_reclen;
     }
   }
 
-  if (found) {
-    std::string fname;
-    fname.reserve(dir.size() + found_it->size());
-    fname = dir;
-    fname += *found_it;
-    add_work_item(fname, empty_string);
+  close(fd);
+
+  return ret;
+}
+#else
+static int read_dir(const std::string &dir,
+                    std::vector<std::string> &raws,
+                    std::vector<std::string> &jpgs,
+                    std::vector<std::string> *dirs)
+{
+  DIR *dp = opendir(dir.c_str());
+  if (dp == NULL) {
+    int ret = errno;
+    perror(dir.c_str());
+    return ret;
   }
 
+  struct dirent *dirp;
+  while ((dirp = readdir(dp)) != NULL)
+    add_entry(dirp->d_name, entry_type(dirfd(dp), dirp->d_name, dirp->d_type), raws, jpgs, dirs);
+
+  closedir(dp);
+
   return 0;
 }
+#endif
+#endif
 
-int FileFinder::find_file(std::string &fname)
-{
-  std::string dir_name;
-  std::string file_name;
-  std::string res;
+// Directories of a tree still to be read, shared by the walker threads
+struct DirWalk {
+  DirWalk(FileFinder &oFinder) : m_oFinder(oFinder), m_oMutex("DirWalk"), m_ulBusy(0)
+  {
+  }
 
-  size_t idx = fname.find_last_of(DIR_DELIM);
-  if (idx == std::string::npos) {
-    dir_name = ".";
-    file_name = fname;
-  } else {
-    dir_name = fname.substr(0, idx);
-    file_name = fname.substr(idx + 1, fname.length());
+  FileFinder &m_oFinder;
+
+  dng_mutex m_oMutex;
+  dng_condition m_oCondition;
+  std::deque<std::string> m_oDirs; // Each ending with a delimiter
+  size_t m_ulBusy; // Walkers reading a directory, which may add more
+
+  // Next directory to read, false once the whole tree was read
+  bool next(std::string &dir)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    while (m_oDirs.empty() && m_ulBusy)
+      m_oCondition.Wait(m_oMutex);
+
+    if (m_oDirs.empty()) {
+      m_oCondition.Broadcast();
+      return false;
+    }
+
+    dir = m_oDirs.front();
+    m_oDirs.pop_front();
+    ++m_ulBusy;
+
+    return true;
   }
 
-  size_t suffix_idx = file_name.find_last_of('_');
-  if (suffix_idx == std::string::npos) {
-    add_work_item(fname, res);
-    return 0;
+  void done(const std::string &dir, const std::vector<std::string> &subdirs)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    std::vector<std::string>::const_iterator it;
+    for (it = subdirs.begin(); it != subdirs.end(); ++it)
+      m_oDirs.push_back(dir + *it + DELIM);
+
+    --m_ulBusy;
+    m_oCondition.Broadcast();
   }
 
-  std::string suffix = file_name.substr(suffix_idx + 1, file_name.length());
-  int pic_num = atoi(suffix.c_str());
-  if (pic_num < 1) {
-    add_work_item(fname, res);
-    return 0;
+  void walk(void)
+  {
+    std::string dir;
+    std::vector<std::string> raws;
+    std::vector<std::string> jpgs;
+    std::vector<std::string> subdirs;
+
+    while (next(dir)) {
+      raws.clear();
+      jpgs.clear();
+      subdirs.clear();
+
+      int ret = read_dir(dir.substr(0, dir.size() - 1), raws, jpgs, m_oFinder.m_bRecursive ? &subdirs : NULL);
+
+      if (ret == 0) {
+        std::sort(raws.begin(), raws.end());
+        m_oFinder.pair_files(dir, raws, jpgs);
+      }
+
+      done(dir, subdirs);
+    }
   }
+};
+
+static void *dir_walker(void *arg)
+{
+  ((DirWalk *)arg)->walk();
+  return NULL;
+}
+
+static bool work_item_less(const RawWorkItem *a, const RawWorkItem *b)
+{
+  return a->m_szRawFile < b->m_szRawFile;
+}
 
-  std::list<std::string> files;
-  int ret = list_dir(dir_name, files, m_Filter);
+int FileFinder::find_files(const std::string &dir)
+{
+  const size_t first = m_WorkItems.size();
+
+  // Only the root is read before the walkers start, so a bad argument is an error
+  std::vector<std::string> raws;
+  std::vector<std::string> jpgs;
+  std::vector<std::string> subdirs;
+
+  int ret = read_dir(dir, raws, jpgs, m_bRecursive ? &subdirs : NULL);
   if (ret)
     return ret;
 
-  char buffer[16];
-  snprintf(buffer, sizeof(buffer), "_%03u.JPG", pic_num + 1);
+  const std::string root(dir + DELIM);
 
-  dir_name += DELIM;
+  std::sort(raws.begin(), raws.end());
+  pair_files(root, raws, jpgs);
 
-  const std::string jpg_suffix(buffer);
-  std::list<std::string>::iterator it, found_it = files.begin();
-  bool found = false;
-  for (it = files.begin(); it != files.end(); ++it) {
-    if (found) {
-      if (has_suffix(*it, jpg_suffix)) {
-        res = dir_name + *it;
-      }
-      add_work_item(fname, res);
-      found = false;
-      break;
-    }
+  if (!subdirs.empty()) {
+    DirWalk walk(*this);
 
-    if (*it == file_name) {
-      found_it = it;
-      found = true;
+    std::vector<std::string>::const_iterator it;
+    for (it = subdirs.begin(); it != subdirs.end(); ++it)
+      walk.m_oDirs.push_back(root + *it + DELIM);
+
+    std::vector<pthread_t> threads(m_unThreads);
+    unsigned int started = 0;
+
+    for (unsigned int i = 1; i < m_unThreads; ++i) {
+      if (pthread_create(&threads[i], NULL, dir_walker, &walk))
+        break;
+      ++started;
     }
+
+    // The calling thread walks as well
+    walk.walk();
+
+    for (unsigned int i = 1; i <= started; ++i)
+      pthread_join(threads[i], NULL);
   }
 
-  if (found) {
-    res = dir_name + *found_it;
-    add_work_item(fname, empty_string);
+  // Walkers finish directories in any order
+  if (!m_poSink)
+    std::sort(m_WorkItems.begin() + first, m_WorkItems.end(), work_item_less);
+
+  return 0;
+}
+
+int FileFinder::find_file(const std::string &fname)
+{
+  std::string res;
+
+  size_t idx = fname.find_last_of(DIR_DELIM);
+  const std::string dir(idx == std::string::npos ? std::string(".") : fname.substr(0, idx));
+  const std::string file_name(idx == std::string::npos ? fname : fname.substr(idx + 1));
+
+  std::string suffix;
+  if (get_metadata_suffix(file_name, suffix)) {
+    // Its JPG is matched among the directory's by number, like the RAWs of a directory argument.
+    // The directory is listed for its first file only, "find | xargs" passes all of them.
+    std::map<std::string, JpgsBySuffix>::iterator cached = m_oDirJpgs.find(dir);
+
+    if (cached == m_oDirJpgs.end()) {
+      std::vector<std::string> raws;
+      std::vector<std::string> jpgs;
+
+      int ret = read_dir(dir, raws, jpgs, NULL);
+      if (ret)
+        return ret;
+
+      cached = m_oDirJpgs.insert(std::make_pair(dir, JpgsBySuffix())).first;
+      map_jpgs(jpgs, cached->second);
+    }
+
+    const std::string jpg = metadata_name(file_name, cached->second);
+    if (!jpg.empty())
+      res = fname.substr(0, idx == std::string::npos ? 0 : idx + 1) + jpg;
   }
 
+  add_work_item(fname, res);
+
   return 0;
 }
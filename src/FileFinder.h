@@ -3,9 +3,14 @@
 #ifndef __FILE_FIDER_H__
 #define __FILE_FIDER_H__
 
+#include <map>
 #include <string>
 #include <vector>
+
+#include <dng_mutex.h>
+
 #include "utils.h"
+#include "WorkQueue.h"
 
 struct RawWorkItem {
   RawWorkItem(const std::string &szRawFile, const std::string &szMetadataFile)
@@ -17,13 +22,18 @@ struct RawWorkItem {
   const std::string m_szMetadataFile;
 };
 
+// Finds the RAW files to convert and pairs each with the JPG holding its metadata.
+// Directory trees are walked by several threads at once, a directory's RAWs are
+// paired with its JPGs by picture number as soon as it has been read.
 class FileFinder
 {
   public:
-  FileFinder()
+  // JPGs of a directory by their "_NNN.JPG" suffix, the part get_metadata_suffix() gives: the leading
+  // part of a JPG's name may differ from its RAW's (a timestamp a second later). Names are sorted.
+  typedef std::map<std::string, std::vector<std::string> > JpgsBySuffix;
+
+  FileFinder() : m_bRecursive(false), m_unThreads(1), m_poSink(NULL), m_ulFound(0), m_oMutex("FileFinder")
   {
-    m_Filter.push_back(jpeg_suffix);
-    m_Filter.push_back(raw_suffix);
   }
 
   ~FileFinder()
@@ -31,22 +41,64 @@ class FileFinder
     cleanup_work_items();
   }
 
-  int find_files(std::string &dir);
-  int find_file(std::string &fname);
+  // Also descend into subdirectories (symbolic links are not followed)
+  void set_recursive(bool bRecursive)
+  {
+    m_bRecursive = bRecursive;
+  }
+
+  // Directories read at once while walking a tree
+  void set_threads(unsigned int unThreads)
+  {
+    m_unThreads = unThreads ? unThreads : 1;
+  }
+
+  // Hand work items to queue as they are found instead of collecting them
+  void set_sink(WorkQueue<RawWorkItem> *poSink)
+  {
+    m_poSink = poSink;
+  }
+
+  // Work items of dir are sorted by name once it is done, unless they went to the sink
+  int find_files(const std::string &dir);
+  // The JPGs of fname's directory are listed once for all the files given of it
+  int find_file(const std::string &fname);
+
+  // Suffix of the JPG holding the metadata of szRawFile ("..._001.RAW" -> "_002.JPG"), false if it has none
+  static bool get_metadata_suffix(const std::string &szRawFile, std::string &szSuffix);
 
   const std::vector<RawWorkItem *> get_work_items(void)
   {
     return m_WorkItems;
   }
 
+  // Work items found so far, sink included
+  size_t get_found(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulFound;
+  }
+
   protected:
+  friend struct DirWalk;
+
+  // Pair the RAWs of dir (ending with a delimiter) with its JPGs, names sorted
+  void pair_files(const std::string &dir, const std::vector<std::string> &raws, const std::vector<std::string> &jpgs);
+
   void add_work_item(const std::string &szRawFile, const std::string &szMetadataFile);
 
   void cleanup_work_items(void);
 
-  std::vector<RawWorkItem *> m_WorkItems;
+  bool m_bRecursive;
+  unsigned int m_unThreads;
+  WorkQueue<RawWorkItem> *m_poSink;
 
-  std::list<std::string> m_Filter;
+  // JPGs of the directories of find_file() not paired yet
+  std::map<std::string, JpgsBySuffix> m_oDirJpgs;
+
+  std::vector<RawWorkItem *> m_WorkItems;
+  size_t m_ulFound;
+  dng_mutex m_oMutex; // Directory walkers add items concurrently
 };
 
 #endif // __FILE_FIDER_H__
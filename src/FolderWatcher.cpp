@@ -0,0 +1,285 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+#include "FolderWatcher.h"
+#include "helpers.h"
+#include "utils.h"
+
+static unsigned long long now_msec(void)
+#ifdef __linux__
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long)ts.tv_sec * 1000 + (unsigned long long)ts.tv_nsec / 1000000;
+}
+#else
+{
+  return 0;
+}
+#endif
+
+FolderWatcher::FolderWatcher(const std::string &dir, unsigned int grace_ms)
+        : m_szDir(dir), m_ulGraceMs(grace_ms), m_fd(-1)
+{
+  m_szDir += DELIM;
+}
+
+FolderWatcher::~FolderWatcher()
+{
+#ifdef __linux__
+  if (m_fd >= 0)
+    close(m_fd);
+#endif
+}
+
+int FolderWatcher::start(void)
+#ifdef __linux__
+{
+  m_fd = inotify_init1(IN_CLOEXEC);
+  if (m_fd < 0) {
+    perror("inotify_init1");
+    return errno;
+  }
+
+  // Close after write means a copy finished, moved to catches tools that write a temp name and rename
+  if (inotify_add_watch(m_fd, m_szDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    perror("inotify_add_watch");
+    return errno;
+  }
+
+  return 0;
+}
+#else
+{
+  fprintf(stderr, "Watching a directory is not supported on this platform\n");
+  return -1;
+}
+#endif
+
+bool FolderWatcher::file_state(const std::string &name, FileState &state) const
+{
+  struct stat sb;
+  if (stat((m_szDir + name).c_str(), &sb))
+    return false;
+
+  state.m_ulSize = (unsigned long long)sb.st_size;
+  state.m_lMtime = (long long)sb.st_mtime;
+
+  return true;
+}
+
+void FolderWatcher::settle(const std::string &name)
+{
+  std::list<SettlingFile>::const_iterator it;
+  for (it = m_oSettling.begin(); it != m_oSettling.end(); ++it) {
+    if (it->m_szName == name)
+      return;
+  }
+
+  SettlingFile oFile;
+  oFile.m_szName = name;
+  oFile.m_ulTime = now_msec();
+
+  if (file_state(name, oFile.m_oState))
+    m_oSettling.push_back(oFile);
+}
+
+void FolderWatcher::scanned(std::vector<RawWorkItem *> &items)
+{
+  const long long now = (long long)time(NULL);
+  const long long grace = (long long)((m_ulGraceMs + 999) / 1000);
+
+  std::vector<RawWorkItem *> complete;
+  std::vector<RawWorkItem *>::const_iterator it;
+
+  for (it = items.begin(); it != items.end(); ++it) {
+    const std::string raw = (*it)->m_szRawFile.substr(m_szDir.size());
+    const std::string &metadata = (*it)->m_szMetadataFile;
+    const std::string jpg = metadata.empty() ? std::string() : metadata.substr(m_szDir.size());
+
+    FileState oRaw, oJpg;
+    if (!file_state(raw, oRaw) || (!jpg.empty() && !file_state(jpg, oJpg)))
+      continue;
+
+    // Written to lately: a copy may still be going on, its close (or its settling) brings it back
+    if (now - oRaw.m_lMtime <= grace || (!jpg.empty() && now - oJpg.m_lMtime <= grace)) {
+      settle(raw);
+      if (!jpg.empty())
+        settle(jpg);
+      continue;
+    }
+
+    m_oScanned[raw] = oRaw;
+    if (!jpg.empty())
+      m_oScanned[jpg] = oJpg;
+
+    complete.push_back(*it);
+  }
+
+  items.swap(complete);
+}
+
+void FolderWatcher::on_event(const std::string &name, std::vector<RawWorkItem *> &items)
+{
+  // Closed at last, it lands like any other file
+  std::list<SettlingFile>::iterator settling;
+  for (settling = m_oSettling.begin(); settling != m_oSettling.end(); ++settling) {
+    if (settling->m_szName == name) {
+      m_oSettling.erase(settling);
+      break;
+    }
+  }
+
+  // Moved in or closed between start() and the scan, which has it already, unless it changed since
+  std::map<std::string, FileState>::iterator known = m_oScanned.find(name);
+  if (known != m_oScanned.end()) {
+    FileState oState;
+    const bool same = file_state(name, oState) && oState == known->second;
+
+    m_oScanned.erase(known);
+    if (same)
+      return;
+  }
+
+  on_file(name, items);
+}
+
+void FolderWatcher::on_file(const std::string &name, std::vector<RawWorkItem *> &items)
+{
+  LandedFile oFile;
+  oFile.m_szName = name;
+  oFile.m_ulTime = now_msec();
+
+  std::list<LandedFile>::iterator it;
+
+  if (has_suffix(name, raw_suffix)) {
+    if (!FileFinder::get_metadata_suffix(name, oFile.m_szSuffix)) {
+      items.push_back(new RawWorkItem(m_szDir + name, std::string()));
+      return;
+    }
+
+    for (it = m_oJpgs.begin(); it != m_oJpgs.end(); ++it) {
+      if (has_suffix(it->m_szName, oFile.m_szSuffix)) {
+        items.push_back(new RawWorkItem(m_szDir + name, m_szDir + it->m_szName));
+        m_oJpgs.erase(it);
+        return;
+      }
+    }
+
+    m_oRaws.push_back(oFile);
+  } else if (has_suffix(name, jpeg_suffix)) {
+    for (it = m_oRaws.begin(); it != m_oRaws.end(); ++it) {
+      if (has_suffix(name, it->m_szSuffix)) {
+        items.push_back(new RawWorkItem(m_szDir + it->m_szName, m_szDir + name));
+        m_oRaws.erase(it);
+        return;
+      }
+    }
+
+    m_oJpgs.push_back(oFile);
+  }
+}
+
+void FolderWatcher::expire(std::vector<RawWorkItem *> &items)
+{
+  const unsigned long long now = now_msec();
+
+  // Files of the scan no event came for land once they stayed the same for the grace period
+  std::list<SettlingFile>::iterator settling = m_oSettling.begin();
+  while (settling != m_oSettling.end()) {
+    if (now - settling->m_ulTime < m_ulGraceMs) {
+      ++settling;
+      continue;
+    }
+
+    FileState oState;
+    if (!file_state(settling->m_szName, oState)) {
+      settling = m_oSettling.erase(settling);
+    } else if (oState == settling->m_oState) {
+      on_file(settling->m_szName, items);
+      settling = m_oSettling.erase(settling);
+    } else {
+      settling->m_oState = oState;
+      settling->m_ulTime = now;
+      ++settling;
+    }
+  }
+
+  // Lists are in landing order, so the oldest entries are up front
+  while (!m_oRaws.empty() && now - m_oRaws.front().m_ulTime >= m_ulGraceMs) {
+    items.push_back(new RawWorkItem(m_szDir + m_oRaws.front().m_szName, std::string()));
+    m_oRaws.pop_front();
+  }
+
+  // A JPG nobody claimed in time is a plain photo
+  while (!m_oJpgs.empty() && now - m_oJpgs.front().m_ulTime >= m_ulGraceMs)
+    m_oJpgs.pop_front();
+}
+
+int FolderWatcher::poll(unsigned int timeout_ms, std::vector<RawWorkItem *> &items)
+#ifdef __linux__
+{
+  struct pollfd pfd;
+  pfd.fd = m_fd;
+  pfd.events = POLLIN;
+
+  // Do not sleep past the moment the oldest unpaired RAW has to go
+  if (!m_oRaws.empty()) {
+    unsigned long long waited = now_msec() - m_oRaws.front().m_ulTime;
+    unsigned long long left = waited < m_ulGraceMs ? m_ulGraceMs - waited : 0;
+    if (left < timeout_ms)
+      timeout_ms = (unsigned int)left;
+  }
+
+  int ret = ::poll(&pfd, 1, (int)timeout_ms);
+  if (ret < 0) {
+    if (errno == EINTR)
+      return 0;
+    perror("poll");
+    return errno;
+  }
+
+  if (ret > 0) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t len = read(m_fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        return 0;
+      perror("read");
+      return errno;
+    }
+
+    const struct inotify_event *event;
+    for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)ptr;
+
+      if (event->mask & IN_Q_OVERFLOW)
+        fprintf(stderr, "%s: Too many files landed at once, some were missed\n", m_szDir.c_str());
+
+      if (event->len && !(event->mask & IN_ISDIR))
+        on_event(event->name, items);
+    }
+  }
+
+  expire(items);
+
+  return 0;
+}
+#else
+{
+  return -1;
+}
+#endif
@@ -0,0 +1,80 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __FOLDER_WATCHER_H__
+#define __FOLDER_WATCHER_H__
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "FileFinder.h"
+
+// Watches a spool directory (inotify, Linux only) and turns files that finished landing into work items.
+// A RAW is paired with its JPG when both have been written. If the JPG does not show up within the
+// grace period the RAW is converted on its own.
+class FolderWatcher
+{
+  public:
+  FolderWatcher(const std::string &dir, unsigned int grace_ms);
+  ~FolderWatcher();
+
+  // Start watching, before the files already in the directory are read so none landing meanwhile is missed
+  int start(void);
+
+  // Work items found in the directory after start(). Those whose files were modified within the grace
+  // period may still be landing: they are taken out of items and converted once closed, or once they
+  // stop changing. The events of the others are not taken for new files unless they changed since.
+  void scanned(std::vector<RawWorkItem *> &items);
+
+  // Wait up to timeout_ms for files to land. Appends the work items that are ready (caller owns them).
+  int poll(unsigned int timeout_ms, std::vector<RawWorkItem *> &items);
+
+  protected:
+  struct LandedFile {
+    std::string m_szName;
+    std::string m_szSuffix; // For RAW: suffix of the expected JPG
+    unsigned long long m_ulTime;
+  };
+
+  // Size and modification time, to tell whether a file changed
+  struct FileState {
+    FileState() : m_ulSize(0), m_lMtime(0)
+    {
+    }
+
+    bool operator==(const FileState &other) const
+    {
+      return m_ulSize == other.m_ulSize && m_lMtime == other.m_lMtime;
+    }
+
+    unsigned long long m_ulSize;
+    long long m_lMtime;
+  };
+
+  // A file found by the scan that may still be landing
+  struct SettlingFile {
+    std::string m_szName;
+    FileState m_oState;
+    unsigned long long m_ulTime; // When m_oState was taken
+  };
+
+  bool file_state(const std::string &name, FileState &state) const;
+  void settle(const std::string &name);
+
+  void on_event(const std::string &name, std::vector<RawWorkItem *> &items);
+  void on_file(const std::string &name, std::vector<RawWorkItem *> &items);
+  void expire(std::vector<RawWorkItem *> &items);
+
+  std::string m_szDir;
+  const unsigned long long m_ulGraceMs;
+  int m_fd;
+
+  std::list<LandedFile> m_oRaws; // Waiting for their JPG
+  std::list<LandedFile> m_oJpgs; // Not claimed by a RAW yet
+
+  std::list<SettlingFile> m_oSettling; // Found by the scan, waiting to be closed or to stop changing
+  std::map<std::string, FileState> m_oScanned; // Found by the scan and converted from it
+};
+
+#endif // __FOLDER_WATCHER_H__
@@ -0,0 +1,96 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "CFAReader.h"
+#include "DNGConverter.h"
+#include "FrameAccumulator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_FRAME_ACCUMULATOR_SSE2 1
+#include <emmintrin.h>
+#endif
+
+FrameAccumulator::FrameAccumulator() : m_poProfile(NULL), m_ulFrames(0)
+{
+}
+
+void FrameAccumulator::AddRow(uint32 *sums, const uint16 *row, uint32 count)
+{
+  uint32 i = 0;
+
+#ifdef HAVE_FRAME_ACCUMULATOR_SSE2
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 8 <= count; i += 8) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+
+    __m128i *dst = (__m128i *)(sums + i);
+    _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), _mm_unpacklo_epi16(v, zero)));
+    _mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1), _mm_unpackhi_epi16(v, zero)));
+  }
+#endif
+
+  for (; i < count; ++i)
+    sums[i] += row[i];
+}
+
+int FrameAccumulator::AddFrame(const std::string &szRawFile)
+{
+  struct stat sb;
+  if (stat(szRawFile.c_str(), &sb)) {
+    perror(szRawFile.c_str());
+    return -1;
+  }
+
+  const CameraProfile *poProfile = NULL;
+  for (size_t i = 0; i < DNGConverter::GetCameraProfileCount(); ++i) {
+    if (DNGConverter::GetCameraProfile(i).m_ulFileSize == (size_t)sb.st_size) {
+      poProfile = &DNGConverter::GetCameraProfile(i);
+      break;
+    }
+  }
+
+  if (!poProfile) {
+    fprintf(stderr, "%s: Unsupported format\n", szRawFile.c_str());
+    return -1;
+  }
+
+  if (m_poProfile && m_poProfile != poProfile) {
+    fprintf(stderr, "%s: Frame of a different camera or resolution than the ones before\n", szRawFile.c_str());
+    return -1;
+  }
+
+  if (m_ulFrames == 65535) {
+    fprintf(stderr, "%s: Too many frames\n", szRawFile.c_str());
+    return -1;
+  }
+
+  CFAReader reader;
+  if (reader.open(szRawFile.c_str(), poProfile->m_ulFileSize)) {
+    fprintf(stderr, "%s: Unable to read\n", szRawFile.c_str());
+    return -1;
+  }
+
+  const uint32 w = poProfile->m_ulWidth;
+  const uint32 h = poProfile->m_ulHeight;
+
+  if (!m_poProfile) {
+    m_poProfile = poProfile;
+    m_oSums.assign((size_t)w * h, 0);
+  }
+
+  std::vector<uint16> row(w);
+
+  for (uint32 y = 0; y < h; ++y) {
+    reader.read_area((uint8_t *)&row[0], w, poProfile->m_ulStride, y, 0, 1, w);
+    AddRow(&m_oSums[(size_t)y * w], &row[0], w);
+  }
+
+  ++m_ulFrames;
+
+  return 0;
+}
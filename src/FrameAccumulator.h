@@ -0,0 +1,49 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __FRAME_ACCUMULATOR_H__
+#define __FRAME_ACCUMULATOR_H__
+
+#include <string>
+#include <vector>
+
+#include "CameraProfile.h"
+
+// Per pixel sums of RAW frames of one camera, in readout orientation. Frames are unpacked a row at a
+// time and added to the sums as they stream by, so only the sums stay in memory whatever the count.
+class FrameAccumulator
+{
+  public:
+  FrameAccumulator();
+
+  // Add the RAW file to the sums, -1 if it cannot be read or its size differs from the frames before.
+  // Sums of up to 65535 frames fit.
+  int AddFrame(const std::string &szRawFile);
+
+  // Camera of the frames, NULL before the first one
+  const CameraProfile *GetProfile() const
+  {
+    return m_poProfile;
+  }
+
+  size_t GetFrameCount() const
+  {
+    return m_ulFrames;
+  }
+
+  // m_ulWidth * m_ulHeight of the profile, row by row
+  const std::vector<uint32> &GetSums() const
+  {
+    return m_oSums;
+  }
+
+  // sums[i] += row[i]
+  static void AddRow(uint32 *sums, const uint16 *row, uint32 count);
+
+  protected:
+  const CameraProfile *m_poProfile;
+  size_t m_ulFrames;
+
+  std::vector<uint32> m_oSums;
+};
+
+#endif // __FRAME_ACCUMULATOR_H__
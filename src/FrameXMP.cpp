@@ -0,0 +1,112 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+
+#include <dng_string.h>
+#include <dng_xmp_sdk.h>
+
+#include "FrameXMP.h"
+
+FrameXMP::FrameXMP(const dng_xmp &oTemplate) : dng_xmp(oTemplate), m_bTemplateSynced(true)
+{
+}
+
+void FrameXMP::SyncExif(dng_exif &exif, const dng_exif *originalExif, bool doingUpdateFromXMP, bool removeFromXMP)
+{
+  if (!m_bTemplateSynced || originalExif || doingUpdateFromXMP || removeFromXMP) {
+    dng_xmp::SyncExif(exif, originalExif, doingUpdateFromXMP, removeFromXMP);
+    return;
+  }
+
+  // Anything set later is synced in full
+  m_bTemplateSynced = false;
+
+  SyncFrameExif(exif);
+}
+
+void FrameXMP::SyncFrameExif(dng_exif &exif)
+{
+  // Software: XMP is preferred by dng_xmp, the template's is a placeholder
+  if (exif.fSoftware.NotEmpty())
+    SetString(XMP_NS_XAP, "CreatorTool", exif.fSoftware);
+  else
+    Remove(XMP_NS_XAP, "CreatorTool");
+
+  // ExposureTime / ShutterSpeedValue, twice like dng_xmp
+  if (!exif.fExposureTime.IsValid())
+    Remove(XMP_NS_EXIF, "ExposureTime");
+  if (!exif.fShutterSpeedValue.IsValid())
+    Remove(XMP_NS_EXIF, "ShutterSpeedValue");
+
+  for (uint32 pass = 0; pass < 2; pass++) {
+    dng_urational et = exif.fExposureTime;
+    Sync_urational(XMP_NS_EXIF, "ExposureTime", et, preferNonXMP);
+    if (et.IsValid())
+      exif.SetExposureTime(et.As_real64(), false);
+
+    dng_srational ss = exif.fShutterSpeedValue;
+    Sync_srational(XMP_NS_EXIF, "ShutterSpeedValue", ss, preferNonXMP);
+    if (ss.IsValid())
+      exif.SetShutterSpeedValue(ss.As_real64());
+  }
+
+  // ISO speed ratings, up to the first zero. 65535 (a higher rating in XMP) only comes from XMP.
+  uint32 isoCount = 0;
+  while (isoCount < 3 && exif.fISOSpeedRatings[isoCount] && exif.fISOSpeedRatings[isoCount] != 65535)
+    ++isoCount;
+  if (isoCount < 3 && exif.fISOSpeedRatings[isoCount] == 65535)
+    isoCount = 0;
+
+  if (isoCount == 0)
+    Remove(XMP_NS_EXIF, "ISOSpeedRatings");
+  else
+    Sync_uint32_array(XMP_NS_EXIF, "ISOSpeedRatings", exif.fISOSpeedRatings, isoCount, 3, preferNonXMP);
+
+  if (!exif.fExposureBiasValue.IsValid())
+    Remove(XMP_NS_EXIF, "ExposureBiasValue");
+  Sync_srational(XMP_NS_EXIF, "ExposureBiasValue", exif.fExposureBiasValue, preferNonXMP);
+
+  if (!exif.fFocalLength.IsValid())
+    Remove(XMP_NS_EXIF, "FocalLength");
+  Sync_urational(XMP_NS_EXIF, "FocalLength", exif.fFocalLength, preferNonXMP);
+
+  if (exif.fFocalLengthIn35mmFilm == 0)
+    Remove(XMP_NS_EXIF, "FocalLengthIn35mmFilm");
+  Sync_uint32(
+    XMP_NS_EXIF, "FocalLengthIn35mmFilm", exif.fFocalLengthIn35mmFilm, exif.fFocalLengthIn35mmFilm == 0, preferNonXMP);
+
+  // Lens info, of which the focal lengths are per frame
+  dng_string lensInfo;
+  if (exif.fLensInfo[0].IsValid()) {
+    char s[256];
+    sprintf(s, "%u/%u %u/%u %u/%u %u/%u", (unsigned)exif.fLensInfo[0].n, (unsigned)exif.fLensInfo[0].d,
+            (unsigned)exif.fLensInfo[1].n, (unsigned)exif.fLensInfo[1].d, (unsigned)exif.fLensInfo[2].n,
+            (unsigned)exif.fLensInfo[2].d, (unsigned)exif.fLensInfo[3].n, (unsigned)exif.fLensInfo[3].d);
+    lensInfo.Set(s);
+    SetString(XMP_NS_AUX, "LensInfo", lensInfo);
+  } else {
+    Remove(XMP_NS_AUX, "LensInfo");
+  }
+
+  // Dates: XMP is preferred by dng_xmp, the template's are placeholders. The round trip through
+  // the EXIF value adds the time zone like dng_xmp::UpdateExifDates() does.
+  if (exif.fDateTimeOriginal.IsValid()) {
+    dng_string s = exif.fDateTimeOriginal.Encode_ISO_8601();
+    exif.fDateTimeOriginal.Decode_ISO_8601(s.Get());
+    s = exif.fDateTimeOriginal.Encode_ISO_8601();
+    SetString(XMP_NS_EXIF, "DateTimeOriginal", s);
+    SetString(XMP_NS_PHOTOSHOP, "DateCreated", s);
+  } else {
+    Remove(XMP_NS_EXIF, "DateTimeOriginal");
+    Remove(XMP_NS_PHOTOSHOP, "DateCreated");
+  }
+
+  if (exif.fDateTimeDigitized.IsValid()) {
+    dng_string s = exif.fDateTimeDigitized.Encode_ISO_8601();
+    exif.fDateTimeDigitized.Decode_ISO_8601(s.Get());
+    s = exif.fDateTimeDigitized.Encode_ISO_8601();
+    SetString(XMP_NS_EXIF, "DateTimeDigitized", s);
+  } else {
+    Remove(XMP_NS_EXIF, "DateTimeDigitized");
+  }
+}
@@ -0,0 +1,30 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __FRAME_XMP_H__
+#define __FRAME_XMP_H__
+
+#include <dng_exif.h>
+#include <dng_xmp.h>
+
+// XMP of a negative copied from the per camera profile template, which dng_xmp::SyncExif() already ran on.
+// The first plain SyncExif() (the one of dng_negative::SynchronizeMetadata) only syncs the fields that
+// DNGConverter sets per frame; every other call, and copies, sync everything as dng_xmp does.
+class FrameXMP : public dng_xmp
+{
+  public:
+  explicit FrameXMP(const dng_xmp &oTemplate);
+
+  virtual void SyncExif(dng_exif &exif,
+                        const dng_exif *originalExif = NULL,
+                        bool doingUpdateFromXMP = false,
+                        bool removeFromXMP = false);
+
+  protected:
+  // The per frame fields, as dng_xmp::SyncExif() syncs them into an XMP that does not have them yet.
+  // The template holds placeholders in their place, so they keep their position in the packet.
+  void SyncFrameExif(dng_exif &exif);
+
+  bool m_bTemplateSynced;
+};
+
+#endif // __FRAME_XMP_H__
@@ -0,0 +1,111 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <dng_pixel_buffer.h>
+#include <dng_tag_types.h>
+#include <dng_utils.h>
+
+#include "ImageDigestTask.h"
+
+ImageDigestTask::ImageDigestTask(const dng_image &image)
+        : m_oImage(image), m_ulTilesAcross(0), m_ulTilesDown(0), m_ulTileBytes(0)
+{
+  fMinTaskArea = 1;
+
+  fUnitCell = dng_point(Min_int32(kDigestTileSize, m_oImage.Bounds().H()),
+                        Min_int32(kDigestTileSize, m_oImage.Bounds().W()));
+
+  fMaxTileSize = dng_point(fUnitCell.v, Min_int32(fUnitCell.h * MD5_LANES, m_oImage.Bounds().W()));
+}
+
+void ImageDigestTask::Start(uint32 threadCount,
+                            const dng_point &tileSize,
+                            dng_memory_allocator *allocator,
+                            dng_abort_sniffer * /* sniffer */)
+{
+  // The digest of other pixel types is not taken from the samples as they are
+  if (m_oImage.PixelType() != ttShort || tileSize.v != fUnitCell.v || tileSize.h % fUnitCell.h)
+    ThrowProgramError();
+
+  m_ulTilesAcross = (m_oImage.Bounds().W() + fUnitCell.h - 1) / fUnitCell.h;
+  m_ulTilesDown = (m_oImage.Bounds().H() + fUnitCell.v - 1) / fUnitCell.v;
+
+  m_oTileHash.Reset(new dng_fingerprint[m_ulTilesAcross * m_ulTilesDown]);
+
+  m_ulTileBytes = m_oImage.Planes() * TagTypeSize(ttShort) * fUnitCell.h * fUnitCell.v;
+
+  for (uint32 index = 0; index < threadCount; index++)
+    m_oBufferData[index].Reset(allocator->Allocate(m_ulTileBytes * (tileSize.h / fUnitCell.h)));
+}
+
+void ImageDigestTask::Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer * /* sniffer */)
+{
+  const dng_rect &bounds = m_oImage.Bounds();
+  const uint32 planes = m_oImage.Planes();
+
+  const uint8 *data[MD5_LANES];
+  uint32 bytes[MD5_LANES];
+  uint32 tileIndex[MD5_LANES];
+  uint32 count = 0;
+
+  for (int32 left = tile.l; left < tile.r; left += fUnitCell.h) {
+    dng_rect area(tile.t, left, tile.b, Min_int32(left + fUnitCell.h, tile.r));
+
+    uint32 pixels = area.W() * area.H();
+    uint8 *buf = m_oBufferData[threadIndex]->Buffer_uint8() + count * m_ulTileBytes;
+
+    dng_pixel_buffer buffer;
+
+    buffer.fArea = area;
+    buffer.fPlane = 0;
+    buffer.fPlanes = planes;
+    buffer.fRowStep = area.W();
+    buffer.fColStep = 1;
+    buffer.fPlaneStep = pixels;
+    buffer.fPixelType = ttShort;
+    buffer.fPixelSize = TagTypeSize(ttShort);
+    buffer.fData = buf;
+
+    m_oImage.Get(buffer);
+
+    // Hashed little endian whatever the host
+#if qDNGBigEndian
+    DoSwapBytes16((uint16 *)buf, planes * pixels);
+#endif
+
+    data[count] = buf;
+    bytes[count] = planes * pixels * TagTypeSize(ttShort);
+    tileIndex[count] = ((area.t - bounds.t) / fUnitCell.v) * m_ulTilesAcross + (area.l - bounds.l) / fUnitCell.h;
+    ++count;
+  }
+
+  bool sameSize = (count == MD5_LANES);
+  for (uint32 i = 1; sameSize && i < count; ++i)
+    sameSize = (bytes[i] == bytes[0]);
+
+  if (sameSize) {
+    dng_fingerprint result[MD5_LANES];
+
+    md5_x4(data, bytes[0], result);
+
+    for (uint32 i = 0; i < count; ++i)
+      m_oTileHash[tileIndex[i]] = result[i];
+  } else {
+    for (uint32 i = 0; i < count; ++i) {
+      dng_md5_printer printer;
+
+      printer.Process(data[i], bytes[i]);
+
+      m_oTileHash[tileIndex[i]] = printer.Result();
+    }
+  }
+}
+
+dng_fingerprint ImageDigestTask::Result()
+{
+  dng_md5_printer printer;
+
+  for (uint32 tileIndex = 0; tileIndex < m_ulTilesAcross * m_ulTilesDown; tileIndex++)
+    printer.Process(m_oTileHash[tileIndex].data, 16);
+
+  return printer.Result();
+}
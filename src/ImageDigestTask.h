@@ -0,0 +1,45 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __IMAGE_DIGEST_TASK_H__
+#define __IMAGE_DIGEST_TASK_H__
+
+#include <dng_area_task.h>
+#include <dng_auto_ptr.h>
+#include <dng_fingerprint.h>
+#include <dng_image.h>
+#include <dng_memory.h>
+#include <dng_sdk_limits.h>
+
+#include "FastMD5.h"
+
+// NewRawImageDigest of a 16-bit image read back from a DNG, equal to dng_negative::FindNewRawImageDigest()
+// but hashing MD5_LANES of its 256x256 tiles side by side like CFAUnpackTask.
+class ImageDigestTask : public dng_area_task
+{
+  public:
+  explicit ImageDigestTask(const dng_image &image);
+
+  virtual void Start(uint32 threadCount,
+                     const dng_point &tileSize,
+                     dng_memory_allocator *allocator,
+                     dng_abort_sniffer *sniffer);
+
+  virtual void Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer *sniffer);
+
+  dng_fingerprint Result();
+
+  protected:
+  enum { kDigestTileSize = 256 };
+
+  const dng_image &m_oImage;
+
+  uint32 m_ulTilesAcross;
+  uint32 m_ulTilesDown;
+  uint32 m_ulTileBytes;
+
+  AutoArray<dng_fingerprint> m_oTileHash;
+
+  AutoPtr<dng_memory_block> m_oBufferData[kMaxMPThreads];
+};
+
+#endif // __IMAGE_DIGEST_TASK_H__
@@ -0,0 +1,145 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+
+#include "Journal.h"
+#include "utils.h"
+
+static const char journal_header[] = "sjcam_raw2dng journal 1";
+
+Journal::Journal(const std::string &szPath, const std::string &szConfig)
+        : m_szPath(szPath), m_szConfig(szConfig), m_fp(NULL), m_oMutex("Journal"), m_bCutShort(false)
+{
+}
+
+Journal::~Journal()
+{
+  if (m_fp)
+    fclose(m_fp);
+
+  std::vector<RawWorkItem *>::const_iterator it;
+  for (it = m_oItems.begin(); it != m_oItems.end(); ++it)
+    delete *it;
+}
+
+int Journal::load(void)
+{
+  FILE *fp = fopen(m_szPath.c_str(), "r");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  std::string line;
+  std::vector<std::string> fields;
+  bool header = true;
+  int ret = 0;
+  int c;
+
+  while ((c = fgetc(fp)) != EOF) {
+    if (c != '\n') {
+      line += (char)c;
+      continue;
+    }
+
+    // Only lines with their newline count, the last one may have been cut short by a crash
+    split_string(line, '\t', fields);
+    line.clear();
+
+    if (header) {
+      if (fields.size() != 2 || fields[0] != journal_header) {
+        fprintf(stderr, "%s: Not a conversion journal\n", m_szPath.c_str());
+        ret = -1;
+        break;
+      }
+
+      if (fields[1] != m_szConfig) {
+        fprintf(stderr, "%s: Journal was written with different options (%s)\n", m_szPath.c_str(), fields[1].c_str());
+        ret = -1;
+        break;
+      }
+
+      header = false;
+    } else if (fields.size() == 3 && fields[0] == "item") {
+      if (m_oKnown.insert(fields[1]).second)
+        m_oItems.push_back(new RawWorkItem(fields[1], fields[2]));
+    } else if (fields.size() == 2 && fields[0] == "done") {
+      m_oDone.insert(fields[1]);
+    }
+  }
+
+  m_bCutShort = !line.empty();
+
+  if (header && ret == 0) {
+    fprintf(stderr, "%s: Empty journal\n", m_szPath.c_str());
+    ret = -1;
+  }
+
+  fclose(fp);
+
+  return ret;
+}
+
+int Journal::open(const std::vector<RawWorkItem *> &oItems)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  bool is_new = m_oKnown.empty() && m_oDone.empty();
+
+  m_fp = fopen(m_szPath.c_str(), is_new ? "w" : "a");
+  if (!m_fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  if (is_new)
+    fprintf(m_fp, "%s\t%s\n", journal_header, m_szConfig.c_str());
+  else if (m_bCutShort)
+    fputc('\n', m_fp);
+
+  std::vector<RawWorkItem *>::const_iterator it;
+  for (it = oItems.begin(); it != oItems.end(); ++it)
+    write_item(**it);
+
+  if (fflush(m_fp)) {
+    perror("fflush");
+    return -1;
+  }
+
+  return 0;
+}
+
+void Journal::write_item(const RawWorkItem &oItem)
+{
+  if (m_oKnown.insert(oItem.m_szRawFile).second)
+    fprintf(m_fp, "item\t%s\t%s\n", oItem.m_szRawFile.c_str(), oItem.m_szMetadataFile.c_str());
+}
+
+void Journal::add_item(const RawWorkItem &oItem)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  if (m_fp) {
+    write_item(oItem);
+    fflush(m_fp);
+  }
+}
+
+bool Journal::is_done(const std::string &szRawFile)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  return m_oDone.find(szRawFile) != m_oDone.end();
+}
+
+void Journal::mark_done(const std::string &szRawFile)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  m_oDone.insert(szRawFile);
+
+  if (m_fp) {
+    fprintf(m_fp, "done\t%s\n", szRawFile.c_str());
+    fflush(m_fp);
+  }
+}
@@ -0,0 +1,59 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdio.h>
+
+#include <string>
+#include <set>
+#include <vector>
+
+#include <dng_mutex.h>
+
+#include "FileFinder.h"
+
+// Append-only record of a batch: the work items it was started with and every item that completed.
+// Each record is flushed as soon as it is written, so the journal survives the process being killed
+// and a later run can pick up the unfinished items.
+class Journal
+{
+  public:
+  Journal(const std::string &szPath, const std::string &szConfig);
+  ~Journal();
+
+  // Read an existing journal (for resume). Fails if it was written with other options.
+  int load(void);
+
+  // Open for appending and record the work items not recorded yet
+  int open(const std::vector<RawWorkItem *> &oItems);
+
+  // Record a work item that became known after open()
+  void add_item(const RawWorkItem &oItem);
+
+  bool is_done(const std::string &szRawFile);
+
+  void mark_done(const std::string &szRawFile);
+
+  // Work items recorded by the journal, in the original order
+  const std::vector<RawWorkItem *> &get_items(void) const
+  {
+    return m_oItems;
+  }
+
+  protected:
+  void write_item(const RawWorkItem &oItem);
+
+  const std::string m_szPath;
+  const std::string m_szConfig;
+
+  FILE *m_fp;
+  dng_mutex m_oMutex;
+  bool m_bCutShort; // The loaded journal ends without a newline, its last line is ended before appending
+
+  std::vector<RawWorkItem *> m_oItems;
+  std::set<std::string> m_oKnown;
+  std::set<std::string> m_oDone;
+};
+
+#endif // __JOURNAL_H__
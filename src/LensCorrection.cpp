@@ -0,0 +1,447 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <math.h>
+
+#include <dng_host.h>
+#include <dng_image.h>
+#include <dng_negative.h>
+#include <dng_rect.h>
+#include <dng_simple_image.h>
+#include <dng_tag_types.h>
+#include <dng_utils.h>
+
+#include "LensCorrection.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_LENS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Gain 1 + k0 r^2 + k1 r^4 + ... + k4 r^10 of each pixel of a row, r^2 = (h0 + i * step)^2 + dy2
+static void vignette_gains(real32 *gains, uint32 count, real32 h0, real32 step, real32 dy2, const real32 *k)
+{
+  uint32 i = 0;
+
+#ifdef HAVE_LENS_SSE2
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 k0 = _mm_set1_ps(k[0]);
+  const __m128 k1 = _mm_set1_ps(k[1]);
+  const __m128 k2 = _mm_set1_ps(k[2]);
+  const __m128 k3 = _mm_set1_ps(k[3]);
+  const __m128 k4 = _mm_set1_ps(k[4]);
+  const __m128 vh0 = _mm_set1_ps(h0);
+  const __m128 vstep = _mm_set1_ps(step);
+  const __m128 vdy2 = _mm_set1_ps(dy2);
+  const __m128i four = _mm_set1_epi32(4);
+
+  __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+  for (; i + 4 <= count; i += 4) {
+    const __m128 dx = _mm_add_ps(vh0, _mm_mul_ps(_mm_cvtepi32_ps(index), vstep));
+    const __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), vdy2);
+
+    __m128 g = _mm_add_ps(k3, _mm_mul_ps(r2, k4));
+    g = _mm_add_ps(k2, _mm_mul_ps(r2, g));
+    g = _mm_add_ps(k1, _mm_mul_ps(r2, g));
+    g = _mm_add_ps(k0, _mm_mul_ps(r2, g));
+    g = _mm_add_ps(one, _mm_mul_ps(r2, g));
+
+    _mm_storeu_ps(gains + i, g);
+    index = _mm_add_epi32(index, four);
+  }
+#endif
+
+  for (; i < count; ++i) {
+    const real32 dx = h0 + (real32)i * step;
+    const real32 r2 = dx * dx + dy2;
+
+    gains[i] = 1.0f + r2 * (k[0] + r2 * (k[1] + r2 * (k[2] + r2 * (k[3] + r2 * k[4]))));
+  }
+}
+
+// Scale a row of 16-bit samples by gains, rounded and clipped
+static void scale_row16(uint16 *p, int32 colStep, const real32 *gains, uint32 count)
+{
+  uint32 i = 0;
+
+#ifdef HAVE_LENS_SSE2
+  if (colStep == 1) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 lower = _mm_setzero_ps();
+    const __m128 upper = _mm_set1_ps(65535.0f);
+
+    for (; i + 8 <= count; i += 8) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+      __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+      __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+
+      lo = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(gains + i)), half), lower), upper);
+      hi = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(hi, _mm_loadu_ps(gains + i + 4)), half), lower), upper);
+
+      // There is no unsigned 32 to 16-bit pack before SSE4.1, so pack around the signed one
+      const __m128i ilo = _mm_sub_epi32(_mm_cvttps_epi32(lo), bias);
+      const __m128i ihi = _mm_sub_epi32(_mm_cvttps_epi32(hi), bias);
+
+      _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(_mm_packs_epi32(ilo, ihi), flip));
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    uint16 &sample = p[(int32)i * colStep];
+    const real32 v = (real32)sample * gains[i] + 0.5f;
+
+    sample = v >= 65535.0f ? (uint16)65535 : v <= 0.0f ? (uint16)0 : (uint16)v;
+  }
+}
+
+FastFixVignetteRadial::FastFixVignetteRadial(const dng_vignette_radial_params &params, uint32 flags)
+        : dng_opcode_FixVignetteRadial(params, flags), m_bFast(false), m_fCenterH(0), m_fCenterV(0), m_fScaleH(0),
+          m_fScaleV(0)
+{
+  for (uint32 i = 0; i < dng_vignette_radial_params::kNumTerms; ++i)
+    m_fTerms[i] = 0;
+}
+
+uint32 FastFixVignetteRadial::BufferPixelType(uint32 imagePixelType)
+{
+  return imagePixelType == ttShort ? ttShort : dng_opcode_FixVignetteRadial::BufferPixelType(imagePixelType);
+}
+
+void FastFixVignetteRadial::Prepare(dng_negative &negative,
+                                    uint32 threadCount,
+                                    const dng_point &tileSize,
+                                    const dng_rect &imageBounds,
+                                    uint32 imagePlanes,
+                                    uint32 bufferPixelType,
+                                    dng_memory_allocator &allocator)
+{
+  m_bFast = bufferPixelType == ttShort;
+
+  if (!m_bFast) {
+    dng_opcode_FixVignetteRadial::Prepare(
+      negative, threadCount, tileSize, imageBounds, imagePlanes, bufferPixelType, allocator);
+    return;
+  }
+
+  if (imagePlanes < 1 || imagePlanes > kMaxColorPlanes)
+    ThrowProgramError();
+
+  fImagePlanes = imagePlanes;
+
+  // Same geometry as the SDK: distances normalized to the farthest corner, measured to pixel centers
+  const dng_rect_real64 bounds(imageBounds);
+
+  const real64 centerH = Lerp_real64(bounds.l, bounds.r, fParams.fCenter.h);
+  const real64 centerV = Lerp_real64(bounds.t, bounds.b, fParams.fCenter.v);
+
+  const real64 pixelScaleV = 1.0 / negative.PixelAspectRatio();
+
+  const real64 maxRadius =
+    hypot(Max_real64(Abs_real64(centerV - bounds.t), Abs_real64(centerV - bounds.b)) * pixelScaleV,
+          Max_real64(Abs_real64(centerH - bounds.l), Abs_real64(centerH - bounds.r)));
+
+  m_fCenterH = (real32)(centerH - 0.5);
+  m_fCenterV = (real32)(centerV - 0.5);
+  m_fScaleH = (real32)(1.0 / maxRadius);
+  m_fScaleV = (real32)(pixelScaleV / maxRadius);
+
+  for (uint32 i = 0; i < dng_vignette_radial_params::kNumTerms; ++i)
+    m_fTerms[i] = (real32)fParams.fParams[i];
+
+  for (uint32 i = 0; i < threadCount; ++i)
+    m_oGains[i].Reset(allocator.Allocate(tileSize.h * (uint32)sizeof(real32)));
+}
+
+void FastFixVignetteRadial::ProcessArea(dng_negative &negative,
+                                        uint32 threadIndex,
+                                        dng_pixel_buffer &buffer,
+                                        const dng_rect &dstArea,
+                                        const dng_rect &imageBounds)
+{
+  if (!m_bFast) {
+    dng_opcode_FixVignetteRadial::ProcessArea(negative, threadIndex, buffer, dstArea, imageBounds);
+    return;
+  }
+
+  const uint32 cols = dstArea.W();
+  real32 *gains = m_oGains[threadIndex]->Buffer_real32();
+
+  const real32 h0 = ((real32)dstArea.l - m_fCenterH) * m_fScaleH;
+
+  for (int32 row = dstArea.t; row < dstArea.b; ++row) {
+    const real32 dy = ((real32)row - m_fCenterV) * m_fScaleV;
+
+    // One gain per pixel serves all planes
+    vignette_gains(gains, cols, h0, m_fScaleH, dy * dy, m_fTerms);
+
+    for (uint32 plane = 0; plane < buffer.fPlanes; ++plane)
+      scale_row16(buffer.DirtyPixel_uint16(row, dstArea.l, plane), buffer.fColStep, gains, cols);
+  }
+}
+
+// Replace image by its warp through params, false if the SDK has to do it
+static bool apply_warp(dng_host &host,
+                       const dng_negative &negative,
+                       AutoPtr<dng_image> &image,
+                       const dng_warp_params &params,
+                       real64 kt0,
+                       real64 kt1)
+{
+  const dng_rect bounds = image->Bounds();
+
+  if (image->PixelType() != ttShort || negative.PixelAspectRatio() != 1.0 || params.fPlanes != 1 ||
+      bounds.W() < 2 || bounds.H() < 2)
+    return false;
+
+  dng_simple_image *src = dynamic_cast<dng_simple_image *>(image.Get());
+  if (!src)
+    return false;
+
+  AutoPtr<dng_image> dstImage(host.Make_dng_image(bounds, image->Planes(), image->PixelType()));
+
+  dng_simple_image *dst = dynamic_cast<dng_simple_image *>(dstImage.Get());
+  if (!dst)
+    return false;
+
+  dng_pixel_buffer srcBuffer;
+  dng_pixel_buffer dstBuffer;
+
+  src->GetPixelBuffer(srcBuffer);
+  dst->GetPixelBuffer(dstBuffer);
+
+  LensWarpTask task(params, kt0, kt1, srcBuffer, dstBuffer);
+  host.PerformAreaTask(task, bounds);
+
+  image.Reset(dstImage.Release());
+
+  return true;
+}
+
+FastWarpFisheye::FastWarpFisheye(const dng_warp_params_fisheye &params, uint32 flags)
+        : dng_opcode_WarpFisheye(params, flags)
+{
+}
+
+void FastWarpFisheye::Apply(dng_host &host, dng_negative &negative, AutoPtr<dng_image> &image)
+{
+  if (!apply_warp(host, negative, image, fWarpParams, 0.0, 0.0))
+    dng_opcode_WarpFisheye::Apply(host, negative, image);
+}
+
+FastWarpRectilinear::FastWarpRectilinear(const dng_warp_params_rectilinear &params, uint32 flags)
+        : dng_opcode_WarpRectilinear(params, flags)
+{
+}
+
+void FastWarpRectilinear::Apply(dng_host &host, dng_negative &negative, AutoPtr<dng_image> &image)
+{
+  if (!apply_warp(host, negative, image, fWarpParams, fWarpParams.fTanParams[0][0], fWarpParams.fTanParams[0][1]))
+    dng_opcode_WarpRectilinear::Apply(host, negative, image);
+}
+
+// Normalized offset dx of each destination pixel of a row from the center and its r^2
+static void warp_radii(real32 *dx, real32 *r2, uint32 count, real32 h0, real32 step, real32 dy2)
+{
+  uint32 i = 0;
+
+#ifdef HAVE_LENS_SSE2
+  const __m128 vh0 = _mm_set1_ps(h0);
+  const __m128 vstep = _mm_set1_ps(step);
+  const __m128 vdy2 = _mm_set1_ps(dy2);
+  const __m128i four = _mm_set1_epi32(4);
+
+  __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+  for (; i + 4 <= count; i += 4) {
+    const __m128 x = _mm_add_ps(vh0, _mm_mul_ps(_mm_cvtepi32_ps(index), vstep));
+
+    _mm_storeu_ps(dx + i, x);
+    _mm_storeu_ps(r2 + i, _mm_add_ps(_mm_mul_ps(x, x), vdy2));
+    index = _mm_add_epi32(index, four);
+  }
+#endif
+
+  for (; i < count; ++i) {
+    dx[i] = h0 + (real32)i * step;
+    r2[i] = dx[i] * dx[i] + dy2;
+  }
+}
+
+// Source pixel positions from the offsets and radial ratios (in xs), tangential terms included
+static void warp_coords(real32 *xs,
+                        real32 *ys,
+                        const real32 *dx,
+                        const real32 *r2,
+                        uint32 count,
+                        real32 dy,
+                        real32 centerH,
+                        real32 centerV,
+                        real32 radius,
+                        real32 kt0,
+                        real32 kt1)
+{
+  uint32 i = 0;
+
+#ifdef HAVE_LENS_SSE2
+  const __m128 vdy = _mm_set1_ps(dy);
+  const __m128 vch = _mm_set1_ps(centerH);
+  const __m128 vcv = _mm_set1_ps(centerV);
+  const __m128 vradius = _mm_set1_ps(radius);
+  const __m128 vkt0 = _mm_set1_ps(kt0);
+  const __m128 vkt1 = _mm_set1_ps(kt1);
+  const __m128 two = _mm_set1_ps(2.0f);
+  const __m128 dy2x2 = _mm_set1_ps(2.0f * dy * dy);
+
+  for (; i + 4 <= count; i += 4) {
+    const __m128 x = _mm_loadu_ps(dx + i);
+    const __m128 rr = _mm_loadu_ps(r2 + i);
+    const __m128 ratio = _mm_loadu_ps(xs + i);
+
+    // dxTan = 2 kt0 dx dy + kt1 (r^2 + 2 dx^2), dyTan = 2 kt1 dx dy + kt0 (r^2 + 2 dy^2)
+    const __m128 dxdy2 = _mm_mul_ps(two, _mm_mul_ps(x, vdy));
+    const __m128 tanH = _mm_add_ps(_mm_mul_ps(vkt0, dxdy2),
+                                   _mm_mul_ps(vkt1, _mm_add_ps(rr, _mm_mul_ps(two, _mm_mul_ps(x, x)))));
+    const __m128 tanV = _mm_add_ps(_mm_mul_ps(vkt1, dxdy2), _mm_mul_ps(vkt0, _mm_add_ps(rr, dy2x2)));
+
+    _mm_storeu_ps(xs + i, _mm_add_ps(vch, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(x, ratio), tanH), vradius)));
+    _mm_storeu_ps(ys + i, _mm_add_ps(vcv, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vdy, ratio), tanV), vradius)));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    const real32 x = dx[i];
+    const real32 ratio = xs[i];
+
+    const real32 tanH = 2.0f * kt0 * x * dy + kt1 * (r2[i] + 2.0f * x * x);
+    const real32 tanV = 2.0f * kt1 * x * dy + kt0 * (r2[i] + 2.0f * dy * dy);
+
+    xs[i] = centerH + (x * ratio + tanH) * radius;
+    ys[i] = centerV + (dy * ratio + tanV) * radius;
+  }
+}
+
+// Bilinear samples of all planes of src at the positions xs, ys, edges repeated outside of it
+static void resample_row16(const dng_pixel_buffer &src,
+                           uint16 *dst,
+                           int32 dstColStep,
+                           int32 dstPlaneStep,
+                           const real32 *xs,
+                           const real32 *ys,
+                           uint32 count)
+{
+  const dng_rect &area = src.fArea;
+  const uint16 *base = src.ConstPixel_uint16(area.t, area.l, 0);
+
+  const int32 rowStep = src.fRowStep;
+  const int32 colStep = src.fColStep;
+  const int32 planeStep = src.fPlaneStep;
+  const uint32 planes = src.fPlanes;
+
+  const real32 minH = (real32)area.l;
+  const real32 minV = (real32)area.t;
+  const real32 maxH = (real32)(area.r - 1);
+  const real32 maxV = (real32)(area.b - 1);
+
+  for (uint32 i = 0; i < count; ++i) {
+    const real32 x = xs[i] < minH ? minH : xs[i] > maxH ? maxH : xs[i];
+    const real32 y = ys[i] < minV ? minV : ys[i] > maxV ? maxV : ys[i];
+
+    // The last row and column interpolate towards themselves
+    const int32 x0 = Min_int32((int32)x, area.r - 2);
+    const int32 y0 = Min_int32((int32)y, area.b - 2);
+
+    const real32 fx = x - (real32)x0;
+    const real32 fy = y - (real32)y0;
+
+    const real32 w00 = (1.0f - fx) * (1.0f - fy);
+    const real32 w01 = fx * (1.0f - fy);
+    const real32 w10 = (1.0f - fx) * fy;
+    const real32 w11 = fx * fy;
+
+    const uint16 *p = base + (y0 - area.t) * rowStep + (x0 - area.l) * colStep;
+    uint16 *d = dst + (int32)i * dstColStep;
+
+    for (uint32 plane = 0; plane < planes; ++plane) {
+      const uint16 *s = p + (int32)plane * planeStep;
+
+      const real32 v = w00 * s[0] + w01 * s[colStep] + w10 * s[rowStep] + w11 * s[rowStep + colStep];
+
+      d[(int32)plane * dstPlaneStep] = (uint16)(v + 0.5f);
+    }
+  }
+}
+
+LensWarpTask::LensWarpTask(const dng_warp_params &params,
+                           real64 kt0,
+                           real64 kt1,
+                           const dng_pixel_buffer &src,
+                           dng_pixel_buffer &dst)
+        : m_oSrc(src), m_oDst(dst), m_fCenterH(0), m_fCenterV(0), m_fRadius(1), m_fInvRadius(1), m_fTan0((real32)kt0),
+          m_fTan1((real32)kt1), m_oRatio(kRatioTableSize + 2), m_ulRowStride(0)
+{
+  const dng_rect_real64 bounds(src.fArea);
+
+  const dng_point_real64 center(Lerp_real64(bounds.t, bounds.b, params.fCenter.v),
+                                Lerp_real64(bounds.l, bounds.r, params.fCenter.h));
+
+  const real64 radius = MaxDistancePointToRect(center, bounds);
+
+  m_fCenterH = (real32)center.h;
+  m_fCenterV = (real32)center.v;
+  m_fRadius = (real32)radius;
+  m_fInvRadius = (real32)(1.0 / radius);
+
+  // No pixel is farther than the corners (r^2 = 1), the last entry only pads the interpolation.
+  // The SDK's ratios at the very center are exact only in the limit, so start just off it.
+  for (uint32 i = 0; i < m_oRatio.size(); ++i)
+    m_oRatio[i] = (real32)params.EvaluateRatio(0, Max_real64((real64)i / kRatioTableSize, 1.0e-9));
+
+  fMaxTileSize = dng_point(64, Min_int32(1024, src.fArea.W()));
+}
+
+void LensWarpTask::Start(uint32 threadCount,
+                         const dng_point &tileSize,
+                         dng_memory_allocator *allocator,
+                         dng_abort_sniffer * /* sniffer */)
+{
+  m_ulRowStride = ((uint32)tileSize.h + 3) & ~3u;
+
+  for (uint32 i = 0; i < threadCount; ++i)
+    m_oRows[i].Reset(allocator->Allocate(4 * m_ulRowStride * (uint32)sizeof(real32)));
+}
+
+void LensWarpTask::Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer * /* sniffer */)
+{
+  real32 *dx = m_oRows[threadIndex]->Buffer_real32();
+  real32 *r2 = dx + m_ulRowStride;
+  real32 *xs = r2 + m_ulRowStride;
+  real32 *ys = xs + m_ulRowStride;
+
+  const uint32 cols = tile.W();
+  const real32 h0 = ((real32)tile.l - m_fCenterH) * m_fInvRadius;
+  const real32 *ratio = &m_oRatio[0];
+
+  for (int32 row = tile.t; row < tile.b; ++row) {
+    const real32 dy = ((real32)row - m_fCenterV) * m_fInvRadius;
+
+    warp_radii(dx, r2, cols, h0, m_fInvRadius, dy * dy);
+
+    // The radial function is tabulated over r^2, which takes the model's atan() and powers
+    // out of the per pixel work
+    for (uint32 i = 0; i < cols; ++i) {
+      const real32 t = Min_real32(r2[i], 1.0f) * kRatioTableSize;
+      const uint32 index = (uint32)t;
+
+      xs[i] = ratio[index] + (t - (real32)index) * (ratio[index + 1] - ratio[index]);
+    }
+
+    warp_coords(xs, ys, dx, r2, cols, dy, m_fCenterH, m_fCenterV, m_fRadius, m_fTan0, m_fTan1);
+
+    resample_row16(m_oSrc, m_oDst.DirtyPixel_uint16(row, tile.l, 0), m_oDst.fColStep, m_oDst.fPlaneStep, xs, ys, cols);
+  }
+}
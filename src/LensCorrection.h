@@ -0,0 +1,111 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __LENS_CORRECTION_H__
+#define __LENS_CORRECTION_H__
+
+#include <vector>
+
+#include <dng_area_task.h>
+#include <dng_auto_ptr.h>
+#include <dng_lens_correction.h>
+#include <dng_memory.h>
+#include <dng_pixel_buffer.h>
+#include <dng_sdk_limits.h>
+
+// Lens correction opcodes that are stored in a DNG exactly like the SDK's, but apply themselves
+// to the 16-bit stage 3 image (previews and TIFF) much faster: the vignette gain is computed in
+// SIMD lanes and applied in place instead of through float tile buffers, and the warps share one
+// bilinear resampling of all planes from a tabulated radial function instead of evaluating the
+// model and a bicubic kernel for every sample of every plane. Images they do not handle
+// (float pixels, non-square pixels, per-plane models) go through the SDK as before.
+
+class FastFixVignetteRadial : public dng_opcode_FixVignetteRadial
+{
+  public:
+  FastFixVignetteRadial(const dng_vignette_radial_params &params, uint32 flags);
+
+  virtual uint32 BufferPixelType(uint32 imagePixelType);
+
+  virtual void Prepare(dng_negative &negative,
+                       uint32 threadCount,
+                       const dng_point &tileSize,
+                       const dng_rect &imageBounds,
+                       uint32 imagePlanes,
+                       uint32 bufferPixelType,
+                       dng_memory_allocator &allocator);
+
+  virtual void ProcessArea(dng_negative &negative,
+                           uint32 threadIndex,
+                           dng_pixel_buffer &buffer,
+                           const dng_rect &dstArea,
+                           const dng_rect &imageBounds);
+
+  protected:
+  bool m_bFast;
+
+  // Optical center in pixels and the scale normalizing distances to the farthest corner
+  real32 m_fCenterH;
+  real32 m_fCenterV;
+  real32 m_fScaleH;
+  real32 m_fScaleV;
+  real32 m_fTerms[dng_vignette_radial_params::kNumTerms];
+
+  AutoPtr<dng_memory_block> m_oGains[kMaxMPThreads];
+};
+
+class FastWarpFisheye : public dng_opcode_WarpFisheye
+{
+  public:
+  FastWarpFisheye(const dng_warp_params_fisheye &params, uint32 flags);
+
+  virtual void Apply(dng_host &host, dng_negative &negative, AutoPtr<dng_image> &image);
+};
+
+class FastWarpRectilinear : public dng_opcode_WarpRectilinear
+{
+  public:
+  FastWarpRectilinear(const dng_warp_params_rectilinear &params, uint32 flags);
+
+  virtual void Apply(dng_host &host, dng_negative &negative, AutoPtr<dng_image> &image);
+};
+
+// Resamples the whole source into the destination through the radial (and tangential) warp of
+// the first plane's parameters, each tile computing its source coordinates one row at a time
+class LensWarpTask : public dng_area_task
+{
+  public:
+  LensWarpTask(const dng_warp_params &params,
+               real64 kt0,
+               real64 kt1,
+               const dng_pixel_buffer &src,
+               dng_pixel_buffer &dst);
+
+  virtual void Start(uint32 threadCount,
+                     const dng_point &tileSize,
+                     dng_memory_allocator *allocator,
+                     dng_abort_sniffer *sniffer);
+
+  virtual void Process(uint32 threadIndex, const dng_rect &tile, dng_abort_sniffer *sniffer);
+
+  protected:
+  // Intervals of the radial ratio table over the squared normalized radius [0, 1]
+  enum { kRatioTableSize = 2048 };
+
+  const dng_pixel_buffer &m_oSrc;
+  dng_pixel_buffer &m_oDst;
+
+  real32 m_fCenterH;
+  real32 m_fCenterV;
+  real32 m_fRadius;
+  real32 m_fInvRadius;
+  real32 m_fTan0;
+  real32 m_fTan1;
+
+  std::vector<real32> m_oRatio;
+
+  // dx, r^2, x and y of a tile row
+  AutoPtr<dng_memory_block> m_oRows[kMaxMPThreads];
+  uint32 m_ulRowStride;
+};
+
+#endif // __LENS_CORRECTION_H__
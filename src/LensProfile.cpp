@@ -0,0 +1,270 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include <dng_exceptions.h>
+#include <dng_host.h>
+#include <dng_lens_correction.h>
+#include <dng_string.h>
+#include <dng_xmp.h>
+#include <dng_xmp_sdk.h>
+
+#include "LensCorrection.h"
+#include "LensProfile.h"
+
+// Samples of the squared radius the vignette gain polynomial is fitted to
+#define VIGNETTE_FIT_SAMPLES 64
+
+LensProfile::LensProfile()
+        : m_eModel(modelNone), m_fFocalLengthX(0), m_fCenterX(0.5), m_fCenterY(0.5), m_bVignette(false)
+{
+  for (int i = 0; i < 3; ++i) {
+    m_fRadial[i] = 0;
+    m_fVignette[i] = 0;
+  }
+
+  m_fTangential[0] = 0;
+  m_fTangential[1] = 0;
+}
+
+static bool get_param(const dng_xmp &xmp, const std::string &model, const char *name, real64 &value)
+{
+  return xmp.Get_real64(XMP_NS_PHOTOSHOP, (model + "/stCamera:" + name).c_str(), value);
+}
+
+int LensProfile::Load(const std::string &szPath)
+{
+  FILE *fp = fopen(szPath.c_str(), "rb");
+  if (!fp) {
+    perror(szPath.c_str());
+    return -1;
+  }
+
+  std::vector<char> data;
+  char buffer[4096];
+  size_t n;
+
+  while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    data.insert(data.end(), buffer, buffer + n);
+
+  fclose(fp);
+
+  if (data.empty()) {
+    fprintf(stderr, "%s: Empty lens profile\n", szPath.c_str());
+    return -1;
+  }
+
+  try {
+    dng_host host;
+    dng_xmp xmp(host.Allocator());
+
+    xmp.Parse(host, &data[0], (uint32)data.size());
+
+    for (int i = 1; m_eModel == modelNone; ++i) {
+      char item[64];
+      snprintf(item, sizeof(item), "CameraProfiles[%d]", i);
+
+      if (!xmp.Exists(XMP_NS_PHOTOSHOP, item))
+        break;
+
+      const std::string profile(item);
+      std::string model;
+
+      if (xmp.Exists(XMP_NS_PHOTOSHOP, (profile + "/stCamera:FisheyeModel").c_str())) {
+        m_eModel = modelFisheye;
+        model = profile + "/stCamera:FisheyeModel";
+      } else if (xmp.Exists(XMP_NS_PHOTOSHOP, (profile + "/stCamera:PerspectiveModel").c_str())) {
+        m_eModel = modelPerspective;
+        model = profile + "/stCamera:PerspectiveModel";
+      } else {
+        continue;
+      }
+
+      dng_string name;
+      if (xmp.GetString(XMP_NS_PHOTOSHOP, (profile + "/stCamera:ProfileName").c_str(), name))
+        m_szName = name.Get();
+
+      if (!get_param(xmp, model, "FocalLengthX", m_fFocalLengthX) || m_fFocalLengthX <= 0) {
+        fprintf(stderr, "%s: Lens model without a focal length\n", szPath.c_str());
+        return -1;
+      }
+
+      get_param(xmp, model, "ImageXCenter", m_fCenterX);
+      get_param(xmp, model, "ImageYCenter", m_fCenterY);
+      get_param(xmp, model, "RadialDistortParam1", m_fRadial[0]);
+      get_param(xmp, model, "RadialDistortParam2", m_fRadial[1]);
+      get_param(xmp, model, "RadialDistortParam3", m_fRadial[2]);
+      get_param(xmp, model, "TangentialDistortParam1", m_fTangential[0]);
+      get_param(xmp, model, "TangentialDistortParam2", m_fTangential[1]);
+
+      // Its falloff is relative to the focal length of the model it belongs to
+      const std::string vignette(model + "/stCamera:VignetteModel");
+      m_bVignette = get_param(xmp, vignette, "VignetteModelParam1", m_fVignette[0]);
+      get_param(xmp, vignette, "VignetteModelParam2", m_fVignette[1]);
+      get_param(xmp, vignette, "VignetteModelParam3", m_fVignette[2]);
+    }
+  } catch (const dng_exception &e) {
+    fprintf(stderr, "%s: Unable to parse lens profile (%d)\n", szPath.c_str(), e.ErrorCode());
+    return -1;
+  }
+
+  if (m_eModel == modelNone) {
+    fprintf(stderr, "%s: No fisheye or perspective lens model found\n", szPath.c_str());
+    return -1;
+  }
+
+  if (m_szName.empty())
+    m_szName = szPath;
+
+  return 0;
+}
+
+void LensProfile::Scale(uint32 ulWidth, uint32 ulHeight, real64 &fFocal, real64 &fMaxDist) const
+{
+  const real64 dmax = (real64)(ulWidth > ulHeight ? ulWidth : ulHeight);
+
+  const real64 cx = m_fCenterX * dmax;
+  const real64 cy = m_fCenterY * dmax;
+
+  fFocal = m_fFocalLengthX * dmax;
+  fMaxDist = hypot(cx > ulWidth - cx ? cx : ulWidth - cx, cy > ulHeight - cy ? cy : ulHeight - cy);
+}
+
+// Optical center relative to the image, as the opcodes take it
+static dng_point_real64 relative_center(real64 fCenterX, real64 fCenterY, uint32 ulWidth, uint32 ulHeight)
+{
+  const real64 dmax = (real64)(ulWidth > ulHeight ? ulWidth : ulHeight);
+
+  return dng_point_real64(fCenterY * dmax / ulHeight, fCenterX * dmax / ulWidth);
+}
+
+dng_opcode *LensProfile::MakeWarpOpcode(uint32 ulWidth, uint32 ulHeight) const
+{
+  real64 f, maxDist;
+  Scale(ulWidth, ulHeight, f, maxDist);
+
+  const dng_point_real64 center(relative_center(m_fCenterX, m_fCenterY, ulWidth, ulHeight));
+
+  dng_vector radial(4);
+
+  if (m_eModel == modelFisheye) {
+    // LCP: r = f * t * (1 + k1 t^2 + k2 t^4), t the angle of the ray.
+    // DNG: the same with t = atan(r) of the corrected image, whose focal length is the corner distance.
+    radial[0] = f / maxDist;
+    radial[1] = radial[0] * m_fRadial[0];
+    radial[2] = radial[0] * m_fRadial[1];
+    radial[3] = 0;
+
+    dng_warp_params_fisheye params(1, &radial, center);
+    if (!params.IsValid())
+      return NULL;
+
+    return new FastWarpFisheye(params, dng_opcode::kFlag_None);
+  }
+
+  if (m_eModel == modelPerspective) {
+    // LCP radii are in focal lengths, DNG radii in corner distances
+    const real64 s = maxDist / f;
+
+    radial[0] = 1.0;
+    radial[1] = m_fRadial[0] * s * s;
+    radial[2] = m_fRadial[1] * s * s * s * s;
+    radial[3] = m_fRadial[2] * s * s * s * s * s * s;
+
+    dng_vector tangential(2);
+    tangential[0] = m_fTangential[0] * s;
+    tangential[1] = m_fTangential[1] * s;
+
+    dng_warp_params_rectilinear params(1, &radial, &tangential, center);
+    if (!params.IsValid())
+      return NULL;
+
+    return new FastWarpRectilinear(params, dng_opcode::kFlag_None);
+  }
+
+  return NULL;
+}
+
+// Solve the n x n system a x = b in place (Gaussian elimination with partial pivoting)
+static bool solve(std::vector<real64> &a, std::vector<real64> &b, uint32 n)
+{
+  for (uint32 col = 0; col < n; ++col) {
+    uint32 pivot = col;
+    for (uint32 row = col + 1; row < n; ++row) {
+      if (fabs(a[row * n + col]) > fabs(a[pivot * n + col]))
+        pivot = row;
+    }
+
+    if (fabs(a[pivot * n + col]) < 1e-300)
+      return false;
+
+    for (uint32 k = 0; k < n; ++k)
+      std::swap(a[col * n + k], a[pivot * n + k]);
+    std::swap(b[col], b[pivot]);
+
+    for (uint32 row = col + 1; row < n; ++row) {
+      const real64 factor = a[row * n + col] / a[col * n + col];
+
+      for (uint32 k = col; k < n; ++k)
+        a[row * n + k] -= factor * a[col * n + k];
+      b[row] -= factor * b[col];
+    }
+  }
+
+  for (uint32 col = n; col-- > 0;) {
+    for (uint32 k = col + 1; k < n; ++k)
+      b[col] -= a[col * n + k] * b[k];
+    b[col] /= a[col * n + col];
+  }
+
+  return true;
+}
+
+dng_opcode *LensProfile::MakeVignetteOpcode(uint32 ulWidth, uint32 ulHeight) const
+{
+  if (!m_bVignette)
+    return NULL;
+
+  real64 f, maxDist;
+  Scale(ulWidth, ulHeight, f, maxDist);
+
+  const real64 s2 = (maxDist / f) * (maxDist / f);
+  const uint32 terms = dng_vignette_radial_params::kNumTerms;
+
+  // The gain undoing the falloff is its reciprocal, which the opcode's polynomial in r^2
+  // (normalized to the corner distance) can only approximate: least squares fit
+  std::vector<real64> a(terms * terms, 0.0);
+  std::vector<real64> b(terms, 0.0);
+
+  for (uint32 i = 0; i <= VIGNETTE_FIT_SAMPLES; ++i) {
+    const real64 u = (real64)i / VIGNETTE_FIT_SAMPLES;
+    const real64 uf = u * s2;
+
+    const real64 falloff = 1.0 + uf * (m_fVignette[0] + uf * (m_fVignette[1] + uf * m_fVignette[2]));
+    if (falloff <= 0)
+      return NULL;
+
+    real64 powers[dng_vignette_radial_params::kNumTerms];
+    powers[0] = u;
+    for (uint32 j = 1; j < terms; ++j)
+      powers[j] = powers[j - 1] * u;
+
+    for (uint32 j = 0; j < terms; ++j) {
+      for (uint32 k = 0; k < terms; ++k)
+        a[j * terms + k] += powers[j] * powers[k];
+      b[j] += powers[j] * (1.0 / falloff - 1.0);
+    }
+  }
+
+  if (!solve(a, b, terms))
+    return NULL;
+
+  dng_vignette_radial_params params(b, relative_center(m_fCenterX, m_fCenterY, ulWidth, ulHeight));
+  if (!params.IsValid())
+    return NULL;
+
+  return new FastFixVignetteRadial(params, dng_opcode::kFlag_None);
+}
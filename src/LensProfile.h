@@ -0,0 +1,57 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __LENS_PROFILE_H__
+#define __LENS_PROFILE_H__
+
+#include <string>
+
+#include <dng_opcodes.h>
+
+// Lens model of an Adobe lens correction profile (LCP) such as lens_profiles/GP43520.lcp, turned
+// into the DNG opcodes correcting images of a given size. Action cameras have a single fixed lens,
+// so the first camera profile of the file with a geometric model is used.
+//
+// LCP models are normalized to the focal length and the larger image dimension, the DNG opcodes to
+// the distance from the optical center to the farthest corner; the conversion happens per image size.
+class LensProfile
+{
+  public:
+  LensProfile();
+
+  // Read szPath, -1 if it cannot be read or holds no usable model
+  int Load(const std::string &szPath);
+
+  const std::string &GetName() const
+  {
+    return m_szName;
+  }
+
+  bool HasVignette() const
+  {
+    return m_bVignette;
+  }
+
+  // Opcodes for an image of ulWidth x ulHeight (ownership passes to the caller), NULL without a model
+  dng_opcode *MakeWarpOpcode(uint32 ulWidth, uint32 ulHeight) const;
+  dng_opcode *MakeVignetteOpcode(uint32 ulWidth, uint32 ulHeight) const;
+
+  protected:
+  enum Model { modelNone, modelPerspective, modelFisheye };
+
+  // Focal length in pixels and the distance from the optical center to the farthest corner
+  void Scale(uint32 ulWidth, uint32 ulHeight, real64 &fFocal, real64 &fMaxDist) const;
+
+  std::string m_szName;
+
+  Model m_eModel;
+  real64 m_fFocalLengthX; // In units of the larger image dimension
+  real64 m_fCenterX;
+  real64 m_fCenterY;
+  real64 m_fRadial[3];
+  real64 m_fTangential[2];
+
+  bool m_bVignette;
+  real64 m_fVignette[3]; // Falloff 1 + a1 r^2 + a2 r^4 + a3 r^6, r in focal lengths
+};
+
+#endif // __LENS_PROFILE_H__
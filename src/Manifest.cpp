@@ -0,0 +1,301 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "FastMD5.h"
+#include "Manifest.h"
+#include "utils.h"
+
+static const char manifest_header[] = "sjcam_raw2dng manifest 2";
+
+// Absolute path of an existing file, or the name as given if it cannot be resolved
+static std::string absolute_path(const std::string &szFile)
+{
+  if (szFile.empty())
+    return szFile;
+
+#if defined(_WIN32) || defined(_WIN64)
+  char path[_MAX_PATH];
+  if (!_fullpath(path, szFile.c_str(), sizeof(path)))
+    return szFile;
+#else
+  char path[PATH_MAX];
+  if (!realpath(szFile.c_str(), path))
+    return szFile;
+#endif
+
+  return path;
+}
+
+static bool stat_file(const std::string &szFile, unsigned long long &ulSize, long long &lMTime)
+{
+  struct stat sb;
+
+  if (stat(szFile.c_str(), &sb))
+    return false;
+
+  ulSize = (unsigned long long)sb.st_size;
+  lMTime = (long long)sb.st_mtime;
+
+  return true;
+}
+
+// True if szFile still has content szOldHash, only hashed again (into szHash) if its mtime changed
+static bool same_content(const std::string &szFile,
+                         bool bMTimeChanged,
+                         const std::string &szOldHash,
+                         std::string &szHash)
+{
+  if (!bMTimeChanged) {
+    szHash = szOldHash;
+    return true;
+  }
+
+  return !szOldHash.empty() && md5_file(szFile, szHash) && szHash == szOldHash;
+}
+
+static void write_entry(FILE *fp, const std::string &szRawFile, const ManifestEntry &oEntry)
+{
+  fprintf(fp,
+          "%s\t%llu\t%lld\t%s\t%s\t%llu\t%lld\t%s\t%s\n",
+          szRawFile.c_str(),
+          oEntry.m_ulSize,
+          oEntry.m_lMTime,
+          oEntry.m_szHash.c_str(),
+          oEntry.m_szMetadataFile.c_str(),
+          oEntry.m_ulMetadataSize,
+          oEntry.m_lMetadataMTime,
+          oEntry.m_szMetadataHash.c_str(),
+          oEntry.m_szConfig.c_str());
+}
+
+Manifest::Manifest(const std::string &szPath, const std::string &szConfig, bool bHash)
+        : m_szPath(szPath), m_szConfig(szConfig), m_bHash(bHash), m_oMutex("Manifest"), m_ulSkipped(0),
+          m_bDirty(false), m_poFile(NULL)
+{
+}
+
+Manifest::~Manifest()
+{
+  if (m_poFile)
+    fclose(m_poFile);
+}
+
+int Manifest::load(void)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  FILE *fp = fopen(m_szPath.c_str(), "r");
+  if (!fp) {
+    // First run, nothing converted yet
+    return rewrite();
+  }
+
+  std::string line;
+  std::vector<std::string> fields;
+  bool header = true;
+  int c;
+
+  do {
+    c = fgetc(fp);
+    if (c != '\n' && c != EOF) {
+      line += (char)c;
+      continue;
+    }
+
+    if (header) {
+      if (line != manifest_header) {
+        fprintf(stderr, "%s: Unknown manifest format, starting a new one\n", m_szPath.c_str());
+        break;
+      }
+      header = false;
+    } else if (split_string(line, '\t', fields) == 9) {
+      // Later lines of an input are the updates of later runs
+      ManifestEntry &oEntry = m_oEntries[fields[0]];
+
+      oEntry.m_ulSize = strtoull(fields[1].c_str(), NULL, 10);
+      oEntry.m_lMTime = strtoll(fields[2].c_str(), NULL, 10);
+      oEntry.m_szHash = fields[3];
+      oEntry.m_szMetadataFile = fields[4];
+      oEntry.m_ulMetadataSize = strtoull(fields[5].c_str(), NULL, 10);
+      oEntry.m_lMetadataMTime = strtoll(fields[6].c_str(), NULL, 10);
+      oEntry.m_szMetadataHash = fields[7];
+      oEntry.m_szConfig = fields[8];
+    } else if (!line.empty()) {
+      // Also the last line of a run that was killed while appending it
+      fprintf(stderr, "%s: Skipping malformed manifest line\n", m_szPath.c_str());
+    }
+
+    line.clear();
+  } while (c != EOF);
+
+  fclose(fp);
+
+  return rewrite();
+}
+
+int Manifest::save(void)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  if (!m_bDirty)
+    return 0;
+
+  return rewrite();
+}
+
+int Manifest::rewrite(void)
+{
+  if (m_poFile) {
+    fclose(m_poFile);
+    m_poFile = NULL;
+  }
+
+  // Write aside and rename, so an interrupted run never leaves a truncated manifest behind
+  const std::string tmp_path = m_szPath + ".tmp";
+
+  FILE *fp = fopen(tmp_path.c_str(), "w");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  fprintf(fp, "%s\n", manifest_header);
+
+  std::map<std::string, ManifestEntry>::const_iterator it;
+  for (it = m_oEntries.begin(); it != m_oEntries.end(); ++it)
+    write_entry(fp, it->first, it->second);
+
+  if (fclose(fp)) {
+    perror("fclose");
+    remove(tmp_path.c_str());
+    return -1;
+  }
+
+#if defined(_WIN32) || defined(_WIN64)
+  // rename() does not replace an existing file on Windows
+  remove(m_szPath.c_str());
+#endif
+
+  if (rename(tmp_path.c_str(), m_szPath.c_str())) {
+    perror("rename");
+    return -1;
+  }
+
+  m_bDirty = false;
+
+  m_poFile = fopen(m_szPath.c_str(), "a");
+  if (!m_poFile) {
+    perror(m_szPath.c_str());
+    return -1;
+  }
+
+  return 0;
+}
+
+void Manifest::append(const std::string &szRawFile, const ManifestEntry &oEntry)
+{
+  m_bDirty = true;
+
+  if (!m_poFile)
+    return;
+
+  // Flushed at once, so a run that is killed keeps the files it finished
+  write_entry(m_poFile, szRawFile, oEntry);
+  if (fflush(m_poFile))
+    perror(m_szPath.c_str());
+}
+
+bool Manifest::stat_input(const std::string &szRawFile,
+                          const std::string &szMetadataFile,
+                          ManifestEntry &oEntry,
+                          bool bHash)
+{
+  if (!stat_file(szRawFile, oEntry.m_ulSize, oEntry.m_lMTime))
+    return false;
+
+  if (bHash && !md5_file(szRawFile, oEntry.m_szHash))
+    return false;
+
+  if (szMetadataFile.empty())
+    return true;
+
+  if (!stat_file(szMetadataFile, oEntry.m_ulMetadataSize, oEntry.m_lMetadataMTime))
+    return false;
+
+  if (bHash && !md5_file(szMetadataFile, oEntry.m_szMetadataHash))
+    return false;
+
+  return true;
+}
+
+bool Manifest::is_up_to_date(const std::string &szRawFile, const std::string &szMetadataFile)
+{
+  const std::string raw_path = absolute_path(szRawFile);
+  ManifestEntry oOld;
+
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    std::map<std::string, ManifestEntry>::const_iterator it = m_oEntries.find(raw_path);
+    if (it == m_oEntries.end())
+      return false;
+
+    oOld = it->second;
+  }
+
+  if (oOld.m_szConfig != m_szConfig || oOld.m_szMetadataFile != absolute_path(szMetadataFile))
+    return false;
+
+  ManifestEntry oCur;
+  if (!stat_input(szRawFile, szMetadataFile, oCur, false) || oCur.m_ulSize != oOld.m_ulSize ||
+      oCur.m_ulMetadataSize != oOld.m_ulMetadataSize)
+    return false;
+
+  const bool raw_touched = oCur.m_lMTime != oOld.m_lMTime;
+  const bool metadata_touched = oCur.m_lMetadataMTime != oOld.m_lMetadataMTime;
+
+  if (raw_touched || metadata_touched) {
+    // Copying a card again usually resets mtime, the content hash tells whether it really changed
+    if (!m_bHash || !same_content(szRawFile, raw_touched, oOld.m_szHash, oCur.m_szHash) ||
+        !same_content(szMetadataFile, metadata_touched, oOld.m_szMetadataHash, oCur.m_szMetadataHash))
+      return false;
+
+    oCur.m_szMetadataFile = oOld.m_szMetadataFile;
+    oCur.m_szConfig = oOld.m_szConfig;
+
+    dng_lock_mutex lock(&m_oMutex);
+    m_oEntries[raw_path] = oCur;
+    append(raw_path, oCur);
+    ++m_ulSkipped;
+
+    return true;
+  }
+
+  dng_lock_mutex lock(&m_oMutex);
+  ++m_ulSkipped;
+
+  return true;
+}
+
+void Manifest::update(const std::string &szRawFile, const std::string &szMetadataFile)
+{
+  ManifestEntry oEntry;
+
+  if (!stat_input(szRawFile, szMetadataFile, oEntry, m_bHash))
+    return;
+
+  const std::string raw_path = absolute_path(szRawFile);
+  oEntry.m_szMetadataFile = absolute_path(szMetadataFile);
+  oEntry.m_szConfig = m_szConfig;
+
+  dng_lock_mutex lock(&m_oMutex);
+  m_oEntries[raw_path] = oEntry;
+  append(raw_path, oEntry);
+}
@@ -0,0 +1,75 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdio.h>
+
+#include <string>
+#include <map>
+
+#include <dng_mutex.h>
+
+// State of an input and its JPG the last time it was converted successfully
+struct ManifestEntry {
+  ManifestEntry() : m_ulSize(0), m_lMTime(0), m_ulMetadataSize(0), m_lMetadataMTime(0)
+  {
+  }
+
+  unsigned long long m_ulSize;
+  long long m_lMTime;
+  std::string m_szHash; // MD5 of the input, empty unless hashing was requested
+  std::string m_szMetadataFile; // Absolute, empty without JPG
+  unsigned long long m_ulMetadataSize;
+  long long m_lMetadataMTime;
+  std::string m_szMetadataHash; // Like m_szHash
+  std::string m_szConfig; // Converter version and output affecting options
+};
+
+// Record of converted inputs used by incremental mode to skip files whose outputs are up to date.
+// Inputs are recorded by absolute path, however they were named.
+// Lookups and updates are safe from several threads. Updates are appended to the file as they are made,
+// load() and save() rewrite it with only the latest entry of every input.
+class Manifest
+{
+  public:
+  Manifest(const std::string &szPath, const std::string &szConfig, bool bHash);
+  ~Manifest();
+
+  // Read the manifest and open it for the updates of this run
+  int load(void);
+  int save(void);
+
+  // True if szRawFile (paired with szMetadataFile) was converted with the current config and has not changed since
+  bool is_up_to_date(const std::string &szRawFile, const std::string &szMetadataFile);
+
+  // Record a successful conversion of szRawFile
+  void update(const std::string &szRawFile, const std::string &szMetadataFile);
+
+  size_t get_skipped(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulSkipped;
+  }
+
+  protected:
+  bool stat_input(const std::string &szRawFile, const std::string &szMetadataFile, ManifestEntry &oEntry, bool bHash);
+
+  // Rewrite the file from m_oEntries and reopen it for appending, with m_oMutex held
+  int rewrite(void);
+
+  // Append an entry to the file, with m_oMutex held
+  void append(const std::string &szRawFile, const ManifestEntry &oEntry);
+
+  const std::string m_szPath;
+  const std::string m_szConfig;
+  const bool m_bHash;
+
+  dng_mutex m_oMutex;
+  std::map<std::string, ManifestEntry> m_oEntries;
+  size_t m_ulSkipped;
+  bool m_bDirty; // Entries appended since the file was last rewritten
+  FILE *m_poFile; // Appended to, NULL until load()
+};
+
+#endif // __MANIFEST_H__
@@ -0,0 +1,192 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <dng_auto_ptr.h>
+
+#include "MemoryBudget.h"
+#include "StopWatch.h"
+
+#define MB (1024.0 * 1024.0)
+
+// Block handed to the SDK, forwarding to one from the default allocator and keeping its account current
+class AccountedBlock : public dng_memory_block
+{
+  public:
+  AccountedBlock(dng_memory_block *poBlock, MemoryAccount &oAccount)
+          : dng_memory_block(poBlock->LogicalSize()), m_poBlock(poBlock), m_oAccount(oAccount)
+  {
+    SetBuffer(m_poBlock->Buffer());
+    m_oAccount.allocated(LogicalSize());
+  }
+
+  virtual ~AccountedBlock()
+  {
+    m_oAccount.freed(LogicalSize());
+    delete m_poBlock;
+  }
+
+  protected:
+  dng_memory_block *m_poBlock;
+  MemoryAccount &m_oAccount;
+
+  private:
+  AccountedBlock(const AccountedBlock &);
+  AccountedBlock &operator=(const AccountedBlock &);
+};
+
+MemoryBudget::MemoryBudget(uint64 ulLimit)
+        : m_ulLimit(ulLimit), m_oMutex("MemoryBudget"), m_ulNextTicket(0), m_ulServing(0), m_ulReserved(0),
+          m_unInFlight(0), m_ulInUse(0), m_ulPeakInUse(0), m_ulPeakReserved(0), m_unPeakInFlight(0), m_ulFiles(0),
+          m_ulOverProjection(0), m_ulWorstOverrun(0), m_ulPeakFile(0), m_ulWaitsBudget(0), m_ulWaitBudgetNsec(0),
+          m_ulWaitsAlone(0), m_ulWaitAloneNsec(0)
+{
+}
+
+bool MemoryBudget::fits(uint64 ulProjected) const
+{
+  if (m_ulLimit == 0 || m_unInFlight == 0)
+    return true;
+
+  return ulProjected <= m_ulLimit && m_ulReserved + ulProjected <= m_ulLimit;
+}
+
+void MemoryBudget::admit(uint64 ulProjected)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  // First come, first served: a large file is not passed over forever by smaller ones
+  const uint64 ticket = m_ulNextTicket++;
+
+  if (ticket != m_ulServing || !fits(ulProjected)) {
+    StopWatch watch;
+    watch.run();
+
+    while (ticket != m_ulServing || !fits(ulProjected))
+      m_oCondition.Wait(m_oMutex);
+
+    watch.stop();
+
+    if (m_ulLimit && ulProjected > m_ulLimit) {
+      ++m_ulWaitsAlone;
+      m_ulWaitAloneNsec += watch.elapsed_nsec();
+    } else {
+      ++m_ulWaitsBudget;
+      m_ulWaitBudgetNsec += watch.elapsed_nsec();
+    }
+  }
+
+  ++m_ulServing;
+  m_ulReserved += ulProjected;
+  ++m_unInFlight;
+
+  if (m_ulReserved > m_ulPeakReserved)
+    m_ulPeakReserved = m_ulReserved;
+  if (m_unInFlight > m_unPeakInFlight)
+    m_unPeakInFlight = m_unInFlight;
+
+  // The next ticket may fit as well
+  m_oCondition.Broadcast();
+}
+
+void MemoryBudget::release(uint64 ulProjected, uint64 ulPeak)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  m_ulReserved -= ulProjected;
+  --m_unInFlight;
+
+  ++m_ulFiles;
+  if (ulPeak > m_ulPeakFile)
+    m_ulPeakFile = ulPeak;
+
+  if (ulPeak > ulProjected) {
+    ++m_ulOverProjection;
+    if (ulPeak - ulProjected > m_ulWorstOverrun)
+      m_ulWorstOverrun = ulPeak - ulProjected;
+  }
+
+  m_oCondition.Broadcast();
+}
+
+void MemoryBudget::allocated(uint64 ulBytes)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  m_ulInUse += ulBytes;
+  if (m_ulInUse > m_ulPeakInUse)
+    m_ulPeakInUse = m_ulInUse;
+}
+
+void MemoryBudget::freed(uint64 ulBytes)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  m_ulInUse -= ulBytes;
+}
+
+void MemoryBudget::print(FILE *fp)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  fprintf(fp, "\nMemory");
+  if (m_ulLimit)
+    fprintf(fp, " (limit %.1f MB)", (double)m_ulLimit / MB);
+  fprintf(fp, ": peak %.1f MB in use by up to %u files at once, %.1f MB projected, largest file %.1f MB\n",
+          (double)m_ulPeakInUse / MB, m_unPeakInFlight, (double)m_ulPeakReserved / MB, (double)m_ulPeakFile / MB);
+
+  if (m_ulWaitsBudget)
+    fprintf(fp, "  %llu files waited %.3f s for other files to free memory\n", (unsigned long long)m_ulWaitsBudget,
+            (double)m_ulWaitBudgetNsec / 1e9);
+
+  if (m_ulWaitsAlone)
+    fprintf(fp, "  %llu files projected above the limit waited %.3f s to run alone\n",
+            (unsigned long long)m_ulWaitsAlone, (double)m_ulWaitAloneNsec / 1e9);
+
+  if (m_ulOverProjection)
+    fprintf(fp, "  %llu of %llu files used more than projected, by up to %.1f MB\n",
+            (unsigned long long)m_ulOverProjection, (unsigned long long)m_ulFiles, (double)m_ulWorstOverrun / MB);
+}
+
+MemoryAccount::MemoryAccount(MemoryBudget &oBudget, uint64 ulProjected)
+        : m_oBudget(oBudget), m_ulProjected(ulProjected), m_oMutex("MemoryAccount"), m_ulInUse(0), m_ulPeak(0)
+{
+  m_oBudget.admit(m_ulProjected);
+}
+
+MemoryAccount::~MemoryAccount()
+{
+  m_oBudget.release(m_ulProjected, m_ulPeak);
+}
+
+dng_memory_block *MemoryAccount::Allocate(uint32 size)
+{
+  AutoPtr<dng_memory_block> block(gDefaultDNGMemoryAllocator.Allocate(size));
+
+  dng_memory_block *result = new AccountedBlock(block.Get(), *this);
+  block.Release();
+
+  return result;
+}
+
+void MemoryAccount::allocated(uint64 ulBytes)
+{
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    m_ulInUse += ulBytes;
+    if (m_ulInUse > m_ulPeak)
+      m_ulPeak = m_ulInUse;
+  }
+
+  m_oBudget.allocated(ulBytes);
+}
+
+void MemoryAccount::freed(uint64 ulBytes)
+{
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    m_ulInUse -= ulBytes;
+  }
+
+  m_oBudget.freed(ulBytes);
+}
@@ -0,0 +1,93 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __MEMORY_BUDGET_H__
+#define __MEMORY_BUDGET_H__
+
+#include <stdio.h>
+
+#include <dng_types.h>
+#include <dng_memory.h>
+#include <dng_mutex.h>
+
+// Memory the files in flight get from the SDK, and admission of new files against a limit.
+// Each file reserves its projected footprint before it starts; a file that does not fit next
+// to the ones already converting waits until enough of them are done. A file projected above
+// the whole limit waits until it can run alone, so it still gets converted.
+class MemoryBudget
+{
+  public:
+  // ulLimit of 0 only accounts, nothing ever waits
+  MemoryBudget(uint64 ulLimit);
+
+  // Blocks until ulProjected bytes fit next to the files in flight
+  void admit(uint64 ulProjected);
+
+  // A file admitted with ulProjected is done, having used at most ulPeak bytes
+  void release(uint64 ulProjected, uint64 ulPeak);
+
+  // SDK allocations of the files in flight
+  void allocated(uint64 ulBytes);
+  void freed(uint64 ulBytes);
+
+  uint64 limit(void) const
+  {
+    return m_ulLimit;
+  }
+
+  // Peaks and the time files spent waiting for memory, by reason
+  void print(FILE *fp);
+
+  protected:
+  bool fits(uint64 ulProjected) const;
+
+  const uint64 m_ulLimit;
+
+  dng_mutex m_oMutex;
+  dng_condition m_oCondition;
+
+  uint64 m_ulNextTicket; // Files are admitted in the order they asked
+  uint64 m_ulServing;
+
+  uint64 m_ulReserved; // Projected footprint of the files in flight
+  uint32 m_unInFlight;
+  uint64 m_ulInUse; // Allocated by the files in flight
+
+  uint64 m_ulPeakInUse;
+  uint64 m_ulPeakReserved;
+  uint32 m_unPeakInFlight;
+
+  uint64 m_ulFiles;
+  uint64 m_ulOverProjection; // Files that used more than projected
+  uint64 m_ulWorstOverrun; // Largest of those overruns in bytes
+  uint64 m_ulPeakFile; // Largest footprint of a single file
+
+  uint64 m_ulWaitsBudget; // Files that waited for others to finish
+  uint64 m_ulWaitBudgetNsec;
+  uint64 m_ulWaitsAlone; // Files above the limit that waited to run alone
+  uint64 m_ulWaitAloneNsec;
+};
+
+// Allocator of one file's SDK memory, reporting to a MemoryBudget. Constructing it admits the
+// file (possibly waiting), destroying it releases the reservation; every block allocated through
+// it must be gone by then.
+class MemoryAccount : public dng_memory_allocator
+{
+  public:
+  MemoryAccount(MemoryBudget &oBudget, uint64 ulProjected);
+  virtual ~MemoryAccount();
+
+  virtual dng_memory_block *Allocate(uint32 size);
+
+  void allocated(uint64 ulBytes);
+  void freed(uint64 ulBytes);
+
+  protected:
+  MemoryBudget &m_oBudget;
+  const uint64 m_ulProjected;
+
+  dng_mutex m_oMutex; // Area task helpers allocate concurrently
+  uint64 m_ulInUse;
+  uint64 m_ulPeak;
+};
+
+#endif // __MEMORY_BUDGET_H__
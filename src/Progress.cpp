@@ -0,0 +1,296 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include "Progress.h"
+#include "helpers.h"
+#include "utils.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Events a thread can have in flight before it waits for the flusher
+#define PROGRESS_RING_SIZE 1024
+
+#define PROGRESS_FLUSH_MSEC 100
+
+// Ring indices are only written by one side each, publishing them with release/acquire ordering
+// is all the synchronization the producer and the flusher need
+#if defined(_MSC_VER)
+static inline size_t load_acquire(volatile size_t *ptr)
+{
+  size_t val = *ptr;
+  _ReadWriteBarrier();
+  return val;
+}
+
+static inline void store_release(volatile size_t *ptr, size_t val)
+{
+  _ReadWriteBarrier();
+  *ptr = val;
+}
+#else
+static inline size_t load_acquire(volatile size_t *ptr)
+{
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(volatile size_t *ptr, size_t val)
+{
+  __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+#endif
+
+static uint64 now_usec(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  return (uint64)tv.tv_sec * 1000000 + (uint64)tv.tv_usec;
+}
+
+// Events of one thread, written by that thread only
+class ProgressBuffer
+{
+  public:
+  ProgressBuffer(unsigned int unThread)
+          : m_unThread(unThread), m_ulItemStart(0), m_ulItemBytes(0), m_ulFailed(0), m_ulHead(0), m_ulTail(0),
+            m_oSlots(PROGRESS_RING_SIZE)
+  {
+  }
+
+  void push(const ProgressEvent &oEvent)
+  {
+    const size_t head = m_ulHead;
+
+    // Full: the flusher is behind, give it a moment rather than dropping events
+    while (head - load_acquire(&m_ulTail) == PROGRESS_RING_SIZE)
+      sleep_msec(1);
+
+    m_oSlots[head % PROGRESS_RING_SIZE] = oEvent;
+    store_release(&m_ulHead, head + 1);
+  }
+
+  void drain(FILE *fp);
+
+  const unsigned int m_unThread;
+
+  // Current item
+  std::string m_szItem;
+  uint64 m_ulItemStart;
+  uint64 m_ulItemBytes;
+
+  size_t m_ulFailed;
+
+  protected:
+  volatile size_t m_ulHead;
+  volatile size_t m_ulTail;
+  std::vector<ProgressEvent> m_oSlots;
+};
+
+void ProgressBuffer::drain(FILE *fp)
+{
+  const size_t head = load_acquire(&m_ulHead);
+  size_t tail = m_ulTail;
+
+  for (; tail != head; ++tail) {
+    const ProgressEvent &ev = m_oSlots[tail % PROGRESS_RING_SIZE];
+
+    fprintf(fp, "{\"event\":\"%s\",\"ts_us\":%llu,\"thread\":%u,\"item\":", ev.m_szEvent,
+            (unsigned long long)ev.m_ulTimestamp, m_unThread);
+    write_json_string(fp, ev.m_szItem);
+
+    if (ev.m_szStage)
+      fprintf(fp, ",\"stage\":\"%s\"", ev.m_szStage);
+    if (ev.m_szFormat)
+      fprintf(fp, ",\"format\":\"%s\"", ev.m_szFormat);
+
+    fprintf(fp, ",\"dur_us\":%llu,\"bytes\":%llu", (unsigned long long)ev.m_ulDuration,
+            (unsigned long long)ev.m_ulBytes);
+
+    if (ev.m_szEvent[0] == 'd')
+      fprintf(fp, ",\"error\":%d", ev.m_iError);
+
+    fputs("}\n", fp);
+  }
+
+  store_release(&m_ulTail, tail);
+}
+
+// Identifies the Progress a thread's buffer belongs to, a later Progress gets fresh buffers
+static unsigned int g_unProgressGeneration = 0;
+static THREAD_LOCAL unsigned int t_unGeneration = 0;
+static THREAD_LOCAL ProgressBuffer *t_poBuffer = NULL;
+
+Progress::Progress(FILE *fp)
+        : m_fp(fp), m_unGeneration(++g_unProgressGeneration), m_oMutex("Progress"), m_bStarted(false), m_bStop(false)
+{
+}
+
+Progress::~Progress()
+{
+  stop();
+
+  std::vector<ProgressBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it)
+    delete *it;
+}
+
+int Progress::start(size_t ulItems, size_t ulThreads)
+{
+  m_oRunWatch.run();
+
+  fprintf(m_fp, "{\"event\":\"begin\",\"ts_us\":%llu,\"items\":%zu,\"threads\":%zu}\n", (unsigned long long)now_usec(),
+          ulItems, ulThreads);
+  fflush(m_fp);
+
+  if (pthread_create(&m_oThread, NULL, flusher, this)) {
+    fprintf(stderr, "Error: Unable to start progress thread\n");
+    return -1;
+  }
+
+  m_bStarted = true;
+
+  return 0;
+}
+
+void Progress::stop(void)
+{
+  if (!m_bStarted)
+    return;
+
+  m_bStop = true;
+  pthread_join(m_oThread, NULL);
+  m_bStarted = false;
+
+  m_oRunWatch.stop();
+
+  size_t failed = 0;
+  std::vector<ProgressBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it)
+    failed += (*it)->m_ulFailed;
+
+  fprintf(m_fp, "{\"event\":\"end\",\"ts_us\":%llu,\"dur_us\":%llu,\"failed\":%zu}\n", (unsigned long long)now_usec(),
+          (unsigned long long)m_oRunWatch.elapsed_usec(), failed);
+  fflush(m_fp);
+}
+
+ProgressBuffer *Progress::get_buffer(void)
+{
+  if (t_unGeneration == m_unGeneration)
+    return t_poBuffer;
+
+  dng_lock_mutex lock(&m_oMutex);
+
+  t_poBuffer = new ProgressBuffer((unsigned int)m_oBuffers.size());
+  t_unGeneration = m_unGeneration;
+  m_oBuffers.push_back(t_poBuffer);
+
+  return t_poBuffer;
+}
+
+void Progress::begin_item(const std::string &szItem, uint64 ulBytes)
+{
+  ProgressBuffer *buffer = get_buffer();
+
+  buffer->m_szItem = szItem;
+  buffer->m_ulItemStart = now_usec();
+  buffer->m_ulItemBytes = 0;
+
+  ProgressEvent ev;
+  ev.m_szItem = szItem;
+  ev.m_szEvent = "start";
+  ev.m_szStage = NULL;
+  ev.m_szFormat = NULL;
+  ev.m_ulTimestamp = buffer->m_ulItemStart;
+  ev.m_ulDuration = 0;
+  ev.m_ulBytes = ulBytes;
+  ev.m_iError = 0;
+
+  buffer->push(ev);
+}
+
+void Progress::end_item(int32 iError)
+{
+  ProgressBuffer *buffer = get_buffer();
+  const uint64 now = now_usec();
+
+  ProgressEvent ev;
+  ev.m_szItem = buffer->m_szItem;
+  ev.m_szEvent = "done";
+  ev.m_szStage = NULL;
+  ev.m_szFormat = NULL;
+  ev.m_ulTimestamp = now;
+  ev.m_ulDuration = now - buffer->m_ulItemStart;
+  ev.m_ulBytes = buffer->m_ulItemBytes;
+  ev.m_iError = iError;
+
+  if (iError)
+    ++buffer->m_ulFailed;
+
+  buffer->push(ev);
+  buffer->m_szItem.clear();
+}
+
+void Progress::skip_item(const std::string &szItem)
+{
+  ProgressBuffer *buffer = get_buffer();
+
+  ProgressEvent ev;
+  ev.m_szItem = szItem;
+  ev.m_szEvent = "skip";
+  ev.m_szStage = NULL;
+  ev.m_szFormat = NULL;
+  ev.m_ulTimestamp = now_usec();
+  ev.m_ulDuration = 0;
+  ev.m_ulBytes = 0;
+  ev.m_iError = 0;
+
+  buffer->push(ev);
+}
+
+void Progress::stage(const char *szStage, uint64 ulDuration, uint64 ulBytes, const char *szFormat)
+{
+  ProgressBuffer *buffer = get_buffer();
+
+  // Output size of the item is what its encoders produced
+  if (szFormat)
+    buffer->m_ulItemBytes += ulBytes;
+
+  ProgressEvent ev;
+  ev.m_szItem = buffer->m_szItem;
+  ev.m_szEvent = "stage";
+  ev.m_szStage = szStage;
+  ev.m_szFormat = szFormat;
+  ev.m_ulTimestamp = now_usec() - ulDuration;
+  ev.m_ulDuration = ulDuration;
+  ev.m_ulBytes = ulBytes;
+  ev.m_iError = 0;
+
+  buffer->push(ev);
+}
+
+void Progress::drain(void)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  std::vector<ProgressBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it)
+    (*it)->drain(m_fp);
+
+  fflush(m_fp);
+}
+
+void *Progress::flusher(void *arg)
+{
+  Progress *progress = (Progress *)arg;
+
+  while (!progress->m_bStop) {
+    progress->drain();
+    sleep_msec(PROGRESS_FLUSH_MSEC);
+  }
+
+  // Everything reported before stop()
+  progress->drain();
+
+  return NULL;
+}
@@ -0,0 +1,73 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include <dng_types.h>
+#include <dng_mutex.h>
+#include <dng_pthread.h>
+
+#include "StopWatch.h"
+
+struct ProgressEvent {
+  std::string m_szItem;
+  const char *m_szEvent; // start, stage, skip or done
+  const char *m_szStage;
+  const char *m_szFormat;
+  uint64 m_ulTimestamp; // usec since the epoch
+  uint64 m_ulDuration; // usec
+  uint64 m_ulBytes;
+  int32 m_iError;
+};
+
+class ProgressBuffer;
+
+// Machine readable progress: one JSON object per line for each item and conversion stage.
+// Converter threads append to rings of their own without taking locks, a flusher thread
+// drains them to the output, so reporting never makes workers wait for each other.
+class Progress
+{
+  public:
+  Progress(FILE *fp);
+  ~Progress();
+
+  // Writes the begin event (ulItems is 0 if not known up front) and starts the flusher
+  int start(size_t ulItems, size_t ulThreads);
+
+  // Writes the events still buffered and the end event, all reporting threads must be done
+  void stop(void);
+
+  // Item the calling thread works on, until end_item()
+  void begin_item(const std::string &szItem, uint64 ulBytes);
+  void end_item(int32 iError);
+
+  // Item left alone because its outputs are up to date
+  void skip_item(const std::string &szItem);
+
+  // A stage of the calling thread's current item took ulDuration usec until now
+  void stage(const char *szStage, uint64 ulDuration, uint64 ulBytes, const char *szFormat = NULL);
+
+  protected:
+  ProgressBuffer *get_buffer(void);
+  void drain(void);
+
+  static void *flusher(void *arg);
+
+  FILE *m_fp;
+  const unsigned int m_unGeneration;
+  StopWatch m_oRunWatch;
+
+  dng_mutex m_oMutex; // Only taken the first time a thread reports
+  std::vector<ProgressBuffer *> m_oBuffers;
+
+  pthread_t m_oThread;
+  bool m_bStarted;
+  volatile bool m_bStop;
+};
+
+#endif // __PROGRESS_H__
@@ -0,0 +1,140 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <dng_exceptions.h>
+
+#include "ScratchAllocator.h"
+#include "helpers.h"
+
+// Deleted file of its own, mapped for as long as the block lives
+class ScratchBlock : public dng_memory_block
+{
+  public:
+  ScratchBlock(uint32 logicalSize, const std::string &szDir)
+          : dng_memory_block(logicalSize), m_ulSize(PhysicalSize()),
+#if defined(_WIN32) || defined(_WIN64)
+            m_fd(INVALID_HANDLE_VALUE), m_map_handle(NULL),
+#endif
+            m_buf(NULL)
+  {
+#if defined(_WIN32) || defined(_WIN64)
+    char path[MAX_PATH];
+    if (!GetTempFileName(szDir.c_str(), "sjr", 0, path))
+      fail(szDir);
+
+    // Gone as soon as the last handle is closed
+    m_fd = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                      FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (INVALID_HANDLE_VALUE == m_fd)
+      fail(path);
+
+    // Extends the file to the size of the mapping
+    m_map_handle = CreateFileMapping(m_fd, NULL, PAGE_READWRITE, (DWORD)((uint64)m_ulSize >> 32),
+                                     (DWORD)(m_ulSize & 0xFFFFFFFF), NULL);
+    if (NULL == m_map_handle)
+      fail(path);
+
+    m_buf = MapViewOfFile(m_map_handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (NULL == m_buf)
+      fail(path);
+#else
+    std::string path(szDir + "sjcam_raw2dng.scratch.XXXXXX");
+
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+      fail(path);
+
+    unlink(path.c_str());
+
+    if (ftruncate(fd, (off_t)m_ulSize)) {
+      close(fd);
+      fail(path);
+    }
+
+    void *buf = ::mmap(NULL, m_ulSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == buf)
+      fail(path);
+
+    m_buf = buf;
+#endif
+
+    SetBuffer(m_buf);
+  }
+
+  virtual ~ScratchBlock()
+  {
+    unmap();
+  }
+
+  protected:
+  void unmap(void)
+  {
+#if defined(_WIN32) || defined(_WIN64)
+    if (m_buf)
+      UnmapViewOfFile(m_buf);
+    if (m_map_handle != NULL)
+      CloseHandle(m_map_handle);
+    if (m_fd != INVALID_HANDLE_VALUE)
+      CloseHandle(m_fd);
+#else
+    if (m_buf)
+      ::munmap(m_buf, m_ulSize);
+#endif
+  }
+
+  // The SDK reports any allocation failure as full memory
+  void fail(const std::string &path)
+  {
+#if defined(_WIN32) || defined(_WIN64)
+    fprintf(stderr, "%s: Unable to create scratch file (%lu)\n", path.c_str(), GetLastError());
+    unmap();
+#else
+    perror(path.c_str());
+#endif
+    ThrowMemoryFull("Unable to create scratch file");
+  }
+
+  const size_t m_ulSize;
+#if defined(_WIN32) || defined(_WIN64)
+  HANDLE m_fd;
+  HANDLE m_map_handle;
+#endif
+  void *m_buf;
+
+  private:
+  ScratchBlock(const ScratchBlock &);
+  ScratchBlock &operator=(const ScratchBlock &);
+};
+
+static std::string dir_prefix(const std::string &dir)
+{
+  if (dir.empty())
+    return "." DELIM;
+
+  if (dir[dir.size() - 1] != DIR_DELIM)
+    return dir + DELIM;
+
+  return dir;
+}
+
+ScratchAllocator::ScratchAllocator(const std::string &szDir) : m_szDir(dir_prefix(szDir))
+{
+}
+
+dng_memory_block *ScratchAllocator::Allocate(uint32 size)
+{
+  return new ScratchBlock(size, m_szDir);
+}
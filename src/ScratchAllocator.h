@@ -0,0 +1,25 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __SCRATCH_ALLOCATOR_H__
+#define __SCRATCH_ALLOCATOR_H__
+
+#include <string>
+
+#include <dng_memory.h>
+
+// Memory blocks backed by scratch files in a directory instead of RAM, for the full size images
+// of low memory conversions. Each block is a shared mapping of a file of its own that is deleted
+// as soon as it is created, so the kernel can write image pages back to disk and drop them under
+// memory pressure instead of having to keep them resident. Nothing is left behind after a crash.
+class ScratchAllocator : public dng_memory_allocator
+{
+  public:
+  ScratchAllocator(const std::string &szDir);
+
+  virtual dng_memory_block *Allocate(uint32 size);
+
+  protected:
+  const std::string m_szDir;
+};
+
+#endif // __SCRATCH_ALLOCATOR_H__
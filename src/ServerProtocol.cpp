@@ -0,0 +1,277 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "ServerProtocol.h"
+#include "utils.h"
+
+#ifndef MSG_NOSIGNAL
+// Not on macOS, where the server ignores SIGPIPE instead
+#define MSG_NOSIGNAL 0
+#endif
+
+std::string encode_options(const Config &conf)
+{
+  std::string opts;
+
+  if (conf.m_bDng)
+    opts += ",dng";
+  if (conf.m_bTiff)
+    opts += ",tiff";
+  if (conf.m_bNoCalibration)
+    opts += ",no-color";
+  if (conf.m_bGenPreview)
+    opts += ",thumb";
+  if (conf.m_bFlipped)
+    opts += ",rotated";
+  if (conf.m_bLensCorrections)
+    opts += ",lens";
+  if (conf.m_bAutoWB)
+    opts += ",auto-wb";
+
+  return opts.empty() ? opts : opts.substr(1);
+}
+
+bool decode_options(const std::string &opts, Config &conf)
+{
+  std::vector<std::string> fields;
+  std::vector<std::string>::const_iterator it;
+
+  split_string(opts, ',', fields);
+
+  for (it = fields.begin(); it != fields.end(); ++it) {
+    if (*it == "dng")
+      conf.m_bDng = true;
+    else if (*it == "tiff")
+      conf.m_bTiff = true;
+    else if (*it == "no-color")
+      conf.m_bNoCalibration = true;
+    else if (*it == "thumb")
+      conf.m_bGenPreview = true;
+    else if (*it == "rotated")
+      conf.m_bFlipped = true;
+    else if (*it == "lens")
+      conf.m_bLensCorrections = true;
+    else if (*it == "auto-wb")
+      conf.m_bAutoWB = true;
+    else if (!it->empty())
+      return false;
+  }
+
+  return true;
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+std::string default_socket_path(void)
+{
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && runtime_dir[0])
+    return std::string(runtime_dir) + "/sjcam_raw2dngd.sock";
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/sjcam_raw2dngd-%u.sock", (unsigned int)getuid());
+
+  return path;
+}
+
+static int socket_address(const std::string &path, struct sockaddr_un &addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: Socket path too long\n", path.c_str());
+    return -1;
+  }
+
+  strcpy(addr.sun_path, path.c_str());
+
+  return 0;
+}
+
+int connect_socket(const std::string &path)
+{
+  struct sockaddr_un addr;
+
+  if (socket_address(path, addr))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int listen_socket(const std::string &path)
+{
+  struct sockaddr_un addr;
+
+  if (socket_address(path, addr))
+    return -1;
+
+  int fd = connect_socket(path);
+  if (fd >= 0) {
+    close(fd);
+    fprintf(stderr, "%s: A server is already running\n", path.c_str());
+    return -1;
+  }
+
+  struct stat sb;
+  if (lstat(path.c_str(), &sb) == 0) {
+    if (!S_ISSOCK(sb.st_mode)) {
+      fprintf(stderr, "%s: Exists and is not a socket\n", path.c_str());
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // Jobs write files with the rights of the server, so only its own user may connect
+  mode_t old_mask = umask(0077);
+  int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+
+  if (ret) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, SOMAXCONN)) {
+    perror("listen");
+    close(fd);
+    unlink(path.c_str());
+    return -1;
+  }
+
+  return fd;
+}
+
+int send_all(int fd, const void *buf, size_t len)
+{
+  const char *pos = (const char *)buf;
+
+  while (len > 0) {
+    ssize_t ret = send(fd, pos, len, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    pos += ret;
+    len -= (size_t)ret;
+  }
+
+  return 0;
+}
+
+int send_line(int fd, const std::vector<std::string> &fields)
+{
+  std::string line;
+  std::vector<std::string>::const_iterator it;
+
+  for (it = fields.begin(); it != fields.end(); ++it) {
+    if (it != fields.begin())
+      line += '\t';
+    line += *it;
+  }
+  line += '\n';
+
+  return send_all(fd, line.data(), line.size());
+}
+
+SocketReader::SocketReader(int fd) : m_iFd(fd), m_ulPos(0), m_ulLen(0)
+{
+}
+
+size_t SocketReader::fill(void)
+{
+  if (m_ulPos < m_ulLen)
+    return m_ulLen - m_ulPos;
+
+  ssize_t ret;
+  do {
+    ret = recv(m_iFd, m_aBuf, sizeof(m_aBuf), 0);
+  } while (ret < 0 && errno == EINTR);
+
+  m_ulPos = 0;
+  m_ulLen = ret > 0 ? (size_t)ret : 0;
+
+  return m_ulLen;
+}
+
+int SocketReader::read_line(std::vector<std::string> &fields)
+{
+  std::string line;
+
+  for (;;) {
+    if (!fill())
+      return line.empty() ? 1 : -1;
+
+    const char *start = m_aBuf + m_ulPos;
+    const char *end = (const char *)memchr(start, '\n', m_ulLen - m_ulPos);
+
+    if (end) {
+      line.append(start, (size_t)(end - start));
+      m_ulPos += (size_t)(end - start) + 1;
+      break;
+    }
+
+    line.append(start, m_ulLen - m_ulPos);
+    m_ulPos = m_ulLen;
+
+    // Paths and numbers only, anything longer is not talking our protocol
+    if (line.size() > 65536)
+      return -1;
+  }
+
+  split_string(line, '\t', fields);
+
+  return 0;
+}
+
+int SocketReader::read(void *buf, size_t len)
+{
+  char *pos = (char *)buf;
+
+  while (len > 0) {
+    size_t avail = fill();
+    if (!avail)
+      return -1;
+
+    size_t n = avail < len ? avail : len;
+    memcpy(pos, m_aBuf + m_ulPos, n);
+
+    m_ulPos += n;
+    pos += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+#endif
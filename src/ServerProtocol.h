@@ -0,0 +1,74 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __SERVER_PROTOCOL_H__
+#define __SERVER_PROTOCOL_H__
+
+#include <string>
+#include <vector>
+
+#include "DNGConverter.h"
+
+// Conversation between sjcam_raw2dngd and its clients over a Unix domain socket.
+// Messages are lines of tab separated fields, binary payloads follow their line directly.
+//
+// Client -> server:
+//   options <opts> <output dir>                   Options for the jobs that follow (opts as in encode_options())
+//   file <raw path> <metadata path>               Convert files on disk, absolute paths (metadata may be empty)
+//   buffer <id> <raw size> <metadata size> <fmt>  Convert the RAW (and JPG) bytes that follow, fmt is dng or tiff
+//   end                                           No more jobs, close once all are answered
+//
+// Server -> client (job replies in completion order):
+//   hello <protocol version> <converter version>  Sent on connect
+//   started <id>                                  A worker picked up the job (id is the RAW path for files)
+//   done <id> <error code>                        File job finished, 0 on success
+//   output <id> <error code> <size>               Buffer job finished, followed by size bytes of output
+//   bye <converted> <failed>                      Reply to end
+//   error <message>                               Malformed request, the connection is closed
+
+#define SERVER_PROTOCOL_VERSION "sjcam_raw2dngd 1"
+
+// Larger requests are refused instead of being buffered
+#define SERVER_MAX_BUFFER_SIZE (256ULL << 20)
+
+// Output affecting options as a comma separated list ("dng,tiff,no-color,thumb,rotated,lens")
+std::string encode_options(const Config &conf);
+bool decode_options(const std::string &opts, Config &conf);
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+// $XDG_RUNTIME_DIR/sjcam_raw2dngd.sock, or a per user name in /tmp
+std::string default_socket_path(void);
+
+int connect_socket(const std::string &path);
+
+// Fails if a server is already answering on path, a stale socket left by a dead one is replaced
+int listen_socket(const std::string &path);
+
+int send_all(int fd, const void *buf, size_t len);
+
+// Fields joined with tabs and terminated by a newline
+int send_line(int fd, const std::vector<std::string> &fields);
+
+// Buffered reads of lines and payloads from a socket
+class SocketReader
+{
+  public:
+  SocketReader(int fd);
+
+  // Splits the next line into fields. Returns 0, 1 on orderly shutdown, -1 on error.
+  int read_line(std::vector<std::string> &fields);
+
+  int read(void *buf, size_t len);
+
+  protected:
+  size_t fill(void);
+
+  const int m_iFd;
+  char m_aBuf[4096];
+  size_t m_ulPos;
+  size_t m_ulLen;
+};
+
+#endif
+
+#endif // __SERVER_PROTOCOL_H__
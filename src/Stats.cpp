@@ -0,0 +1,285 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#include "Stats.h"
+#include "helpers.h"
+#include "utils.h"
+
+struct StatsSeries {
+  StatsSeries(const char *szName, const char *szFormat, bool bTask)
+          : m_szName(szName), m_szFormat(szFormat), m_bTask(bTask), m_ulBytes(0), m_ulPixels(0)
+  {
+  }
+
+  const char *m_szName;
+  const char *m_szFormat;
+  bool m_bTask;
+
+  std::vector<uint64> m_oSamples; // nsec
+  uint64 m_ulBytes;
+  uint64 m_ulPixels;
+};
+
+// Spans of one thread, only touched by that thread until the run is over
+class StatsBuffer
+{
+  public:
+  StatsSeries &get(const char *szName, const char *szFormat, bool bTask)
+  {
+    // A handful of stages and tasks, a linear scan beats any lookup structure
+    for (size_t i = 0; i < m_oSeries.size(); ++i) {
+      if (m_oSeries[i].m_szName == szName && m_oSeries[i].m_szFormat == szFormat)
+        return m_oSeries[i];
+    }
+
+    m_oSeries.push_back(StatsSeries(szName, szFormat, bTask));
+
+    return m_oSeries.back();
+  }
+
+  std::vector<StatsSeries> m_oSeries;
+};
+
+// Identifies the Stats a thread's buffer belongs to, a later Stats gets fresh buffers
+static unsigned int g_unStatsGeneration = 0;
+static THREAD_LOCAL unsigned int t_unGeneration = 0;
+static THREAD_LOCAL StatsBuffer *t_poBuffer = NULL;
+
+Stats::Stats() : m_unGeneration(++g_unStatsGeneration), m_oMutex("Stats")
+{
+}
+
+Stats::~Stats()
+{
+  std::vector<StatsBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it)
+    delete *it;
+}
+
+void Stats::start(void)
+{
+  m_oRunWatch.reset();
+  m_oRunWatch.run();
+}
+
+void Stats::stop(void)
+{
+  m_oRunWatch.stop();
+}
+
+StatsBuffer *Stats::get_buffer(void)
+{
+  if (t_unGeneration == m_unGeneration)
+    return t_poBuffer;
+
+  dng_lock_mutex lock(&m_oMutex);
+
+  t_poBuffer = new StatsBuffer();
+  t_unGeneration = m_unGeneration;
+  m_oBuffers.push_back(t_poBuffer);
+
+  return t_poBuffer;
+}
+
+void Stats::add(const char *szStage, const char *szFormat, uint64 ulNsec, uint64 ulBytes, uint64 ulPixels)
+{
+  StatsSeries &series = get_buffer()->get(szStage, szFormat, false);
+
+  series.m_oSamples.push_back(ulNsec);
+  series.m_ulBytes += ulBytes;
+  series.m_ulPixels += ulPixels;
+}
+
+void Stats::add_task(const char *szTypeName, uint64 ulNsec, uint64 ulPixels)
+{
+  StatsSeries &series = get_buffer()->get(szTypeName, NULL, true);
+
+  series.m_oSamples.push_back(ulNsec);
+  series.m_ulPixels += ulPixels;
+}
+
+static std::string series_label(const StatsSeries &series)
+{
+  std::string label;
+
+  if (series.m_bTask) {
+    label = demangle_type_name(series.m_szName);
+  } else {
+    label = series.m_szName;
+    if (series.m_szFormat) {
+      label += " ";
+      label += series.m_szFormat;
+    }
+  }
+
+  return label;
+}
+
+// Nearest rank percentile of sorted samples, in msec
+static double percentile_msec(const std::vector<uint64> &samples, unsigned int pct)
+{
+  size_t rank = (samples.size() * pct + 99) / 100;
+
+  return (double)samples[rank ? rank - 1 : 0] / 1e6;
+}
+
+static void print_rate(FILE *fp, uint64 amount, double divisor, double sec)
+{
+  if (amount && sec > 0)
+    fprintf(fp, " %9.1f", (double)amount / divisor / sec);
+  else
+    fprintf(fp, " %9s", "-");
+}
+
+static void print_table(FILE *fp, const char *title, const std::vector<StatsSeries> &series)
+{
+  fprintf(fp, "%-28s %7s %10s %9s %9s %9s %9s %9s\n", title, "Count", "Total s", "p50 ms", "p95 ms", "p99 ms",
+          "MP/s", "MB/s");
+
+  for (size_t i = 0; i < series.size(); ++i) {
+    std::vector<uint64> samples(series[i].m_oSamples);
+    std::sort(samples.begin(), samples.end());
+
+    uint64 total = 0;
+    for (size_t j = 0; j < samples.size(); ++j)
+      total += samples[j];
+
+    const double sec = (double)total / 1e9;
+
+    fprintf(fp, "%-28s %7zu %10.3f %9.2f %9.2f %9.2f", series_label(series[i]).c_str(), samples.size(), sec,
+            percentile_msec(samples, 50), percentile_msec(samples, 95), percentile_msec(samples, 99));
+
+    // Per thread throughput of the stage: what one worker gets through while busy with it
+    print_rate(fp, series[i].m_ulPixels, 1e6, sec);
+    print_rate(fp, series[i].m_ulBytes, 1024.0 * 1024.0, sec);
+    fputc('\n', fp);
+  }
+}
+
+void Stats::merge(std::vector<StatsSeries> &stages, std::vector<StatsSeries> &tasks) const
+{
+  // Threads recorded the same stages under the same names, merge them
+  std::vector<StatsBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it) {
+    std::vector<StatsSeries>::const_iterator src;
+    for (src = (*it)->m_oSeries.begin(); src != (*it)->m_oSeries.end(); ++src) {
+      std::vector<StatsSeries> &merged = src->m_bTask ? tasks : stages;
+
+      size_t i;
+      for (i = 0; i < merged.size(); ++i) {
+        if (strcmp(merged[i].m_szName, src->m_szName) == 0 &&
+            (merged[i].m_szFormat == src->m_szFormat ||
+             (merged[i].m_szFormat && src->m_szFormat && strcmp(merged[i].m_szFormat, src->m_szFormat) == 0)))
+          break;
+      }
+
+      if (i == merged.size())
+        merged.push_back(StatsSeries(src->m_szName, src->m_szFormat, src->m_bTask));
+
+      merged[i].m_oSamples.insert(merged[i].m_oSamples.end(), src->m_oSamples.begin(), src->m_oSamples.end());
+      merged[i].m_ulBytes += src->m_ulBytes;
+      merged[i].m_ulPixels += src->m_ulPixels;
+    }
+  }
+}
+
+void Stats::print(FILE *fp)
+{
+  std::vector<StatsSeries> stages;
+  std::vector<StatsSeries> tasks;
+
+  merge(stages, tasks);
+
+  fprintf(fp, "\n");
+  print_table(fp, "Stage", stages);
+
+  if (!tasks.empty()) {
+    fprintf(fp, "\n");
+    print_table(fp, "SDK area task", tasks);
+  }
+
+  // Whole run, wall clock
+  const double wall = (double)m_oRunWatch.elapsed_nsec() / 1e9;
+  size_t files = 0;
+  uint64 pixels = 0;
+  uint64 bytes = 0;
+
+  for (size_t i = 0; i < stages.size(); ++i) {
+    if (strcmp(stages[i].m_szName, "file") == 0) {
+      files += stages[i].m_oSamples.size();
+      pixels += stages[i].m_ulPixels;
+      bytes += stages[i].m_ulBytes;
+    }
+  }
+
+  fprintf(fp, "\nConverted %zu files in %.3f s", files, wall);
+  if (wall > 0)
+    fprintf(fp, ": %.1f MP/s, %.1f MB/s of RAW input", (double)pixels / 1e6 / wall,
+            (double)bytes / (1024.0 * 1024.0) / wall);
+  fprintf(fp, "\n");
+}
+
+static bool series_less(const StatsSeries &a, const StatsSeries &b)
+{
+  return series_label(a) < series_label(b);
+}
+
+static void write_json_rate(FILE *fp, const char *key, uint64 amount, double divisor, double sec)
+{
+  fprintf(fp, ",\"%s\":", key);
+  if (amount && sec > 0)
+    fprintf(fp, "%.3f", (double)amount / divisor / sec);
+  else
+    fputs("null", fp);
+}
+
+static void write_json_series(FILE *fp, const char *key, std::vector<StatsSeries> &series, const char *indent)
+{
+  // Sorted by name, so runs can be diffed whatever order the threads recorded in
+  std::sort(series.begin(), series.end(), series_less);
+
+  fprintf(fp, "%s\"%s\": [", indent, key);
+
+  for (size_t i = 0; i < series.size(); ++i) {
+    std::vector<uint64> samples(series[i].m_oSamples);
+    std::sort(samples.begin(), samples.end());
+
+    uint64 total = 0;
+    for (size_t j = 0; j < samples.size(); ++j)
+      total += samples[j];
+
+    const double sec = (double)total / 1e9;
+
+    fprintf(fp, "%s\n%s  {\"name\":", i ? "," : "", indent);
+    write_json_string(fp, series[i].m_bTask ? demangle_type_name(series[i].m_szName) : series[i].m_szName);
+    if (series[i].m_szFormat) {
+      fputs(",\"format\":", fp);
+      write_json_string(fp, series[i].m_szFormat);
+    }
+    fprintf(fp, ",\"count\":%zu,\"total_s\":%.6f,\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"p99_ms\":%.3f", samples.size(),
+            sec, percentile_msec(samples, 50), percentile_msec(samples, 95), percentile_msec(samples, 99));
+    write_json_rate(fp, "mpix_per_s", series[i].m_ulPixels, 1e6, sec);
+    write_json_rate(fp, "mb_per_s", series[i].m_ulBytes, 1024.0 * 1024.0, sec);
+    fputc('}', fp);
+  }
+
+  if (!series.empty())
+    fprintf(fp, "\n%s", indent);
+  fputc(']', fp);
+}
+
+void Stats::write_json(FILE *fp, const char *indent)
+{
+  std::vector<StatsSeries> stages;
+  std::vector<StatsSeries> tasks;
+
+  merge(stages, tasks);
+
+  write_json_series(fp, "stages", stages, indent);
+  fputs(",\n", fp);
+  write_json_series(fp, "tasks", tasks, indent);
+}
@@ -0,0 +1,94 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+
+#include <vector>
+
+#include <dng_types.h>
+#include <dng_mutex.h>
+
+#include "Progress.h"
+#include "StopWatch.h"
+#include "Trace.h"
+
+class StatsBuffer;
+struct StatsSeries;
+
+// Timing of the conversion stages and SDK area tasks, summarized at the end of the run.
+// Spans are recorded in per-thread buffers without locking, so leaving it on costs
+// a clock read and a vector append per span.
+class Stats
+{
+  public:
+  Stats();
+  ~Stats();
+
+  void start(void);
+  void stop(void);
+
+  // A stage (and output format, or NULL) took ulNsec on the calling thread.
+  // Names must outlive the run, they are told apart by address until print().
+  void add(const char *szStage, const char *szFormat, uint64 ulNsec, uint64 ulBytes, uint64 ulPixels);
+
+  // An SDK area task of type szTypeName (from typeid) covered ulPixels in ulNsec
+  void add_task(const char *szTypeName, uint64 ulNsec, uint64 ulPixels);
+
+  // Totals, p50/p95/p99 and throughput per stage and task. All recording threads must be done.
+  void print(FILE *fp);
+
+  // The same as "stages" and "tasks" members of a JSON object, sorted by name so runs
+  // can be compared. Every line starts with szIndent, no newline after the last one.
+  void write_json(FILE *fp, const char *szIndent);
+
+  protected:
+  StatsBuffer *get_buffer(void);
+  void merge(std::vector<StatsSeries> &stages, std::vector<StatsSeries> &tasks) const;
+
+  const unsigned int m_unGeneration;
+  StopWatch m_oRunWatch;
+
+  dng_mutex m_oMutex; // Only taken the first time a thread records
+  std::vector<StatsBuffer *> m_oBuffers;
+};
+
+// Times one stage of the current item and reports it to the progress stream, the stats
+// and/or the trace when done() is called. Does nothing if none of them is enabled.
+class StageSpan
+{
+  public:
+  StageSpan(Progress *poProgress, Stats *poStats, Trace *poTrace, const char *szStage)
+          : m_poProgress(poProgress), m_poStats(poStats), m_poTrace(poTrace), m_szStage(szStage)
+  {
+    if (m_poProgress || m_poStats || m_poTrace)
+      m_oWatch.run();
+  }
+
+  void done(uint64 ulBytes, uint64 ulPixels = 0, const char *szFormat = NULL)
+  {
+    if (!m_poProgress && !m_poStats && !m_poTrace)
+      return;
+
+    m_oWatch.stop();
+
+    if (m_poProgress)
+      m_poProgress->stage(m_szStage, m_oWatch.elapsed_usec(), ulBytes, szFormat);
+
+    if (m_poStats)
+      m_poStats->add(m_szStage, szFormat, m_oWatch.elapsed_nsec(), ulBytes, ulPixels);
+
+    if (m_poTrace)
+      m_poTrace->span(m_szStage, szFormat, m_oWatch.started_nsec(), m_oWatch.started_nsec() + m_oWatch.elapsed_nsec());
+  }
+
+  protected:
+  Progress *m_poProgress;
+  Stats *m_poStats;
+  Trace *m_poTrace;
+  const char *m_szStage;
+  StopWatch m_oWatch;
+};
+
+#endif // __STATS_H__
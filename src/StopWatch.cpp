@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <time.h>
 
 #include "StopWatch.h"
 
@@ -44,33 +45,25 @@ int gettimeofday(struct timeval *tv, struct timezone *tz)
 }
 #endif
 
-static struct timeval _utime_gap(struct timeval a, struct timeval b)
+uint64_t monotonic_nsec(void)
+#if defined(_WIN32) || defined(_WIN64)
 {
-  struct timeval ret;
-  if (b.tv_usec >= a.tv_usec) {
-    ret.tv_usec = b.tv_usec - a.tv_usec;
-    ret.tv_sec = b.tv_sec - a.tv_sec;
-  } else {
-    ret.tv_usec = 1000000 + b.tv_usec - a.tv_usec;
-    ret.tv_sec = b.tv_sec - a.tv_sec - 1;
-  }
-  return ret;
-}
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER count;
 
-uint64_t StopWatch::elapsed_usec()
-{
-  return (uint64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec;
-}
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+
+  QueryPerformanceCounter(&count);
 
-void StopWatch::stop()
+  return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+         (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+}
+#else
 {
-  struct timeval end, gap;
-  gettimeofday(&end, NULL);
-  gap = _utime_gap(start, end);
-  elapsed.tv_sec += gap.tv_sec;
-  elapsed.tv_usec += gap.tv_usec;
-  if (elapsed.tv_usec >= 1000000) {
-    elapsed.tv_usec -= 1000000;
-    elapsed.tv_sec++;
-  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
+#endif
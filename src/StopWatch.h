@@ -17,37 +17,51 @@ int gettimeofday(struct timeval *tv, struct timezone *tz);
 #include <sys/time.h>
 #endif
 
+// Nanoseconds of a clock that never jumps (CLOCK_MONOTONIC / QueryPerformanceCounter)
+uint64_t monotonic_nsec(void);
+
 class StopWatch
 {
   public:
-  StopWatch()
+  StopWatch() : start(0)
   {
     reset();
   }
 
   void reset()
   {
-    elapsed.tv_sec = 0;
-    elapsed.tv_usec = 0;
+    elapsed = 0;
+  }
+
+  uint64_t elapsed_usec()
+  {
+    return elapsed / 1000;
   }
 
-  uint64_t elapsed_usec();
+  uint64_t elapsed_nsec()
+  {
+    return elapsed;
+  }
 
-  void elapsed_timeval(struct timeval *res)
+  // monotonic_nsec() of the last run()
+  uint64_t started_nsec()
   {
-    *res = elapsed;
+    return start;
   }
 
   void run()
   {
-    gettimeofday(&start, NULL);
+    start = monotonic_nsec();
   }
 
-  void stop();
+  void stop()
+  {
+    elapsed += monotonic_nsec() - start;
+  }
 
   protected:
-  struct timeval elapsed;
-  struct timeval start;
+  uint64_t elapsed;
+  uint64_t start;
 };
 
 #endif // __STOP_WATCH_H
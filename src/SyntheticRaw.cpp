@@ -0,0 +1,64 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "SyntheticRaw.h"
+
+// xorshift32, the same sequence everywhere
+static inline uint32 next_random(uint32 &state)
+{
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static inline uint32 scene_value(const CameraProfile &profile, uint32 x, uint32 y, uint32 &state)
+{
+  const uint32 range = 4095 - profile.m_ulBlackLevel;
+  uint32 value;
+
+  if ((y & 1) == 0 && (x & 1) == 0)
+    value = (uint32)((uint64)range * x / profile.m_ulWidth); // R
+  else if ((y & 1) && (x & 1))
+    value = (uint32)((uint64)range * y / profile.m_ulHeight); // B
+  else
+    value = (uint32)((uint64)range * (x + y) / (profile.m_ulWidth + profile.m_ulHeight)); // G
+
+  if (((x >> 7) ^ (y >> 7)) & 1)
+    value = value / 2 + range / 4;
+
+  value += next_random(state) & 0x3F;
+
+  return std::min(value, range) + profile.m_ulBlackLevel;
+}
+
+void synthetic_raw_row(const CameraProfile &profile, uint32 y, uint32 &state, uint8 *row)
+{
+  uint8 *out = row;
+
+  // Two 12 bit pixels in three bytes, the layout CFAReader unpacks
+  for (uint32 x = 0; x < profile.m_ulWidth; x += 2, out += 3) {
+    const uint32 p0 = scene_value(profile, x, y, state);
+    const uint32 p1 = scene_value(profile, x + 1, y, state);
+
+    out[0] = (uint8)p0;
+    out[1] = (uint8)(((p0 >> 8) & 0x0F) | ((p1 & 0x0F) << 4));
+    out[2] = (uint8)(p1 >> 4);
+  }
+
+  memset(out, 0, profile.m_ulStride);
+}
+
+void synthetic_raw(const CameraProfile &profile, uint32 seed, std::vector<uint8> &raw)
+{
+  const size_t row_bytes = profile.m_ulFileSize / profile.m_ulHeight;
+  uint32 state = seed;
+
+  raw.resize(profile.m_ulFileSize);
+
+  for (uint32 y = 0; y < profile.m_ulHeight; ++y)
+    synthetic_raw_row(profile, y, state, &raw[y * row_bytes]);
+}
@@ -0,0 +1,23 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __SYNTHETIC_RAW_H__
+#define __SYNTHETIC_RAW_H__
+
+#include <vector>
+
+#include <dng_types.h>
+
+#include "CameraProfile.h"
+
+// Deterministic frames in the packed 12 bit layout of the cameras, for the benchmarks:
+// a Bayer scene with smooth gradients, hard edges for the demosaic and xorshift noise,
+// identical on every host and every run for the same seed.
+
+// Row y of the frame into row (m_ulFileSize / m_ulHeight bytes, stride included).
+// state carries the noise from row to row, start it at the seed.
+void synthetic_raw_row(const CameraProfile &profile, uint32 y, uint32 &state, uint8 *row);
+
+// The whole frame, m_ulFileSize bytes
+void synthetic_raw(const CameraProfile &profile, uint32 seed, std::vector<uint8> &raw);
+
+#endif // __SYNTHETIC_RAW_H__
@@ -0,0 +1,283 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <map>
+
+#include "Trace.h"
+#include "StopWatch.h"
+#include "helpers.h"
+#include "utils.h"
+
+// Spans a thread keeps, the oldest are overwritten beyond that
+#define TRACE_RING_SIZE 65536
+
+// Tile helpers of a lane are numbered below this
+#define TRACE_LANE_THREADS 1000
+
+enum TraceKind { traceStage, traceTask, traceTile };
+
+struct TraceEvent {
+  const char *m_szName;
+  const char *m_szDetail;
+  TraceKind m_eKind;
+  int32 m_iItem; // Index into the buffer's items, -1 for none
+  uint64 m_ulStart;
+  uint64 m_ulEnd;
+  dng_rect m_oTile;
+};
+
+// Spans of one thread, only touched by that thread until the run is over
+class TraceBuffer
+{
+  public:
+  TraceBuffer(uint32 unLane, uint32 unIndex) : m_unLane(unLane), m_unIndex(unIndex), m_iItem(-1), m_ulNext(0)
+  {
+  }
+
+  void push(const TraceEvent &oEvent)
+  {
+    if (m_oEvents.size() < TRACE_RING_SIZE)
+      m_oEvents.push_back(oEvent);
+    else
+      m_oEvents[m_ulNext % TRACE_RING_SIZE] = oEvent;
+
+    ++m_ulNext;
+  }
+
+  size_t dropped(void) const
+  {
+    return m_ulNext - m_oEvents.size();
+  }
+
+  // Event i in the order they were recorded
+  const TraceEvent &event(size_t i) const
+  {
+    return m_oEvents[(m_ulNext - m_oEvents.size() + i) % TRACE_RING_SIZE];
+  }
+
+  const uint32 m_unLane;
+  const uint32 m_unIndex;
+
+  std::vector<std::string> m_oItems;
+  int32 m_iItem;
+
+  std::vector<TraceEvent> m_oEvents;
+  size_t m_ulNext;
+};
+
+// Identifies the Trace a thread's buffer belongs to, a later Trace gets fresh buffers
+static unsigned int g_unTraceGeneration = 0;
+static THREAD_LOCAL unsigned int t_unGeneration = 0;
+static THREAD_LOCAL TraceBuffer *t_poBuffer = NULL;
+
+Trace::Trace(const std::string &szFile)
+        : m_szFile(szFile), m_fp(NULL), m_unGeneration(++g_unTraceGeneration), m_ulBase(0), m_oMutex("Trace"),
+          m_unLanes(0)
+{
+}
+
+Trace::~Trace()
+{
+  if (m_fp)
+    fclose(m_fp);
+
+  std::vector<TraceBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it)
+    delete *it;
+}
+
+int Trace::start(void)
+{
+  m_fp = fopen(m_szFile.c_str(), "w");
+  if (!m_fp) {
+    perror(m_szFile.c_str());
+    return -1;
+  }
+
+  m_ulBase = monotonic_nsec();
+
+  return 0;
+}
+
+static void write_args(FILE *fp, const TraceBuffer &buffer, const TraceEvent &ev)
+{
+  if (ev.m_eKind == traceTile) {
+    fprintf(fp, ",\"args\":{\"top\":%d,\"left\":%d,\"bottom\":%d,\"right\":%d}", ev.m_oTile.t, ev.m_oTile.l,
+            ev.m_oTile.b, ev.m_oTile.r);
+  } else if (ev.m_iItem >= 0) {
+    fputs(",\"args\":{\"item\":", fp);
+    write_json_string(fp, buffer.m_oItems[ev.m_iItem]);
+    fputc('}', fp);
+  }
+}
+
+int Trace::stop(void)
+{
+  if (!m_fp)
+    return -1;
+
+  static const char *const categories[] = { "stage", "task", "tile" };
+
+  // Area task names come from typeid, demangle each once
+  std::map<const char *, std::string> names;
+
+  size_t dropped = 0;
+  const char *sep = "";
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", m_fp);
+
+  std::vector<TraceBuffer *>::const_iterator it;
+  for (it = m_oBuffers.begin(); it != m_oBuffers.end(); ++it) {
+    const TraceBuffer &buffer = **it;
+    const uint32 pid = buffer.m_unLane;
+    const uint32 tid = buffer.m_unLane * TRACE_LANE_THREADS + buffer.m_unIndex;
+
+    if (buffer.m_unIndex == 0) {
+      fprintf(m_fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"converter %u\"}}", sep,
+              pid, pid);
+      sep = ",\n";
+      fprintf(m_fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"converter\"}}",
+              sep, pid, tid);
+    } else {
+      fprintf(m_fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"tiles %u\"}}",
+              sep, pid, tid, buffer.m_unIndex);
+    }
+    sep = ",\n";
+
+    for (size_t i = 0; i < buffer.m_oEvents.size(); ++i) {
+      const TraceEvent &ev = buffer.event(i);
+
+      std::string name;
+      if (ev.m_eKind == traceStage) {
+        name = ev.m_szName;
+        if (ev.m_szDetail) {
+          name += " ";
+          name += ev.m_szDetail;
+        }
+      } else {
+        std::map<const char *, std::string>::iterator found = names.find(ev.m_szName);
+        if (found == names.end())
+          found = names.insert(std::make_pair(ev.m_szName, demangle_type_name(ev.m_szName))).first;
+        name = found->second;
+      }
+
+      fprintf(m_fp, "%s{\"name\":", sep);
+      write_json_string(m_fp, name);
+      fprintf(m_fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u",
+              categories[ev.m_eKind], (double)(ev.m_ulStart - m_ulBase) / 1e3,
+              (double)(ev.m_ulEnd - ev.m_ulStart) / 1e3, pid, tid);
+      write_args(m_fp, buffer, ev);
+      fputc('}', m_fp);
+    }
+
+    dropped += buffer.dropped();
+  }
+
+  fputs("\n]}\n", m_fp);
+
+  int ret = ferror(m_fp) ? -1 : 0;
+  if (fclose(m_fp))
+    ret = -1;
+  m_fp = NULL;
+
+  if (ret)
+    fprintf(stderr, "Error: Unable to write trace to %s\n", m_szFile.c_str());
+  else if (dropped)
+    fprintf(stderr, "Warning: %zu early spans did not fit in the trace buffers\n", dropped);
+
+  return ret;
+}
+
+TraceBuffer *Trace::new_buffer(uint32 unLane, uint32 unIndex)
+{
+  dng_lock_mutex lock(&m_oMutex);
+
+  if (unLane == 0)
+    unLane = ++m_unLanes;
+
+  // Area tasks of a lane run one after the other and their helpers are joined in between,
+  // so helper i of the next task takes over the buffer of helper i of the previous one
+  const uint32 tid = unLane * TRACE_LANE_THREADS + unIndex;
+  std::map<uint32, TraceBuffer *>::const_iterator found = m_oLanes.find(tid);
+
+  if (found != m_oLanes.end()) {
+    t_poBuffer = found->second;
+  } else {
+    t_poBuffer = new TraceBuffer(unLane, unIndex);
+    m_oBuffers.push_back(t_poBuffer);
+    m_oLanes[tid] = t_poBuffer;
+  }
+
+  t_unGeneration = m_unGeneration;
+
+  return t_poBuffer;
+}
+
+TraceBuffer *Trace::get_buffer(void)
+{
+  if (t_unGeneration == m_unGeneration)
+    return t_poBuffer;
+
+  return new_buffer(0, 0);
+}
+
+uint32 Trace::lane(void)
+{
+  return get_buffer()->m_unLane;
+}
+
+void Trace::join_lane(uint32 unLane, uint32 unIndex)
+{
+  new_buffer(unLane, unIndex % TRACE_LANE_THREADS);
+}
+
+void Trace::begin_item(const std::string &szItem)
+{
+  TraceBuffer *buffer = get_buffer();
+
+  buffer->m_iItem = (int32)buffer->m_oItems.size();
+  buffer->m_oItems.push_back(szItem);
+}
+
+void Trace::span(const char *szName, const char *szDetail, uint64 ulStart, uint64 ulEnd)
+{
+  TraceBuffer *buffer = get_buffer();
+
+  TraceEvent ev;
+  ev.m_szName = szName;
+  ev.m_szDetail = szDetail;
+  ev.m_eKind = traceStage;
+  ev.m_iItem = buffer->m_iItem;
+  ev.m_ulStart = ulStart;
+  ev.m_ulEnd = ulEnd;
+
+  buffer->push(ev);
+}
+
+void Trace::task(const char *szTypeName, uint64 ulStart, uint64 ulEnd)
+{
+  TraceBuffer *buffer = get_buffer();
+
+  TraceEvent ev;
+  ev.m_szName = szTypeName;
+  ev.m_szDetail = NULL;
+  ev.m_eKind = traceTask;
+  ev.m_iItem = buffer->m_iItem;
+  ev.m_ulStart = ulStart;
+  ev.m_ulEnd = ulEnd;
+
+  buffer->push(ev);
+}
+
+void Trace::tile(const char *szTypeName, uint64 ulStart, uint64 ulEnd, const dng_rect &oTile)
+{
+  TraceEvent ev;
+  ev.m_szName = szTypeName;
+  ev.m_szDetail = NULL;
+  ev.m_eKind = traceTile;
+  ev.m_iItem = -1;
+  ev.m_ulStart = ulStart;
+  ev.m_ulEnd = ulEnd;
+  ev.m_oTile = oTile;
+
+  get_buffer()->push(ev);
+}
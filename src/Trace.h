@@ -0,0 +1,72 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dng_types.h>
+#include <dng_mutex.h>
+#include <dng_rect.h>
+
+class TraceBuffer;
+
+// Per thread timeline of the conversion in Chrome's Trace Event Format, for chrome://tracing
+// or ui.perfetto.dev. Each thread records spans into a ring of its own without locking and
+// the file is only written by stop(), so a thread that records a lot only loses its oldest
+// spans instead of slowing down.
+//
+// Every converter thread shows up as a process of its own, with the helper threads working
+// on the tiles of its SDK area tasks as threads of that process.
+class Trace
+{
+  public:
+  Trace(const std::string &szFile);
+  ~Trace();
+
+  // Creates the file, so a bad path is reported before converting anything
+  int start(void);
+
+  // Writes the recorded spans, all recording threads must be done
+  int stop(void);
+
+  // Item the calling thread works on, attached to its following spans
+  void begin_item(const std::string &szItem);
+
+  // A span of the calling thread between two monotonic_nsec() readings.
+  // Names must outlive the run, szDetail (or NULL) is appended to the name.
+  void span(const char *szName, const char *szDetail, uint64 ulStart, uint64 ulEnd);
+
+  // An SDK area task of type szTypeName (from typeid) over the calling thread's current item
+  void task(const char *szTypeName, uint64 ulStart, uint64 ulEnd);
+
+  // One tile of an SDK area task processed by the calling thread
+  void tile(const char *szTypeName, uint64 ulStart, uint64 ulEnd, const dng_rect &oTile);
+
+  // Lane (trace process) of the calling thread
+  uint32 lane(void);
+
+  // Record the calling thread as tile helper unIndex of lane unLane.
+  // Must come before it records anything.
+  void join_lane(uint32 unLane, uint32 unIndex);
+
+  protected:
+  TraceBuffer *get_buffer(void);
+  TraceBuffer *new_buffer(uint32 unLane, uint32 unIndex);
+
+  const std::string m_szFile;
+  FILE *m_fp;
+  const unsigned int m_unGeneration;
+  uint64 m_ulBase;
+
+  dng_mutex m_oMutex; // Only taken the first time a thread records
+  std::vector<TraceBuffer *> m_oBuffers;
+  std::map<uint32, TraceBuffer *> m_oLanes; // By trace thread id
+  uint32 m_unLanes;
+};
+
+#endif // __TRACE_H__
@@ -0,0 +1,69 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __WORK_QUEUE_H__
+#define __WORK_QUEUE_H__
+
+#include <deque>
+
+#include <dng_mutex.h>
+
+// Blocking queue feeding work items (owned pointers to T) to converter threads as they become known
+template <class T> class WorkQueue
+{
+  public:
+  WorkQueue() : m_oMutex("WorkQueue"), m_bClosed(false)
+  {
+  }
+
+  ~WorkQueue()
+  {
+    typename std::deque<T *>::const_iterator it;
+
+    for (it = m_oItems.begin(); it != m_oItems.end(); ++it)
+      delete *it;
+  }
+
+  // Takes ownership of item
+  void push(T *item)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    m_oItems.push_back(item);
+    m_oCondition.Signal();
+  }
+
+  // Wait for the next item, ownership passes to the caller. Returns NULL once closed and drained.
+  T *pop(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    while (m_oItems.empty() && !m_bClosed)
+      m_oCondition.Wait(m_oMutex);
+
+    if (m_oItems.empty())
+      return NULL;
+
+    T *item = m_oItems.front();
+    m_oItems.pop_front();
+
+    return item;
+  }
+
+  // No more items will be pushed, wake up idle workers
+  void close(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    m_bClosed = true;
+    m_oCondition.Broadcast();
+  }
+
+  protected:
+  dng_mutex m_oMutex;
+  dng_condition m_oCondition;
+
+  std::deque<T *> m_oItems;
+  bool m_bClosed;
+};
+
+#endif // __WORK_QUEUE_H__
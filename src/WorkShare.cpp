@@ -0,0 +1,218 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "WorkShare.h"
+#include "helpers.h"
+#include "utils.h"
+
+static const std::string lease_suffix(".lease");
+static const std::string done_suffix(".done");
+
+// The file's name and the name of its directory, which hosts see alike wherever the files are mounted
+static std::string share_key(const std::string &szRawFile)
+{
+  size_t pos = szRawFile.find_last_of("/\\");
+  if (pos == std::string::npos || pos == 0)
+    return szRawFile;
+
+  pos = szRawFile.find_last_of("/\\", pos - 1);
+
+  return pos == std::string::npos ? szRawFile : szRawFile.substr(pos + 1);
+}
+
+// 64-bit FNV-1a, the same on every host unlike std::hash
+static uint64_t share_hash(const std::string &szKey)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < szKey.size(); ++i) {
+    char c = szKey[i];
+    hash ^= (uint8_t)(c == '\\' ? '/' : c);
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static bool path_exists(const std::string &szPath)
+{
+  struct stat sb;
+  return stat(szPath.c_str(), &sb) == 0;
+}
+
+WorkShare::WorkShare() : m_ulShard(0), m_ulShards(1), m_unTtl(DEFAULT_LEASE_TTL), m_oMutex("WorkShare"), m_ulSkipped(0)
+{
+}
+
+void WorkShare::set_shard(size_t ulIndex, size_t ulCount)
+{
+  m_ulShard = ulIndex - 1;
+  m_ulShards = ulCount;
+}
+
+int WorkShare::set_lease_dir(const std::string &szDir, unsigned int unTtl)
+{
+  struct stat sb;
+  if (stat(szDir.c_str(), &sb)) {
+    perror(szDir.c_str());
+    return -1;
+  }
+
+  if (!S_ISDIR(sb.st_mode)) {
+    fprintf(stderr, "%s: Not a directory\n", szDir.c_str());
+    return -1;
+  }
+
+  m_szLeaseDir = szDir;
+  if (!has_suffix(m_szLeaseDir, DELIM))
+    m_szLeaseDir += DELIM;
+
+  m_unTtl = unTtl;
+
+  char host[256];
+#if defined(_WIN32) || defined(_WIN64)
+  const char *name = getenv("COMPUTERNAME");
+  snprintf(host, sizeof(host), "%s", name ? name : "localhost");
+#else
+  if (gethostname(host, sizeof(host)))
+    strcpy(host, "localhost");
+  host[sizeof(host) - 1] = '\0';
+#endif
+
+  char pid[32];
+  snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+
+  m_szOwner = std::string(host) + ":" + pid;
+
+  return 0;
+}
+
+bool WorkShare::in_shard(const std::string &szRawFile) const
+{
+  return m_ulShards <= 1 || share_hash(share_key(szRawFile)) % m_ulShards == m_ulShard;
+}
+
+std::string WorkShare::lease_path(const std::string &szRawFile) const
+{
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)share_hash(share_key(szRawFile)));
+
+  return m_szLeaseDir + name;
+}
+
+bool WorkShare::create_lease(const std::string &szLease) const
+{
+  int fd = open(szLease.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    if (errno != EEXIST)
+      perror(szLease.c_str());
+    return false;
+  }
+
+  // Who holds it, for whoever looks into the directory; the mtime is what counts
+  char line[320];
+  int len = snprintf(line, sizeof(line), "%s %lld\n", m_szOwner.c_str(), (long long)time(NULL));
+  if (len > 0 && write(fd, line, (size_t)len) != len)
+    perror(szLease.c_str());
+
+  close(fd);
+
+  return true;
+}
+
+bool WorkShare::take_over(const std::string &szLease) const
+{
+  struct stat sb;
+  if (stat(szLease.c_str(), &sb))
+    return errno == ENOENT;
+
+  if ((long long)time(NULL) - (long long)sb.st_mtime < (long long)m_unTtl)
+    return false;
+
+  // Only one of the processes finding the lease stale gets to rename it
+  std::string szOwner = m_szOwner;
+  std::replace(szOwner.begin(), szOwner.end(), ':', '.');
+  const std::string szStale = szLease + ".stale." + szOwner;
+
+  if (rename(szLease.c_str(), szStale.c_str()))
+    return errno == ENOENT;
+
+  // Another process took over between the stat and the rename, that lease is fresh: hand it back
+  bool stale =
+          stat(szStale.c_str(), &sb) == 0 && (long long)time(NULL) - (long long)sb.st_mtime >= (long long)m_unTtl;
+
+  if (!stale && rename(szStale.c_str(), szLease.c_str()) == 0)
+    return false;
+
+  remove(szStale.c_str());
+
+  return stale;
+}
+
+bool WorkShare::claim(const std::string &szRawFile)
+{
+  bool claimed = in_shard(szRawFile);
+
+  if (claimed && !m_szLeaseDir.empty()) {
+    const std::string szBase = lease_path(szRawFile);
+    const std::string szLease = szBase + lease_suffix;
+    const std::string szDone = szBase + done_suffix;
+
+    claimed = !path_exists(szDone) && (create_lease(szLease) || (take_over(szLease) && create_lease(szLease)));
+
+    // Finished by its previous holder between the check and the lease
+    if (claimed && path_exists(szDone)) {
+      remove(szLease.c_str());
+      claimed = false;
+    }
+  }
+
+  if (!claimed) {
+    dng_lock_mutex lock(&m_oMutex);
+    ++m_ulSkipped;
+  }
+
+  return claimed;
+}
+
+void WorkShare::release(const std::string &szRawFile, bool bDone)
+{
+  if (m_szLeaseDir.empty())
+    return;
+
+  const std::string szBase = lease_path(szRawFile);
+  const std::string szLease = szBase + lease_suffix;
+
+  if (!bDone) {
+    remove(szLease.c_str());
+    return;
+  }
+
+  const std::string szDone = szBase + done_suffix;
+
+  // The lease may have been taken over meanwhile, the file is done all the same
+  if (replace_file(szLease, szDone)) {
+    int fd = open(szDone.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      perror(szDone.c_str());
+    else
+      close(fd);
+  }
+}
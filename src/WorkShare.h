@@ -0,0 +1,71 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __WORK_SHARE_H__
+#define __WORK_SHARE_H__
+
+#include <string>
+
+#include <dng_mutex.h>
+
+// Lease age after which the worker holding it is taken for dead
+#define DEFAULT_LEASE_TTL 600
+
+// Splits one batch between processes, on one host or several sharing the files, with no coordinator.
+// Statically, every process takes the files whose name hashes to its shard. Dynamically, a process
+// claims a file by creating its lease in a shared directory and turns the lease into a done mark
+// once converted, so the others skip it; leases older than the TTL are taken over.
+//
+// Files are known by their directory and file name ("100MEDIA/IMG_0001.RAW"), so hosts may mount the
+// files at different paths. Creating a lease and renaming it are atomic on local file systems and NFS.
+// A race lost around a stale lease at worst converts a file twice, which outputs survive as they are
+// renamed into place; no file is ever left out.
+class WorkShare
+{
+  public:
+  WorkShare();
+
+  // Only files of shard ulIndex (1 based) of ulCount
+  void set_shard(size_t ulIndex, size_t ulCount);
+
+  // Claim files by lease in szDir, which must exist, taking over leases older than unTtl seconds.
+  // The clocks of the hosts must agree to well within unTtl.
+  int set_lease_dir(const std::string &szDir, unsigned int unTtl);
+
+  bool in_shard(const std::string &szRawFile) const;
+
+  // True if this process is to convert szRawFile: it is in the shard and, with leases, its lease
+  // was created or taken over
+  bool claim(const std::string &szRawFile);
+
+  // Mark a claimed file done, or give up its lease so another process may try it
+  void release(const std::string &szRawFile, bool bDone);
+
+  // Files claimed by the other processes
+  size_t get_skipped(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulSkipped;
+  }
+
+  protected:
+  // "<lease dir>/<hash of the file's name>"
+  std::string lease_path(const std::string &szRawFile) const;
+
+  // Create the lease, false if it exists
+  bool create_lease(const std::string &szLease) const;
+
+  // Move the lease out of the way if it is older than the TTL, false if it is not (any more)
+  bool take_over(const std::string &szLease) const;
+
+  size_t m_ulShard;
+  size_t m_ulShards;
+
+  std::string m_szLeaseDir;
+  unsigned int m_unTtl;
+  std::string m_szOwner; // host:pid, written into the leases
+
+  dng_mutex m_oMutex;
+  size_t m_ulSkipped;
+};
+
+#endif // __WORK_SHARE_H__
@@ -0,0 +1,661 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+// Microbenchmarks of the kernels a conversion spends its time in, at the real frame sizes of
+// the cameras. Each kernel runs a few untimed warmup rounds and then the timed repetitions,
+// the summary of every kernel and frame size goes to stdout as JSON.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "CFAReader.h"
+#include "CFAUnpackTask.h"
+#include "ConverterHost.h"
+#include "DNGConverter.h"
+#include "FastMD5.h"
+#include "StopWatch.h"
+#include "SyntheticRaw.h"
+#include "utils.h"
+#include "version.h"
+
+#include <dng_fingerprint.h>
+#include <dng_globals.h>
+#include <dng_image.h>
+#include <dng_image_writer.h>
+#include <dng_lossless_jpeg.h>
+#include <dng_memory_stream.h>
+#include <dng_negative.h>
+#include <dng_pixel_buffer.h>
+#include <dng_preview.h>
+#include <dng_render.h>
+#include <dng_resample.h>
+#include <dng_string.h>
+
+#define DEFAULT_REPS 5
+#define DEFAULT_WARMUP 1
+
+// Tiles the DNG writer hands to the lossless JPEG encoder
+#define LOSSLESS_TILE_SIZE 256
+
+// Longest side of the JPEG preview the converter embeds
+#define PREVIEW_SIZE 1024
+
+// Everything the kernels of one frame size work on
+struct Frame {
+  Frame(const CameraProfile &profile, uint32 threads)
+          : m_oProfile(profile), m_oBounds(profile.m_ulHeight, profile.m_ulWidth), m_oHost(threads)
+  {
+  }
+
+  const CameraProfile &m_oProfile;
+  const dng_rect m_oBounds;
+  ConverterHost m_oHost;
+
+  std::vector<uint8> m_oRaw;
+  CFAReader m_oReader;
+
+  AutoPtr<dng_image> m_oStage1;
+  std::vector<uint16> m_oStage1Samples; // Stage 1 with its planes interleaved, as the DNG writer encodes it
+
+  AutoPtr<dng_negative> m_oNegative; // Up to stage 3
+  AutoPtr<dng_image> m_oPreview; // Rendered at preview size
+};
+
+class Kernel
+{
+  public:
+  Kernel(const char *szName) : m_szName(szName), m_ulPixels(0), m_ulBytes(0)
+  {
+  }
+
+  virtual ~Kernel()
+  {
+  }
+
+  // Untimed, before every round
+  virtual void prepare(Frame &)
+  {
+  }
+
+  virtual void run(Frame &frame) = 0;
+
+  const char *m_szName;
+  uint64 m_ulPixels; // Processed per round, for the throughput
+  uint64 m_ulBytes;
+};
+
+class CFAReadKernel : public Kernel
+{
+  public:
+  CFAReadKernel() : Kernel("cfa_read")
+  {
+  }
+
+  virtual void prepare(Frame &frame)
+  {
+    m_oOut.resize((size_t)frame.m_oProfile.m_ulWidth * frame.m_oProfile.m_ulHeight * 2);
+  }
+
+  virtual void run(Frame &frame)
+  {
+    frame.m_oReader.read(&m_oOut[0], frame.m_oProfile.m_ulWidth, frame.m_oProfile.m_ulHeight,
+                         frame.m_oProfile.m_ulStride);
+  }
+
+  protected:
+  std::vector<uint8> m_oOut;
+};
+
+class CFAReadAreaKernel : public CFAReadKernel
+{
+  public:
+  CFAReadAreaKernel()
+  {
+    m_szName = "cfa_read_area";
+  }
+
+  virtual void run(Frame &frame)
+  {
+    frame.m_oReader.read_area(&m_oOut[0], frame.m_oProfile.m_ulWidth, frame.m_oProfile.m_ulStride, 0, 0,
+                              frame.m_oProfile.m_ulHeight, frame.m_oProfile.m_ulWidth);
+  }
+};
+
+// Unpack and raw digest, the "read" stage of a conversion
+class CFAUnpackKernel : public Kernel
+{
+  public:
+  CFAUnpackKernel() : Kernel("cfa_unpack")
+  {
+  }
+
+  virtual void run(Frame &frame)
+  {
+    CFAUnpackTask task(frame.m_oReader, frame.m_oProfile, *frame.m_oStage1.Get());
+    frame.m_oHost.PerformAreaTask(task, frame.m_oBounds);
+  }
+};
+
+class MD5Kernel : public Kernel
+{
+  public:
+  MD5Kernel() : Kernel("md5")
+  {
+  }
+
+  virtual void run(Frame &frame)
+  {
+    dng_md5_printer printer;
+    printer.Process(&frame.m_oRaw[0], (uint32)frame.m_oRaw.size());
+    printer.Result();
+  }
+};
+
+// Four quarters of the frame side by side, as CFAUnpackTask hashes its tiles
+class MD5x4Kernel : public Kernel
+{
+  public:
+  MD5x4Kernel() : Kernel("md5_x4")
+  {
+  }
+
+  virtual void run(Frame &frame)
+  {
+    const uint32 len = (uint32)(frame.m_oRaw.size() / MD5_LANES);
+    const uint8 *data[MD5_LANES];
+    dng_fingerprint result[MD5_LANES];
+
+    for (uint32 i = 0; i < MD5_LANES; ++i)
+      data[i] = &frame.m_oRaw[i * len];
+
+    md5_x4(data, len, result);
+  }
+};
+
+class LosslessJPEGKernel : public Kernel
+{
+  public:
+  LosslessJPEGKernel() : Kernel("lossless_jpeg")
+  {
+  }
+
+  virtual void run(Frame &frame)
+  {
+    const uint32 width = frame.m_oProfile.m_ulWidth;
+    const uint32 height = frame.m_oProfile.m_ulHeight;
+    const uint32 planes = frame.m_oStage1->Planes();
+    dng_memory_stream stream(frame.m_oHost.Allocator());
+
+    for (uint32 top = 0; top < height; top += LOSSLESS_TILE_SIZE) {
+      const uint32 rows = std::min((uint32)LOSSLESS_TILE_SIZE, height - top);
+
+      for (uint32 left = 0; left < width; left += LOSSLESS_TILE_SIZE) {
+        const uint32 cols = std::min((uint32)LOSSLESS_TILE_SIZE, width - left);
+
+        EncodeLosslessJPEG(&frame.m_oStage1Samples[((size_t)top * width + left) * planes], rows, cols, planes, 12,
+                           (int32)(width * planes), (int32)planes, stream);
+      }
+    }
+  }
+};
+
+// Negative with a fresh copy of stage 1, built up to stage 2 if bStage2
+static dng_negative *make_negative(DNGConverter &converter, Frame &frame, bool bStage2)
+{
+  AutoPtr<dng_negative> negative(converter.MakeNegative(frame.m_oHost, &frame.m_oProfile, Exif()));
+
+  AutoPtr<dng_image> stage1(frame.m_oStage1->Clone());
+  negative->SetStage1Image(stage1);
+
+  if (bStage2)
+    negative->BuildStage2Image(frame.m_oHost);
+
+  return negative.Release();
+}
+
+// dng_linearize_image / dng_linearize_plane
+class LinearizeKernel : public Kernel
+{
+  public:
+  LinearizeKernel(DNGConverter &converter) : Kernel("linearize"), m_oConverter(converter)
+  {
+  }
+
+  virtual void prepare(Frame &frame)
+  {
+    m_oNegative.Reset(make_negative(m_oConverter, frame, false));
+  }
+
+  virtual void run(Frame &frame)
+  {
+    m_oNegative->BuildStage2Image(frame.m_oHost);
+  }
+
+  protected:
+  DNGConverter &m_oConverter;
+  AutoPtr<dng_negative> m_oNegative;
+};
+
+// Demosaic, dng_bilinear_interpolator
+class DemosaicKernel : public LinearizeKernel
+{
+  public:
+  DemosaicKernel(DNGConverter &converter) : LinearizeKernel(converter)
+  {
+    m_szName = "demosaic";
+  }
+
+  virtual void prepare(Frame &frame)
+  {
+    m_oNegative.Reset(make_negative(m_oConverter, frame, true));
+  }
+
+  virtual void run(Frame &frame)
+  {
+    m_oNegative->BuildStage3Image(frame.m_oHost);
+  }
+};
+
+// Full size render, dng_render_task
+class RenderKernel : public Kernel
+{
+  public:
+  RenderKernel() : Kernel("render")
+  {
+  }
+
+  virtual void run(Frame &frame)
+  {
+    dng_render render(frame.m_oHost, *frame.m_oNegative.Get());
+    AutoPtr<dng_image> image(render.Render());
+  }
+};
+
+// Stage 3 down to preview size, dng_resample_task
+class ResampleKernel : public Kernel
+{
+  public:
+  ResampleKernel() : Kernel("resample")
+  {
+  }
+
+  virtual void prepare(Frame &frame)
+  {
+    if (m_oImage.Get())
+      return;
+
+    const dng_image &stage3 = *frame.m_oNegative->Stage3Image();
+    const dng_rect &bounds = stage3.Bounds();
+    const real64 scale = (real64)PREVIEW_SIZE / (real64)Max_int32(bounds.W(), bounds.H());
+
+    dng_rect dst(Round_int32(bounds.H() * scale), Round_int32(bounds.W() * scale));
+    m_oImage.Reset(frame.m_oHost.Make_dng_image(dst, stage3.Planes(), stage3.PixelType()));
+  }
+
+  virtual void run(Frame &frame)
+  {
+    const dng_image &stage3 = *frame.m_oNegative->Stage3Image();
+
+    ResampleImage(frame.m_oHost, stage3, *m_oImage.Get(), stage3.Bounds(), m_oImage->Bounds(),
+                  dng_resample_bicubic::Get());
+  }
+
+  protected:
+  AutoPtr<dng_image> m_oImage;
+};
+
+class JPEGPreviewKernel : public Kernel
+{
+  public:
+  JPEGPreviewKernel() : Kernel("jpeg_preview")
+  {
+  }
+
+  virtual void run(Frame &frame)
+  {
+    dng_jpeg_preview preview;
+    dng_image_writer writer;
+
+    writer.EncodeJPEGPreview(frame.m_oHost, *frame.m_oPreview.Get(), preview, 4);
+  }
+};
+
+struct KernelResult {
+  std::string m_szKernel;
+  const CameraProfile *m_poProfile;
+  std::vector<uint64> m_oSamples; // nsec, sorted
+  uint64 m_ulPixels;
+  uint64 m_ulBytes;
+};
+
+static void prepare_frame(DNGConverter &converter, Frame &frame)
+{
+  synthetic_raw(frame.m_oProfile, 1, frame.m_oRaw);
+  frame.m_oReader.open(&frame.m_oRaw[0], frame.m_oRaw.size(), frame.m_oProfile.m_ulFileSize);
+
+  // With the planes of a conversion's, the kernels after unpacking go through all of them
+  frame.m_oStage1.Reset(DNGConverter::MakeRawImage(frame.m_oHost, frame.m_oProfile));
+
+  CFAUnpackTask task(frame.m_oReader, frame.m_oProfile, *frame.m_oStage1.Get());
+  frame.m_oHost.PerformAreaTask(task, frame.m_oBounds);
+
+  const uint32 planes = frame.m_oStage1->Planes();
+
+  frame.m_oStage1Samples.resize((size_t)frame.m_oBounds.W() * frame.m_oBounds.H() * planes);
+
+  dng_pixel_buffer buffer;
+
+  buffer.fArea = frame.m_oBounds;
+  buffer.fPlane = 0;
+  buffer.fPlanes = planes;
+  buffer.fRowStep = frame.m_oBounds.W() * planes;
+  buffer.fColStep = planes;
+  buffer.fPlaneStep = 1;
+  buffer.fPixelType = ttShort;
+  buffer.fPixelSize = TagTypeSize(ttShort);
+  buffer.fData = &frame.m_oStage1Samples[0];
+
+  frame.m_oStage1->Get(buffer);
+
+  frame.m_oNegative.Reset(make_negative(converter, frame, true));
+  frame.m_oNegative->BuildStage3Image(frame.m_oHost);
+
+  dng_render render(frame.m_oHost, *frame.m_oNegative.Get());
+  render.SetMaximumSize(PREVIEW_SIZE);
+  frame.m_oPreview.Reset(render.Render());
+}
+
+static void run_kernel(Kernel &kernel, Frame &frame, int warmup, int reps, KernelResult &result)
+{
+  for (int i = 0; i < warmup; ++i) {
+    kernel.prepare(frame);
+    kernel.run(frame);
+  }
+
+  for (int i = 0; i < reps; ++i) {
+    kernel.prepare(frame);
+
+    StopWatch watch;
+    watch.run();
+    kernel.run(frame);
+    watch.stop();
+
+    result.m_oSamples.push_back(watch.elapsed_nsec());
+  }
+
+  std::sort(result.m_oSamples.begin(), result.m_oSamples.end());
+
+  result.m_szKernel = kernel.m_szName;
+  result.m_poProfile = &frame.m_oProfile;
+  result.m_ulPixels = kernel.m_ulPixels;
+  result.m_ulBytes = kernel.m_ulBytes;
+}
+
+static int pin_cpus(const std::vector<std::string> &cpus)
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < cpus.size(); ++i)
+    CPU_SET(atoi(cpus[i].c_str()), &set);
+
+  // Tile helper threads started later inherit the mask
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    perror("sched_setaffinity");
+    return -1;
+  }
+#elif defined(_WIN32) || defined(_WIN64)
+  DWORD_PTR mask = 0;
+  for (size_t i = 0; i < cpus.size(); ++i)
+    mask |= (DWORD_PTR)1 << atoi(cpus[i].c_str());
+
+  if (!SetProcessAffinityMask(GetCurrentProcess(), mask)) {
+    fprintf(stderr, "Error: Unable to pin to CPUs (%lu)\n", GetLastError());
+    return -1;
+  }
+#else
+  (void)cpus;
+  fprintf(stderr, "Warning: CPU pinning is not supported on this platform\n");
+#endif
+
+  return 0;
+}
+
+static void write_rate(FILE *fp, const char *key, uint64 amount, double divisor, uint64 nsec)
+{
+  fprintf(fp, ",\"%s\":", key);
+  if (amount && nsec)
+    fprintf(fp, "%.3f", (double)amount / divisor / ((double)nsec / 1e9));
+  else
+    fputs("null", fp);
+}
+
+static void write_result(FILE *fp, const KernelResult &result)
+{
+  const std::vector<uint64> &samples = result.m_oSamples;
+  const size_t n = samples.size();
+
+  double mean = 0;
+  for (size_t i = 0; i < n; ++i)
+    mean += (double)samples[i];
+  mean /= (double)n;
+
+  double var = 0;
+  for (size_t i = 0; i < n; ++i)
+    var += ((double)samples[i] - mean) * ((double)samples[i] - mean);
+  const double stddev = n > 1 ? sqrt(var / (double)(n - 1)) : 0;
+
+  const uint64 median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  const size_t rank95 = (n * 95 + 99) / 100;
+
+  fprintf(fp, "{\"kernel\":\"%s\",\"width\":%u,\"height\":%u,\"reps\":%zu", result.m_szKernel.c_str(),
+          result.m_poProfile->m_ulWidth, result.m_poProfile->m_ulHeight, n);
+  fprintf(fp, ",\"min_ms\":%.3f,\"median_ms\":%.3f,\"mean_ms\":%.3f,\"p95_ms\":%.3f,\"max_ms\":%.3f,\"stddev_ms\":%.3f",
+          (double)samples[0] / 1e6, (double)median / 1e6, mean / 1e6, (double)samples[rank95 - 1] / 1e6,
+          (double)samples[n - 1] / 1e6, stddev / 1e6);
+
+  // Throughput at the median, the least noisy estimate over a handful of rounds
+  write_rate(fp, "mpix_per_s", result.m_ulPixels, 1e6, median);
+  write_rate(fp, "mb_per_s", result.m_ulBytes, 1024.0 * 1024.0, median);
+  fputc('}', fp);
+}
+
+static bool selected(const std::vector<std::string> &names, const std::string &name)
+{
+  return names.empty() || std::find(names.begin(), names.end(), name) != names.end();
+}
+
+static void usage(const char *prog)
+{
+  printf("Usage: %s <options>\n"
+         "Times the conversion kernels on synthetic frames of every supported resolution and prints\n"
+         "the summary as JSON on stdout\n"
+         "\n"
+         "Options:\n"
+         "\t-h, --help          Help\n"
+         "\t-v, --version       Print version info and exit\n"
+         "\t-n, --reps <NUM>    Timed repetitions per kernel. Default: %d\n"
+         "\t-w, --warmup <NUM>  Untimed repetitions before. Default: %d\n"
+         "\t-p, --threads <NUM> Threads per area task. Default: 1\n"
+         "\t--cpu <LIST>        Pin to the CPUs in the comma separated LIST\n"
+         "\t-k, --kernel <LIST> Only the kernels in the comma separated LIST: cfa_read, cfa_read_area,\n"
+         "\t                    cfa_unpack, md5, md5_x4, lossless_jpeg, linearize, demosaic, render,\n"
+         "\t                    resample, jpeg_preview\n"
+         "\t-s, --size <WxH>    Only frames of this size\n",
+         prog, DEFAULT_REPS, DEFAULT_WARMUP);
+}
+
+int main(int argc, char *argv[])
+{
+  int reps = DEFAULT_REPS;
+  int warmup = DEFAULT_WARMUP;
+  int threads = 1;
+  std::string cpu_list;
+  std::vector<std::string> cpus;
+  std::vector<std::string> kernels;
+  std::string size;
+
+  int index;
+
+#if qDNGValidate
+  gVerbose = false;
+#endif
+
+  for (index = 1; index < argc && argv[index][0] == '-'; index++) {
+    dng_string option;
+
+    option.Set(&argv[index][1]);
+
+    if (option.Matches("h", true) || option.Matches("-help", true)) {
+      usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (option.Matches("v", true) || option.Matches("-version", true)) {
+      printf("Version: %s\n", VERSION_STR);
+      return EXIT_SUCCESS;
+    } else if (option.Matches("n", true) || option.Matches("-reps", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0]) && atoi(argv[index + 1]) > 0) {
+        reps = atoi(argv[++index]);
+      } else {
+        fprintf(stderr, "Error: Missing number of repetitions\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("w", true) || option.Matches("-warmup", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0])) {
+        warmup = atoi(argv[++index]);
+      } else {
+        fprintf(stderr, "Error: Missing number of warmup repetitions\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("p", true) || option.Matches("-threads", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0]) && atoi(argv[index + 1]) > 0) {
+        threads = atoi(argv[++index]);
+      } else {
+        fprintf(stderr, "Error: Missing number of threads\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-cpu", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0])) {
+        cpu_list = argv[++index];
+        split_string(cpu_list, ',', cpus);
+      } else {
+        fprintf(stderr, "Error: Missing CPU list\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("k", true) || option.Matches("-kernel", true)) {
+      if (index + 1 < argc) {
+        split_string(argv[++index], ',', kernels);
+      } else {
+        fprintf(stderr, "Error: Missing kernel list\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("s", true) || option.Matches("-size", true)) {
+      if (index + 1 < argc) {
+        size = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing frame size\n");
+        return EXIT_FAILURE;
+      }
+    } else {
+      fprintf(stderr, "Error: Unknown option \"-%s\"\n", option.Get());
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!cpus.empty() && pin_cpus(cpus))
+    return EXIT_FAILURE;
+
+  // Builds the negatives the way a conversion does
+  Config conf;
+  DNGConverter converter(conf);
+
+  std::vector<KernelResult> results;
+
+  for (size_t p = 0; p < DNGConverter::GetCameraProfileCount(); ++p) {
+    const CameraProfile &profile = DNGConverter::GetCameraProfile(p);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%ux%u", profile.m_ulWidth, profile.m_ulHeight);
+    if (!size.empty() && size != name)
+      continue;
+
+    fprintf(stderr, "%s (%s)\n", name, profile.m_szCameraModel.c_str());
+
+    Frame frame(profile, (uint32)threads);
+    prepare_frame(converter, frame);
+
+    const uint64 pixels = (uint64)profile.m_ulWidth * profile.m_ulHeight;
+    const uint64 preview_pixels = (uint64)frame.m_oPreview->Bounds().W() * frame.m_oPreview->Bounds().H();
+
+    std::vector<Kernel *> list;
+    list.push_back(new CFAReadKernel());
+    list.push_back(new CFAReadAreaKernel());
+    list.push_back(new CFAUnpackKernel());
+    list.push_back(new MD5Kernel());
+    list.push_back(new MD5x4Kernel());
+    list.push_back(new LosslessJPEGKernel());
+    list.push_back(new LinearizeKernel(converter));
+    list.push_back(new DemosaicKernel(converter));
+    list.push_back(new RenderKernel());
+    list.push_back(new ResampleKernel());
+    list.push_back(new JPEGPreviewKernel());
+
+    for (size_t k = 0; k < list.size(); ++k) {
+      Kernel &kernel = *list[k];
+
+      kernel.m_ulPixels = pixels;
+      if (kernel.m_szName == std::string("jpeg_preview"))
+        kernel.m_ulPixels = preview_pixels;
+
+      // Raw readout for the kernels working on it, 16-bit samples of every stage 1 plane for the others
+      if (kernel.m_szName[0] == 'c' || kernel.m_szName[0] == 'm')
+        kernel.m_ulBytes = profile.m_ulFileSize;
+      else if (kernel.m_szName == std::string("lossless_jpeg") || kernel.m_szName == std::string("linearize"))
+        kernel.m_ulBytes = pixels * 2 * frame.m_oStage1->Planes();
+
+      if (selected(kernels, kernel.m_szName)) {
+        fprintf(stderr, "  %s\n", kernel.m_szName);
+
+        results.push_back(KernelResult());
+        try {
+          run_kernel(kernel, frame, warmup, reps, results.back());
+        } catch (const dng_exception &except) {
+          fprintf(stderr, "Error: %s failed (%d)\n", kernel.m_szName, except.ErrorCode());
+          results.pop_back();
+        }
+      }
+
+      delete list[k];
+    }
+  }
+
+  printf("{\n");
+  printf("  \"benchmark\": \"bench_kernels\",\n");
+  printf("  \"version\": \"%s\",\n", VERSION_STR);
+  printf("  \"config\": {\"reps\":%d,\"warmup\":%d,\"threads\":%d,\"cpus\":", reps, warmup, threads);
+  if (cpu_list.empty())
+    printf("null");
+  else
+    write_json_string(stdout, cpu_list);
+  printf("},\n");
+
+  printf("  \"kernels\": [");
+  for (size_t i = 0; i < results.size(); ++i) {
+    printf("%s\n    ", i ? "," : "");
+    write_result(stdout, results[i]);
+  }
+  printf("%s]\n}\n", results.empty() ? "" : "\n  ");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,586 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+// End-to-end throughput benchmark: generates a synthetic corpus with a RAW (and optionally
+// a JPG sidecar) for every supported resolution, converts it and reports the results as JSON,
+// so runs can be compared across commits and build hosts.
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <direct.h>
+#include <io.h>
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include "DNGConverter.h"
+#include "Stats.h"
+#include "StopWatch.h"
+#include "SyntheticRaw.h"
+#include "helpers.h"
+#include "utils.h"
+#include "version.h"
+
+#include <dng_globals.h>
+#include <dng_memory_stream.h>
+#include <dng_mutex.h>
+#include <dng_pthread.h>
+#include <dng_string.h>
+
+#define DEFAULT_CORPUS_DIR "bench_corpus"
+#define DEFAULT_FILES_PER_PROFILE 2
+
+struct BenchFile {
+  std::string m_szRawFile;
+  std::string m_szJpgFile; // Empty without sidecars
+  const CameraProfile *m_poProfile;
+};
+
+struct BenchRun {
+  BenchRun()
+          : m_poConverter(NULL), m_poFiles(NULL), m_bMemory(false), m_bDng(false), m_bTiff(false), m_ulNext(0),
+            m_ulFailed(0), m_ulPixels(0), m_ulBytes(0), m_oMutex("BenchRun")
+  {
+  }
+
+  DNGConverter *m_poConverter;
+  const std::vector<BenchFile> *m_poFiles;
+  bool m_bMemory;
+  bool m_bDng;
+  bool m_bTiff;
+
+  size_t m_ulNext;
+  size_t m_ulFailed;
+  uint64 m_ulPixels; // Of the files converted
+  uint64 m_ulBytes;
+  dng_mutex m_oMutex;
+};
+
+static int write_raw(const std::string &path, const CameraProfile &profile, uint32 seed)
+{
+  struct stat sb;
+  if (stat(path.c_str(), &sb) == 0 && (size_t)sb.st_size == profile.m_ulFileSize)
+    return 0;
+
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    perror(path.c_str());
+    return -1;
+  }
+
+  const size_t row_bytes = profile.m_ulFileSize / profile.m_ulHeight;
+  std::vector<uint8> row(row_bytes, 0);
+  uint32 state = seed;
+
+  for (uint32 y = 0; y < profile.m_ulHeight; ++y) {
+    synthetic_raw_row(profile, y, state, &row[0]);
+
+    if (fwrite(&row[0], 1, row_bytes, fp) != row_bytes) {
+      perror(path.c_str());
+      fclose(fp);
+      remove(path.c_str());
+      return -1;
+    }
+  }
+
+  if (fclose(fp)) {
+    perror(path.c_str());
+    remove(path.c_str());
+    return -1;
+  }
+
+  return 0;
+}
+
+static void put16(std::vector<uint8> &buf, uint32 val)
+{
+  buf.push_back((uint8)val);
+  buf.push_back((uint8)(val >> 8));
+}
+
+static void put32(std::vector<uint8> &buf, uint32 val)
+{
+  put16(buf, val & 0xFFFF);
+  put16(buf, val >> 16);
+}
+
+// An IFD entry, count values of type at offset (or the value itself if it fits in 4 bytes)
+static void put_entry(std::vector<uint8> &buf, uint32 tag, uint32 type, uint32 count, uint32 value)
+{
+  put16(buf, tag);
+  put16(buf, type);
+  put32(buf, count);
+  put32(buf, value);
+}
+
+// An ASCII entry of len bytes (with the NUL), short strings are stored in the entry itself
+static void put_ascii_entry(std::vector<uint8> &buf, uint32 tag, const char *str, uint32 len, uint32 offset)
+{
+  if (len > 4) {
+    put_entry(buf, tag, 2, len, offset);
+    return;
+  }
+
+  put16(buf, tag);
+  put16(buf, 2);
+  put32(buf, len);
+  for (uint32 i = 0; i < 4; ++i)
+    buf.push_back(i < len ? (uint8)str[i] : 0);
+}
+
+// Native Exif (little endian TIFF) with the tags XMPFiles reconciles the XMP against:
+// without them it drops the XMP's tiff: and exif: properties the converter needs
+static void build_exif(std::vector<uint8> &exif, const CameraProfile &profile, const char *date)
+{
+  const char *model_str = profile.m_szCameraModel.c_str();
+  const uint32 model_len = (uint32)profile.m_szCameraModel.size() + 1;
+  const uint32 date_len = (uint32)strlen(date) + 1;
+
+  // Offsets from the TIFF header
+  const uint32 ifd0 = 8;
+  const uint32 model = ifd0 + 2 + 2 * 12 + 4;
+  const uint32 exif_ifd = (model + (model_len > 4 ? model_len : 0) + 1) & ~1U;
+  const uint32 exposure_time = exif_ifd + 2 + 5 * 12 + 4;
+  const uint32 exposure_bias = exposure_time + 8;
+  const uint32 date_time = exposure_bias + 8;
+
+  const char header[] = "Exif\0\0II*\0";
+  exif.assign(header, header + sizeof(header) - 1);
+  put32(exif, ifd0);
+
+  put16(exif, 2);
+  put_ascii_entry(exif, 0x0110, model_str, model_len, model); // Model
+  put_entry(exif, 0x8769, 4, 1, exif_ifd); // ExifIFD
+  put32(exif, 0);
+  if (model_len > 4)
+    exif.insert(exif.end(), model_str, model_str + model_len);
+  exif.resize(6 + exif_ifd, 0);
+
+  put16(exif, 5);
+  put_entry(exif, 0x829A, 5, 1, exposure_time); // ExposureTime
+  put_entry(exif, 0x8827, 3, 1, 100); // ISOSpeedRatings
+  put_ascii_entry(exif, 0x9003, date, date_len, date_time); // DateTimeOriginal
+  put_entry(exif, 0x9204, 10, 1, exposure_bias); // ExposureBiasValue
+  put_entry(exif, 0x9208, 3, 1, 0); // LightSource
+  put32(exif, 0);
+  put32(exif, 1);
+  put32(exif, 120);
+  put32(exif, 0);
+  put32(exif, 10);
+  exif.insert(exif.end(), date, date + date_len);
+}
+
+static void put_segment(FILE *fp, uint8 marker, const void *data, size_t size)
+{
+  const size_t seg_len = size + 2;
+  const uint8 header[] = { 0xFF, marker, (uint8)(seg_len >> 8), (uint8)seg_len };
+
+  fwrite(header, 1, sizeof(header), fp);
+  fwrite(data, 1, size, fp);
+}
+
+// A JPEG holding just the Exif and XMP the converter reads its metadata from
+static int write_jpg(const std::string &path, const CameraProfile &profile, uint32 index)
+{
+  static const char xmp_sig[] = "http://ns.adobe.com/xap/1.0/";
+
+  char date[32];
+  snprintf(date, sizeof(date), "2017:06:01 12:00:%02u", index % 60);
+
+  std::vector<uint8> exif;
+  build_exif(exif, profile, date);
+
+  char packet[2048];
+  const int packet_len =
+    snprintf(packet, sizeof(packet),
+             "<?xpacket begin=\"\xEF\xBB\xBF\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>"
+             "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">"
+             "<rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">"
+             "<rdf:Description rdf:about=\"\" xmlns:xmp=\"http://ns.adobe.com/xap/1.0/\""
+             " xmlns:tiff=\"http://ns.adobe.com/tiff/1.0/\" xmlns:exif=\"http://ns.adobe.com/exif/1.0/\""
+             " xmp:CreatorTool=\"bench_raw2dng\" tiff:Model=\"%s\""
+             " exif:DateTimeOriginal=\"2017-06-01T12:00:%02u\" exif:ExposureTime=\"1/120\""
+             " exif:ExposureBiasValue=\"0/10\" exif:LightSource=\"0\">"
+             "<exif:ISOSpeedRatings><rdf:Seq><rdf:li>100</rdf:li></rdf:Seq></exif:ISOSpeedRatings>"
+             "</rdf:Description></rdf:RDF></x:xmpmeta><?xpacket end=\"r\"?>",
+             profile.m_szCameraModel.c_str(), index % 60);
+
+  std::vector<uint8> xmp(xmp_sig, xmp_sig + sizeof(xmp_sig));
+  xmp.insert(xmp.end(), packet, packet + packet_len);
+
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (!fp) {
+    perror(path.c_str());
+    return -1;
+  }
+
+  const uint8 soi[] = { 0xFF, 0xD8 };
+  const uint8 eoi[] = { 0xFF, 0xD9 };
+
+  fwrite(soi, 1, sizeof(soi), fp);
+  put_segment(fp, 0xE1, &exif[0], exif.size());
+  put_segment(fp, 0xE1, &xmp[0], xmp.size());
+  fwrite(eoi, 1, sizeof(eoi), fp);
+
+  if (ferror(fp) | fclose(fp)) {
+    perror(path.c_str());
+    remove(path.c_str());
+    return -1;
+  }
+
+  return 0;
+}
+
+static int make_dir(const std::string &path)
+{
+#if defined(_WIN32) || defined(_WIN64)
+  if (_mkdir(path.c_str()) && errno != EEXIST) {
+#else
+  if (mkdir(path.c_str(), 0755) && errno != EEXIST) {
+#endif
+    perror(path.c_str());
+    return -1;
+  }
+
+  return 0;
+}
+
+static int read_file(const std::string &path, std::vector<uint8> &data)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp)
+    return -1;
+
+  struct stat sb;
+  if (fstat(fileno(fp), &sb)) {
+    fclose(fp);
+    return -1;
+  }
+
+  data.resize((size_t)sb.st_size);
+  const size_t got = data.empty() ? 0 : fread(&data[0], 1, data.size(), fp);
+  fclose(fp);
+
+  return got == data.size() ? 0 : -1;
+}
+
+static size_t peak_rss_bytes(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+#if defined(__APPLE__)
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static dng_error_code convert_file(BenchRun *run, const BenchFile &file)
+{
+  if (!run->m_bMemory)
+    return run->m_poConverter->ConvertToDNG(file.m_szRawFile, file.m_szJpgFile);
+
+  // Same pipeline without the file system: inputs loaded up front, outputs kept in memory
+  std::vector<uint8> raw;
+  std::vector<uint8> jpg;
+
+  if (read_file(file.m_szRawFile, raw) || (!file.m_szJpgFile.empty() && read_file(file.m_szJpgFile, jpg)))
+    return dng_error_read_file;
+
+  dng_memory_stream dng(gDefaultDNGMemoryAllocator);
+  dng_memory_stream tiff(gDefaultDNGMemoryAllocator);
+
+  return run->m_poConverter->ConvertBuffer(&raw[0], raw.size(), jpg.empty() ? NULL : &jpg[0], jpg.size(),
+                                           run->m_bDng ? &dng : NULL, run->m_bTiff ? &tiff : NULL);
+}
+
+static void *bench_worker(void *arg)
+{
+  BenchRun *run = (BenchRun *)arg;
+
+  for (;;) {
+    size_t index;
+    {
+      dng_lock_mutex lock(&run->m_oMutex);
+      if (run->m_ulNext == run->m_poFiles->size())
+        break;
+      index = run->m_ulNext++;
+    }
+
+    const BenchFile &file = (*run->m_poFiles)[index];
+
+    dng_error_code rc = convert_file(run, file);
+    if (rc != dng_error_none)
+      fprintf(stderr, "Error: %s: conversion failed (%d)\n", file.m_szRawFile.c_str(), rc);
+
+    dng_lock_mutex lock(&run->m_oMutex);
+    if (rc != dng_error_none) {
+      ++run->m_ulFailed;
+    } else {
+      run->m_ulPixels += (uint64)file.m_poProfile->m_ulWidth * file.m_poProfile->m_ulHeight;
+      run->m_ulBytes += file.m_poProfile->m_ulFileSize;
+    }
+  }
+
+  return NULL;
+}
+
+static void usage(const char *prog)
+{
+  printf("Usage: %s <options>\n"
+         "Generates a synthetic RAW corpus for every supported resolution, converts it and prints\n"
+         "the throughput as JSON on stdout (other messages go to stderr)\n"
+         "\n"
+         "Options:\n"
+         "\t-h, --help          Help\n"
+         "\t-v, --version       Print version info and exit\n"
+         "\t--corpus <DIR>      Directory of the corpus, reused if already generated. Default: " DEFAULT_CORPUS_DIR "\n"
+         "\t-n, --files <NUM>   Files per resolution. Default: %d\n"
+         "\t--jpg               Generate JPG sidecars with the metadata\n"
+         "\t-p, --threads <NUM> Files converted at once. Default: number of CPUS in the system\n"
+         "\t-t, --tiff          Write TIFF images\n"
+         "\t-d, --dng           Write DNG images (used by default if no output is supplied)\n"
+         "\t-m, --thumb         Add JPEG thumbnails\n"
+         "\t--memory            Convert from and to memory instead of files\n"
+         "\t--keep              Keep the converted files (in <corpus>" DELIM "out)\n",
+         prog, DEFAULT_FILES_PER_PROFILE);
+}
+
+int main(int argc, char *argv[])
+{
+  Config conf;
+  std::string corpus_dir(DEFAULT_CORPUS_DIR);
+  int files_per_profile = DEFAULT_FILES_PER_PROFILE;
+  int threads = 0;
+  bool jpg = false;
+  bool memory = false;
+  bool keep = false;
+
+  int index;
+
+#if qDNGValidate
+  gVerbose = false;
+#endif
+
+  for (index = 1; index < argc && argv[index][0] == '-'; index++) {
+    dng_string option;
+
+    option.Set(&argv[index][1]);
+
+    if (option.Matches("h", true) || option.Matches("-help", true)) {
+      usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (option.Matches("v", true) || option.Matches("-version", true)) {
+      printf("Version: %s\n", VERSION_STR);
+      return EXIT_SUCCESS;
+    } else if (option.Matches("-corpus", true)) {
+      if (index + 1 < argc) {
+        corpus_dir = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing directory name\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("n", true) || option.Matches("-files", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0]) && atoi(argv[index + 1]) > 0) {
+        files_per_profile = atoi(argv[++index]);
+      } else {
+        fprintf(stderr, "Error: Missing number of files\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("p", true) || option.Matches("-threads", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0])) {
+        threads = atoi(argv[++index]);
+      } else {
+        fprintf(stderr, "Error: Missing number of threads\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-jpg", true)) {
+      jpg = true;
+    } else if (option.Matches("t", true) || option.Matches("-tiff", true)) {
+      conf.m_bTiff = true;
+    } else if (option.Matches("d", true) || option.Matches("-dng", true)) {
+      conf.m_bDng = true;
+    } else if (option.Matches("m", true) || option.Matches("-thumb", true)) {
+      conf.m_bGenPreview = true;
+    } else if (option.Matches("-memory", true)) {
+      memory = true;
+    } else if (option.Matches("-keep", true)) {
+      keep = true;
+    } else {
+      fprintf(stderr, "Error: Unknown option \"-%s\"\n", option.Get());
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!conf.m_bTiff && !conf.m_bDng)
+    conf.m_bDng = true;
+
+  // The JSON gets stdout to itself, the converter's messages go to stderr
+  fflush(stdout);
+  int fd = dup(fileno(stdout));
+  FILE *json = fd < 0 ? NULL : fdopen(fd, "w");
+  if (!json || dup2(fileno(stderr), fileno(stdout)) < 0) {
+    perror("dup");
+    return EXIT_FAILURE;
+  }
+
+  // -------------------------------------------------------------
+  // Corpus
+  // -------------------------------------------------------------
+
+  const std::string out_dir(corpus_dir + DELIM "out");
+  if (make_dir(corpus_dir) || make_dir(out_dir))
+    return EXIT_FAILURE;
+
+  std::vector<BenchFile> files;
+
+  fprintf(stderr, "Generating corpus in %s\n", corpus_dir.c_str());
+
+  for (size_t p = 0; p < DNGConverter::GetCameraProfileCount(); ++p) {
+    const CameraProfile &profile = DNGConverter::GetCameraProfile(p);
+
+    for (int i = 0; i < files_per_profile; ++i) {
+      char name[64];
+      snprintf(name, sizeof(name), DELIM "%ux%u_%03d", profile.m_ulWidth, profile.m_ulHeight, i);
+
+      BenchFile file;
+      file.m_szRawFile = corpus_dir + name + raw_suffix;
+      file.m_poProfile = &profile;
+
+      if (write_raw(file.m_szRawFile, profile, (uint32)(p * 1000 + i + 1)))
+        return EXIT_FAILURE;
+
+      if (jpg) {
+        file.m_szJpgFile = corpus_dir + name + jpeg_suffix;
+        if (write_jpg(file.m_szJpgFile, profile, (uint32)i))
+          return EXIT_FAILURE;
+      }
+
+      files.push_back(file);
+    }
+  }
+
+  // -------------------------------------------------------------
+  // Conversion
+  // -------------------------------------------------------------
+
+  const size_t n_system_cpus = get_num_cpus();
+  size_t n_threads = threads > 0 ? (size_t)threads : n_system_cpus;
+  n_threads = std::min(n_threads, files.size());
+
+  // Same split as sjcam_raw2dng: CPUs not busy with a file of their own help with the tiles
+  conf.m_iThreads = (int)n_threads;
+  conf.m_iTaskThreads = (int)std::max((size_t)1, n_system_cpus / n_threads);
+  conf.m_szPathPrefixOutput = out_dir + DELIM;
+
+  Stats stats;
+  conf.m_poStats = &stats;
+
+  DNGConverter converter(conf);
+
+  BenchRun run;
+  run.m_poConverter = &converter;
+  run.m_poFiles = &files;
+  run.m_bMemory = memory;
+  run.m_bDng = conf.m_bDng;
+  run.m_bTiff = conf.m_bTiff;
+
+  fprintf(stderr, "Converting %zu files with %zu threads\n", files.size(), n_threads);
+
+  StopWatch watch;
+  stats.start();
+  watch.run();
+
+  std::vector<pthread_t> pthreads(n_threads);
+  size_t started = 0;
+
+  for (size_t i = 1; i < n_threads; ++i) {
+    if (pthread_create(&pthreads[i], NULL, bench_worker, &run)) {
+      fprintf(stderr, "Error: Unable to start thread: %zu\n", i);
+      break;
+    }
+    ++started;
+  }
+
+  // The main thread converts too
+  bench_worker(&run);
+
+  for (size_t i = 1; i <= started; ++i)
+    pthread_join(pthreads[i], NULL);
+
+  watch.stop();
+  stats.stop();
+
+  if (!keep && !memory) {
+    std::vector<BenchFile>::const_iterator it;
+    for (it = files.begin(); it != files.end(); ++it) {
+      std::string dng_file;
+      std::string tiff_file;
+      converter.GetOutputFiles(it->m_szRawFile, dng_file, tiff_file);
+      remove(dng_file.c_str());
+      remove(tiff_file.c_str());
+    }
+  }
+
+  // -------------------------------------------------------------
+  // Report
+  // -------------------------------------------------------------
+
+  const double sec = (double)watch.elapsed_nsec() / 1e9;
+  const size_t converted = files.size() - run.m_ulFailed;
+
+  fprintf(json, "{\n");
+  fprintf(json, "  \"benchmark\": \"bench_raw2dng\",\n");
+  fprintf(json, "  \"version\": \"%s\",\n", VERSION_STR);
+  fprintf(json,
+          "  \"config\": {\"files_per_resolution\":%d,\"threads\":%zu,\"task_threads\":%d,\"cpus\":%zu,"
+          "\"dng\":%s,\"tiff\":%s,\"thumb\":%s,\"jpg\":%s,\"memory\":%s},\n",
+          files_per_profile, n_threads, conf.m_iTaskThreads, n_system_cpus, conf.m_bDng ? "true" : "false",
+          conf.m_bTiff ? "true" : "false", conf.m_bGenPreview ? "true" : "false", jpg ? "true" : "false",
+          memory ? "true" : "false");
+
+  fprintf(json, "  \"resolutions\": [");
+  for (size_t p = 0; p < DNGConverter::GetCameraProfileCount(); ++p) {
+    const CameraProfile &profile = DNGConverter::GetCameraProfile(p);
+    fprintf(json, "%s\n    {\"camera\":", p ? "," : "");
+    write_json_string(json, profile.m_szCameraModel);
+    fprintf(json, ",\"width\":%u,\"height\":%u,\"stride\":%u,\"raw_bytes\":%zu}", profile.m_ulWidth,
+            profile.m_ulHeight, profile.m_ulStride, profile.m_ulFileSize);
+  }
+  fprintf(json, "\n  ],\n");
+
+  fprintf(json,
+          "  \"results\": {\"files\":%zu,\"failed\":%zu,\"seconds\":%.3f,\"files_per_s\":%.3f,\"mpix_per_s\":%.3f,"
+          "\"mb_per_s\":%.3f,\"peak_rss_bytes\":%zu},\n",
+          files.size(), run.m_ulFailed, sec, sec > 0 ? (double)converted / sec : 0.0,
+          sec > 0 ? (double)run.m_ulPixels / 1e6 / sec : 0.0,
+          sec > 0 ? (double)run.m_ulBytes / (1024.0 * 1024.0) / sec : 0.0,
+          peak_rss_bytes());
+
+  stats.write_json(json, "  ");
+  fprintf(json, "\n}\n");
+  fclose(json);
+
+  return run.m_ulFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,6 +1,16 @@
-
+#include <algorithm>
 #include <cstdlib>
+#include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 // Must be defined to instantiate template classes
 #define TXMP_STRING_TYPE std::string
@@ -14,20 +24,84 @@
 #include <XMP.incl_cpp>
 
 #include <iostream>
-#include <fstream>
+
+#include <dng_mutex.h>
+#include <dng_pthread.h>
+
+#include "utils.h"
+#include "helpers.h"
 
 using namespace std;
 
-static void write_RDF(string *rdf, const string &szInputFile)
+enum OutputFormat { outputSidecar, outputJsonLines, outputPackets };
+
+// Files to process, handed out to the workers one at a time. Everything printed goes through
+// the lock, so each message and each record of the output stream stays in one piece.
+struct ExtractWork {
+  ExtractWork(const vector<string> &oFiles,
+              const vector<string> &oSidecars,
+              OutputFormat eFormat,
+              FILE *poOut,
+              FILE *poLog)
+          : m_oFiles(oFiles), m_oSidecars(oSidecars), m_eFormat(eFormat), m_poOut(poOut), m_poLog(poLog),
+            m_oMutex("ExtractWork"), m_ulNext(0), m_ulDone(0), m_ulFailed(0)
+  {
+  }
+
+  const vector<string> &m_oFiles;
+  const vector<string> &m_oSidecars; // sidecar of each file, empty when writing one stream
+  const OutputFormat m_eFormat;
+  FILE *const m_poOut; // NULL when writing sidecars
+  FILE *const m_poLog;
+
+  dng_mutex m_oMutex;
+  size_t m_ulNext;
+  size_t m_ulDone;
+  size_t m_ulFailed;
+};
+
+// Returns 0 or the errno of the failed open, write or close
+static int write_RDF(const string &rdf, const string &szOutputFile)
+{
+  FILE *fp = fopen(szOutputFile.c_str(), "wb");
+  if (!fp)
+    return errno;
+
+  int err = 0;
+  if (fwrite(rdf.data(), 1, rdf.size(), fp) != rdf.size())
+    err = errno ? errno : EIO;
+  if (fclose(fp) && !err)
+    err = errno;
+
+  return err;
+}
+
+static void write_record(ExtractWork *work, const string &szInputFile, const string &sMetaBuffer)
 {
-  ofstream oOutFile;
-  oOutFile.open(szInputFile.c_str(), ios::out);
-  oOutFile << *rdf;
-  oOutFile.close();
+  dng_lock_mutex lock(&work->m_oMutex);
+
+  if (work->m_eFormat == outputJsonLines) {
+    fputs("{\"file\":", work->m_poOut);
+    write_json_string(work->m_poOut, szInputFile);
+    fputs(",\"xmp\":", work->m_poOut);
+    write_json_string(work->m_poOut, sMetaBuffer);
+    fputs("}\n", work->m_poOut);
+  } else {
+    fwrite(sMetaBuffer.data(), 1, sMetaBuffer.size(), work->m_poOut);
+  }
+}
+
+static void log_message(ExtractWork *work, const string &szMessage)
+{
+  dng_lock_mutex lock(&work->m_oMutex);
+  fprintf(work->m_poLog, "%s\n", szMessage.c_str());
 }
 
-static int process_file(const string &szInputFile)
+// oFile and oMeta belong to the calling worker and are reused for all of its files
+static int process_file(ExtractWork *work, SXMPFiles &oFile, SXMPMeta &oMeta, size_t ulIndex)
 {
+  const string &szInputFile = work->m_oFiles[ulIndex];
+
   int iRet = EXIT_SUCCESS;
 
   try {
@@ -35,66 +109,282 @@ static int process_file(const string &szInputFile)
     XMP_OptionBits opts = kXMPFiles_OpenForRead | kXMPFiles_OpenUseSmartHandler;
 
     bool bOk;
-    SXMPFiles oFile;
-    string szStatus;
 
     // First we try and open the file
     bOk = oFile.OpenFile(szInputFile, kXMP_UnknownFile, opts);
     if (!bOk) {
-      szStatus += "No smart handler available for " + szInputFile + "\nTrying packet scanning.\n";
-
       opts = kXMPFiles_OpenForUpdate | kXMPFiles_OpenUsePacketScanning;
       bOk = oFile.OpenFile(szInputFile, kXMP_UnknownFile, opts);
     }
 
     // If the file is open then read the metadata
     if (bOk) {
-      // Form output filename
-      string szBaseFilename;
-      size_t unIndex = szInputFile.find_last_of(".");
-      if (unIndex == string::npos) {
-        szBaseFilename = szInputFile;
-      } else {
-        szBaseFilename = szInputFile.substr(0, unIndex);
-      }
-      string szOutputFile;
-      szOutputFile.reserve(szBaseFilename.size() + sizeof(".xmp"));
-      szOutputFile = szBaseFilename;
-      szOutputFile.append(".xmp");
-
-      cout << szStatus << endl;
-      cout << szInputFile << " is opened successfully" << endl;
-      // Create the xmp object and get the xmp data
-      SXMPMeta oMeta;
+      // Get the xmp data
+      oMeta.Erase();
       oFile.GetXMP(&oMeta);
+      oFile.CloseFile();
 
       string sMetaBuffer;
-      oMeta.SerializeToBuffer(&sMetaBuffer, kXMP_OmitPacketWrapper | kXMP_UseCompactFormat, 0, "\n");
-      write_RDF(&sMetaBuffer, szOutputFile);
 
-      cout << "XMP written to " << szOutputFile << endl;
+      if (work->m_eFormat == outputSidecar) {
+        const string &szOutputFile = work->m_oSidecars[ulIndex];
 
-      oFile.CloseFile();
+        oMeta.SerializeToBuffer(&sMetaBuffer, kXMP_OmitPacketWrapper | kXMP_UseCompactFormat, 0, "\n");
+        int err = write_RDF(sMetaBuffer, szOutputFile);
+
+        if (err) {
+          log_message(work, "Unable to write " + szOutputFile + ": " + strerror(err));
+          iRet = EXIT_FAILURE;
+        } else {
+          log_message(work, "XMP of " + szInputFile + " written to " + szOutputFile);
+        }
+      } else if (work->m_eFormat == outputJsonLines) {
+        oMeta.SerializeToBuffer(&sMetaBuffer, kXMP_OmitPacketWrapper | kXMP_UseCompactFormat, 0, "\n");
+        write_record(work, szInputFile, sMetaBuffer);
+      } else {
+        // Each packet names its file in rdf:about and keeps its wrapper, read-only so it is not padded
+        oMeta.SetObjectName(szInputFile.c_str());
+        oMeta.SerializeToBuffer(&sMetaBuffer, kXMP_UseCompactFormat | kXMP_ReadOnlyPacket, 0, "\n");
+        write_record(work, szInputFile, sMetaBuffer);
+      }
     } else {
-      cout << "Unable to open " << szInputFile << endl;
+      log_message(work, "Unable to open " + szInputFile);
       iRet = EXIT_FAILURE;
     }
   } catch (XMP_Error &e) {
-    cout << "ERROR: " << e.GetErrMsg() << endl;
+    log_message(work, "ERROR: " + szInputFile + ": " + e.GetErrMsg());
     iRet = EXIT_FAILURE;
   }
 
   return iRet;
 }
 
+static void *extract_worker(void *arg)
+{
+  ExtractWork *work = (ExtractWork *)arg;
+
+  SXMPFiles oFile;
+  SXMPMeta oMeta;
+
+  for (;;) {
+    size_t i;
+
+    {
+      dng_lock_mutex lock(&work->m_oMutex);
+      if (work->m_ulNext == work->m_oFiles.size())
+        break;
+      i = work->m_ulNext++;
+    }
+
+    int ret = process_file(work, oFile, oMeta, i);
+
+    dng_lock_mutex lock(&work->m_oMutex);
+    if (ret == EXIT_SUCCESS)
+      ++work->m_ulDone;
+    else
+      ++work->m_ulFailed;
+  }
+
+  return NULL;
+}
+
+// File name without its extension
+static string sidecar_base(const string &szFile)
+{
+  size_t dot = szFile.find_last_of('.');
+  size_t delim = szFile.find_last_of(DELIM);
+
+  if (dot == string::npos || (delim != string::npos && dot < delim))
+    return szFile;
+
+  return szFile.substr(0, dot);
+}
+
+// Sidecar of each file: foo.xmp, or foo.dng.xmp and foo.tiff.xmp when several files share the name foo,
+// so no two workers write the same sidecar. A file given more than once is extracted once.
+static void name_sidecars(vector<string> &oFiles, vector<string> &oSidecars)
+{
+  set<string> seen;
+  map<string, size_t> bases;
+  vector<string> files;
+
+  for (size_t i = 0; i < oFiles.size(); ++i) {
+    if (seen.insert(oFiles[i]).second) {
+      files.push_back(oFiles[i]);
+      ++bases[sidecar_base(oFiles[i])];
+    }
+  }
+
+  oFiles.swap(files);
+
+  oSidecars.clear();
+  oSidecars.reserve(oFiles.size());
+
+  for (size_t i = 0; i < oFiles.size(); ++i) {
+    string base = sidecar_base(oFiles[i]);
+    oSidecars.push_back((bases[base] > 1 ? oFiles[i] : base) + ".xmp");
+  }
+}
+
+// Files of a directory that carry XMP: camera JPGs and converted DNG and TIFF files
+static int add_dir(const string &szDir, vector<string> &oFiles)
+{
+  list<string> filter;
+  filter.push_back(jpeg_suffix);
+  filter.push_back(dng_suffix);
+  filter.push_back(tiff_suffix);
+
+  list<string> files;
+  int ret = list_dir(szDir, files, filter);
+  if (ret) {
+    fprintf(stderr, "Unable to list directory %s\n", szDir.c_str());
+    return ret;
+  }
+
+  files.sort();
+
+  list<string>::const_iterator it;
+  for (it = files.begin(); it != files.end(); ++it)
+    oFiles.push_back(szDir + DELIM + *it);
+
+  return 0;
+}
+
+static int add_arg(const string &szArg, vector<string> &oFiles)
+{
+  struct stat sb;
+
+  if (stat(szArg.c_str(), &sb)) {
+    perror(szArg.c_str());
+    return -1;
+  }
+
+  if (S_ISDIR(sb.st_mode))
+    return add_dir(szArg, oFiles);
+
+  oFiles.push_back(szArg);
+
+  return 0;
+}
+
+// One file or directory per line, "-" reads standard input
+static int add_list(const string &szList, vector<string> &oFiles)
+{
+  FILE *fp = szList == "-" ? stdin : fopen(szList.c_str(), "r");
+  if (!fp) {
+    perror(szList.c_str());
+    return -1;
+  }
+
+  int ret = 0;
+  char line[4096];
+
+  while (!ret && fgets(line, sizeof(line), fp)) {
+    size_t len = strlen(line);
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+
+    if (len)
+      ret = add_arg(line, oFiles);
+  }
+
+  if (fp != stdin)
+    fclose(fp);
+
+  return ret;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Extract the XMP metadata of files into .xmp sidecars or one stream\n"
+          "Usage:  %s [options] <file|dir> [<file|dir>...]\n"
+          "\n"
+          "Valid options:\n"
+          "\t-h, --help            Help\n"
+          "\t-l, --list <FILE>     Also process the files and directories listed in FILE, one per line\n"
+          "\t                      (\"-\" for standard input)\n"
+          "\t-o, --output <FILE>   Write all packets to FILE (\"-\" for standard output) instead of\n"
+          "\t                      a sidecar next to each file\n"
+          "\t-f, --format <FORMAT> Format of --output: jsonl for one JSON object per file (default),\n"
+          "\t                      xmp for the XMP packets one after another\n"
+          "\t-p, --threads <NUM>   Number of threads to run. Default: number of CPUs in the system\n",
+          prog);
+}
+
 int main(int argc, const char *argv[])
 {
-  if (argc != 2) // 2 := command and 1 parameter
-  {
-    cout << "usage: extract_xmp <filename>" << endl;
+  if (argc == 1) {
+    usage(argv[0]);
     return EXIT_SUCCESS;
   }
 
+  vector<string> oFiles;
+  string szOutput;
+  OutputFormat eFormat = outputJsonLines;
+  size_t ulThreads = get_num_cpus();
+  int index;
+
+  for (index = 1; index < argc && argv[index][0] == '-' && argv[index][1]; index++) {
+    string option(&argv[index][1]);
+
+    if (option == "h" || option == "-help") {
+      usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (index + 1 == argc) {
+      fprintf(stderr, "Error: Missing value of \"-%s\"\n", option.c_str());
+      return EXIT_FAILURE;
+    } else if (option == "l" || option == "-list") {
+      if (add_list(argv[++index], oFiles))
+        return EXIT_FAILURE;
+    } else if (option == "o" || option == "-output") {
+      szOutput = argv[++index];
+    } else if (option == "f" || option == "-format") {
+      string format(argv[++index]);
+      if (format == "jsonl") {
+        eFormat = outputJsonLines;
+      } else if (format == "xmp") {
+        eFormat = outputPackets;
+      } else {
+        fprintf(stderr, "Error: Unknown format \"%s\"\n", format.c_str());
+        return EXIT_FAILURE;
+      }
+    } else if (option == "p" || option == "-threads") {
+      int threads = atoi(argv[++index]);
+      if (threads > 0)
+        ulThreads = (size_t)threads;
+    } else {
+      fprintf(stderr, "Error: Unknown option \"-%s\"\n", option.c_str());
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (; index < argc; ++index) {
+    if (add_arg(argv[index], oFiles))
+      return EXIT_FAILURE;
+  }
+
+  if (oFiles.empty()) {
+    fprintf(stderr, "Error: No file specified\n");
+    return EXIT_FAILURE;
+  }
+
+  vector<string> oSidecars;
+  if (szOutput.empty()) {
+    eFormat = outputSidecar;
+    name_sidecars(oFiles, oSidecars);
+  }
+
+  FILE *poOut = NULL;
+  if (!szOutput.empty()) {
+    poOut = szOutput == "-" ? stdout : fopen(szOutput.c_str(), "wb");
+    if (!poOut) {
+      perror(szOutput.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
   if (!SXMPMeta::Initialize()) {
     cout << "Could not initialize toolkit!";
     return EXIT_FAILURE;
@@ -109,7 +399,40 @@ int main(int argc, const char *argv[])
     return EXIT_FAILURE;
   }
 
-  int ret = process_file(argv[1]);
+  int ret = EXIT_SUCCESS;
+
+  {
+    // Messages meant for people stay out of a stream written to standard output
+    ExtractWork work(oFiles, oSidecars, eFormat, poOut, poOut == stdout ? stderr : stdout);
+
+    ulThreads = std::min(ulThreads, oFiles.size());
+
+    vector<pthread_t> threads(ulThreads);
+    size_t started = 0;
+
+    for (size_t i = 1; i < ulThreads; ++i) {
+      if (pthread_create(&threads[i], NULL, extract_worker, &work))
+        break;
+      ++started;
+    }
+
+    // The main thread extracts as well
+    extract_worker(&work);
+
+    for (size_t i = 1; i <= started; ++i)
+      pthread_join(threads[i], NULL);
+
+    if (oFiles.size() > 1 || poOut)
+      fprintf(work.m_poLog, "Extracted XMP of %zu of %zu files\n", work.m_ulDone, oFiles.size());
+
+    if (work.m_ulFailed)
+      ret = EXIT_FAILURE;
+  }
+
+  if (poOut && poOut != stdout && fclose(poOut)) {
+    perror(szOutput.c_str());
+    ret = EXIT_FAILURE;
+  }
 
   // Terminate the toolkit
   SXMPFiles::Terminate();
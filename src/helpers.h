@@ -11,4 +11,10 @@
 #define DIR_DELIM '/'
 #endif
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 #endif // __HELPERS_H__
@@ -1,6 +1,10 @@
 /* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
 
+#include <algorithm>
+#include <list>
+#include <map>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <stdio.h>
@@ -9,10 +13,21 @@
 #include <errno.h>
 #include <sys/stat.h>
 
+#include <dng_pthread.h>
+
 #include "FileFinder.h"
 #include "utils.h"
 #include "helpers.h"
 
+// Directories read at once while searching, and files removed at once
+#define DISCOVERY_THREADS 8
+#define PRUNE_THREADS 8
+
+// Files a worker takes at a time
+#define PRUNE_BATCH 64
+
+#define MB (1024.0 * 1024.0)
+
 static int handle_arg(const char *arg, FileFinder &finder)
 {
   struct stat sb;
@@ -45,20 +60,143 @@ static void usage(const char *prog)
           "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n"
           "!!!WARNING: WILL REMOVE FILES!!!\n"
           "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n"
-          "Usage:  %s [options] <raw_dir>\n"
+          "Usage:  %s [options] <raw_dir> [<raw_dir>...]\n"
           "\n"
           "Valid options:\n"
           "\t-h, --help          Help\n"
           "\t-d, --dry-run       Only print what is going to be deleted without actually deleting\n"
           "\t-i, --input <DIR>   Directory containing .dng files if they are not\n"
-          "\t                    in the same folder with .RAW and .JPG\n",
+          "\t                    in the same folder with .RAW and .JPG\n"
+          "\t-R, --recursive     Also prune the subdirectories of the given dirs\n",
           prog);
 }
 
-static int do_prune(const std::vector<RawWorkItem *> &o_WorkItems, std::list<std::string> &files, bool bDryRun)
+// DNG files by full path, each directory listed once however many RAWs it holds
+class DngIndex
+{
+  public:
+  DngIndex()
+  {
+    m_Filter.push_back(dng_suffix);
+  }
+
+  bool is_loaded(const std::string &dir) const
+  {
+    return m_Dirs.count(dir) != 0;
+  }
+
+  // Whether dir has any DNG at all, -1 if it cannot be read
+  int load(const std::string &dir)
+  {
+    std::map<std::string, bool>::const_iterator it = m_Dirs.find(dir);
+    if (it != m_Dirs.end())
+      return it->second;
+
+    std::list<std::string> files;
+    if (list_dir(dir, files, m_Filter))
+      return -1;
+
+    std::list<std::string>::const_iterator file_it;
+    for (file_it = files.begin(); file_it != files.end(); ++file_it)
+      m_Files.insert(dir + DELIM + *file_it);
+
+    m_Dirs[dir] = !files.empty();
+
+    return !files.empty();
+  }
+
+  bool contains(const std::string &dir, const std::string &name) const
+  {
+    return m_Files.count(dir + DELIM + name) != 0;
+  }
+
+  protected:
+  std::list<std::string> m_Filter;
+  std::map<std::string, bool> m_Dirs;
+  std::unordered_set<std::string> m_Files; // Looked up once per RAW
+};
+
+// Files to remove, handed out to the workers in batches
+struct PruneWork {
+  PruneWork(const std::vector<std::string> &oFiles, bool bDryRun)
+          : m_oFiles(oFiles), m_bDryRun(bDryRun), m_oMutex("PruneWork"), m_ulNext(0), m_ulBytes(0),
+            m_ulRemoved(0), m_ulFailed(0)
+  {
+  }
+
+  bool next_batch(size_t &start, size_t &end)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    if (m_ulNext == m_oFiles.size())
+      return false;
+
+    start = m_ulNext;
+    end = std::min(m_oFiles.size(), start + PRUNE_BATCH);
+    m_ulNext = end;
+
+    return true;
+  }
+
+  void add(uint64 ulBytes, size_t ulRemoved, size_t ulFailed)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    m_ulBytes += ulBytes;
+    m_ulRemoved += ulRemoved;
+    m_ulFailed += ulFailed;
+  }
+
+  const std::vector<std::string> &m_oFiles;
+  const bool m_bDryRun;
+
+  dng_mutex m_oMutex;
+  size_t m_ulNext;
+  uint64 m_ulBytes;
+  size_t m_ulRemoved;
+  size_t m_ulFailed;
+};
+
+// Unlinks wait on the file system rather than the CPU, a few at once hide most of that
+static void *prune_worker(void *arg)
+{
+  PruneWork *work = (PruneWork *)arg;
+  size_t start, end;
+
+  while (work->next_batch(start, end)) {
+    uint64 bytes = 0;
+    size_t removed = 0;
+    size_t failed = 0;
+
+    for (size_t i = start; i < end; ++i) {
+      const char *path = work->m_oFiles[i].c_str();
+      struct stat sb;
+
+      if (stat(path, &sb) || (!work->m_bDryRun && remove(path))) {
+        perror(path);
+        ++failed;
+        continue;
+      }
+
+      bytes += (uint64)sb.st_size;
+      ++removed;
+    }
+
+    work->add(bytes, removed, failed);
+  }
+
+  return NULL;
+}
+
+// Sort the work items whose DNG is missing into files, -1 on error
+static int select_files(const std::vector<RawWorkItem *> &o_WorkItems,
+                        const std::string &szInputFolder,
+                        std::vector<std::string> &files,
+                        size_t &ulRaws,
+                        size_t &ulJpgs)
 {
   std::vector<RawWorkItem *>::const_iterator it;
-  size_t count = 0;
+  DngIndex dngs;
 
   for (it = o_WorkItems.begin(); it != o_WorkItems.end(); ++it) {
     const std::string &szRawFile = (*it)->m_szRawFile;
@@ -69,34 +207,85 @@ static int do_prune(const std::vector<RawWorkItem *> &o_WorkItems, std::list<std
     }
 
     size_t unDelimIndex = szRawFile.find_last_of(DELIM);
-    if (unDelimIndex == std::string::npos)
-      unDelimIndex = 0;
-    else
-      ++unDelimIndex;
-
-    std::string szDngFilename = szRawFile.substr(unDelimIndex, unDotIndex - unDelimIndex) + dng_suffix;
-
-    bool found = false;
-    std::list<std::string>::iterator dng_it;
-    for (dng_it = files.begin(); dng_it != files.end(); ++dng_it) {
-      if (*dng_it == szDngFilename) {
-        files.erase(dng_it);
-        found = true;
-        break;
-      }
+    if (unDelimIndex == std::string::npos) {
+      printf("Encountered an internal error. Refusing to continue!\n");
+      return -1;
     }
 
-    if (!found) {
-      printf("Removing: %s, %s\n", (*it)->m_szRawFile.c_str(), (*it)->m_szMetadataFile.c_str());
-      ++count;
-      if (!bDryRun) {
-        remove((*it)->m_szRawFile.c_str());
-        remove((*it)->m_szMetadataFile.c_str());
-      }
+    const std::string szDngDir = szInputFolder.empty() ? szRawFile.substr(0, unDelimIndex) : szInputFolder;
+    const std::string szDngFilename = szRawFile.substr(unDelimIndex + 1, unDotIndex - unDelimIndex - 1) + dng_suffix;
+
+    const bool bReported = dngs.is_loaded(szDngDir);
+
+    int ret = dngs.load(szDngDir);
+    if (ret < 0) {
+      fprintf(stderr, "Unable to list folder '%s'\n", szDngDir.c_str());
+      return -1;
+    }
+
+    // Most likely nothing was converted there yet, rather than everything being meant to go
+    if (ret == 0) {
+      if (!bReported)
+        printf("No DNG files found in folder '%s', skipping it\n", szDngDir.c_str());
+      continue;
+    }
+
+    if (dngs.contains(szDngDir, szDngFilename))
+      continue;
+
+    printf("Removing: %s, %s\n", szRawFile.c_str(), (*it)->m_szMetadataFile.c_str());
+
+    files.push_back(szRawFile);
+    ++ulRaws;
+
+    if (!(*it)->m_szMetadataFile.empty()) {
+      files.push_back((*it)->m_szMetadataFile);
+      ++ulJpgs;
     }
   }
 
-  printf("Removed %zd RAW and JPG\n", count);
+  return 0;
+}
+
+static int do_prune(const std::vector<RawWorkItem *> &o_WorkItems, const std::string &szInputFolder, bool bDryRun)
+{
+  std::vector<std::string> files;
+  size_t ulRaws = 0;
+  size_t ulJpgs = 0;
+
+  if (select_files(o_WorkItems, szInputFolder, files, ulRaws, ulJpgs))
+    return -1;
+
+  PruneWork work(files, bDryRun);
+
+  std::vector<pthread_t> threads(PRUNE_THREADS);
+  size_t started = 0;
+
+  for (size_t i = 1; i < threads.size() && i * PRUNE_BATCH < files.size(); ++i) {
+    if (pthread_create(&threads[i], NULL, prune_worker, &work))
+      break;
+    ++started;
+  }
+
+  // The main thread removes files as well
+  prune_worker(&work);
+
+  for (size_t i = 1; i <= started; ++i)
+    pthread_join(threads[i], NULL);
+
+  printf("%zu of %zu RAW files have no DNG\n", ulRaws, o_WorkItems.size());
+
+  if (bDryRun)
+    printf("Would remove %zu RAW and %zu JPG, %.1f MB (%llu bytes)\n", ulRaws, ulJpgs, (double)work.m_ulBytes / MB,
+           (unsigned long long)work.m_ulBytes);
+  else
+    printf("Removed %zu of %zu RAW and JPG, %.1f MB (%llu bytes) reclaimed\n", work.m_ulRemoved, files.size(),
+           (double)work.m_ulBytes / MB, (unsigned long long)work.m_ulBytes);
+
+  if (work.m_ulFailed) {
+    fprintf(stderr, "Error: %zu files could not be %s\n", work.m_ulFailed, bDryRun ? "read" : "removed");
+    return -1;
+  }
 
   return 0;
 }
@@ -111,6 +300,7 @@ int main(int argc, char *argv[])
   std::string szInputFolder;
   int index;
   bool bDryRun = false;
+  bool bRecursive = false;
 
   for (index = 1; index < argc && argv[index][0] == '-'; index++) {
     std::string option(&argv[index][1]);
@@ -120,6 +310,8 @@ int main(int argc, char *argv[])
       return EXIT_SUCCESS;
     } else if (option == "d" || option == "-dry-run") {
       bDryRun = true;
+    } else if (option == "R" || option == "-recursive") {
+      bRecursive = true;
     } else if (option == "i" || option == "-input") {
       if (index + 1 < argc) {
         szInputFolder = argv[++index];
@@ -151,41 +343,22 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
-  if (index + 1 != argc) {
-    fprintf(stderr, "Error: More than one directory specified\n");
-    return EXIT_FAILURE;
-  }
-
   FileFinder oFiles;
+  oFiles.set_recursive(bRecursive);
+  oFiles.set_threads(bRecursive ? DISCOVERY_THREADS : 1);
 
-  int rc = handle_arg(argv[index], oFiles);
-  if (rc)
-    return EXIT_FAILURE;
-
-  if (szInputFolder.empty())
-    szInputFolder = argv[index];
+  for (; index < argc; ++index) {
+    if (handle_arg(argv[index], oFiles))
+      return EXIT_FAILURE;
+  }
 
   const std::vector<RawWorkItem *> o_WorkItems = oFiles.get_work_items();
   if (o_WorkItems.size() == 0) {
-    printf("No raw files found in folder '%s'\n", argv[index]);
-    return EXIT_SUCCESS;
-  }
-
-  std::list<std::string> filter;
-  filter.push_back(dng_suffix);
-
-  std::list<std::string> files;
-  rc = list_dir(szInputFolder, files, filter);
-  if (rc)
-    return EXIT_FAILURE;
-
-  if (files.size() == 0) {
-    printf("No DNG files found in folder '%s'\n", szInputFolder.c_str());
+    printf("No raw files found\n");
     return EXIT_SUCCESS;
   }
 
-  rc = do_prune(o_WorkItems, files, bDryRun);
-  if (rc)
+  if (do_prune(o_WorkItems, szInputFolder, bDryRun))
     return EXIT_FAILURE;
 
   printf("Prune complete\n");
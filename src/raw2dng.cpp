@@ -0,0 +1,187 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <dng_exceptions.h>
+#include <dng_memory.h>
+#include <dng_memory_stream.h>
+
+#include "raw2dng.h"
+#include "DNGConverter.h"
+#include "utils.h"
+#include "version.h"
+
+struct raw2dng_converter {
+  raw2dng_converter(Config &config) : m_oConverter(config)
+  {
+  }
+
+  DNGConverter m_oConverter;
+};
+
+// Memory stream that can hand out its pages in order, so the result is never copied into one block
+class PagedMemoryStream : public dng_memory_stream
+{
+  public:
+  PagedMemoryStream() : dng_memory_stream(gDefaultDNGMemoryAllocator)
+  {
+  }
+
+  int ForEachPage(raw2dng_write_fn write, void *ctx)
+  {
+    Flush();
+
+    uint64 left = fMemoryStreamLength;
+
+    for (uint32 i = 0; left > 0; ++i) {
+      uint32 len = (uint32)Min_uint64(left, fPageSize);
+
+      if (write(ctx, fPageList[i]->Buffer(), len))
+        return dng_error_user_canceled;
+
+      left -= len;
+    }
+
+    return RAW2DNG_OK;
+  }
+};
+
+static int write_to_buffer(void *ctx, const void *data, size_t len)
+{
+  uint8 **pos = (uint8 **)ctx;
+
+  memcpy(*pos, data, len);
+  *pos += len;
+
+  return 0;
+}
+
+static int convert(raw2dng_converter *conv,
+                   const void *raw,
+                   size_t raw_size,
+                   const void *metadata,
+                   size_t metadata_size,
+                   raw2dng_format format,
+                   PagedMemoryStream &stream)
+{
+  if (!conv || !raw)
+    return dng_error_unknown;
+
+  return conv->m_oConverter.ConvertBuffer(raw,
+                                          raw_size,
+                                          metadata,
+                                          metadata_size,
+                                          format == RAW2DNG_FORMAT_DNG ? &stream : NULL,
+                                          format == RAW2DNG_FORMAT_TIFF ? &stream : NULL);
+}
+
+const char *raw2dng_version(void)
+{
+  return VERSION_STR;
+}
+
+void raw2dng_default_options(raw2dng_options *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+}
+
+raw2dng_converter *raw2dng_create(const raw2dng_options *opts)
+{
+  raw2dng_options defaults;
+  if (!opts) {
+    raw2dng_default_options(&defaults);
+    opts = &defaults;
+  }
+
+  Config conf;
+  conf.m_bNoCalibration = opts->no_calibration != 0;
+  conf.m_bGenPreview = opts->thumbnail != 0;
+  conf.m_bFlipped = opts->rotated != 0;
+  conf.m_iTaskThreads = opts->threads > 0 ? opts->threads : (int)get_num_cpus();
+
+  try {
+    return new raw2dng_converter(conf);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void raw2dng_destroy(raw2dng_converter *conv)
+{
+  delete conv;
+}
+
+int raw2dng_convert(raw2dng_converter *conv,
+                    const void *raw,
+                    size_t raw_size,
+                    const void *metadata,
+                    size_t metadata_size,
+                    raw2dng_format format,
+                    void **out,
+                    size_t *out_size)
+{
+  if (!out || !out_size)
+    return dng_error_unknown;
+
+  *out = NULL;
+  *out_size = 0;
+
+  try {
+    PagedMemoryStream stream;
+
+    int ret = convert(conv, raw, raw_size, metadata, metadata_size, format, stream);
+    if (ret != RAW2DNG_OK)
+      return ret;
+
+    size_t len = (size_t)stream.Length();
+
+    uint8 *buf = (uint8 *)malloc(len);
+    if (!buf)
+      return dng_error_memory;
+
+    uint8 *pos = buf;
+    stream.ForEachPage(write_to_buffer, &pos);
+
+    *out = buf;
+    *out_size = len;
+  } catch (const dng_exception &except) {
+    return except.ErrorCode();
+  } catch (...) {
+    return dng_error_unknown;
+  }
+
+  return RAW2DNG_OK;
+}
+
+int raw2dng_convert_to_sink(raw2dng_converter *conv,
+                            const void *raw,
+                            size_t raw_size,
+                            const void *metadata,
+                            size_t metadata_size,
+                            raw2dng_format format,
+                            raw2dng_write_fn write,
+                            void *ctx)
+{
+  if (!write)
+    return dng_error_unknown;
+
+  try {
+    PagedMemoryStream stream;
+
+    int ret = convert(conv, raw, raw_size, metadata, metadata_size, format, stream);
+    if (ret != RAW2DNG_OK)
+      return ret;
+
+    return stream.ForEachPage(write, ctx);
+  } catch (const dng_exception &except) {
+    return except.ErrorCode();
+  } catch (...) {
+    return dng_error_unknown;
+  }
+}
+
+void raw2dng_free(void *buf)
+{
+  free(buf);
+}
@@ -0,0 +1,89 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __RAW2DNG_H__
+#define __RAW2DNG_H__
+
+/*
+ * In-process conversion API of libsjcam_raw2dng.
+ *
+ * A converter is created once and may then be used from several threads at once.
+ * Input is the RAW readout exactly as the camera wrote it and, optionally, the JPG
+ * the camera saved alongside (used for EXIF data: ISO, exposure, date...).
+ *
+ * Functions return RAW2DNG_OK or one of the dng_error_code values of the DNG SDK.
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#if defined(RAW2DNG_SHARED_BUILD)
+#define RAW2DNG_API __declspec(dllexport)
+#elif defined(RAW2DNG_SHARED)
+#define RAW2DNG_API __declspec(dllimport)
+#else
+#define RAW2DNG_API
+#endif
+#else
+#define RAW2DNG_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RAW2DNG_OK 0
+
+typedef enum {
+  RAW2DNG_FORMAT_DNG = 0, /* Raw DNG */
+  RAW2DNG_FORMAT_TIFF = 1 /* Rendered 16-bit RGB TIFF */
+} raw2dng_format;
+
+typedef struct raw2dng_options {
+  int no_calibration; /* Do not apply color calibration */
+  int thumbnail; /* Embed JPEG preview and thumbnail */
+  int rotated; /* Image was taken in rotated orientation */
+  int threads; /* Threads working on a single image, 0 for all CPUs */
+} raw2dng_options;
+
+/* Receives the output in order. Return 0 to continue, anything else aborts the conversion. */
+typedef int (*raw2dng_write_fn)(void *ctx, const void *data, size_t len);
+
+typedef struct raw2dng_converter raw2dng_converter;
+
+RAW2DNG_API const char *raw2dng_version(void);
+
+RAW2DNG_API void raw2dng_default_options(raw2dng_options *opts);
+
+/* opts may be NULL for defaults. Returns NULL on failure. */
+RAW2DNG_API raw2dng_converter *raw2dng_create(const raw2dng_options *opts);
+
+RAW2DNG_API void raw2dng_destroy(raw2dng_converter *conv);
+
+/* Convert into a buffer allocated by the library, release it with raw2dng_free().
+ * metadata may be NULL. */
+RAW2DNG_API int raw2dng_convert(raw2dng_converter *conv,
+                                const void *raw,
+                                size_t raw_size,
+                                const void *metadata,
+                                size_t metadata_size,
+                                raw2dng_format format,
+                                void **out,
+                                size_t *out_size);
+
+/* Convert and hand the output to write() in order, without an intermediate copy */
+RAW2DNG_API int raw2dng_convert_to_sink(raw2dng_converter *conv,
+                                        const void *raw,
+                                        size_t raw_size,
+                                        const void *metadata,
+                                        size_t metadata_size,
+                                        raw2dng_format format,
+                                        raw2dng_write_fn write,
+                                        void *ctx);
+
+RAW2DNG_API void raw2dng_free(void *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RAW2DNG_H__ */
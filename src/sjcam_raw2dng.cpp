@@ -5,41 +5,332 @@
 #include <algorithm>
 
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/stat.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
+#include "BadPixelMap.h"
+#include "Calibration.h"
+#include "ConversionCache.h"
 #include "DNGConverter.h"
 #include "FileFinder.h"
+#include "FolderWatcher.h"
+#include "Journal.h"
+#include "Manifest.h"
+#include "MemoryBudget.h"
+#include "Progress.h"
+#include "Stats.h"
+#include "StopWatch.h"
+#include "Trace.h"
+#include "ServerProtocol.h"
 #include "helpers.h"
 #include "utils.h"
+#include "version.h"
+#include "WorkQueue.h"
+#include "WorkShare.h"
 
 #include <dng_globals.h>
 #include <dng_string.h>
 #include <dng_pthread.h>
 
-#define VERSION_STR "v1.2.0"
+#define MANIFEST_NAME ".sjcam_raw2dng.manifest"
+
+// How long a RAW that landed in a watched folder waits for its JPG
+#define WATCH_PAIR_GRACE_MS 5000
+
+// Directories read at once by a recursive search, it waits on the disk far more than on the CPU
+#define DISCOVERY_THREADS 8
 
-static FileFinder g_Files;
+static volatile sig_atomic_t g_bStop = 0;
 
 struct ThreadWork {
   DNGConverter *oConverter;
+  Manifest *oManifest;
+  Journal *oJournal;
+  WorkShare *oShare;
+  Progress *oProgress;
   const std::vector<RawWorkItem *> *oWorks;
   size_t m_ulStart;
   size_t m_ulEnd;
+  WorkQueue<RawWorkItem> *oQueue;
 };
 
+static void convert_item(DNGConverter *converter,
+                         Manifest *manifest,
+                         Journal *journal,
+                         WorkShare *share,
+                         Progress *progress,
+                         const RawWorkItem *item)
+{
+  // Another process's file
+  if (share && !share->claim(item->m_szRawFile)) {
+    if (progress)
+      progress->skip_item(item->m_szRawFile);
+    return;
+  }
+
+  bool up_to_date = manifest && converter->OutputsExist(item->m_szRawFile) &&
+                    manifest->is_up_to_date(item->m_szRawFile, item->m_szMetadataFile);
+
+  if (up_to_date && progress)
+    progress->skip_item(item->m_szRawFile);
+
+  if (up_to_date && share)
+    share->release(item->m_szRawFile, true);
+
+  if (!up_to_date) {
+    if (progress) {
+      struct stat sb;
+      progress->begin_item(item->m_szRawFile, stat(item->m_szRawFile.c_str(), &sb) ? 0 : (uint64)sb.st_size);
+    }
+
+    dng_error_code rc = converter->ConvertToDNG(item->m_szRawFile, item->m_szMetadataFile);
+
+    if (progress)
+      progress->end_item(rc);
+
+    if (share)
+      share->release(item->m_szRawFile, rc == dng_error_none);
+
+    if (rc != dng_error_none)
+      return;
+
+    if (manifest)
+      manifest->update(item->m_szRawFile, item->m_szMetadataFile);
+  }
+
+  if (journal)
+    journal->mark_done(item->m_szRawFile);
+}
+
 static void *thread_worker(void *arg)
 {
   ThreadWork *work = (ThreadWork *)arg;
 
-  for (size_t i = work->m_ulStart; i < work->m_ulEnd; ++i)
-    work->oConverter->ConvertToDNG((*(work->oWorks))[i]->m_szRawFile, (*(work->oWorks))[i]->m_szMetadataFile);
+  for (size_t i = work->m_ulStart; i < work->m_ulEnd; ++i) {
+    convert_item(
+            work->oConverter, work->oManifest, work->oJournal, work->oShare, work->oProgress, (*(work->oWorks))[i]);
+  }
 
   return NULL;
 }
 
-static int handle_arg(const char *arg)
+static void *queue_worker(void *arg)
+{
+  ThreadWork *work = (ThreadWork *)arg;
+  RawWorkItem *item;
+
+  while ((item = work->oQueue->pop()) != NULL) {
+    convert_item(work->oConverter, work->oManifest, work->oJournal, work->oShare, work->oProgress, item);
+    delete item;
+  }
+
+  return NULL;
+}
+
+static void on_stop_signal(int sig)
+{
+  g_bStop = 1;
+
+  // A second signal terminates right away
+  signal(sig, SIG_DFL);
+}
+
+// Convert files as they land in dir until interrupted, reusing one converter for all of them
+static int watch_dir(const std::string &dir,
+                     FolderWatcher &watcher,
+                     DNGConverter *converter,
+                     Manifest *manifest,
+                     Journal *journal,
+                     WorkShare *share,
+                     Progress *progress,
+                     const std::vector<RawWorkItem *> &o_WorkItems,
+                     size_t n_cpus)
+{
+  int ret = 0;
+
+  WorkQueue<RawWorkItem> queue;
+
+  std::vector<RawWorkItem *>::const_iterator it;
+  for (it = o_WorkItems.begin(); it != o_WorkItems.end(); ++it)
+    queue.push(new RawWorkItem(**it));
+
+  ThreadWork work;
+  work.oConverter = converter;
+  work.oManifest = manifest;
+  work.oJournal = journal;
+  work.oShare = share;
+  work.oProgress = progress;
+  work.oWorks = NULL;
+  work.m_ulStart = 0;
+  work.m_ulEnd = 0;
+  work.oQueue = &queue;
+
+  std::vector<pthread_t> threads(n_cpus);
+  size_t started = 0;
+
+  for (size_t i = 0; i < n_cpus; ++i) {
+    if (pthread_create(&threads[i], NULL, queue_worker, &work)) {
+      fprintf(stderr, "Error: Unable to start thread: %zu\n", i);
+      break;
+    }
+    ++started;
+  }
+
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+
+  printf("Watching %s (Ctrl-C to stop)\n", dir.c_str());
+
+  std::vector<RawWorkItem *> landed;
+
+  while (!g_bStop && started) {
+    ret = watcher.poll(1000, landed);
+    if (ret)
+      break;
+
+    for (it = landed.begin(); it != landed.end(); ++it) {
+      if (journal)
+        journal->add_item(**it);
+      queue.push(*it);
+    }
+    landed.clear();
+  }
+
+  printf("Finishing queued files\n");
+
+  // Workers drain whatever is queued, RAWs still waiting for their JPG are picked up by the next run
+  queue.close();
+
+  for (size_t i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+  return ret;
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// Hand the work items to a running sjcam_raw2dngd, which converts them with its warm converters
+static int convert_remote(const std::string &socket_path, const Config &conf, const std::vector<RawWorkItem *> &items)
+{
+  int fd = connect_socket(socket_path);
+  if (fd < 0) {
+    fprintf(stderr, "%s: No conversion server answering\n", socket_path.c_str());
+    return -1;
+  }
+
+  SocketReader reader(fd);
+  std::vector<std::string> fields;
+
+  if (reader.read_line(fields) || fields.size() < 2 || fields[0] != "hello" || fields[1] != SERVER_PROTOCOL_VERSION) {
+    fprintf(stderr, "%s: Not a compatible conversion server\n", socket_path.c_str());
+    close(fd);
+    return -1;
+  }
+
+  // The server runs elsewhere, so paths must not depend on our working directory
+  char path[PATH_MAX];
+  std::string output_dir;
+
+  if (!conf.m_szPathPrefixOutput.empty()) {
+    if (!realpath(conf.m_szPathPrefixOutput.c_str(), path)) {
+      perror("realpath");
+      close(fd);
+      return -1;
+    }
+    output_dir = path;
+  }
+
+  std::vector<std::string> request;
+  request.push_back("options");
+  request.push_back(encode_options(conf));
+  request.push_back(output_dir);
+
+  int ret = send_line(fd, request);
+
+  // Files the server was never asked for, failed all the same
+  size_t unsent = 0;
+
+  std::vector<RawWorkItem *>::const_iterator it;
+  for (it = items.begin(); it != items.end() && !ret; ++it) {
+    request.clear();
+    request.push_back("file");
+
+    if (!realpath((*it)->m_szRawFile.c_str(), path)) {
+      perror((*it)->m_szRawFile.c_str());
+      ++unsent;
+      continue;
+    }
+    request.push_back(path);
+
+    if (!(*it)->m_szMetadataFile.empty() && realpath((*it)->m_szMetadataFile.c_str(), path))
+      request.push_back(path);
+    else
+      request.push_back("");
+
+    ret = send_line(fd, request);
+  }
+
+  request.clear();
+  request.push_back("end");
+
+  if (ret || send_line(fd, request)) {
+    perror("send");
+    close(fd);
+    return -1;
+  }
+
+  ret = -1;
+
+  while (reader.read_line(fields) == 0) {
+    if (fields[0] == "started" && fields.size() == 2) {
+      printf("RAW: %s (server)\n", fields[1].c_str());
+    } else if (fields[0] == "done" && fields.size() == 3) {
+      if (fields[2] != "0")
+        fprintf(stderr, "%s: Conversion failed (error %s)\n", fields[1].c_str(), fields[2].c_str());
+    } else if (fields[0] == "bye" && fields.size() == 3) {
+      printf("Server converted %s files, %s failed\n", fields[1].c_str(), fields[2].c_str());
+      if (unsent)
+        fprintf(stderr, "%zu files could not be sent to the server\n", unsent);
+      ret = fields[2] == "0" && !unsent ? 0 : -1;
+      break;
+    } else if (fields[0] == "error" && fields.size() == 2) {
+      fprintf(stderr, "Server error: %s\n", fields[1].c_str());
+      break;
+    }
+  }
+
+  close(fd);
+
+  return ret;
+}
+#endif
+
+// Everything that changes the produced files, so a manifest entry is only trusted for the same settings
+static std::string config_signature(const Config &conf)
+{
+  std::string signature = std::string(VERSION_STR) + "," + encode_options(conf);
+
+  if (conf.m_bLensCorrections)
+    signature += "," + conf.m_szLensProfile;
+  if (!conf.m_szBadPixelMap.empty())
+    signature += ",bad-pixels=" + conf.m_szBadPixelMap;
+  if (!conf.m_szDarkMaster.empty())
+    signature += ",dark=" + conf.m_szDarkMaster;
+  if (!conf.m_szFlatMaster.empty())
+    signature += ",flat=" + conf.m_szFlatMaster;
+
+  return signature;
+}
+
+static int handle_arg(FileFinder &files, const char *arg)
 {
   struct stat sb;
 
@@ -53,11 +344,11 @@ static int handle_arg(const char *arg)
 
   switch (sb.st_mode & S_IFMT) {
   case S_IFDIR:
-    ret = g_Files.find_files(str_arg);
+    ret = files.find_files(str_arg);
     break;
 
   case S_IFREG:
-    ret = g_Files.find_file(str_arg);
+    ret = files.find_file(str_arg);
     break;
 
   default:
@@ -68,6 +359,155 @@ static int handle_arg(const char *arg)
   return ret;
 }
 
+// Convert the files under args while they are still being searched for
+static int convert_streamed(FileFinder &files,
+                            const std::vector<std::string> &args,
+                            DNGConverter *converter,
+                            Manifest *manifest,
+                            WorkShare *share,
+                            Progress *progress,
+                            size_t n_cpus)
+{
+  WorkQueue<RawWorkItem> queue;
+  files.set_sink(&queue);
+
+  ThreadWork work;
+  work.oConverter = converter;
+  work.oManifest = manifest;
+  work.oJournal = NULL;
+  work.oShare = share;
+  work.oProgress = progress;
+  work.oWorks = NULL;
+  work.m_ulStart = 0;
+  work.m_ulEnd = 0;
+  work.oQueue = &queue;
+
+  std::vector<pthread_t> threads(n_cpus);
+  size_t started = 0;
+
+  for (size_t i = 0; i < n_cpus; ++i) {
+    if (pthread_create(&threads[i], NULL, queue_worker, &work)) {
+      fprintf(stderr, "Error: Unable to start thread: %zu\n", i);
+      break;
+    }
+    ++started;
+  }
+
+  int ret = started ? 0 : -1;
+
+  std::vector<std::string>::const_iterator it;
+  for (it = args.begin(); it != args.end() && started; ++it) {
+    if (handle_arg(files, it->c_str()))
+      ret = -1;
+  }
+
+  queue.close();
+
+  for (size_t i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+  files.set_sink(NULL);
+
+  if (files.get_found() == 0)
+    printf("No raw files found\n");
+
+  return ret;
+}
+
+static bool raw_file_less(const RawWorkItem *a, const RawWorkItem *b)
+{
+  return a->m_szRawFile < b->m_szRawFile;
+}
+
+// Stack runs of stack_size files in name order into one output each, all files with 0.
+// A last run may be shorter.
+static int convert_stacks(DNGConverter *converter,
+                          Progress *progress,
+                          const std::vector<RawWorkItem *> &items,
+                          size_t stack_size,
+                          bool median)
+{
+  std::vector<RawWorkItem *> sorted(items);
+  std::sort(sorted.begin(), sorted.end(), raw_file_less);
+
+  if (stack_size == 0)
+    stack_size = sorted.size();
+
+  if (stack_size > MAX_STACK_FRAMES) {
+    fprintf(stderr, "Error: More than %d files to stack\n", MAX_STACK_FRAMES);
+    return -1;
+  }
+
+  int ret = 0;
+
+  for (size_t start = 0; start < sorted.size() && !g_bStop; start += stack_size) {
+    const size_t end = std::min(start + stack_size, sorted.size());
+
+    std::vector<std::string> frames;
+    for (size_t i = start; i < end; ++i)
+      frames.push_back(sorted[i]->m_szRawFile);
+
+    if (progress)
+      progress->begin_item(frames[0], 0);
+
+    dng_error_code rc = converter->StackToDNG(frames, sorted[start]->m_szMetadataFile, median);
+
+    if (progress)
+      progress->end_item(rc);
+
+    if (rc != dng_error_none)
+      ret = -1;
+  }
+
+  return ret;
+}
+
+// Build a bad pixel map from dark and/or flat frames of one camera
+static int find_bad_pixels(const std::string &map_path, char *frames[], int count, bool flipped)
+{
+  BadPixelDetector detector;
+
+  for (int i = 0; i < count; ++i) {
+    if (detector.AddFrame(frames[i]))
+      return -1;
+  }
+
+  BadPixelMap map;
+  size_t hot, dead;
+
+  StopWatch watch;
+  watch.run();
+  detector.Detect(map, flipped, hot, dead);
+  watch.stop();
+
+  printf("Found %zu hot and %zu dead pixels in %zu frames (%.3f sec)\n", hot, dead, detector.GetFrameCount(),
+         (double)watch.elapsed_usec() / 1e6);
+
+  return map.Save(map_path);
+}
+
+// Average dark or flat frames of one camera into a calibration master
+static int make_master(const std::string &master_path, char *frames[], int count, bool flipped)
+{
+  FrameAccumulator frames_sum;
+
+  StopWatch watch;
+  watch.run();
+
+  for (int i = 0; i < count; ++i) {
+    if (frames_sum.AddFrame(frames[i]))
+      return -1;
+  }
+
+  CalibrationMaster master;
+  master.Average(frames_sum, flipped);
+  watch.stop();
+
+  printf("Averaged %zu frames (%.3f sec)\n", master.GetFrameCount(), (double)watch.elapsed_usec() / 1e6);
+
+  return master.Save(master_path);
+}
+
 static void usage(const char *prog, Config &conf)
 {
   fprintf(stderr,
@@ -79,23 +519,93 @@ static void usage(const char *prog, Config &conf)
 #endif
           "\t-h, --help          Help\n"
           "\t-v, --version       Print version info and exit\n"
-#if 0
-          "\t-l, --no-lens       Do not apply lens corrections\n"
-#endif
+          "\t-l, --lens <LCP>    Apply the lens corrections of the profile (e.g. lens_profiles/GP43520.lcp)\n"
+          "\t-b, --bad-pixels <MAP> Fix the hot and dead pixels of MAP in files of the camera it was built for\n"
+          "\t--find-bad-pixels <MAP> Build MAP from the given dark (lens capped) and/or evenly lit RAW frames of\n"
+          "\t                    one camera instead of converting them. Add -r for frames taken rotated\n"
+          "\t--dark <MASTER>     Subtract the dark frame master in files of the camera it was built for\n"
+          "\t--flat <MASTER>     Flat field files of the camera it was built for with the flat frame master\n"
+          "\t--make-master <MASTER> Average the given dark or flat RAW frames of one camera into MASTER instead\n"
+          "\t                    of converting them. Add -r for frames taken rotated\n"
+          "\t--stack <N|all>     Stack runs of N files (by name), or all files, of one camera into one noise reduced\n"
+          "\t                    \"<first file>_stack\" output each, with the metadata of the first file\n"
+          "\t--stack-median      Stack by the median of every pixel instead of the mean, which drops outliers\n"
+          "\t                    such as passing objects, at 25%% more noise\n"
           "\t-p, --threads <NUM> Number of threads to run. Default: %d (0 or -1 for number of CPUS in the system)\n"
           "\t-c, --no-color      Do not apply color calibration (for color calibration)\n"
+          "\t--auto-wb           Estimate the white balance of each file (gray world) instead of using the\n"
+          "\t                    camera's fixed one\n"
+          "\t--verify            Read every DNG back once written and check its raw image decodes to the one\n"
+          "\t                    converted; DNGs that do not are not kept and the exit status is 1\n"
           "\t-m, --thumb         Add JPEG thumbnails (disabled by default to save disk space and conversion time)\n"
           "\t-o, --output <DIR>  Output dir (must exist)\n"
           "\t-t, --tiff          Write TIFF image to \"<file>.tiff\" (false by default)\n"
           "\t-d, --dng           Write DNG image to \"<file>.dng\" (used by default if no output is supplied)\n"
-          "\t-r, --rotated       Image was taken in rotated orientation (false by default)\n",
+          "\t-r, --rotated       Image was taken in rotated orientation (false by default)\n"
+          "\t-R, --recursive     Also convert the files in subdirectories of the given dirs. Files are converted\n"
+          "\t                    while the search goes on, unless --journal or --resume is given\n"
+          "\t-i, --incremental   Skip files converted by a previous run with the same options and unchanged since\n"
+          "\t                    (state is kept in \"" MANIFEST_NAME "\" in the output dir or current dir)\n"
+          "\t--incremental-hash  Like --incremental, also compare content hashes when a file's mtime changed\n"
+          "\t-j, --journal <FILE> Record the batch and every completed file in FILE\n"
+          "\t--resume <FILE>     Continue the batch recorded in FILE, converting only unfinished files\n"
+          "\t                    (files/dirs may be omitted to use the ones the batch was started with)\n"
+          "\t--shard <K/N>       Only convert the files of shard K of N (1 <= K <= N), split by a hash of every\n"
+          "\t                    file's name, so N processes or hosts given the same files share them out\n"
+          "\t--lease-dir <DIR>   Share the files with the other processes given DIR (e.g. on a shared mount):\n"
+          "\t                    each file is claimed by a lease there before it is converted and marked done\n"
+          "\t                    after, so every file is converted once. Use an empty DIR for every new batch\n"
+          "\t--lease-ttl <SEC>   Take over leases older than SEC seconds, left by dead processes. Default: %d\n"
+          "\t-w, --watch <DIR>   Convert files already in DIR, then keep converting new ones as they land (Linux)\n"
+          "\t--progress=jsonl    Report progress as JSON lines on stdout, one event per file and conversion stage\n"
+          "\t                    (other messages go to stderr). --progress=text is the default\n"
+          "\t--stats             Print timing of the conversion stages and SDK tasks at the end\n"
+          "\t--trace <FILE>      Write a timeline of every thread's stages and SDK task tiles to FILE,\n"
+          "\t                    in Trace Event Format (open with ui.perfetto.dev or chrome://tracing)\n"
+          "\t--max-memory <SIZE> Only start a file when its projected memory fits next to the files in flight\n"
+          "\t                    within SIZE bytes (K, M or G suffix allowed). Peak use is reported at the end\n"
+          "\t--cache <DIR>       Keep the outputs in DIR by a hash of their RAW, JPG and options, and reuse\n"
+          "\t                    them (reflinked or hard linked) for the same RAW under any name instead of\n"
+          "\t                    converting it again. Several processes may share DIR\n"
+          "\t--cache-size <SIZE> Evict the least recently used outputs beyond SIZE bytes of the cache (K, M or G\n"
+          "\t                    suffix allowed). Default: 16G\n"
+          "\t--low-memory        Keep the full size images of a conversion in scratch files in the output dir\n"
+          "\t                    instead of RAM. Somewhat slower, but many more files fit in memory at once\n"
+#if !defined(_WIN32) && !defined(_WIN64)
+          "\t-s, --server <SOCKET> Let the sjcam_raw2dngd server listening on SOCKET convert the files\n"
+#endif
+          ,
           prog,
-          conf.m_iThreads);
+          conf.m_iThreads,
+          DEFAULT_LEASE_TTL);
 }
 
 int main(int argc, char *argv[])
 {
+  // Not a global: it uses the file suffixes of utils.cpp, which may not be constructed yet before main()
+  FileFinder files;
   Config conf;
+  bool incremental = false;
+  bool incremental_hash = false;
+  std::string journal_path;
+  std::string watch_path;
+  std::string server_path;
+  bool resume = false;
+  bool progress_jsonl = false;
+  bool print_stats = false;
+  std::string trace_path;
+  std::string bad_pixels_path;
+  std::string master_path;
+  uint64_t max_memory = 0;
+  uint64_t cache_size = DEFAULT_CACHE_SIZE;
+  bool recursive = false;
+  bool stack = false;
+  size_t stack_size = 0; // 0 for all files in one stack
+  bool stack_median = false;
+  size_t shard_index = 0;
+  size_t shard_count = 0;
+  std::string lease_dir;
+  unsigned int lease_ttl = DEFAULT_LEASE_TTL;
 
   if (argc == 1) {
     usage(argv[0], conf);
@@ -126,6 +636,119 @@ int main(int argc, char *argv[])
       conf.m_bDng = true;
     } else if (option.Matches("r", true) || option.Matches("-rotated", true)) {
       conf.m_bFlipped = true;
+    } else if (option.Matches("R", true) || option.Matches("-recursive", true)) {
+      recursive = true;
+    } else if (option.Matches("i", true) || option.Matches("-incremental", true)) {
+      incremental = true;
+    } else if (option.Matches("-incremental-hash", true)) {
+      incremental = true;
+      incremental_hash = true;
+    } else if (option.Matches("j", true) || option.Matches("-journal", true) || option.Matches("-resume", true)) {
+      resume = option.Matches("-resume", true);
+      if (index + 1 < argc) {
+        journal_path = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing journal file name\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-progress=jsonl", true)) {
+      progress_jsonl = true;
+    } else if (option.Matches("-progress=text", true)) {
+      progress_jsonl = false;
+    } else if (option.Matches("-stats", true)) {
+      print_stats = true;
+    } else if (option.Matches("-trace", true)) {
+      if (index + 1 < argc) {
+        trace_path = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing trace file name\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-max-memory", true)) {
+      if (index + 1 < argc && parse_size(argv[index + 1], max_memory) == 0 && max_memory > 0) {
+        ++index;
+      } else {
+        fprintf(stderr, "Error: Missing or invalid memory size\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-low-memory", true)) {
+      conf.m_bLowMemory = true;
+    } else if (option.Matches("-cache", true)) {
+      if (index + 1 < argc) {
+        conf.m_szCacheDir = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing cache directory\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-cache-size", true)) {
+      if (index + 1 < argc && parse_size(argv[index + 1], cache_size) == 0 && cache_size > 0) {
+        ++index;
+      } else {
+        fprintf(stderr, "Error: Missing or invalid cache size\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-stack", true)) {
+      if (index + 1 < argc && !strcmp(argv[index + 1], "all")) {
+        stack_size = 0;
+      } else if (index + 1 < argc && isdigit(argv[index + 1][0]) && atoi(argv[index + 1]) > 0 &&
+                 atoi(argv[index + 1]) <= MAX_STACK_FRAMES) {
+        stack_size = (size_t)atoi(argv[index + 1]);
+      } else {
+        fprintf(stderr, "Error: Missing or invalid number of frames to stack\n");
+        return EXIT_FAILURE;
+      }
+      ++index;
+      stack = true;
+    } else if (option.Matches("-stack-median", true)) {
+      stack_median = true;
+    } else if (option.Matches("-shard", true)) {
+      char tail;
+      if (index + 1 >= argc || sscanf(argv[index + 1], "%zu/%zu%c", &shard_index, &shard_count, &tail) != 2 ||
+          shard_index < 1 || shard_index > shard_count) {
+        fprintf(stderr, "Error: Missing or invalid shard (K/N with 1 <= K <= N)\n");
+        return EXIT_FAILURE;
+      }
+      ++index;
+    } else if (option.Matches("-lease-dir", true)) {
+      if (index + 1 < argc) {
+        lease_dir = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing lease directory\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-lease-ttl", true)) {
+      if (index + 1 < argc && isdigit(argv[index + 1][0]) && atoi(argv[index + 1]) > 0) {
+        lease_ttl = (unsigned int)atoi(argv[++index]);
+      } else {
+        fprintf(stderr, "Error: Missing or invalid lease TTL\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("w", true) || option.Matches("-watch", true)) {
+      if (index + 1 < argc) {
+        watch_path = argv[++index];
+        struct stat sb;
+        if (stat(watch_path.c_str(), &sb)) {
+          perror("stat");
+          return EXIT_FAILURE;
+        }
+
+        if (!S_ISDIR(sb.st_mode)) {
+          fprintf(stderr, "Watched directory not a directory\n");
+          return EXIT_FAILURE;
+        }
+      } else {
+        fprintf(stderr, "Error: Missing directory name\n");
+        return EXIT_FAILURE;
+      }
+#if !defined(_WIN32) && !defined(_WIN64)
+    } else if (option.Matches("s", true) || option.Matches("-server", true)) {
+      if (index + 1 < argc) {
+        server_path = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing socket path\n");
+        return EXIT_FAILURE;
+      }
+#endif
     } else if (option.Matches("p", true) || option.Matches("-threads", true)) {
       if (index + 1 < argc) {
         ++index;
@@ -141,10 +764,51 @@ int main(int argc, char *argv[])
     } else if (option.Matches("v", true) || option.Matches("-version", true)) {
       printf("Version: %s\n", VERSION_STR);
       return EXIT_SUCCESS;
-#if 0
-    } else if (option.Matches("l", true) || option.Matches("-no-lens", true)) {
-      conf.m_bLensCorrections = false;
-#endif
+    } else if (option.Matches("l", true) || option.Matches("-lens", true)) {
+      if (index + 1 < argc) {
+        conf.m_szLensProfile = argv[++index];
+        struct stat sb;
+        if (stat(conf.m_szLensProfile.c_str(), &sb)) {
+          perror("stat");
+          return EXIT_FAILURE;
+        }
+        conf.m_bLensCorrections = true;
+      } else {
+        fprintf(stderr, "Error: Missing lens profile\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("b", true) || option.Matches("-bad-pixels", true)) {
+      if (index + 1 < argc) {
+        conf.m_szBadPixelMap = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing bad pixel map\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-find-bad-pixels", true)) {
+      if (index + 1 < argc) {
+        bad_pixels_path = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing bad pixel map\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-dark", true) || option.Matches("-flat", true)) {
+      if (index + 1 < argc) {
+        (option.Matches("-dark", true) ? conf.m_szDarkMaster : conf.m_szFlatMaster) = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing calibration master\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-make-master", true)) {
+      if (index + 1 < argc) {
+        master_path = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing calibration master\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-verify", true)) {
+      conf.m_bVerify = true;
+    } else if (option.Matches("-auto-wb", true)) {
+      conf.m_bAutoWB = true;
     } else if (option.Matches("c", true) || option.Matches("-no-color", true)) {
       conf.m_bNoCalibration = true;
     } else if (option.Matches("m", true) || option.Matches("-thumb", true)) {
@@ -176,47 +840,291 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (index == argc) {
+  if (index == argc && !resume && watch_path.empty()) {
     fprintf(stderr, "Error: No file specified\n");
     return EXIT_FAILURE;
   }
 
+  if (!bad_pixels_path.empty())
+    return find_bad_pixels(bad_pixels_path, &argv[index], argc - index, conf.m_bFlipped) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (!master_path.empty())
+    return make_master(master_path, &argv[index], argc - index, conf.m_bFlipped) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (!server_path.empty() &&
+      (incremental || !journal_path.empty() || !watch_path.empty() || progress_jsonl || print_stats ||
+       !trace_path.empty() || max_memory || conf.m_bLowMemory || !conf.m_szBadPixelMap.empty() ||
+       !conf.m_szDarkMaster.empty() || !conf.m_szFlatMaster.empty() || conf.m_bLensCorrections)) {
+    fprintf(stderr, "Error: --server does not combine with --incremental, --journal, --watch, --progress=jsonl, "
+                    "--stats, --trace, --max-memory, --low-memory, --bad-pixels, --dark, --flat or --lens "
+                    "(the server has its own)\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!server_path.empty() && (!conf.m_szCacheDir.empty() || conf.m_bVerify)) {
+    fprintf(stderr, "Error: --cache and --verify work on files written here, not with --server\n");
+    return EXIT_FAILURE;
+  }
+
+  if (stack && (!server_path.empty() || !watch_path.empty() || !journal_path.empty() || incremental ||
+                !conf.m_szCacheDir.empty())) {
+    fprintf(stderr, "Error: --stack does not combine with --server, --watch, --journal, --resume, --incremental or "
+                    "--cache\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((shard_count || !lease_dir.empty()) && (!server_path.empty() || stack)) {
+    fprintf(stderr, "Error: --shard and --lease-dir do not combine with --server or --stack\n");
+    return EXIT_FAILURE;
+  }
+
+  WorkShare *share = NULL;
+  if (shard_count || !lease_dir.empty()) {
+    share = new WorkShare();
+    if (shard_count)
+      share->set_shard(shard_index, shard_count);
+    if (!lease_dir.empty() && share->set_lease_dir(lease_dir, lease_ttl)) {
+      delete share;
+      return EXIT_FAILURE;
+    }
+  }
+
+  conf.m_ulCacheSize = cache_size;
+
   if (!conf.m_bTiff && !conf.m_bDng) {
     /* Most users want to convert to DNG */
     conf.m_bDng = true;
   }
 
+  Journal *journal = NULL;
+  if (!journal_path.empty()) {
+    journal = new Journal(journal_path, config_signature(conf));
+    if (resume && journal->load()) {
+      delete journal;
+      delete share;
+      return EXIT_FAILURE;
+    }
+  }
+
   int rc;
+
+  files.set_recursive(recursive);
+  files.set_threads(recursive ? DISCOVERY_THREADS : 1);
+
+  // A journal needs the whole batch up front, the other modes hand files on to the converter as they are found
+  const bool streamed = recursive && !journal && server_path.empty() && watch_path.empty() && !stack;
+  std::vector<std::string> stream_args;
+
+  // Watching starts before the directory is read, so nothing landing in between is missed
+  FolderWatcher watcher(watch_path, WATCH_PAIR_GRACE_MS);
+
+  if (!watch_path.empty() && (watcher.start() || handle_arg(files, watch_path.c_str()))) {
+    delete journal;
+    delete share;
+    return EXIT_FAILURE;
+  }
+
+  while (index < argc && streamed) {
+    struct stat sb;
+    if (stat(argv[index], &sb)) {
+      perror("stat");
+      return EXIT_FAILURE;
+    }
+    stream_args.push_back(argv[index++]);
+  }
+
   while (index < argc) {
-    rc = handle_arg(argv[index++]);
-    if (rc)
+    rc = handle_arg(files, argv[index++]);
+    if (rc) {
+      delete journal;
+      delete share;
       return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<RawWorkItem *> o_WorkItems = files.get_work_items();
+
+  // Files still landing are left to the watcher
+  if (!watch_path.empty())
+    watcher.scanned(o_WorkItems);
+
+  // Files of the other shards are none of this batch, files found later are checked as they come
+  if (share) {
+    std::vector<RawWorkItem *> o_Shard;
+    std::vector<RawWorkItem *>::const_iterator it;
+
+    for (it = o_WorkItems.begin(); it != o_WorkItems.end(); ++it) {
+      if (share->in_shard((*it)->m_szRawFile))
+        o_Shard.push_back(*it);
+    }
+
+    if (shard_count && !streamed)
+      printf("Shard %zu/%zu: %zu of %zu files\n", shard_index, shard_count, o_Shard.size(), o_WorkItems.size());
+
+    o_WorkItems.swap(o_Shard);
   }
 
-  const std::vector<RawWorkItem *> o_WorkItems = g_Files.get_work_items();
-  if (o_WorkItems.size() == 0) {
+  if (journal) {
+    if (o_WorkItems.empty())
+      o_WorkItems = journal->get_items();
+
+    if (journal->open(o_WorkItems)) {
+      delete journal;
+      delete share;
+      return EXIT_FAILURE;
+    }
+
+    if (resume) {
+      std::vector<RawWorkItem *> o_Pending;
+      std::vector<RawWorkItem *>::const_iterator it;
+
+      for (it = o_WorkItems.begin(); it != o_WorkItems.end(); ++it) {
+        if (!journal->is_done((*it)->m_szRawFile))
+          o_Pending.push_back(*it);
+      }
+
+      printf("Resuming: %zu of %zu files left\n", o_Pending.size(), o_WorkItems.size());
+      o_WorkItems.swap(o_Pending);
+    }
+  }
+
+  if (o_WorkItems.size() == 0 && watch_path.empty() && !streamed) {
     printf("No raw files found\n");
+    delete journal;
+    delete share;
     return EXIT_SUCCESS;
   }
 
+  FILE *progress_fp = NULL;
+  if (progress_jsonl) {
+    // Events get stdout to themselves, the messages meant for people go to stderr
+    fflush(stdout);
+    int fd = dup(fileno(stdout));
+    if (fd < 0 || !(progress_fp = fdopen(fd, "w")) || dup2(fileno(stderr), fileno(stdout)) < 0) {
+      perror("dup");
+      delete journal;
+      delete share;
+      return EXIT_FAILURE;
+    }
+  }
+
   setvbuf(stdout, NULL, _IONBF, 0);
 
-  DNGConverter converter(conf);
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (!server_path.empty()) {
+    if (convert_remote(server_path, conf, o_WorkItems))
+      return EXIT_FAILURE;
+
+    printf("Conversion complete\n");
+    return EXIT_SUCCESS;
+  }
+#endif
 
   size_t n_cpus;
+  const size_t n_system_cpus = get_num_cpus();
 
   if (conf.m_iThreads == 0 || conf.m_iThreads == -1) {
-    n_cpus = get_num_cpus();
+    n_cpus = n_system_cpus;
   } else {
     n_cpus = (size_t)conf.m_iThreads;
   }
 
-  n_cpus = std::min(n_cpus, o_WorkItems.size());
-  if (n_cpus == 1) {
+  // Watch mode keeps all threads, more files are on their way, and so does a search still going on
+  if (watch_path.empty() && !streamed)
+    n_cpus = std::min(n_cpus, o_WorkItems.size());
+
+  // Stacks are few and large, they take turns on all CPUs
+  if (stack)
+    n_cpus = 1;
+
+  // CPUs not busy with a file of their own help with the tiles of the files in flight
+  conf.m_iTaskThreads = (int)std::max((size_t)1, n_system_cpus / std::max((size_t)1, n_cpus));
+
+  int exit_code = EXIT_SUCCESS;
+
+  Manifest *manifest = NULL;
+  if (incremental) {
+    std::string manifest_path(conf.m_szPathPrefixOutput);
+    if (manifest_path.empty())
+      manifest_path = "." DELIM;
+    manifest_path += MANIFEST_NAME;
+
+    manifest = new Manifest(manifest_path, config_signature(conf), incremental_hash);
+
+    // Converted files are recorded as they finish, so it must be writable from the start
+    if (manifest->load()) {
+      fprintf(stderr, "Error: Unable to write manifest \"%s\"\n", manifest_path.c_str());
+      delete manifest;
+      manifest = NULL;
+      exit_code = EXIT_FAILURE;
+    }
+  }
+
+  Progress *progress = NULL;
+  if (progress_fp) {
+    progress = new Progress(progress_fp);
+    if (progress->start(watch_path.empty() && !streamed ? o_WorkItems.size() : 0, n_cpus)) {
+      delete progress;
+      progress = NULL;
+      exit_code = EXIT_FAILURE;
+    }
+    conf.m_poProgress = progress;
+  }
+
+  Stats *stats = NULL;
+  if (print_stats) {
+    stats = new Stats();
+    stats->start();
+    conf.m_poStats = stats;
+  }
+
+  Trace *trace = NULL;
+  if (!trace_path.empty()) {
+    trace = new Trace(trace_path);
+    if (trace->start()) {
+      delete trace;
+      trace = NULL;
+      exit_code = EXIT_FAILURE;
+    }
+    conf.m_poTrace = trace;
+  }
+
+  // Accounting alone for --stats, admission as well with a limit
+  MemoryBudget *memory = NULL;
+  if (max_memory || print_stats) {
+    memory = new MemoryBudget(max_memory);
+    conf.m_poMemory = memory;
+  }
+
+  DNGConverter converter(conf);
+  if (conf.m_bLensCorrections && !converter.GetLensProfile()) {
+    fprintf(stderr, "Error: Unable to load lens profile \"%s\"\n", conf.m_szLensProfile.c_str());
+    exit_code = EXIT_FAILURE;
+  } else if (!conf.m_szBadPixelMap.empty() && !converter.GetBadPixelMap()) {
+    fprintf(stderr, "Error: Unable to load bad pixel map \"%s\"\n", conf.m_szBadPixelMap.c_str());
+    exit_code = EXIT_FAILURE;
+  } else if ((!conf.m_szDarkMaster.empty() || !conf.m_szFlatMaster.empty()) && !converter.GetCalibration()) {
+    fprintf(stderr, "Error: Unable to load calibration masters\n");
+    exit_code = EXIT_FAILURE;
+  } else if (!conf.m_szCacheDir.empty() && !converter.GetCache()) {
+    fprintf(stderr, "Error: Unable to open cache \"%s\"\n", conf.m_szCacheDir.c_str());
+    exit_code = EXIT_FAILURE;
+  } else if (exit_code != EXIT_SUCCESS) {
+    // The manifest, progress stream or trace failed to start (reported), nothing is converted without them
+  } else if (stack) {
+    if (convert_stacks(&converter, progress, o_WorkItems, stack_size, stack_median))
+      exit_code = EXIT_FAILURE;
+  } else if (!watch_path.empty()) {
+    if (watch_dir(watch_path, watcher, &converter, manifest, journal, share, progress, o_WorkItems, n_cpus))
+      exit_code = EXIT_FAILURE;
+  } else if (streamed) {
+    if (convert_streamed(files, stream_args, &converter, manifest, share, progress, n_cpus))
+      exit_code = EXIT_FAILURE;
+  } else if (n_cpus == 1) {
     std::vector<RawWorkItem *>::const_iterator it;
 
     for (it = o_WorkItems.begin(); it != o_WorkItems.end(); ++it)
-      converter.ConvertToDNG((*it)->m_szRawFile, (*it)->m_szMetadataFile);
+      convert_item(&converter, manifest, journal, share, progress, *it);
   } else {
     ThreadWork *works = new ThreadWork[n_cpus];
     pthread_t *threads = new pthread_t[n_cpus];
@@ -233,6 +1141,11 @@ int main(int argc, char *argv[])
 
     for (i = 0; i < n_cpus; ++i) {
       works[i].oConverter = &converter;
+      works[i].oManifest = manifest;
+      works[i].oJournal = journal;
+      works[i].oShare = share;
+      works[i].oProgress = progress;
+      works[i].oQueue = NULL;
       works[i].oWorks = &o_WorkItems;
       works[i].m_ulStart = ulStart;
       works[i].m_ulEnd = ulStart + ulQuota;
@@ -269,7 +1182,73 @@ int main(int argc, char *argv[])
     delete[] threads;
   }
 
+  if (manifest) {
+    printf("Skipped %zu up to date files\n", manifest->get_skipped());
+    manifest->save();
+    delete manifest;
+  }
+
+  delete journal;
+
+  if (conf.m_bVerify && conf.m_bDng) {
+    size_t verified, failed;
+    converter.GetVerified(verified, failed);
+
+    printf("Verified %zu DNGs against the images converted: %zu failed\n", verified, failed);
+    if (failed)
+      exit_code = EXIT_FAILURE;
+  }
+
+  ConversionCache *cache = converter.GetCache();
+  if (cache) {
+    const size_t lookups = cache->GetHits() + cache->GetMisses();
+    size_t entries;
+    uint64_t bytes;
+    cache->GetUsage(entries, bytes);
+
+    printf("Cache: %zu hits of %zu files (%.0f%%), %.1f MB reused, %zu entries evicted, %zu entries of %.1f MB "
+           "kept\n",
+           cache->GetHits(),
+           lookups,
+           lookups ? 100.0 * (double)cache->GetHits() / (double)lookups : 0.0,
+           (double)cache->GetBytesFetched() / (1024 * 1024),
+           cache->GetEvicted(),
+           entries,
+           (double)bytes / (1024 * 1024));
+  }
+
+  if (share) {
+    if (share->get_skipped())
+      printf("Left %zu files to the other processes\n", share->get_skipped());
+    delete share;
+  }
+
+  if (progress) {
+    progress->stop();
+    delete progress;
+  }
+
+  if (progress_fp)
+    fclose(progress_fp);
+
+  if (stats) {
+    stats->stop();
+    stats->print(stdout);
+    delete stats;
+  }
+
+  if (memory) {
+    memory->print(stdout);
+    delete memory;
+  }
+
+  if (trace) {
+    if (trace->stop())
+      exit_code = EXIT_FAILURE;
+    delete trace;
+  }
+
   printf("Conversion complete\n");
 
-  return EXIT_SUCCESS;
+  return exit_code;
 }
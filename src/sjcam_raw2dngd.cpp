@@ -0,0 +1,790 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "DNGConverter.h"
+#include "MemoryBudget.h"
+#include "ServerProtocol.h"
+#include "Stats.h"
+#include "helpers.h"
+#include "utils.h"
+#include "version.h"
+#include "WorkQueue.h"
+
+#include <dng_globals.h>
+#include <dng_memory.h>
+#include <dng_memory_stream.h>
+#include <dng_mutex.h>
+#include <dng_string.h>
+#include <dng_pthread.h>
+
+// Jobs, and bytes of buffer jobs, one connection may have waiting or running. Its socket is not read
+// further until some are done, so a client cannot queue more than the server could ever hold.
+#define MAX_QUEUED_JOBS 1024
+#define MAX_QUEUED_BYTES SERVER_MAX_BUFFER_SIZE
+
+static volatile sig_atomic_t g_bStop = 0;
+
+class Connection;
+
+struct ServerJob {
+  ServerJob(Connection *poConn, DNGConverter *poConverter, const std::string &szId)
+          : m_poConn(poConn), m_poConverter(poConverter), m_szId(szId), m_bBuffer(false), m_bTiff(false), m_ulBytes(0)
+  {
+  }
+
+  Connection *m_poConn;
+  DNGConverter *m_poConverter;
+  const std::string m_szId;
+
+  // File job
+  std::string m_szMetadataFile;
+
+  // Buffer job
+  bool m_bBuffer;
+  bool m_bTiff;
+  std::vector<uint8> m_oRaw;
+  std::vector<uint8> m_oMetadata;
+
+  // Bytes counted against the connection's queue
+  uint64 m_ulBytes;
+};
+
+// Converters stay alive for the lifetime of the server, one per set of options and output dir,
+// so their camera profile templates are only built by the first job that needs them.
+// oServer holds the settings of the server itself, which apply to every job.
+class ConverterCache
+{
+  public:
+  ConverterCache(const Config &oServer) : m_oServer(oServer), m_oMutex("ConverterCache")
+  {
+  }
+
+  ~ConverterCache()
+  {
+    std::map<std::string, DNGConverter *>::const_iterator it;
+
+    for (it = m_oConverters.begin(); it != m_oConverters.end(); ++it)
+      delete it->second;
+  }
+
+  DNGConverter *get(Config &conf)
+  {
+    conf.m_iTaskThreads = m_oServer.m_iTaskThreads;
+    conf.m_poStats = m_oServer.m_poStats;
+    conf.m_poMemory = m_oServer.m_poMemory;
+    conf.m_bLowMemory = m_oServer.m_bLowMemory;
+    // For clients asking for lens corrections
+    if (conf.m_bLensCorrections)
+      conf.m_szLensProfile = m_oServer.m_szLensProfile;
+    // Of the camera the server converts for, applied to all jobs
+    conf.m_szBadPixelMap = m_oServer.m_szBadPixelMap;
+    conf.m_szDarkMaster = m_oServer.m_szDarkMaster;
+    conf.m_szFlatMaster = m_oServer.m_szFlatMaster;
+
+    const std::string key = encode_options(conf) + "\t" + conf.m_szPathPrefixOutput;
+
+    dng_lock_mutex lock(&m_oMutex);
+
+    DNGConverter *&converter = m_oConverters[key];
+    if (!converter)
+      converter = new DNGConverter(conf);
+
+    return converter;
+  }
+
+  // Jobs asking for lens corrections get the server's profile, there is no other
+  bool has_lens_profile(void) const
+  {
+    return !m_oServer.m_szLensProfile.empty();
+  }
+
+  protected:
+  const Config m_oServer;
+
+  dng_mutex m_oMutex;
+  std::map<std::string, DNGConverter *> m_oConverters;
+};
+
+// One client. Requests are read by the connection's own thread, replies are sent by the workers
+// running its jobs as they complete.
+class Connection
+{
+  public:
+  Connection(int fd)
+          : m_iFd(fd), m_oMutex("Connection"), m_ulPending(0), m_ulPendingBytes(0), m_ulConverted(0), m_ulFailed(0),
+            m_bClosed(false)
+  {
+  }
+
+  ~Connection()
+  {
+    close(m_iFd);
+  }
+
+  void send(const std::vector<std::string> &fields, dng_memory_stream *poPayload = NULL)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    if (m_bClosed)
+      return;
+
+    if (send_line(m_iFd, fields)) {
+      // Client went away, the remaining jobs still run but are not answered
+      m_bClosed = true;
+      return;
+    }
+
+    if (!poPayload)
+      return;
+
+    uint8 buf[65536];
+    uint64 left = poPayload->Length();
+
+    poPayload->SetReadPosition(0);
+
+    while (left > 0) {
+      uint32 len = (uint32)Min_uint64(left, sizeof(buf));
+
+      poPayload->Get(buf, len);
+      if (send_all(m_iFd, buf, len)) {
+        m_bClosed = true;
+        return;
+      }
+
+      left -= len;
+    }
+  }
+
+  // Wait until a job of ulBytes fits within the connection's limits, a job on its own always does
+  void wait_room(uint64 ulBytes)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    while (m_ulPending > 0 && (m_ulPending >= MAX_QUEUED_JOBS || m_ulPendingBytes + ulBytes > MAX_QUEUED_BYTES))
+      m_oCondition.Wait(m_oMutex);
+  }
+
+  void job_queued(uint64 ulBytes)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    ++m_ulPending;
+    m_ulPendingBytes += ulBytes;
+  }
+
+  void job_done(bool ok, uint64 ulBytes)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    if (ok)
+      ++m_ulConverted;
+    else
+      ++m_ulFailed;
+
+    --m_ulPending;
+    m_ulPendingBytes -= ulBytes;
+    m_oCondition.Broadcast();
+  }
+
+  void wait_jobs(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+
+    while (m_ulPending > 0)
+      m_oCondition.Wait(m_oMutex);
+  }
+
+  void shutdown_read(void)
+  {
+    shutdown(m_iFd, SHUT_RD);
+  }
+
+  size_t get_converted(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulConverted;
+  }
+
+  size_t get_failed(void)
+  {
+    dng_lock_mutex lock(&m_oMutex);
+    return m_ulFailed;
+  }
+
+  const int m_iFd;
+
+  protected:
+  dng_mutex m_oMutex;
+  dng_condition m_oCondition;
+
+  size_t m_ulPending;
+  uint64 m_ulPendingBytes;
+  size_t m_ulConverted;
+  size_t m_ulFailed;
+  bool m_bClosed;
+};
+
+struct Server {
+  Server(const Config &oServer) : m_oConverters(oServer), m_oMutex("Server")
+  {
+  }
+
+  WorkQueue<ServerJob> m_oJobs;
+  ConverterCache m_oConverters;
+
+  // Live connections, so they can be told to stop reading on shutdown
+  dng_mutex m_oMutex;
+  dng_condition m_oCondition;
+  std::set<Connection *> m_oConnections;
+};
+
+struct ConnectionWork {
+  Server *m_poServer;
+  Connection *m_poConn;
+};
+
+static std::string to_string(unsigned long long val)
+{
+  char str[32];
+  snprintf(str, sizeof(str), "%llu", val);
+
+  return str;
+}
+
+// Byte count of a buffer request's payload, false unless a plain number up to SERVER_MAX_BUFFER_SIZE
+static bool parse_payload_size(const std::string &str, size_t &size)
+{
+  char *end;
+
+  errno = 0;
+  unsigned long long val = strtoull(str.c_str(), &end, 10);
+  if (str.empty() || *end || errno || val > SERVER_MAX_BUFFER_SIZE)
+    return false;
+
+  size = (size_t)val;
+
+  return true;
+}
+
+static bool run_job(ServerJob *job)
+{
+  std::vector<std::string> reply;
+
+  reply.push_back("started");
+  reply.push_back(job->m_szId);
+  job->m_poConn->send(reply);
+
+  dng_error_code rc;
+
+  reply.clear();
+
+  if (job->m_bBuffer) {
+    dng_memory_stream stream(gDefaultDNGMemoryAllocator);
+
+    rc = job->m_poConverter->ConvertBuffer(&job->m_oRaw[0],
+                                           job->m_oRaw.size(),
+                                           job->m_oMetadata.empty() ? NULL : &job->m_oMetadata[0],
+                                           job->m_oMetadata.size(),
+                                           job->m_bTiff ? NULL : &stream,
+                                           job->m_bTiff ? &stream : NULL);
+    if (rc == dng_error_none)
+      stream.Flush();
+    else
+      stream.SetLength(0);
+
+    reply.push_back("output");
+    reply.push_back(job->m_szId);
+    reply.push_back(to_string((unsigned long long)rc));
+    reply.push_back(to_string(stream.Length()));
+    job->m_poConn->send(reply, &stream);
+  } else {
+    rc = job->m_poConverter->ConvertToDNG(job->m_szId, job->m_szMetadataFile);
+
+    reply.push_back("done");
+    reply.push_back(job->m_szId);
+    reply.push_back(to_string((unsigned long long)rc));
+    job->m_poConn->send(reply);
+  }
+
+  return rc == dng_error_none;
+}
+
+static void *job_worker(void *arg)
+{
+  Server *server = (Server *)arg;
+  ServerJob *job;
+
+  while ((job = server->m_oJobs.pop()) != NULL) {
+    bool ok = false;
+    try {
+      ok = run_job(job);
+    } catch (...) {
+    }
+
+    // Its buffers are gone before the connection may read more
+    Connection *conn = job->m_poConn;
+    const uint64 bytes = job->m_ulBytes;
+    delete job;
+
+    conn->job_done(ok, bytes);
+  }
+
+  return NULL;
+}
+
+static void send_error(Connection *conn, const char *message)
+{
+  std::vector<std::string> reply;
+
+  reply.push_back("error");
+  reply.push_back(message);
+  conn->send(reply);
+}
+
+// Read requests and queue their jobs until the client is done
+static void serve(Server *server, Connection *conn)
+{
+  SocketReader reader(conn->m_iFd);
+  std::vector<std::string> fields;
+  std::vector<std::string> reply;
+
+  reply.push_back("hello");
+  reply.push_back(SERVER_PROTOCOL_VERSION);
+  reply.push_back(VERSION_STR);
+  conn->send(reply);
+
+  Config conf;
+  conf.m_bDng = true;
+  DNGConverter *converter = NULL;
+
+  while (reader.read_line(fields) == 0) {
+    const std::string &cmd = fields[0];
+
+    if (cmd == "options" && fields.size() == 3) {
+      conf = Config();
+      if (!decode_options(fields[1], conf)) {
+        send_error(conn, "Unknown option");
+        break;
+      }
+
+      if (conf.m_bLensCorrections && !server->m_oConverters.has_lens_profile()) {
+        send_error(conn, "No lens profile on the server");
+        break;
+      }
+
+      if (!conf.m_bTiff && !conf.m_bDng)
+        conf.m_bDng = true;
+
+      conf.m_szPathPrefixOutput = fields[2];
+      if (!conf.m_szPathPrefixOutput.empty()) {
+        if (conf.m_szPathPrefixOutput[0] != '/') {
+          send_error(conn, "Output directory must be an absolute path");
+          break;
+        }
+        conf.m_szPathPrefixOutput += DELIM;
+      }
+
+      converter = NULL;
+    } else if (cmd == "file" && fields.size() == 3) {
+      if (fields[1].empty() || fields[1][0] != '/' || (!fields[2].empty() && fields[2][0] != '/')) {
+        send_error(conn, "File paths must be absolute");
+        break;
+      }
+
+      if (!converter)
+        converter = server->m_oConverters.get(conf);
+
+      conn->wait_room(0);
+
+      ServerJob *job = new ServerJob(conn, converter, fields[1]);
+      job->m_szMetadataFile = fields[2];
+
+      conn->job_queued(0);
+      server->m_oJobs.push(job);
+    } else if (cmd == "buffer" && fields.size() == 5) {
+      size_t raw_size, metadata_size;
+
+      if (!parse_payload_size(fields[2], raw_size) || !raw_size || !parse_payload_size(fields[3], metadata_size) ||
+          (fields[4] != "dng" && fields[4] != "tiff")) {
+        send_error(conn, "Bad buffer request");
+        break;
+      }
+
+      if (!converter)
+        converter = server->m_oConverters.get(conf);
+
+      // Not read off the socket before there is room for it
+      conn->wait_room((uint64)raw_size + metadata_size);
+
+      ServerJob *job = new ServerJob(conn, converter, fields[1]);
+      job->m_bBuffer = true;
+      job->m_bTiff = fields[4] == "tiff";
+      job->m_ulBytes = (uint64)raw_size + metadata_size;
+
+      try {
+        job->m_oRaw.resize(raw_size);
+        job->m_oMetadata.resize(metadata_size);
+      } catch (...) {
+        delete job;
+        send_error(conn, "Out of memory");
+        break;
+      }
+
+      if (reader.read(&job->m_oRaw[0], raw_size) ||
+          (metadata_size && reader.read(&job->m_oMetadata[0], metadata_size))) {
+        delete job;
+        break;
+      }
+
+      conn->job_queued(job->m_ulBytes);
+      server->m_oJobs.push(job);
+    } else if (cmd == "end" && fields.size() == 1) {
+      conn->wait_jobs();
+
+      reply.clear();
+      reply.push_back("bye");
+      reply.push_back(to_string(conn->get_converted()));
+      reply.push_back(to_string(conn->get_failed()));
+      conn->send(reply);
+      break;
+    } else {
+      send_error(conn, "Unknown request");
+      break;
+    }
+  }
+
+  // Queued jobs point back at the connection
+  conn->wait_jobs();
+}
+
+static void *connection_thread(void *arg)
+{
+  ConnectionWork *work = (ConnectionWork *)arg;
+  Server *server = work->m_poServer;
+  Connection *conn = work->m_poConn;
+
+  delete work;
+
+  serve(server, conn);
+
+  dng_lock_mutex lock(&server->m_oMutex);
+
+  server->m_oConnections.erase(conn);
+  delete conn;
+
+  server->m_oCondition.Broadcast();
+
+  return NULL;
+}
+
+static void on_stop_signal(int sig)
+{
+  g_bStop = 1;
+
+  // A second signal terminates right away
+  signal(sig, SIG_DFL);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage:  %s [options]\n"
+          "\n"
+          "Conversion server for sjcam_raw2dng clients (sjcam_raw2dng -s)\n"
+          "\n"
+          "Valid options:\n"
+#if qDNGValidate
+          "\t-verbose            Verbose mode\n"
+#endif
+          "\t-h, --help          Help\n"
+          "\t-v, --version       Print version info and exit\n"
+          "\t-s, --socket <PATH> Socket to listen on. Default: %s\n"
+          "\t-p, --threads <NUM> Number of files converted at once. Default: number of CPUS in the system\n"
+          "\t--stats             Print timing of the conversion stages and SDK tasks on exit\n"
+          "\t--max-memory <SIZE> Only start a job when its projected memory fits next to the jobs in flight\n"
+          "\t                    within SIZE bytes (K, M or G suffix allowed). Peak use is reported on exit\n"
+          "\t--low-memory        Keep the full size images of a job in scratch files in its output dir\n"
+          "\t                    instead of RAM\n"
+          "\t--lens <LCP>        Lens profile of the corrections for clients asking for them\n"
+          "\t--bad-pixels <MAP>  Fix the hot and dead pixels of MAP in files of the camera it was built for\n"
+          "\t--dark <MASTER>     Subtract the dark frame master in files of the camera it was built for\n"
+          "\t--flat <MASTER>     Flat field files of the camera it was built for with the flat frame master\n",
+          prog,
+          default_socket_path().c_str());
+}
+
+int main(int argc, char *argv[])
+{
+  std::string socket_path = default_socket_path();
+  int threads = 0;
+  bool print_stats = false;
+  uint64_t max_memory = 0;
+  bool low_memory = false;
+  std::string lens_profile;
+  std::string bad_pixel_map;
+  std::string dark_master;
+  std::string flat_master;
+
+  int index;
+
+#if qDNGValidate
+  gVerbose = false;
+#endif
+
+  for (index = 1; index < argc && argv[index][0] == '-'; index++) {
+    dng_string option;
+
+    option.Set(&argv[index][1]);
+
+    if (option.Matches("h", true) || option.Matches("-help", true)) {
+      usage(argv[0]);
+      return EXIT_SUCCESS;
+#if qDNGValidate
+    } else if (option.Matches("verbose", true)) {
+      gVerbose = true;
+#endif
+    } else if (option.Matches("v", true) || option.Matches("-version", true)) {
+      printf("Version: %s\n", VERSION_STR);
+      return EXIT_SUCCESS;
+    } else if (option.Matches("s", true) || option.Matches("-socket", true)) {
+      if (index + 1 < argc) {
+        socket_path = argv[++index];
+      } else {
+        fprintf(stderr, "Error: Missing socket path\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-stats", true)) {
+      print_stats = true;
+    } else if (option.Matches("-low-memory", true)) {
+      low_memory = true;
+    } else if (option.Matches("-bad-pixels", true)) {
+      if (index + 1 < argc) {
+        bad_pixel_map = argv[++index];
+        struct stat sb;
+        if (stat(bad_pixel_map.c_str(), &sb)) {
+          perror("stat");
+          return EXIT_FAILURE;
+        }
+      } else {
+        fprintf(stderr, "Error: Missing bad pixel map\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-dark", true) || option.Matches("-flat", true)) {
+      std::string &master = option.Matches("-dark", true) ? dark_master : flat_master;
+      if (index + 1 < argc) {
+        master = argv[++index];
+        struct stat sb;
+        if (stat(master.c_str(), &sb)) {
+          perror("stat");
+          return EXIT_FAILURE;
+        }
+      } else {
+        fprintf(stderr, "Error: Missing calibration master\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-lens", true)) {
+      if (index + 1 < argc) {
+        lens_profile = argv[++index];
+        struct stat sb;
+        if (stat(lens_profile.c_str(), &sb)) {
+          perror("stat");
+          return EXIT_FAILURE;
+        }
+      } else {
+        fprintf(stderr, "Error: Missing lens profile\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("-max-memory", true)) {
+      if (index + 1 < argc && parse_size(argv[index + 1], max_memory) == 0 && max_memory > 0) {
+        ++index;
+      } else {
+        fprintf(stderr, "Error: Missing or invalid memory size\n");
+        return EXIT_FAILURE;
+      }
+    } else if (option.Matches("p", true) || option.Matches("-threads", true)) {
+      if (index + 1 < argc) {
+        ++index;
+        if (!isdigit(argv[index][0])) {
+          fprintf(stderr, "Error: Missing number of threads\n");
+          return EXIT_FAILURE;
+        }
+        threads = atoi(argv[index]);
+      } else {
+        fprintf(stderr, "Error: Missing number of threads\n");
+        return EXIT_FAILURE;
+      }
+    } else {
+      fprintf(stderr, "Error: Unknown option \"-%s\"\n", option.Get());
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (index != argc) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const size_t n_system_cpus = get_num_cpus();
+  const size_t n_workers = threads > 0 ? (size_t)threads : n_system_cpus;
+
+  // Jobs build their converters lazily and a converter goes without what fails to load,
+  // so the server's files are loaded once up front and refused like the CLI does
+  {
+    Config probe_conf;
+    probe_conf.m_szDarkMaster = dark_master;
+    probe_conf.m_szFlatMaster = flat_master;
+    probe_conf.m_szBadPixelMap = bad_pixel_map;
+    probe_conf.m_bLensCorrections = !lens_profile.empty();
+    probe_conf.m_szLensProfile = lens_profile;
+
+    DNGConverter probe(probe_conf);
+    if (!lens_profile.empty() && !probe.GetLensProfile()) {
+      fprintf(stderr, "Error: Unable to load lens profile \"%s\"\n", lens_profile.c_str());
+      return EXIT_FAILURE;
+    }
+
+    if (!bad_pixel_map.empty() && !probe.GetBadPixelMap()) {
+      fprintf(stderr, "Error: Unable to load bad pixel map \"%s\"\n", bad_pixel_map.c_str());
+      return EXIT_FAILURE;
+    }
+
+    if ((!dark_master.empty() || !flat_master.empty()) && !probe.GetCalibration()) {
+      fprintf(stderr, "Error: Unable to load calibration masters\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  int listen_fd = listen_socket(socket_path);
+  if (listen_fd < 0)
+    return EXIT_FAILURE;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+
+  Stats stats;
+  stats.start();
+
+  // Accounting alone for --stats, admission as well with a limit
+  MemoryBudget memory(max_memory);
+  const bool account_memory = max_memory || print_stats;
+
+  Config server_conf;
+  // CPUs not busy with a file of their own help with the tiles of the files in flight
+  server_conf.m_iTaskThreads = (int)std::max((size_t)1, n_system_cpus / n_workers);
+  server_conf.m_poStats = print_stats ? &stats : NULL;
+  server_conf.m_poMemory = account_memory ? &memory : NULL;
+  server_conf.m_bLowMemory = low_memory;
+  server_conf.m_szLensProfile = lens_profile;
+  server_conf.m_szBadPixelMap = bad_pixel_map;
+  server_conf.m_szDarkMaster = dark_master;
+  server_conf.m_szFlatMaster = flat_master;
+
+  Server server(server_conf);
+
+  std::vector<pthread_t> workers(n_workers);
+  size_t started = 0;
+
+  for (size_t i = 0; i < n_workers; ++i) {
+    if (pthread_create(&workers[i], NULL, job_worker, &server)) {
+      fprintf(stderr, "Error: Unable to start thread: %zu\n", i);
+      break;
+    }
+    ++started;
+  }
+
+  printf("Listening on %s with %zu workers (Ctrl-C to stop)\n", socket_path.c_str(), started);
+
+  while (!g_bStop && started) {
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+
+    int ret = poll(&pfd, 1, 1000);
+    if (ret < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    if (ret <= 0)
+      continue;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        perror("accept");
+      continue;
+    }
+
+    ConnectionWork *work = new ConnectionWork;
+    work->m_poServer = &server;
+    work->m_poConn = new Connection(fd);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    dng_lock_mutex lock(&server.m_oMutex);
+
+    if (pthread_create(&thread, &attr, connection_thread, work)) {
+      fprintf(stderr, "Error: Unable to start connection thread\n");
+      delete work->m_poConn;
+      delete work;
+    } else {
+      server.m_oConnections.insert(work->m_poConn);
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+
+  printf("Finishing queued jobs\n");
+
+  close(listen_fd);
+  unlink(socket_path.c_str());
+
+  {
+    // Connections stop taking requests but answer the jobs they already queued
+    dng_lock_mutex lock(&server.m_oMutex);
+
+    std::set<Connection *>::const_iterator it;
+    for (it = server.m_oConnections.begin(); it != server.m_oConnections.end(); ++it)
+      (*it)->shutdown_read();
+
+    while (!server.m_oConnections.empty())
+      server.m_oCondition.Wait(server.m_oMutex);
+  }
+
+  server.m_oJobs.close();
+
+  for (size_t i = 0; i < started; ++i)
+    pthread_join(workers[i], NULL);
+
+  if (print_stats) {
+    stats.stop();
+    stats.print(stdout);
+  }
+
+  if (account_memory)
+    memory.print(stdout);
+
+  return started ? EXIT_SUCCESS : EXIT_FAILURE;
+}
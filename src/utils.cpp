@@ -2,7 +2,9 @@
 
 #include "utils.h"
 
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -15,10 +17,67 @@
 #include <pthread.h>
 #endif
 
+#if defined(__GNUC__)
+#include <cxxabi.h>
+#include <stdlib.h>
+#endif
+
 const std::string jpeg_suffix(".JPG");
 const std::string raw_suffix(".RAW");
 const std::string dng_suffix(".dng");
 const std::string tiff_suffix(".tiff");
+const std::string partial_suffix(".part");
+
+size_t split_string(const std::string &str, char delim, std::vector<std::string> &fields)
+{
+  size_t start = 0;
+  size_t pos;
+
+  fields.clear();
+
+  while ((pos = str.find(delim, start)) != std::string::npos) {
+    fields.push_back(str.substr(start, pos - start));
+    start = pos + 1;
+  }
+
+  fields.push_back(str.substr(start));
+
+  return fields.size();
+}
+
+int parse_size(const char *str, uint64_t &size)
+{
+  char *end;
+
+  if (!isdigit((unsigned char)str[0]))
+    return -1;
+
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno)
+    return -1;
+
+  unsigned int shift = 0;
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    shift += 10;
+    // Fall through
+  case 'M':
+    shift += 10;
+    // Fall through
+  case 'K':
+    shift += 10;
+    ++end;
+    break;
+  }
+
+  if (*end || value > (~0ULL >> shift))
+    return -1;
+
+  size = (uint64_t)value << shift;
+
+  return 0;
+}
 
 int list_dir(const std::string &dir, std::list<std::string> &files, const std::list<std::string> &filter)
 #if defined(_WIN32) || defined(_WIN64)
@@ -119,3 +178,73 @@ void set_thread_prio_low(void)
   pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
 }
 #endif
+
+int replace_file(const std::string &from, const std::string &to)
+#if defined(_WIN32) || defined(_WIN64)
+{
+  if (!MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    return GetLastError();
+
+  return 0;
+}
+#else
+{
+  if (rename(from.c_str(), to.c_str())) {
+    perror("rename");
+    return errno;
+  }
+
+  return 0;
+}
+#endif
+
+void sleep_msec(unsigned int msec)
+#if defined(_WIN32) || defined(_WIN64)
+{
+  Sleep(msec);
+}
+#else
+{
+  usleep((useconds_t)msec * 1000);
+}
+#endif
+
+void write_json_string(FILE *fp, const std::string &str)
+{
+  fputc('"', fp);
+
+  for (size_t i = 0; i < str.size(); ++i) {
+    unsigned char c = (unsigned char)str[i];
+
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+
+  fputc('"', fp);
+}
+
+std::string demangle_type_name(const char *name)
+{
+  std::string label;
+
+#if defined(__GNUC__)
+  int status;
+  char *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+  if (demangled) {
+    label = demangled;
+    free(demangled);
+  } else {
+    label = name;
+  }
+#else
+  label = name;
+  if (label.compare(0, 6, "class ") == 0)
+    label.erase(0, 6);
+#endif
+
+  return label;
+}
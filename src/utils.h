@@ -3,25 +3,46 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
+#include <stdio.h>
+#include <stdint.h>
+
 #include <string>
 #include <list>
+#include <vector>
 
 static inline bool has_suffix(const std::string &str, const std::string &suffix)
 {
   return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
 }
 
+size_t split_string(const std::string &str, char delim, std::vector<std::string> &fields);
+
+// Byte count with an optional K, M or G suffix (powers of 1024). Returns -1 if malformed.
+int parse_size(const char *str, uint64_t &size);
+
 int list_dir(const std::string &dir, std::list<std::string> &files, const std::list<std::string> &filter);
 
 extern const std::string jpeg_suffix;
 extern const std::string raw_suffix;
 extern const std::string dng_suffix;
 extern const std::string tiff_suffix;
+extern const std::string partial_suffix;
 
 size_t get_num_cpus(void);
 
 void set_thread_prio_low(void);
 
+void sleep_msec(unsigned int msec);
+
+// Atomically move a finished file over its final name (replacing an existing file)
+int replace_file(const std::string &from, const std::string &to);
+
+// Write str as a quoted JSON string
+void write_json_string(FILE *fp, const std::string &str);
+
+// Readable name of a type from typeid().name()
+std::string demangle_type_name(const char *name);
+
 #ifndef S_ISDIR
 #define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
 #endif
@@ -0,0 +1,8 @@
+/* vim: set shiftwidth=2 tabstop=2 softtabstop=2 expandtab: */
+
+#ifndef __VERSION_H__
+#define __VERSION_H__
+
+#define VERSION_STR "v1.2.0"
+
+#endif // __VERSION_H__